@@ -0,0 +1,229 @@
+#include "h/boot_profile.h"
+#include "h/http_server.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_private/esp_clk.h"
+#endif
+#include "freertos/FreeRTOS.h"
+
+const static char *TAG = "__BOOT__";
+
+#define GENERATE_BOOT_PHASE_NAME(ID, NAME) NAME,
+
+static const char *phase_names[BOOT_PHASE_COUNT] = {
+    FOREACH_BOOT_PHASE(GENERATE_BOOT_PHASE_NAME)
+};
+
+/* esp_timer times, 0 if not reached. A milestone only has an end */
+static int64_t phase_begin_us[BOOT_PHASE_COUNT];
+static int64_t phase_end_us[BOOT_PHASE_COUNT];
+
+static int64_t pre_app_us = -1;         /* ROM + bootloader, only known after a power-on reset */
+static esp_reset_reason_t reset_reason;
+static bool report_sent = false;
+static portMUX_TYPE boot_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+void boot_profile_init(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    /* Simulation build: a process start, nothing runs before the app */
+    reset_reason = ESP_RST_POWERON;
+#else
+    int64_t now = esp_timer_get_time();
+
+    reset_reason = esp_reset_reason();
+    if (reset_reason == ESP_RST_POWERON) {
+        pre_app_us = (int64_t)esp_clk_rtc_time() - now;
+    }
+#endif
+}
+
+
+/* Times from power-up when known, from the app start otherwise */
+static long boot_ms(int64_t us)
+{
+    return (long)(((pre_app_us > 0 ? pre_app_us : 0) + us) / 1000);
+}
+
+
+void boot_profile_begin(enum boot_phase phase)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&boot_mux);
+    if (phase_begin_us[phase] == 0) {
+        phase_begin_us[phase] = now;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+}
+
+
+void boot_profile_end(enum boot_phase phase)
+{
+    int64_t now = esp_timer_get_time();
+    bool first = false;
+
+    portENTER_CRITICAL(&boot_mux);
+    if (phase_begin_us[phase] != 0 && phase_end_us[phase] == 0) {
+        phase_end_us[phase] = now;
+        first = true;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+
+    if (first) {
+        ESP_LOGI(TAG, "%s: %ld ms", phase_names[phase], (long)((now - phase_begin_us[phase]) / 1000));
+    }
+}
+
+
+void boot_profile_mark(enum boot_phase phase)
+{
+    int64_t now = esp_timer_get_time();
+    bool first = false;
+
+    portENTER_CRITICAL(&boot_mux);
+    if (phase_end_us[phase] == 0) {
+        phase_end_us[phase] = now;
+        first = true;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+
+    if (!first) {
+        return;
+    }
+
+    if (phase == BOOT_PHASE_FIRST_PUBLISH && boot_ms(now) > CONFIG_BOOT_PROFILE_TARGET_MS) {
+        ESP_LOGW(TAG, "%s at %ld ms, over the %d ms target", phase_names[phase], boot_ms(now), CONFIG_BOOT_PROFILE_TARGET_MS);
+    } else {
+        ESP_LOGI(TAG, "%s at %ld ms", phase_names[phase], boot_ms(now));
+    }
+}
+
+
+bool boot_profile_done(enum boot_phase phase)
+{
+    return phase_end_us[phase] != 0;
+}
+
+
+static const char *reset_name(esp_reset_reason_t reason)
+{
+    switch (reason) {
+        case ESP_RST_POWERON:   return "poweron";
+        case ESP_RST_SW:        return "software";
+        case ESP_RST_PANIC:     return "panic";
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:       return "watchdog";
+        case ESP_RST_BROWNOUT:  return "brownout";
+        case ESP_RST_DEEPSLEEP: return "deepsleep";
+        case ESP_RST_EXT:       return "external";
+        default:                return "other";
+    }
+}
+
+
+int boot_profile_json(char *buf, size_t len)
+{
+    int64_t begin[BOOT_PHASE_COUNT];
+    int64_t end[BOOT_PHASE_COUNT];
+    int n;
+    bool first = true;
+
+    /* Consistent copy, the phases end on several tasks */
+    portENTER_CRITICAL(&boot_mux);
+    memcpy(begin, phase_begin_us, sizeof(begin));
+    memcpy(end, phase_end_us, sizeof(end));
+    portEXIT_CRITICAL(&boot_mux);
+
+    n = snprintf(buf, len, "{\"reset\":\"%s\",\"from\":\"%s\"", reset_name(reset_reason),
+                 pre_app_us > 0 ? "power_up" : "app_start");
+    if (pre_app_us > 0 && n < len) {
+        n += snprintf(buf + n, len - n, ",\"pre_app_ms\":%ld", (long)(pre_app_us / 1000));
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, ",\"target_ms\":%d,\"phases\":[", CONFIG_BOOT_PROFILE_TARGET_MS);
+    }
+
+    for (int i = 0; i < BOOT_PHASE_COUNT && n < len; i++) {
+        if (begin[i] == 0 && end[i] == 0) {
+            continue;
+        }
+
+        n += snprintf(buf + n, len - n, "%s{\"name\":\"%s\"", first ? "" : ",", phase_names[i]);
+        first = false;
+        if (n >= len) {
+            break;
+        }
+
+        if (begin[i] == 0) {
+            n += snprintf(buf + n, len - n, ",\"at_ms\":%ld}", boot_ms(end[i]));
+        } else if (end[i] == 0) {
+            n += snprintf(buf + n, len - n, ",\"start_ms\":%ld}", boot_ms(begin[i]));
+        } else {
+            n += snprintf(buf + n, len - n, ",\"start_ms\":%ld,\"ms\":%ld}",
+                          boot_ms(begin[i]), (long)((end[i] - begin[i]) / 1000));
+        }
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, "]}");
+    }
+
+    return (n < len) ? n : -1;
+}
+
+
+void boot_profile_send(esp_mqtt_client_handle_t client)
+{
+    static char json[BOOT_PROFILE_JSON_LEN];
+    char topic[40];
+    char id[ID_LEN + 1];
+    int len;
+
+    if (report_sent) {
+        return;
+    }
+    if (!boot_profile_done(BOOT_PHASE_FIRST_ACK) &&
+        esp_timer_get_time() < (int64_t)CONFIG_BOOT_PROFILE_REPORT_TIMEOUT_S * 1000000) {
+        return;
+    }
+
+    len = boot_profile_json(json, sizeof(json));
+    if (len < 0) {
+        ESP_LOGE(TAG, "Boot report does not fit in %d bytes", BOOT_PROFILE_JSON_LEN);
+        report_sent = true;
+        return;
+    }
+
+    http_config_get(id, NULL);
+    snprintf(topic, sizeof(topic), BOOT_PROFILE_TOPIC_FMT, id);
+    if (esp_mqtt_client_publish(client, topic, json, len, 1, 0) < 0) {
+        ESP_LOGW(TAG, "Boot report not published, retrying");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Boot report: %.*s", len, json);
+    report_sent = true;
+}
+
+
+esp_err_t boot_profile_handler(httpd_req_t *req)
+{
+    static char json[BOOT_PROFILE_JSON_LEN];
+    int len = boot_profile_json(json, sizeof(json));
+
+    if (len < 0) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_send(req, json, len);
+    return ESP_OK;
+}
@@ -0,0 +1,103 @@
+#include "h/deadband.h"
+#include "h/metrics.h"
+
+#include <math.h>
+#include "esp_log.h"
+
+
+#if CONFIG_SENSOR_DEADBAND_ENABLE
+
+const static char *TAG = "__DEADBAND__";
+
+/* Thresholds per channel, 0 disables one */
+typedef struct
+{
+    float abs;      /* Same unit as the value */
+    float pct;      /* Percent of the last reported value */
+} deadband_t;
+
+/* Kconfig only has integers, the thresholds are set in hundredths */
+static const deadband_t deadband[ENDTYPE] = {
+    [TEMP] = { CONFIG_SENSOR_DEADBAND_TEMP_ABS / 100.0f, CONFIG_SENSOR_DEADBAND_TEMP_PCT / 100.0f },
+    [HUM]  = { CONFIG_SENSOR_DEADBAND_HUM_ABS / 100.0f,  CONFIG_SENSOR_DEADBAND_HUM_PCT / 100.0f },
+    [PRES] = { CONFIG_SENSOR_DEADBAND_PRES_ABS / 100.0f, CONFIG_SENSOR_DEADBAND_PRES_PCT / 100.0f },
+};
+
+static bool have_reference = false;
+static sensq reference;             /* Last reported sample */
+
+
+/*
+ * @brief Check if a value moved past any enabled threshold
+ */
+static bool outside_band(enum sensq_type type, float value)
+{
+    const deadband_t *band = &deadband[type];
+    float delta = fabsf(value - reference.value[type]);
+
+    /* No threshold for this channel, report every change */
+    if (band->abs == 0 && band->pct == 0) {
+        return delta != 0;
+    }
+    if (band->abs > 0 && delta >= band->abs) {
+        return true;
+    }
+    if (band->pct > 0 && delta >= fabsf(reference.value[type]) * band->pct / 100.0f) {
+        return true;
+    }
+    return false;
+}
+
+
+bool deadband_check(const sensq *sample)
+{
+    bool report = !have_reference;
+
+    if (!report && CONFIG_SENSOR_HEARTBEAT_S > 0 &&
+        sample->timestamp_us - reference.timestamp_us >= (int64_t)CONFIG_SENSOR_HEARTBEAT_S * 1000000) {
+        ESP_LOGD(TAG, "Heartbeat, reporting sample #%lu", (unsigned long)sample->seq);
+        report = true;
+    }
+
+    if (!report) {
+        SENSQ_FOREACH_CHANNEL(type) {
+            if (outside_band(type, sample->value[type])) {
+                report = true;
+                break;
+            }
+        }
+    }
+
+    if (!report) {
+        metric_inc(METRIC_SAMPLES_SUPPRESSED);
+        ESP_LOGD(TAG, "Sample #%lu inside the deadband, suppressed", (unsigned long)sample->seq);
+        return false;
+    }
+
+    reference = *sample;
+    have_reference = true;
+    metric_inc(METRIC_SAMPLES_REPORTED);
+    return true;
+}
+
+#else /* !CONFIG_SENSOR_DEADBAND_ENABLE */
+
+bool deadband_check(const sensq *sample)
+{
+    metric_inc(METRIC_SAMPLES_REPORTED);
+    return true;
+}
+
+#endif /* CONFIG_SENSOR_DEADBAND_ENABLE */
+
+
+uint32_t deadband_sent(void)
+{
+    return metric_get(METRIC_SAMPLES_REPORTED);
+}
+
+
+uint32_t deadband_suppressed(void)
+{
+    return metric_get(METRIC_SAMPLES_SUPPRESSED);
+}
@@ -0,0 +1,243 @@
+#include "h/dns_proto.h"
+
+#include <string.h>
+
+#define DNS_FLAG_QR         0x8000
+#define DNS_FLAG_AA         0x0400
+#define DNS_FLAG_RD         0x0100
+#define DNS_OPCODE(flags)   (((flags) >> 11) & 0x0F)
+#define DNS_NAME_PTR_QNAME  0xC00C      /* Compression pointer to the question name */
+
+/* Answer: pointer, type, class, TTL, rdlength, IPv4 */
+#define DNS_A_RR_LEN        (2 + 2 + 2 + 4 + 2 + 4)
+/* Authority: pointer, type, class, TTL, rdlength, then mname and rname pointers and 5 timers */
+#define DNS_SOA_RR_LEN      (2 + 2 + 2 + 4 + 2 + 2 + 2 + 5 * 4)
+
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint8_t *wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+    return p + 2;
+}
+
+static inline uint8_t *wr32(uint8_t *p, uint32_t v)
+{
+    return wr16(wr16(p, v >> 16), v & 0xFFFF);
+}
+
+
+/*
+ * @brief End of the question name
+ * @return Offset just past the root label, 0 if the name is malformed or truncated
+ *
+ *  Compression pointers are not valid in a question, so any label length
+ *  above 63 is refused along with them.
+ */
+static size_t question_name_end(const uint8_t *msg, size_t len)
+{
+    size_t pos = DNS_HEADER_LEN;
+    size_t name_len = 1;
+
+    while (pos < len) {
+        uint8_t label = msg[pos];
+        if (label == 0) {
+            return pos + 1;
+        }
+        if (label > DNS_LABEL_MAX) {
+            return 0;
+        }
+        name_len += label + 1;
+        if (name_len > DNS_NAME_MAX || pos + 1 + label >= len) {
+            return 0;
+        }
+        pos += 1 + label;
+    }
+    return 0;
+}
+
+
+static size_t error_reply(uint8_t *msg, uint16_t flags, uint8_t rcode, dns_query_info_t *info)
+{
+    /* Header only: the question may be what is wrong */
+    wr16(msg + 2, DNS_FLAG_QR | (flags & (0x7800 | DNS_FLAG_RD)) | rcode);
+    memset(msg + 4, 0, DNS_HEADER_LEN - 4);
+    if (info) {
+        info->kind = DNS_REPLY_ERROR;
+    }
+    return DNS_HEADER_LEN;
+}
+
+
+size_t dns_reply_build(uint8_t *msg, size_t len, size_t size, uint32_t redirect_ip, dns_query_info_t *info)
+{
+    uint16_t flags, qtype, qclass;
+    size_t pos;
+    uint8_t *p;
+
+    if (info) {
+        info->kind = DNS_REPLY_DROP;
+        info->qtype = 0;
+    }
+    if (len < DNS_HEADER_LEN || size < len) {
+        return 0;
+    }
+
+    /* Never answer a response, that is how reflection loops start */
+    flags = rd16(msg + 2);
+    if (flags & DNS_FLAG_QR) {
+        return 0;
+    }
+    if (DNS_OPCODE(flags) != 0) {
+        return error_reply(msg, flags, DNS_RCODE_NOTIMP, info);
+    }
+    if (rd16(msg + 4) != 1 || (pos = question_name_end(msg, len)) == 0 || pos + 4 > len) {
+        return error_reply(msg, flags, DNS_RCODE_FORMERR, info);
+    }
+
+    qtype = rd16(msg + pos);
+    qclass = rd16(msg + pos + 2);
+    pos += 4;
+    if (info) {
+        info->qtype = qtype;
+    }
+
+    /* Reply = header + question as received + one record; the rest of the query is dropped */
+    wr16(msg + 2, DNS_FLAG_QR | DNS_FLAG_AA | (flags & DNS_FLAG_RD) | DNS_RCODE_OK);
+    p = msg + pos;
+
+    if ((qclass == DNS_CLASS_IN || qclass == DNS_CLASS_ANY) && (qtype == DNS_TYPE_A || qtype == DNS_TYPE_ANY)) {
+        if (pos + DNS_A_RR_LEN > size) {
+            return 0;
+        }
+        wr16(msg + 4, 1);
+        wr16(msg + 6, 1);
+        wr16(msg + 8, 0);
+        wr16(msg + 10, 0);
+
+        p = wr16(p, DNS_NAME_PTR_QNAME);
+        p = wr16(p, DNS_TYPE_A);
+        p = wr16(p, DNS_CLASS_IN);
+        p = wr32(p, DNS_TTL_S);
+        p = wr16(p, 4);
+        memcpy(p, &redirect_ip, 4);         /* Already in network order */
+        p += 4;
+        if (info) {
+            info->kind = DNS_REPLY_ANSWER;
+        }
+    } else {
+        /* NODATA: AAAA, HTTPS, ... get an empty answer the client accepts at once
+           instead of a wrong record type, the SOA lets it cache that (RFC 2308) */
+        if (pos + DNS_SOA_RR_LEN > size) {
+            return 0;
+        }
+        wr16(msg + 4, 1);
+        wr16(msg + 6, 0);
+        wr16(msg + 8, 1);
+        wr16(msg + 10, 0);
+
+        p = wr16(p, DNS_NAME_PTR_QNAME);
+        p = wr16(p, DNS_TYPE_SOA);
+        p = wr16(p, DNS_CLASS_IN);
+        p = wr32(p, DNS_TTL_S);
+        p = wr16(p, 2 + 2 + 5 * 4);
+        p = wr16(p, DNS_NAME_PTR_QNAME);    /* mname */
+        p = wr16(p, DNS_NAME_PTR_QNAME);    /* rname */
+        p = wr32(p, 1);                     /* serial */
+        p = wr32(p, 3600);                  /* refresh */
+        p = wr32(p, 600);                   /* retry */
+        p = wr32(p, 86400);                 /* expire */
+        p = wr32(p, DNS_TTL_S);             /* minimum, the negative caching TTL */
+        if (info) {
+            info->kind = DNS_REPLY_NODATA;
+        }
+    }
+
+    return p - msg;
+}
+
+
+bool dns_question_name(const uint8_t *msg, size_t len, char *out, size_t out_size)
+{
+    size_t end = (len >= DNS_HEADER_LEN) ? question_name_end(msg, len) : 0;
+    size_t pos = DNS_HEADER_LEN;
+    size_t n = 0;
+
+    if (out_size == 0 || end == 0) {
+        return false;
+    }
+    while (msg[pos] != 0) {
+        uint8_t label = msg[pos];
+        if (n + label + 1 >= out_size) {
+            out[n] = '\0';
+            return false;
+        }
+        if (n > 0) {
+            out[n++] = '.';
+        }
+        memcpy(out + n, msg + pos + 1, label);
+        n += label;
+        pos += 1 + label;
+    }
+    out[n] = '\0';
+    return true;
+}
+
+
+/* ________________ Per-client rate limit ________________ */
+
+void dns_rate_init(dns_rate_t *rate, uint32_t qps, uint32_t burst)
+{
+    memset(rate, 0, sizeof(*rate));
+    rate->qps = qps;
+    rate->burst = burst;
+}
+
+
+bool dns_rate_allow(dns_rate_t *rate, uint32_t addr, int64_t now_us)
+{
+    dns_rate_client_t *c = NULL;
+    dns_rate_client_t *oldest = &rate->client[0];
+    const uint64_t full = (uint64_t)rate->burst * 1000;
+
+    for (int i = 0; i < DNS_RATE_CLIENTS; i++) {
+        dns_rate_client_t *e = &rate->client[i];
+        if (e->used && e->addr == addr) {
+            c = e;
+            break;
+        }
+        if (!e->used || (oldest->used && e->last_us < oldest->last_us)) {
+            oldest = e;
+        }
+    }
+
+    if (c == NULL) {
+        /* New client, or one not seen for a while: starts with a full bucket */
+        c = oldest;
+        c->used = true;
+        c->addr = addr;
+        c->tokens_milli = full;
+        c->last_us = now_us;
+    } else if (now_us > c->last_us) {
+        /* qps tokens per second = qps thousandths per millisecond. The clock
+           only moves once something was earned, so close queries still add up. */
+        uint64_t earned = (uint64_t)(now_us - c->last_us) * rate->qps / 1000;
+        if (earned > 0) {
+            uint64_t tokens = c->tokens_milli + earned;
+            c->tokens_milli = (tokens > full) ? full : tokens;
+            c->last_us = now_us;
+        }
+    }
+
+    if (c->tokens_milli < 1000) {
+        rate->dropped++;
+        return false;
+    }
+    c->tokens_milli -= 1000;
+    return true;
+}
@@ -1,9 +1,11 @@
 #include "h/dns_server.h"
+#include "h/dns_proto.h"
+#include "h/metrics.h"
 
-#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_netif.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -13,47 +15,19 @@
 
 static const char *TAG = "__DNS__";
 
-/* DNS server response buffer */
-#define DNS_MAX_LEN 512
 static TaskHandle_t dns_task_handle = NULL;
 /* The IP address to redirect all DNS queries to (ESP32's AP IP) */
 static uint32_t redirect_ip_addr = 0;
 
 
-/* DNS Protocol Structures - ensures no padding between fields */
-typedef struct __attribute__((__packed__))
-{
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qd_count;
-    uint16_t an_count;
-    uint16_t ns_count;
-    uint16_t ar_count;
-} dns_header_t;
-
-typedef struct __attribute__((__packed__))
-{
-    uint16_t type;
-    uint16_t class;
-} dns_question_t;
-
-typedef struct __attribute__((__packed__))
-{
-    uint16_t ptr_offset;
-    uint16_t type;
-    uint16_t class;
-    uint32_t ttl;
-    uint16_t addr_len;
-    uint32_t ip_addr;
-} dns_answer_t;
-
-
 static void dns_server_task(void *pvParameters)
 {
-    char rx_buffer[DNS_MAX_LEN];
-    char tx_buffer[DNS_MAX_LEN];
-    uint8_t domain[128];
-    
+    /* Query and reply share the buffer, the reply is built in place */
+    static uint8_t msg[DNS_MAX_LEN];
+    static dns_rate_t rate;
+    dns_query_info_t info;
+    char domain[DNS_NAME_MAX + 1];
+
     int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock < 0) {
         ESP_LOGE(TAG, "Failed to create socket");
@@ -73,68 +47,50 @@ static void dns_server_task(void *pvParameters)
         return;
     }
 
+    dns_rate_init(&rate, CONFIG_DNS_RATE_LIMIT_QPS, CONFIG_DNS_RATE_LIMIT_BURST);
     ESP_LOGI(TAG, "DNS server started on port 53");
 
     while (1) {
         struct sockaddr_in source_addr;
         socklen_t socklen = sizeof(source_addr);
-        int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer), 0, (struct sockaddr *)&source_addr, &socklen);
+        int len = recvfrom(sock, msg, sizeof(msg), 0, (struct sockaddr *)&source_addr, &socklen);
 
-        if (len < sizeof(dns_header_t)) {
+        if (len < DNS_HEADER_LEN) {
             continue;
         }
 
-        /* Copy the request to the response buffer and remove the header */
-        memcpy(tx_buffer, rx_buffer, len);
-        dns_header_t *header = (dns_header_t *)tx_buffer;
-
-        uint16_t offset = sizeof(dns_header_t);
-        uint8_t *question = (uint8_t *)(tx_buffer + offset);
-        
-        /* _______ Extract domain name from question  _______
-            DNS format: [3][w][w][w][7][e][s][p][c][o][n][f][3][c][o][m][0] --> "www.espconf.com"
-        */
-        uint8_t length;
-        int domain_pos = 0;
-
-        while ((length = question[0]) != 0) {
-            offset++;
-            /* Extract section */
-            memcpy(&domain[domain_pos], &question[1], length);
-            domain_pos += length;
-            domain[domain_pos++] = '.';
-            /* Move to the next part */
-            question = (uint8_t *)(tx_buffer + offset + length);
-            offset += length;
-        }
-        
-        if (domain_pos > 0) {
-            domain[domain_pos - 1] = '\0';
-        } else {
-            domain[0] = '\0';
+        /* A flooding client is dropped, it does not get to starve the others */
+        if (!dns_rate_allow(&rate, source_addr.sin_addr.s_addr, esp_timer_get_time())) {
+            metric_inc(METRIC_DNS_RATE_LIMITED);
+            continue;
         }
-        offset++;  // Skip the 0 length byte at end of QNAME
-        ESP_LOGD(TAG, "DNS Query for domain: %s", domain);
-
-        /* _______ Modify the header for the response _______ */
-        header->flags = htons(0x8180);  // Standard response, no error
-        header->an_count = htons(1);    // One answer
 
-        offset += sizeof(dns_question_t);   // Skip over the question section
-
-        /* Create the answer section */
-        dns_answer_t *answer = (dns_answer_t *)(tx_buffer + offset);
-        answer->ptr_offset = htons(0xC00C); // Compressed name pointer to the question
-        answer->type = htons(1);
-        answer->class = htons(1);
-        answer->ttl = htonl(60);            // TTL 60 seconds
-        answer->addr_len = htons(4);
-        answer->ip_addr = redirect_ip_addr; // Our redirection IP
+        size_t reply_len = dns_reply_build(msg, len, sizeof(msg), redirect_ip_addr, &info);
+        switch (info.kind) {
+        case DNS_REPLY_ANSWER:
+            metric_inc(METRIC_DNS_ANSWERS);
+            break;
+        case DNS_REPLY_NODATA:
+            metric_inc(METRIC_DNS_NODATA);
+            break;
+        case DNS_REPLY_ERROR:
+            metric_inc(METRIC_DNS_ERRORS);
+            break;
+        default:
+            /* Responses and other traffic dropped by design, not an error */
+            metric_inc(METRIC_DNS_DROPPED);
+            break;
+        }
+        if (reply_len == 0) {
+            continue;
+        }
 
-        int response_len = offset + sizeof(dns_answer_t);
+        if (esp_log_level_get(TAG) >= ESP_LOG_DEBUG && dns_question_name(msg, reply_len, domain, sizeof(domain))) {
+            ESP_LOGD(TAG, "Query type %u for %s: %s", info.qtype, domain,
+                     info.kind == DNS_REPLY_ANSWER ? "A" : "NODATA");
+        }
 
-        /* Send the DNS response */
-        sendto(sock, tx_buffer, response_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
+        sendto(sock, msg, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
     }
 
     close(sock);
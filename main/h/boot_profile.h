@@ -0,0 +1,99 @@
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_http_server.h"
+#include "mqtt_client.h"
+
+/* Topic of the boot report, sent once per boot: /sensor_<ID>/boot */
+#define BOOT_PROFILE_TOPIC_FMT "/sensor_%s/boot"
+
+#define BOOT_PROFILE_JSON_LEN 1024
+
+/*
+ * Boot phases, in the order they are reported.
+ *
+ * PHASE(id, name): a phase is timed between boot_profile_begin() and
+ * boot_profile_end(), a milestone is a single boot_profile_mark().
+ */
+#define FOREACH_BOOT_PHASE(PHASE) \
+    PHASE(NVS,              "nvs")              /* NVS init, the saved config read back */ \
+    PHASE(WDT,              "wdt")              /* TWDT reconfigured */ \
+    PHASE(SENSOR,           "sensor")           /* I2C and BME280 init */ \
+    PHASE(FIRST_SAMPLE,     "first_sample")     /* First sample in the ring */ \
+    PHASE(ETH,              "eth")              /* Netif, EMAC and PHY init, driver started */ \
+    PHASE(STORE,            "store")            /* Store-and-forward log recovered */ \
+    PHASE(WIFI,             "wifi")             /* Hotspot + backup STA up, DNS server started */ \
+    PHASE(HTTP,             "http")             /* Config portal started */ \
+    PHASE(LINK,             "link")             /* Ethernet driver started to link up */ \
+    PHASE(DHCP,             "dhcp")             /* Driver started to the first IP, on either link */ \
+    PHASE(MQTT,             "mqtt")             /* Client created to CONNACK: DNS, TCP, TLS, MQTT */ \
+    PHASE(FIRST_PUBLISH,    "first_publish")    /* First sample handed to the MQTT client */ \
+    PHASE(FIRST_ACK,        "first_ack")        /* First PUBACK */ \
+
+#define GENERATE_BOOT_PHASE_ENUM(ID, NAME) BOOT_PHASE_##ID,
+
+enum boot_phase {
+    FOREACH_BOOT_PHASE(GENERATE_BOOT_PHASE_ENUM)
+    BOOT_PHASE_COUNT
+};
+
+/**
+ * @brief Take the time reference, first thing in app_main()
+ *
+ *  After a power-on reset the RTC timer counts from power-up, the time spent
+ *  in the ROM and the bootloader is then reported as well and every time is
+ *  relative to power-up. After any other reset they are relative to the app start.
+ */
+void boot_profile_init(void);
+
+/**
+ * @brief Start timing a phase, only the first call per boot counts
+ */
+void boot_profile_begin(enum boot_phase phase);
+
+/**
+ * @brief End a phase started with boot_profile_begin(), only the first call per boot counts
+ */
+void boot_profile_end(enum boot_phase phase);
+
+/**
+ * @brief Record a milestone, only the first call per boot counts
+ */
+void boot_profile_mark(enum boot_phase phase);
+
+/**
+ * @brief Check if a phase has ended, or a milestone was reached
+ */
+bool boot_profile_done(enum boot_phase phase);
+
+/**
+ * @brief Write the boot report as JSON
+ *
+ *  {"reset":"poweron","from":"power_up","pre_app_ms":318,"target_ms":2000,
+ *   "phases":[{"name":"nvs","start_ms":331,"ms":24},...,{"name":"first_publish","at_ms":1712}]}
+ *
+ *  "from" tells what the times count from, "pre_app_ms" (ROM and bootloader)
+ *  is only there after a power-on reset. Phases not reached yet are left out.
+ *
+ * @return Length written, or -1 if the buffer was too small
+ */
+int boot_profile_json(char *buf, size_t len);
+
+/**
+ * @brief Publish the boot report once per boot
+ *
+ *  Sent once the first PUBACK is in, or when the boot never gets there,
+ *  on the first call after CONFIG_BOOT_PROFILE_REPORT_TIMEOUT_S. Cheap to call often.
+ *
+ * @param client Connected MQTT client
+ */
+void boot_profile_send(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief GET /debug/boot handler, the boot report as JSON
+ */
+esp_err_t boot_profile_handler(httpd_req_t *req);
+
+#endif /* BOOT_PROFILE_H */
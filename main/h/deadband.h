@@ -0,0 +1,36 @@
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensor_queue.h"
+
+/*
+ * Report by exception: a sample is only published when one of its values
+ * left the deadband around the last reported value, or when nothing was
+ * reported for a heartbeat period. Thresholds are set per sensq_type in
+ * menuconfig (Sensor Publishing -> "TEMP/HUM/PRES deadband" options).
+ */
+
+/**
+ * @brief Decide if a sample must be reported, and if so make it the new reference
+ *
+ *  Suppressed samples leave gaps in the seq numbers seen by the broker.
+ *  Must be called from the comms task only.
+ *
+ * @param sample Sample read from the sensor ring
+ * @return true if the sample must be published (or stored while offline)
+ */
+bool deadband_check(const sensq *sample);
+
+/**
+ * @brief Number of samples let through since boot
+ */
+uint32_t deadband_sent(void);
+
+/**
+ * @brief Number of samples suppressed since boot
+ */
+uint32_t deadband_suppressed(void);
+
+#endif /* DEADBAND_H */
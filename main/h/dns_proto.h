@@ -0,0 +1,99 @@
+#ifndef DNS_PROTO_H
+#define DNS_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * DNS message handling of the captive portal responder. Plain C, no ESP-IDF
+ * dependency, so the same code runs in the host fuzz / throughput harness
+ * (utils/host/bench_dns.c).
+ */
+
+#define DNS_MAX_LEN         512         /* UDP payload without EDNS */
+#define DNS_HEADER_LEN      12
+#define DNS_NAME_MAX        255         /* Wire format, length bytes included */
+#define DNS_LABEL_MAX       63
+#define DNS_TTL_S           60
+
+#define DNS_TYPE_A          1
+#define DNS_TYPE_SOA        6
+#define DNS_TYPE_ANY        255
+#define DNS_CLASS_IN        1
+#define DNS_CLASS_ANY       255
+
+#define DNS_RCODE_OK        0
+#define DNS_RCODE_FORMERR   1
+#define DNS_RCODE_NOTIMP    4
+
+typedef enum {
+    DNS_REPLY_DROP,         /* Not a query, or too broken to answer */
+    DNS_REPLY_ANSWER,       /* A record with the redirect address */
+    DNS_REPLY_NODATA,       /* Name exists, no record of that type (SOA for negative caching) */
+    DNS_REPLY_ERROR,        /* FORMERR / NOTIMP, header only */
+} dns_reply_kind_t;
+
+typedef struct
+{
+    dns_reply_kind_t kind;
+    uint16_t qtype;
+} dns_query_info_t;
+
+/**
+ * @brief Turn a query into its reply, in place
+ *
+ *  Every read is checked against len and every write against size. The
+ *  question is kept as received, anything after it (EDNS OPT, stray
+ *  records) is dropped from the reply.
+ *
+ * @param msg Query as received, overwritten with the reply
+ * @param len Bytes received
+ * @param size Size of msg
+ * @param redirect_ip IPv4 address for A answers, network byte order
+ * @param info Filled with the query type and the kind of reply, may be NULL
+ * @return Reply length, 0 to send nothing
+ */
+size_t dns_reply_build(uint8_t *msg, size_t len, size_t size, uint32_t redirect_ip, dns_query_info_t *info);
+
+/**
+ * @brief Dotted name of the question, for logs (reply of kind ANSWER or NODATA)
+ * @return false if the name does not fit in out
+ */
+bool dns_question_name(const uint8_t *msg, size_t len, char *out, size_t out_size);
+
+
+/* ________________ Per-client rate limit ________________ */
+
+#define DNS_RATE_CLIENTS    8
+
+typedef struct
+{
+    bool used;
+    uint32_t addr;
+    uint32_t tokens_milli;              /* Thousandths of a query */
+    int64_t last_us;
+} dns_rate_client_t;
+
+typedef struct
+{
+    uint32_t qps;
+    uint32_t burst;
+    uint32_t dropped;
+    dns_rate_client_t client[DNS_RATE_CLIENTS];
+} dns_rate_t;
+
+/**
+ * @brief Token bucket per client address, the least recently seen client is replaced when full
+ * @param qps Sustained queries per second per client
+ * @param burst Queries a client can send at once
+ */
+void dns_rate_init(dns_rate_t *rate, uint32_t qps, uint32_t burst);
+
+/**
+ * @brief Take one token for a query from addr
+ * @return false if the client is over its rate, the query should be dropped
+ */
+bool dns_rate_allow(dns_rate_t *rate, uint32_t addr, int64_t now_us);
+
+#endif /* DNS_PROTO_H */
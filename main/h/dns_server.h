@@ -4,7 +4,7 @@
 #include "esp_netif.h"
 
 /**
- * @brief Start a simple DNS server that redirects all queries to the specified IP
+ * @brief Start the captive portal DNS server: A queries resolve to the AP address, other types get NODATA
  * @param ap_netif The network interface for the access point
  * @return esp_err_t ESP_OK on success
  */
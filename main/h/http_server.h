@@ -6,9 +6,13 @@
 #define ID_LEN 6
 #define URL_LEN 64
 
+/*
+ * Board ID and broker URL set on the config page. Written by the httpd task
+ * (and by app_main before the tasks start), other tasks read them with
+ * http_config_get().
+ */
 extern char ID[ID_LEN + 1];
 extern char URL[URL_LEN + 1];
-extern bool mqtt_config_updated;
 
 
 /*
@@ -19,6 +23,7 @@ extern bool mqtt_config_updated;
     char *p = s, *q = s; \
     while (*p) { \
         if (*p == '+') { \
+            *q++ = ' '; \
             p++; \
         } else if (*p == '%' && p[1] && p[2]) { \
             unsigned int val = 0; \
@@ -45,4 +50,11 @@ httpd_handle_t start_http_server(void);
  */
 void print_http_info(void);
 
+/**
+ * @brief Copy the board ID and broker URL, never half written (any task)
+ * @param id At least ID_LEN + 1 bytes, or NULL
+ * @param url At least URL_LEN + 1 bytes, or NULL
+ */
+void http_config_get(char *id, char *url);
+
 #endif
@@ -0,0 +1,58 @@
+#ifndef LINK_MANAGER_H
+#define LINK_MANAGER_H
+
+#include <stdbool.h>
+#include "esp_http_server.h"
+#include "h/link_policy.h"
+
+/* Probe the gateway of each link, unless a fixed target is set */
+#define LINK_PROBE_TARGET CONFIG_LINK_PROBE_TARGET
+
+typedef void (*link_change_cb_t)(link_id_t active);
+
+/**
+ * @brief Start watching the Ethernet and WiFi STA links, and pick the one to use
+ *
+ *  Each link with an IP is pinged every CONFIG_LINK_PROBE_INTERVAL_MS over its
+ *  own interface, so a dead upstream behind a live PHY is seen too. The active
+ *  link is made the default netif. With CONFIG_LINK_WIFI_HOT_STANDBY the STA
+ *  stays associated with an IP next to Ethernet, so a failover only costs the
+ *  MQTT reconnect. See link_policy.h for the debounce and the switch back.
+ *
+ *  Call after the default event loop is created, before the links start.
+ *
+ * @param cb Called on every change of the active link, from the event loop or a probe task. Keep it short
+ */
+void link_manager_init(link_change_cb_t cb);
+
+/**
+ * @brief Link carrying the traffic, LINK_NONE if none is usable
+ */
+link_id_t link_manager_active(void);
+
+/**
+ * @brief Check if the active link missed a probe, see link_policy_suspect()
+ */
+bool link_manager_suspect(void);
+
+/**
+ * @brief Tell the link manager MQTT is connected, this ends the failover time measure
+ */
+void link_manager_mqtt_connected(void);
+
+/**
+ * @brief GET /debug/link handler: link states and failover times, as JSON
+ *
+ *  {"active":"wifi","standby":"hot","switches":1,
+ *   "links":[{"name":"ethernet","carrier":false,"ip":true,"probe_ok":true,"fails":0,"probes_failed":4},
+ *            {"name":"wifi","carrier":true,"ip":true,"probe_ok":true,"fails":0,"probes_failed":0}],
+ *   "failover":{"count":1,"last_detect_ms":12,"last_ms":431,"avg_ms":431,"max_ms":431},
+ *   "wifi":{"connects":2,"retries":3,"cached_ap_misses":0,"last_ms":1260,"max_ms":1260}}
+ *
+ *  A failover runs from the outage (first failed probe, or carrier loss) to
+ *  MQTT connected again on the other link, detect_ms up to the switch. The
+ *  wifi times run from the STA disconnect (or its enable) to its new IP.
+ */
+esp_err_t link_manager_handler(httpd_req_t *req);
+
+#endif /* LINK_MANAGER_H */
@@ -0,0 +1,99 @@
+#ifndef LINK_POLICY_H
+#define LINK_POLICY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Which uplink carries the traffic: the decision part of the link manager.
+ * Plain C, no ESP-IDF dependency, times are passed in by the caller, so the
+ * same code runs in the host fault-injection harness (utils/host/link_sim.c).
+ *
+ * A link is usable with carrier, an IP and passing probes. Going down is
+ * immediate on carrier or IP loss, and after fail_threshold failed probes in
+ * a row. Coming back takes ok_threshold good probes in a row. The active link
+ * only moves back to the preferred one once that has been usable for hold_ms
+ * without a break, so a flapping cable does not move the traffic every time.
+ */
+
+typedef enum {
+    LINK_NONE = -1,
+    LINK_ETH = 0,           /* Preferred */
+    LINK_WIFI,
+    LINK_COUNT
+} link_id_t;
+
+typedef struct
+{
+    uint8_t fail_threshold;         /* Failed probes in a row before a link is down */
+    uint8_t ok_threshold;           /* Good probes in a row before it is up again */
+    uint32_t hold_ms;               /* Preferred link usable this long before switching back */
+} link_policy_cfg_t;
+
+typedef struct
+{
+    bool carrier;                   /* PHY link, or STA associated */
+    bool has_ip;
+    bool probe_ok;                  /* Debounced probe result */
+    uint8_t fails;                  /* Failed probes in a row */
+    uint8_t oks;                    /* Good probes in a row, while probe_ok is false */
+    int64_t usable_since_us;        /* 0 while not usable */
+    int64_t first_fail_us;          /* First failed probe of the current streak, 0 if none */
+} link_state_t;
+
+typedef struct
+{
+    link_policy_cfg_t cfg;
+    link_state_t link[LINK_COUNT];
+    link_id_t active;
+    uint32_t switches;
+    int64_t outage_us;              /* When the active link stopped working, 0 if it works */
+    int64_t switch_outage_us;       /* Outage that caused the last switch, 0 for a switch back */
+} link_policy_t;
+
+void link_policy_init(link_policy_t *p, const link_policy_cfg_t *cfg);
+
+/**
+ * @brief Carrier (PHY link / STA association) changed
+ */
+void link_policy_carrier(link_policy_t *p, link_id_t link, bool up, int64_t now_us);
+
+/**
+ * @brief IP acquired or lost on a link
+ */
+void link_policy_ip(link_policy_t *p, link_id_t link, bool has_ip, int64_t now_us);
+
+/**
+ * @brief Result of one health probe on a link
+ */
+void link_policy_probe(link_policy_t *p, link_id_t link, bool ok, int64_t now_us);
+
+/**
+ * @brief Check if a link can carry traffic now
+ */
+bool link_policy_usable(const link_policy_t *p, link_id_t link);
+
+/**
+ * @brief Check if the active link missed a probe, but is not declared down yet
+ *
+ *  Messages sent meanwhile may be lost with the link, better keep them.
+ */
+bool link_policy_suspect(const link_policy_t *p);
+
+/**
+ * @brief Decide which link to use, call after every input
+ *
+ *  Moves off a link that is not usable right away: to the preferred link if
+ *  usable, to the other one otherwise. Moves back to the preferred link only
+ *  once its hold time has passed.
+ *
+ * @return The active link, LINK_NONE if no link is usable
+ */
+link_id_t link_policy_select(link_policy_t *p, int64_t now_us);
+
+/**
+ * @brief Name of a link, for logs and reports
+ */
+const char *link_policy_name(link_id_t link);
+
+#endif /* LINK_POLICY_H */
@@ -0,0 +1,27 @@
+#ifndef LIVE_STREAM_H
+#define LIVE_STREAM_H
+
+#include "esp_http_server.h"
+#include "sensor_queue.h"
+
+/* One sample as a WebSocket text frame */
+#define LIVE_STREAM_FRAME_LEN 96
+
+/**
+ * @brief Register the /ws WebSocket endpoint on the config portal
+ * @param server Running HTTP server
+ */
+void live_stream_start(httpd_handle_t server);
+
+/**
+ * @brief Push a new sample to every connected WebSocket client
+ *
+ *  Never blocks and allocates nothing: the sample is copied in a single slot
+ *  and the send is done later from the httpd task. Samples arriving before
+ *  the previous one went out replace it, clients always get the latest one.
+ *
+ * @param sample New sample
+ */
+void live_stream_publish(const sensq *sample);
+
+#endif /* LIVE_STREAM_H */
@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "esp_http_server.h"
+#include "spsc_ring.h"
+
+/*
+ * Lock-free counter registry, served in Prometheus text format on /metrics.
+ * A counter is one relaxed atomic add, cheap enough for any hot path.
+ *
+ * METRIC(id, name, labels, help): entries sharing a name must be adjacent,
+ * HELP and TYPE are only written for the first one.
+ */
+#define FOREACH_METRIC(METRIC) \
+    METRIC(SAMPLES_READ,            "lxft_samples_read_total",          "",                             "Samples read from the BME280") \
+    METRIC(SENSOR_ERRORS,           "lxft_sensor_read_errors_total",    "",                             "Failed BME280 reads") \
+    METRIC(SAMPLES_SUPPRESSED,      "lxft_samples_suppressed_total",    "",                             "Samples inside the deadband, not reported") \
+    METRIC(SAMPLES_REPORTED,        "lxft_samples_reported_total",      "",                             "Samples let through by the deadband") \
+    METRIC(SAMPLES_PUBLISHED,       "lxft_samples_published_total",     "",                             "Samples handed to the MQTT client, backfill included") \
+    METRIC(OFFLINE_NET,             "lxft_samples_offline_total",       "reason=\"network_not_ready\"", "Samples not published live, stored if store-and-forward is on") \
+    METRIC(OFFLINE_MQTT,            "lxft_samples_offline_total",       "reason=\"mqtt_not_ready\"",    "") \
+    METRIC(OFFLINE_LINK,            "lxft_samples_offline_total",       "reason=\"link_suspect\"",      "") \
+    METRIC(PUBLISH_OUTBOX_FULL,     "lxft_mqtt_publish_failures_total", "reason=\"outbox_full\"",       "Failed esp_mqtt_client_publish() calls") \
+    METRIC(PUBLISH_NOT_CONNECTED,   "lxft_mqtt_publish_failures_total", "reason=\"not_connected\"",     "") \
+    METRIC(MQTT_CONNECTS,           "lxft_mqtt_connects_total",         "",                             "MQTT connections, the first one included") \
+    METRIC(MQTT_DISCONNECTS,        "lxft_mqtt_disconnects_total",      "",                             "MQTT disconnections") \
+    METRIC(MQTT_TLS_FULL,           "lxft_mqtt_tls_handshakes_total",   "type=\"full\"",                "MQTT TLS connects by handshake type") \
+    METRIC(MQTT_TLS_RESUMED,        "lxft_mqtt_tls_handshakes_total",   "type=\"resumed\"",             "") \
+    METRIC(MQTT_TLS_FAILED,         "lxft_mqtt_tls_handshakes_total",   "type=\"failed\"",              "") \
+    METRIC(FAILOVER_TO_WIFI,        "lxft_link_failovers_total",        "to=\"wifi\"",                  "Switches between the Ethernet and the WiFi backup link") \
+    METRIC(FAILOVER_TO_ETH,         "lxft_link_failovers_total",        "to=\"ethernet\"",              "") \
+    METRIC(LINK_PROBE_FAILS_ETH,    "lxft_link_probe_failures_total",   "link=\"ethernet\"",            "Link health probes without an answer") \
+    METRIC(LINK_PROBE_FAILS_WIFI,   "lxft_link_probe_failures_total",   "link=\"wifi\"",                "") \
+    METRIC(WIFI_RETRIES,            "lxft_wifi_retries_total",          "",                             "WiFi backup connect attempts after a failure") \
+    METRIC(LIVE_FRAMES_SENT,        "lxft_live_frames_sent_total",      "",                             "Samples sent to the /ws live stream clients") \
+    METRIC(LIVE_CLIENTS_DROPPED,    "lxft_live_clients_dropped_total",  "",                             "Live stream clients closed because they were too slow") \
+    METRIC(DNS_ANSWERS,             "lxft_dns_queries_total",           "reply=\"a\"",                  "Captive portal DNS queries by reply") \
+    METRIC(DNS_NODATA,              "lxft_dns_queries_total",           "reply=\"nodata\"",             "") \
+    METRIC(DNS_ERRORS,              "lxft_dns_queries_total",           "reply=\"error\"",              "") \
+    METRIC(DNS_RATE_LIMITED,        "lxft_dns_rate_limited_total",      "",                             "DNS queries dropped by the per-client rate limit") \
+    METRIC(DNS_DROPPED,             "lxft_dns_dropped_total",           "",                             "DNS packets dropped unanswered, not a query or too broken") \
+
+#define GENERATE_METRIC_ENUM(ID, NAME, LABELS, HELP) METRIC_##ID,
+
+enum metric_id {
+    FOREACH_METRIC(GENERATE_METRIC_ENUM)
+    METRIC_COUNT
+};
+
+extern _Atomic uint32_t metrics[METRIC_COUNT];
+
+static inline void metric_add(enum metric_id id, uint32_t n)
+{
+    atomic_fetch_add_explicit(&metrics[id], n, memory_order_relaxed);
+}
+
+static inline void metric_inc(enum metric_id id)
+{
+    metric_add(id, 1);
+}
+
+static inline uint32_t metric_get(enum metric_id id)
+{
+    return atomic_load_explicit(&metrics[id], memory_order_relaxed);
+}
+
+/**
+ * @brief Report the depth and loss counters of the sensor ring as well
+ */
+void metrics_set_ring(spsc_ring_t *ring);
+
+/**
+ * @brief GET /metrics handler, Prometheus text format 0.0.4
+ */
+esp_err_t metrics_handler(httpd_req_t *req);
+
+#endif /* METRICS_H */
@@ -0,0 +1,49 @@
+#ifndef MQTT_TLS_H
+#define MQTT_TLS_H
+
+#include <stddef.h>
+#include "esp_http_server.h"
+
+#if CONFIG_COMMS_MQTT_TLS_RESUME
+
+#include "esp_tls.h"
+#include "esp_transport.h"
+
+/**
+ * @brief Create the TLS transport for one MQTT client
+ *
+ *  Same role as the SSL transport of esp-mqtt, but the session of the last
+ *  connection is kept across reconnects and client rebuilds and offered on
+ *  the next connect, so the broker can resume it without the certificate
+ *  exchange and the RSA operations. Every connect is timed. TLS 1.2 only.
+ *
+ *  Pass it as network.transport, the MQTT client destroys it with itself.
+ *
+ * @param cfg Certificates, key and checks, copied. client_session and timeout_ms are set per connect
+ * @return Transport handle, or NULL if out of memory
+ */
+esp_transport_handle_t mqtt_tls_transport_create(const esp_tls_cfg_t *cfg);
+
+/**
+ * @brief Drop the saved session, when the broker endpoint changes
+ *
+ *  Only call while no MQTT client is running.
+ */
+void mqtt_tls_forget_session(void);
+
+#endif /* CONFIG_COMMS_MQTT_TLS_RESUME */
+
+/**
+ * @brief GET /debug/mqtt_tls handler: MQTT connect times, full vs. resumed handshakes, as JSON
+ *
+ *  {"session":true,"last":{"us":95210,"resumed":true},
+ *   "full":{"count":1,"avg_us":2310456,"min_us":2310456,"max_us":2310456},
+ *   "resumed":{"count":6,"avg_us":101322,"min_us":90211,"max_us":130540},"failed":0}
+ *
+ *  Times run from the start of the connect to the end of the handshake, so
+ *  they include the TCP connect (and DNS, if the broker is given by name).
+ *  503 if the resumption is disabled.
+ */
+esp_err_t mqtt_tls_handler(httpd_req_t *req);
+
+#endif /* MQTT_TLS_H */
@@ -0,0 +1,73 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+/* RFC 2046 limits the boundary to 70 chars, plus the leading "\r\n--" */
+#define MULTIPART_BOUNDARY_MAX  70
+#define MULTIPART_DELIM_MAX     (MULTIPART_BOUNDARY_MAX + 4)
+#define MULTIPART_HEADERS_MAX   256
+
+/* Called with the body of the file parts, in order, as it is parsed */
+typedef esp_err_t (*multipart_data_cb_t)(const uint8_t *data, size_t len, void *arg);
+
+typedef enum {
+    MULTIPART_PREAMBLE,         /* Before the first delimiter */
+    MULTIPART_AFTER_DELIM,      /* "--" (last part) or "\r\n" (part headers follow) */
+    MULTIPART_HEADERS,
+    MULTIPART_DATA,
+    MULTIPART_DONE,
+} multipart_state_t;
+
+/*
+ * Streaming multipart/form-data parser. Feeds can split the input anywhere,
+ * the delimiter is matched with KMP so nothing is buffered but the part of
+ * it seen so far. Only the parts with a filename are passed on.
+ */
+typedef struct multipart
+{
+    char delim[MULTIPART_DELIM_MAX + 1];
+    uint8_t fail[MULTIPART_DELIM_MAX];      /* KMP failure function of delim */
+    size_t delim_len;
+    size_t match;                           /* Chars of delim matched so far */
+    multipart_state_t state;
+    char after[2];                          /* Chars seen after a delimiter */
+    size_t after_len;
+    char headers[MULTIPART_HEADERS_MAX];
+    size_t headers_len;
+    bool file_part;
+    uint32_t file_parts;
+} multipart_t;
+
+/**
+ * @brief Set up the parser from the request Content-Type
+ * @param mp Parser
+ * @param content_type e.g. "multipart/form-data; boundary=----WebKitFormBoundary..."
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if there is no usable boundary
+ */
+esp_err_t multipart_init(multipart_t *mp, const char *content_type);
+
+/**
+ * @brief Parse the next slice of the body
+ * @param mp Parser
+ * @param data Body bytes
+ * @param len Number of bytes
+ * @param on_data Called for the file part bytes
+ * @param arg Passed to on_data
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE on part headers too long, ESP_FAIL on
+ *         bad framing, or the first error returned by on_data
+ */
+esp_err_t multipart_feed(multipart_t *mp, const uint8_t *data, size_t len, multipart_data_cb_t on_data, void *arg);
+
+/**
+ * @brief Check if the closing delimiter was seen
+ */
+static inline bool multipart_done(const multipart_t *mp)
+{
+    return mp->state == MULTIPART_DONE;
+}
+
+#endif /* MULTIPART_H */
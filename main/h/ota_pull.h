@@ -0,0 +1,51 @@
+#ifndef OTA_PULL_H
+#define OTA_PULL_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/*
+ * Command: {"url":"https://host/fw.bin","size":1234567,"sha256":"<64 hex chars>"}
+ * The file can be a plain image or a utils/host/ota_pack.py package, size is the
+ * one of the file and sha256 the one of the image once unpacked.
+ */
+#define OTA_PULL_TOPIC_FMT          "/sensor_%s/ota"
+/* Progress: {"state":"downloading|verifying|done|failed","offset":..,"size":..[,"error":".."]}
+ * done adds "image" (unpacked bytes) and "ms" (time from the command to the image ready) */
+#define OTA_PULL_STATUS_TOPIC_FMT   "/sensor_%s/ota/status"
+
+/**
+ * @brief Subscribe to the OTA command topic, call on every MQTT connect
+ */
+void ota_pull_subscribe(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Move the subscription to the command topic of the new board ID, on a live connection
+ * @param old_id Board ID the current subscription was made with
+ */
+void ota_pull_resubscribe(esp_mqtt_client_handle_t client, const char *old_id);
+
+/**
+ * @brief Handle an MQTT_EVENT_DATA if it is an OTA command
+ *
+ *  A valid command starts the download task, which fetches the image over
+ *  HTTP(S) on whatever link is up. A dropped connection is resumed with a
+ *  Range request from the last received byte, the image is checked against
+ *  the SHA-256 of the command before it is made bootable.
+ *
+ * @return true if the message was an OTA command (accepted or not)
+ */
+bool ota_pull_handle_data(esp_mqtt_event_handle_t event);
+
+/**
+ * @brief Publish the latest OTA progress, if it changed (comms task, while connected)
+ */
+void ota_pull_send_status(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Check if a pull OTA is running
+ */
+bool ota_pull_busy(void);
+
+#endif /* OTA_PULL_H */
@@ -0,0 +1,105 @@
+#ifndef OTA_STREAM_H
+#define OTA_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "miniz.h"
+#include "ota_update.h"
+
+/*
+ * OTA input decoder in front of ota_update. Accepts, detected from the first bytes:
+ *  - a plain ESP-IDF app image,
+ *  - an image container (utils/host/ota_pack.py): header, then either the
+ *    zlib compressed image or a zlib compressed delta against the running app.
+ *
+ * Delta ops (after inflate), lengths and offsets as LEB128 varints:
+ *   'C' src len         copy len bytes of the running app from src
+ *   'A' src len bytes   add bytes to len bytes of the running app from src
+ *   'I' len bytes       insert bytes
+ *   'E'                 end
+ */
+#define OTA_IMAGE_MAGIC         "LXOT"
+#define OTA_IMAGE_VERSION       1
+#define OTA_IMAGE_ZLIB          1
+#define OTA_IMAGE_DELTA         2
+
+typedef struct __attribute__((__packed__))
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t type;
+    uint16_t reserved;
+    uint32_t image_size;                        /* Output size */
+    uint32_t base_size;                         /* Delta: bytes of the running app it applies to */
+    uint8_t image_sha256[OTA_SHA256_LEN];       /* Of the output */
+    uint8_t base_sha256[OTA_SHA256_LEN];        /* Delta: of the running app */
+} ota_image_header_t;
+
+typedef enum {
+    OTA_STREAM_DETECT,
+    OTA_STREAM_HEADER,
+    OTA_STREAM_RAW,
+    OTA_STREAM_INFLATE,
+    OTA_STREAM_FAILED,
+} ota_stream_state_t;
+
+typedef struct ota_stream
+{
+    ota_update_t ota;
+    ota_stream_state_t state;
+    size_t in_size;                 /* Expected input size, 0 if unknown */
+    size_t in_bytes;                /* Input consumed so far, where a resume starts */
+    int64_t start_us;
+
+    ota_image_header_t hdr;
+    size_t hdr_fill;
+
+    /* Inflate: the 32 KB output window doubles as the dictionary */
+    tinfl_decompressor *inflator;
+    uint8_t *dict;
+    size_t dict_ofs;
+    bool inflate_done;
+
+    /* Delta */
+    const esp_partition_t *base;
+    uint8_t op;
+    uint8_t field;                  /* Varint being read */
+    uint8_t shift;
+    uint32_t args[2];
+    uint32_t remaining;             /* Data bytes left in the current 'A' or 'I' op */
+    uint32_t src;
+    bool delta_done;
+    uint8_t scratch[256];
+} ota_stream_t;
+
+/**
+ * @brief Prepare for a new input
+ * @param s Stream, owned by the caller until ota_stream_finish/abort
+ * @param in_size Input size if known (Content-Length, MQTT command), 0 otherwise
+ */
+void ota_stream_begin(ota_stream_t *s, size_t in_size);
+
+/**
+ * @brief Decode the next slice of input into the inactive slot
+ * @return ESP_OK, ESP_ERR_INVALID_VERSION for an unknown container, ESP_ERR_INVALID_STATE
+ *         if a delta does not match the running app, ESP_ERR_INVALID_RESPONSE on
+ *         corrupt data, or the ota_update error
+ */
+esp_err_t ota_stream_write(ota_stream_t *s, const void *data, size_t len);
+
+/**
+ * @brief Check the decoded image and make it bootable
+ * @param expected_sha256 SHA-256 the decoded image must have, NULL to only use the container's
+ * @param stats Filled on success, may be NULL. elapsed_ms covers the whole update.
+ */
+esp_err_t ota_stream_finish(ota_stream_t *s, const uint8_t *expected_sha256, ota_update_stats_t *stats);
+
+/**
+ * @brief Drop the update, safe to call at any point
+ */
+void ota_stream_abort(ota_stream_t *s);
+
+#endif /* OTA_STREAM_H */
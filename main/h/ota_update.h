@@ -0,0 +1,90 @@
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "mbedtls/sha256.h"
+
+#define OTA_SHA256_LEN 32
+
+/*
+ * Firmware image writer shared by the OTA paths. The caller pushes the image
+ * in pieces of any size; a writer task erases and writes the inactive slot
+ * one full buffer at a time while the caller receives the next one.
+ */
+typedef struct ota_update
+{
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha;
+
+    /* Double buffer: the caller fills one while the writer flushes the other */
+    uint8_t *buf[2];
+    size_t fill;
+    int cur;
+    QueueHandle_t full_q;           /* Caller -> writer: ota_chunk_t */
+    QueueHandle_t free_q;           /* Writer -> caller: buffer index */
+    SemaphoreHandle_t writer_done;
+    volatile esp_err_t writer_err;
+
+    size_t expected_size;           /* 0 if unknown */
+    size_t received;
+    int64_t start_us;
+    int64_t wait_us;                /* Time the caller waited for a free buffer */
+} ota_update_t;
+
+typedef struct ota_update_stats
+{
+    size_t bytes;
+    size_t in_bytes;                /* Bytes received, fewer than bytes for a packed image */
+    uint32_t elapsed_ms;
+    uint32_t kbytes_per_s;
+    uint32_t flash_wait_ms;         /* Part of elapsed_ms spent waiting on the flash */
+    uint8_t sha256[OTA_SHA256_LEN];
+} ota_update_stats_t;
+
+/**
+ * @brief Start writing an image to the inactive OTA slot
+ *
+ *  Flash sectors are erased as they are written (OTA_WITH_SEQUENTIAL_WRITES),
+ *  so nothing is erased up front. A known size is checked against the slot.
+ *
+ * @param ota Context, owned by the caller until ota_update_finish/abort
+ * @param image_size Image size if known, 0 otherwise
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the image can not fit, ESP_ERR_NO_MEM,
+ *         or the esp_ota_begin() error
+ */
+esp_err_t ota_update_begin(ota_update_t *ota, size_t image_size);
+
+/**
+ * @brief Append image bytes
+ *
+ *  Only blocks when both buffers are in use, i.e. while the flash is slower
+ *  than the network.
+ *
+ * @return ESP_OK, or the first write error of the writer task
+ */
+esp_err_t ota_update_write(ota_update_t *ota, const void *data, size_t len);
+
+/**
+ * @brief Flush, validate the image and make it the boot partition
+ * @param ota Context
+ * @param expected_sha256 Image hash to check, NULL to skip the check
+ * @param stats Filled with the size, time and hash of the image, may be NULL
+ * @return ESP_OK, ESP_ERR_INVALID_CRC on hash mismatch, ESP_ERR_OTA_VALIDATE_FAILED
+ *         if the image is not valid, or the write error
+ */
+esp_err_t ota_update_finish(ota_update_t *ota, const uint8_t *expected_sha256, ota_update_stats_t *stats);
+
+/**
+ * @brief Stop the writer and drop the partial image
+ */
+void ota_update_abort(ota_update_t *ota);
+
+#endif /* OTA_UPDATE_H */
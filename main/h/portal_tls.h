@@ -0,0 +1,36 @@
+#ifndef PORTAL_TLS_H
+#define PORTAL_TLS_H
+
+#include "esp_http_server.h"
+
+#if CONFIG_PORTAL_HTTPS
+
+#include "esp_https_server.h"
+
+/**
+ * @brief Fill the TLS part of the portal server config
+ *
+ *  Embedded server certificate and key, session tickets so a browser coming
+ *  back skips the key exchange, and the hooks that time every handshake.
+ *
+ * @param conf Config from HTTPD_SSL_CONFIG_DEFAULT(), the httpd part already set
+ */
+void portal_tls_configure(httpd_ssl_config_t *conf);
+
+#endif /* CONFIG_PORTAL_HTTPS */
+
+/**
+ * @brief GET /debug/tls handler: handshake cost of this connection and totals, as JSON
+ *
+ *  {"this":{"us":412345,"heap":35120,"peak":41872,"resumed":false},
+ *   "full":{"count":4,"avg_us":410233,"min_us":401876,"max_us":423112},
+ *   "resumed":{"count":8,"avg_us":19870,"min_us":18230,"max_us":24511}}
+ *
+ *  "us" runs from the ClientHello to the end of the handshake, "heap" is the
+ *  heap still held by the session afterwards, "peak" the most heap used
+ *  while it ran. Full and resumed (session ticket) handshakes are counted
+ *  apart. 503 if the portal is not on HTTPS.
+ */
+esp_err_t portal_tls_handler(httpd_req_t *req);
+
+#endif /* PORTAL_TLS_H */
@@ -0,0 +1,82 @@
+#ifndef PUB_LATENCY_H
+#define PUB_LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensor_queue.h"
+
+/*
+ * Publish -> PUBACK latency of the QoS1 messages.
+ *
+ * The send time of each message is kept by msg_id until its
+ * MQTT_EVENT_PUBLISHED arrives. Either side may come first: the PUBACK
+ * can be handled by the MQTT task before esp_mqtt_client_publish()
+ * returned the msg_id to the comms task.
+ *
+ * With CONFIG_LATENCY_TRACE every matched message also yields a trace with
+ * the time of each stage, for the /sensor_<ID>/trace topic.
+ */
+
+/* Histogram bucket upper bounds in ms, the last bucket has no bound */
+#define PUB_LATENCY_BUCKETS 11
+static const uint32_t pub_latency_bounds_ms[PUB_LATENCY_BUCKETS - 1] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+typedef struct pub_latency_stats
+{
+    uint32_t count[PUB_LATENCY_BUCKETS];    /* Not cumulative */
+    uint32_t acked;                         /* PUBACKs matched to a send time */
+    uint32_t untracked;                     /* Lost because the table was full */
+    uint64_t sum_ms;
+    uint32_t max_ms;
+} pub_latency_stats_t;
+
+/* Stages of one message, esp_timer_get_time() values */
+typedef struct pub_trace
+{
+    int msg_id;
+    uint32_t samples;       /* Samples in the message */
+    int64_t read_us;        /* Sensor read of the oldest sample, 0 if read before the last reset */
+    int64_t dequeue_us;     /* Taken out of the sensor ring, 0 for stored samples */
+    int64_t publish_us;     /* esp_mqtt_client_publish() called */
+    int64_t puback_us;      /* MQTT_EVENT_PUBLISHED handled */
+} pub_trace_t;
+
+/**
+ * @brief Create the trace ring, call once before publishing
+ */
+void pub_latency_init(void);
+
+/**
+ * @brief Record the send time of a QoS1 message (comms task)
+ * @param msg_id Value returned by esp_mqtt_client_publish()
+ * @param sent_us esp_timer_get_time() taken just before the publish call
+ * @param oldest Oldest sample carried by the message
+ * @param samples Number of samples carried by the message
+ */
+void pub_latency_sent(int msg_id, int64_t sent_us, const sensq *oldest, uint32_t samples);
+
+/**
+ * @brief Record a PUBACK (MQTT event handler)
+ * @param msg_id msg_id of the MQTT_EVENT_PUBLISHED event
+ */
+void pub_latency_acked(int msg_id);
+
+/**
+ * @brief Forget all in-flight messages, e.g. when the client is destroyed
+ */
+void pub_latency_reset_inflight(void);
+
+/**
+ * @brief Copy the histogram and counters
+ */
+void pub_latency_get(pub_latency_stats_t *stats);
+
+/**
+ * @brief Take the next completed trace (comms task)
+ * @return false if there is none
+ */
+bool pub_latency_pop_trace(pub_trace_t *trace);
+
+#endif /* PUB_LATENCY_H */
@@ -0,0 +1,79 @@
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "mqtt_client.h"
+#include "sensor_queue.h"
+
+/* Topic used for the batched payload: /sensor_<ID>/batch, or /sensor_<ID>/bin (see sensor_codec.h) */
+#if CONFIG_SENSOR_BATCH_BINARY
+#define PUB_BATCH_TOPIC_FMT "/sensor_%s/bin"
+#else
+#define PUB_BATCH_TOPIC_FMT "/sensor_%s/batch"
+#endif
+
+/*
+ * Appended to the topic of samples sent from the store-and-forward log, e.g.
+ * /sensor_<ID>/batch/backfill: a subscriber of the live topic never takes an
+ * old stored value for the current one.
+ */
+#define PUB_BACKFILL_SUFFIX "/backfill"
+
+/* Per-message stage times, see publisher_send_traces() */
+#define PUB_TRACE_TOPIC_FMT "/sensor_%s/trace"
+
+/**
+ * @brief Hand a sample to the publisher
+ *
+ *  In batch mode the sample is appended to the pending batch, which is
+ *  published once it is full. A batch still not sent when the next sample
+ *  comes goes to the store-and-forward log. In per-type mode every value is
+ *  published right away on its own topic, all of them or none.
+ *
+ * @param client Connected MQTT client
+ * @param sample Sample to publish
+ * @return false if the sample was not taken, the caller stores it
+ */
+bool publisher_add_sample(esp_mqtt_client_handle_t client, const sensq *sample);
+
+/**
+ * @brief Publish the pending batch if its time window has expired
+ * @param client Connected MQTT client
+ */
+void publisher_poll(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Publish the pending batch now, regardless of size or age
+ * @param client Connected MQTT client
+ * @return true if nothing is left pending
+ */
+bool publisher_flush(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Publish the given samples right away, bypassing the pending batch
+ *
+ *  Used to send samples that already carry their own read timestamp,
+ *  e.g. the store-and-forward backlog. At most CONFIG_SENSOR_BATCH_MAX_SAMPLES
+ *  samples are sent in batch mode.
+ *
+ * @param client Connected MQTT client
+ * @param samples Samples to publish
+ * @param count Number of samples
+ * @param backfill Stored samples, published with PUB_BACKFILL_SUFFIX
+ * @return true if the samples were handed to the MQTT client
+ */
+bool publisher_send_samples(esp_mqtt_client_handle_t client, const sensq *samples, int count, bool backfill);
+
+/**
+ * @brief Publish the traces of the messages acknowledged so far (QoS0)
+ *
+ *  One message per PUBACK on /sensor_<ID>/trace, with the read, dequeue,
+ *  publish and PUBACK times of the oldest sample in it. Does nothing
+ *  unless CONFIG_LATENCY_TRACE is set.
+ *
+ * @param client Connected MQTT client
+ */
+void publisher_send_traces(esp_mqtt_client_handle_t client);
+
+#endif /* PUBLISHER_H */
@@ -0,0 +1,57 @@
+#ifndef SENSOR_CODEC_H
+#define SENSOR_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sensor_queue.h"
+
+/*
+ * Compact binary payload for a batch of samples. Plain C, so the same code
+ * builds for the ESP32 and for the host decoder in utils/host.
+ *
+ *  header:  version (u8) | channels (u8) | count (varint)
+ *  sample0: seq (varint) | t ms (varint) | value[c] (zigzag varint), ...
+ *  sampleN: seq delta, t delta, value[c] delta, all zigzag varints
+ *
+ *  Values are fixed point: round(value * sensor_codec_scale[type]).
+ *  Channels are in enum sensq_type order, INVALID excluded.
+ */
+
+#define SENSOR_CODEC_VERSION    1
+#define SENSOR_CODEC_CHANNELS   (ENDTYPE - 1)
+
+/* Worst case encoded size of count samples */
+#define SENSOR_CODEC_MAX_LEN(count) (2 + 5 + (count) * (5 + 10 + SENSOR_CODEC_CHANNELS * 5))
+
+/* Fixed point scale per channel: TEMP 0.01 degC, HUM 0.01 %RH, PRES 0.1 Pa */
+static const int32_t sensor_codec_scale[ENDTYPE] = {
+    [TEMP] = 100,
+    [HUM]  = 100,
+    [PRES] = 10,
+};
+
+/**
+ * @brief Encode samples into buf
+ * @param samples Samples, in increasing seq order for best compression
+ * @param count Number of samples
+ * @param buf Output buffer
+ * @param len Size of buf, SENSOR_CODEC_MAX_LEN(count) is always enough
+ * @return Encoded length, or -1 if it did not fit
+ */
+int sensor_codec_encode(const sensq *samples, int count, uint8_t *buf, size_t len);
+
+/**
+ * @brief Decode a payload made by sensor_codec_encode()
+ *
+ *  timestamp_us of the decoded samples has a 1 ms resolution.
+ *
+ * @param buf Payload
+ * @param len Payload length
+ * @param samples Output samples
+ * @param max Size of samples
+ * @return Number of samples decoded, or -1 if the payload is invalid,
+ *         truncated, has an unknown version or holds more than max samples
+ */
+int sensor_codec_decode(const uint8_t *buf, size_t len, sensq *samples, int max);
+
+#endif /* SENSOR_CODEC_H */
@@ -1,7 +1,11 @@
 #ifndef SENSOR_QUEUE_H
 #define SENSOR_QUEUE_H
 
-#define SENSQ_LEN 40
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Capacity of the sensor -> comms ring, must be a power of two */
+#define SENSQ_LEN 32
 
 #define str(x) #x
 #define xstr(x) str(x)
@@ -25,11 +29,23 @@ static const char *sensq_string[] = {
     FOREACH_SENSQTYPE(GENERATE_STRING)
 };
 
+/*
+ * One queue item per sensor read: every channel of the sample travels
+ * together, so the comms side never sees a partial sample.
+ * value[] is indexed by enum sensq_type (the INVALID slot stays unused).
+ */
 typedef struct sensq
 {
-    float value;
-    enum sensq_type type;
+    uint32_t seq;           /* Sample number, incremented on every read */
+    int64_t timestamp_us;   /* esp_timer_get_time() when the sensor was read */
+    int64_t dequeue_us;     /* esp_timer_get_time() when the comms task took it, 0 if not known */
+    bool prev_boot;         /* Stored before the last reset, timestamp_us is of that boot */
+    float value[ENDTYPE];
 }sensq;
 
+/* Iterate over the valid channel types of a sample */
+#define SENSQ_FOREACH_CHANNEL(t) \
+    for (enum sensq_type t = INVALID + 1; t < ENDTYPE; t++)
+
 
 #endif /* SENSOR_QUEUE_H */
\ No newline at end of file
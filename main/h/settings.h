@@ -0,0 +1,58 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/* NVS namespace holding the runtime configuration */
+#define SETTINGS_NAMESPACE "lxft_cfg"
+
+/* Keys */
+#define SETTINGS_KEY_PROFILE "profile"
+#define SETTINGS_KEY_ID "id"
+#define SETTINGS_KEY_URL "url"
+#define SETTINGS_KEY_BROKER_HOST "broker_host"     /* Broker host name, and the address it resolved to */
+#define SETTINGS_KEY_BROKER_IP "broker_ip"
+#define SETTINGS_KEY_STA_SSID "sta_ssid"           /* WiFi backup network */
+#define SETTINGS_KEY_STA_PASS "sta_pass"
+#define SETTINGS_KEY_STA_AP "sta_ap"               /* BSSID and channel of its last good AP, see wifi.c */
+
+/**
+ * @brief Read a u8 setting
+ * @return ESP_OK, ESP_ERR_NVS_NOT_FOUND if never saved, or another NVS error
+ */
+esp_err_t settings_get_u8(const char *key, uint8_t *value);
+
+/**
+ * @brief Save a u8 setting and commit it
+ */
+esp_err_t settings_set_u8(const char *key, uint8_t value);
+
+/**
+ * @brief Read a string setting into value (len bytes, including the terminator)
+ */
+esp_err_t settings_get_str(const char *key, char *value, size_t len);
+
+/**
+ * @brief Save a string setting and commit it
+ */
+esp_err_t settings_set_str(const char *key, const char *value);
+
+/**
+ * @brief Read a blob setting, exactly len bytes
+ * @return ESP_OK, ESP_ERR_NVS_NOT_FOUND if never saved, ESP_ERR_NVS_INVALID_LENGTH if of another size
+ */
+esp_err_t settings_get_blob(const char *key, void *value, size_t len);
+
+/**
+ * @brief Save a blob setting and commit it
+ */
+esp_err_t settings_set_blob(const char *key, const void *value, size_t len);
+
+/**
+ * @brief Remove a setting, ESP_OK if it was not there
+ */
+esp_err_t settings_erase(const char *key);
+
+#endif /* SETTINGS_H */
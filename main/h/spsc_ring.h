@@ -0,0 +1,105 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Lock-free single-producer / single-consumer ring of fixed size items.
+ * Plain C11 atomics only, so the same code builds for the ESP32 and for the
+ * host benchmark in utils/host.
+ */
+
+/* Alignment that keeps producer and consumer fields on separate cache lines */
+#define SPSC_RING_CACHE_LINE 64
+
+typedef enum {
+    SPSC_RING_OVERWRITE_OLDEST,     /* Full ring: the oldest item is lost */
+    SPSC_RING_DROP_NEWEST,          /* Full ring: the pushed item is lost */
+} spsc_ring_policy_t;
+
+/* Called by the producer after every push, e.g. to notify the consumer task */
+typedef void (*spsc_ring_notify_t)(void *arg);
+
+typedef struct spsc_ring
+{
+    /* Read-only after creation */
+    uint32_t mask;
+    uint32_t item_size;
+    uint32_t slot_words;                /* item_size rounded up to whole words */
+    spsc_ring_policy_t policy;
+    spsc_ring_notify_t notify;
+    void *notify_arg;
+    _Atomic uint32_t *slots;            /* Copied word by word, see spsc_ring_pop() */
+
+    /* Written by the producer */
+    _Alignas(SPSC_RING_CACHE_LINE) _Atomic uint32_t head;
+    uint32_t tail_cache;                /* Last tail seen by the producer */
+    _Atomic uint32_t dropped;           /* Items rejected (drop newest) */
+    _Atomic uint32_t overwritten;       /* Items lost (overwrite oldest) */
+    _Atomic uint32_t high_watermark;    /* Highest fill level seen */
+
+    /* Written by the consumer (and by the producer when overwriting) */
+    _Alignas(SPSC_RING_CACHE_LINE) _Atomic uint32_t tail;
+    uint32_t head_cache;                /* Last head seen by the consumer */
+} spsc_ring_t;
+
+/**
+ * @brief Allocate a ring
+ * @param capacity Number of items, must be a power of two
+ * @param item_size Size of one item in bytes
+ * @param policy What to do when the ring is full
+ * @return The ring, or NULL on bad arguments / no memory
+ */
+spsc_ring_t *spsc_ring_create(uint32_t capacity, uint32_t item_size, spsc_ring_policy_t policy);
+
+/**
+ * @brief Free a ring created with spsc_ring_create()
+ */
+void spsc_ring_delete(spsc_ring_t *ring);
+
+/**
+ * @brief Set the hook called after each push. Set it before the producer starts.
+ */
+void spsc_ring_set_notify(spsc_ring_t *ring, spsc_ring_notify_t notify, void *arg);
+
+/**
+ * @brief Copy an item into the ring, never blocks (producer only)
+ * @return true if stored, false if dropped because the ring was full
+ */
+bool spsc_ring_push(spsc_ring_t *ring, const void *item);
+
+/**
+ * @brief Copy the oldest item out of the ring, never blocks (consumer only)
+ * @return true if an item was read, false if the ring was empty
+ */
+bool spsc_ring_pop(spsc_ring_t *ring, void *item);
+
+/**
+ * @brief Number of items currently stored (approximate while in use)
+ */
+uint32_t spsc_ring_count(spsc_ring_t *ring);
+
+static inline uint32_t spsc_ring_capacity(const spsc_ring_t *ring)
+{
+    return ring->mask + 1;
+}
+
+static inline uint32_t spsc_ring_dropped(spsc_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
+
+static inline uint32_t spsc_ring_overwritten(spsc_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->overwritten, memory_order_relaxed);
+}
+
+static inline uint32_t spsc_ring_high_watermark(spsc_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->high_watermark, memory_order_relaxed);
+}
+
+#endif /* SPSC_RING_H */
@@ -0,0 +1,44 @@
+#ifndef STORE_FORWARD_H
+#define STORE_FORWARD_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "sensor_queue.h"
+
+/* Label of the data partition used for the log (see partitions.csv) */
+#define SF_PARTITION_LABEL  "spiffs"
+#define SF_PAGE_SIZE        256
+#define SF_SECTOR_SIZE      4096
+
+/**
+ * @brief Open the store-and-forward log and recover its state from flash
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the partition is missing
+ */
+esp_err_t store_forward_init(void);
+
+/**
+ * @brief Keep a sample that could not be published
+ *
+ *  Samples are buffered in RAM and written to flash one full page at a time.
+ *  When the log is full the oldest sector is erased and its samples are lost.
+ *
+ * @param sample Sample to store
+ */
+void store_forward_append(const sensq *sample);
+
+/**
+ * @brief Check if there are stored samples waiting to be sent
+ */
+bool store_forward_pending(void);
+
+/**
+ * @brief Send the next slice of the backlog, at most once per backfill interval
+ *
+ *  Must be called from the comms task only, while MQTT is connected.
+ *
+ * @param client Connected MQTT client
+ */
+void store_forward_backfill(esp_mqtt_client_handle_t client);
+
+#endif /* STORE_FORWARD_H */
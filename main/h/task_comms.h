@@ -1,8 +1,42 @@
 #ifndef TASK_COMMS_H
 #define TASK_COMMS_H
 
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
 #define BOARD_ID_LEN 6
 
+/*
+ * Comms task event group. The state bits are only written by the comms task
+ * and the MQTT event handler, and read from anywhere. The event bits wake the
+ * comms task and are cleared when it takes them.
+ */
+#define COMMS_LINK_UP           (1 << 0)    /* State: an uplink is active */
+#define COMMS_MQTT_UP           (1 << 1)    /* State: MQTT connected */
+#define COMMS_EV_DATA           (1 << 2)    /* Samples in the sensor ring */
+#define COMMS_EV_CONFIG         (1 << 3)    /* Board ID or broker URL changed */
+#define COMMS_EV_LINK           (1 << 4)    /* The active link changed */
+#define COMMS_EV_MQTT           (1 << 5)    /* MQTT connected, disconnected, or a PUBACK freed the outbox */
+#define COMMS_EV_BROKER_STALE   (1 << 6)    /* Broker not reached at its cached address */
+#define COMMS_BROKER_UNVERIFIED (1 << 7)    /* State: connecting to a cached broker address not confirmed yet */
+#define COMMS_BROKER_SAVE       (1 << 8)    /* State: broker host name to resolve and save once connected */
+
+#define COMMS_EVENTS            (COMMS_EV_DATA | COMMS_EV_CONFIG | COMMS_EV_LINK | COMMS_EV_MQTT | COMMS_EV_BROKER_STALE)
+
+/**
+ * @brief Wake the comms task with one or more COMMS_EV_ bits, from any task
+ *
+ *  Not from an ISR. Dropped before the comms task has started, its first
+ *  pass drains the sensor ring anyway.
+ */
+void comms_notify(EventBits_t events);
+
+/**
+ * @brief Check state bits (COMMS_LINK_UP, COMMS_MQTT_UP, ...), all of them must be set
+ */
+bool comms_state(EventBits_t state);
+
 void task_comms(void* arg);
 							
-#endif /* TASK_COMMS_H */			  
\ No newline at end of file
+#endif /* TASK_COMMS_H */
@@ -1,10 +1,57 @@
 #ifndef TASK_SENSORS_H
 #define TASK_SENSORS_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "bmp280.h"
+
 extern float http_temp;
 extern float http_hum;
 extern float http_pres;
 
+/*
+ * Sampling profile: how often the BME280 is read and how it converts.
+ * In forced mode the sensor sleeps between samples and a single conversion
+ * is started just ahead of each deadline.
+ */
+typedef struct sensor_profile
+{
+    const char *name;
+    uint32_t period_ms;
+    BMP280_Mode mode;
+    BMP280_Oversampling os_temp;
+    BMP280_Oversampling os_pres;
+    BMP280_Oversampling os_hum;
+    BMP280_Filter filter;
+    BMP280_StandbyTime standby;     /* Normal mode only */
+} sensor_profile_t;
+
+/**
+ * @brief Number of available sampling profiles
+ */
+int sensor_profile_count(void);
+
+/**
+ * @brief Get a sampling profile by index, NULL if out of range
+ */
+const sensor_profile_t *sensor_profile_get(int index);
+
+/**
+ * @brief Index of the profile in use
+ */
+int sensor_profile_active(void);
+
+/**
+ * @brief Switch to another profile and save it in NVS
+ *
+ *  The sensor task reconfigures the BME280 and restarts its schedule as
+ *  soon as it wakes up, it does not wait for the current period to end.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG on a bad index, or the NVS error
+ */
+esp_err_t sensor_profile_select(int index);
+
 void task_sensors(void* arg);
 							
-#endif /* TASK_SENSORS_H */			  
\ No newline at end of file
+#endif /* TASK_SENSORS_H */			  
@@ -0,0 +1,37 @@
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Topic of the periodic diagnostic message: /sensor_<ID>/diag */
+#define TASK_STATS_TOPIC_FMT "/sensor_%s/diag"
+
+/* Room for the JSON of CONFIG_TASK_STATS_MAX_TASKS tasks */
+#define TASK_STATS_JSON_LEN (128 + CONFIG_TASK_STATS_MAX_TASKS * 112)
+
+/**
+ * @brief Take a run-time stats snapshot once per window and diff it with the previous one
+ *
+ *  Cheap to call often, it returns right away until the window has elapsed.
+ *  Uses static buffers only, so the cost per window does not grow over time.
+ *
+ * @return true if a new window was completed by this call
+ */
+bool task_stats_poll(void);
+
+/**
+ * @brief Write the last completed window as JSON
+ *
+ *  {"window_ms":10000,"cores":[{"core":0,"load":12.5},...],
+ *   "tasks":[{"name":"core1_comms","core":1,"prio":3,"state":"blocked","cpu":1.2,"stack_free":1804},...]}
+ *
+ *  "cpu" is the percentage of one core used by the task over the window,
+ *  "core" is -1 for tasks not pinned to a core, "stack_free" is the stack
+ *  high water mark in bytes.
+ *
+ * @return Length written, or -1 if the buffer was too small or no window completed yet
+ */
+int task_stats_json(char *buf, size_t len);
+
+#endif /* TASK_STATS_H */
@@ -0,0 +1,24 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Start SNTP against CONFIG_SNTP_SERVER, once. Call when an IP is acquired.
+ */
+void time_sync_start(void);
+
+/**
+ * @brief Check if the wall clock was set by SNTP since boot
+ */
+bool time_sync_is_synced(void);
+
+/**
+ * @brief Convert an esp_timer_get_time() value to Unix time in ms
+ * @param timer_us Time since boot, in us
+ * @return Unix time in ms, or 0 while the clock is not synced
+ */
+int64_t time_sync_epoch_ms(int64_t timer_us);
+
+#endif /* TIME_SYNC_H */
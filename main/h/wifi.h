@@ -1,7 +1,6 @@
 #ifndef WIFI_HOTSPOT_H
 #define WIFI_HOTSPOT_H
 
-#include "esp_wifi.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -9,6 +8,9 @@
 #include "lwip/dns.h"
 #include "lwip/sockets.h"
 #include "lwip/netdb.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_wifi.h"
+#endif
 
 /* AP - network settings */
 #define WIFI_SSID       "ESP32-Config-1"
@@ -16,13 +18,44 @@
 #define WIFI_CHANNEL    1
 #define WIFI_MAX_CONNS  10
 
-/* STA - Backup WiFi network credentials */
-#define BACKUP_WIFI_SSID "OnePlus 12"
-#define BACKUP_WIFI_PASS "z5g57j6g"
+/* STA - Backup WiFi network, defaults until set from the config page (kept in NVS) */
+#define BACKUP_WIFI_SSID CONFIG_WIFI_BACKUP_SSID
+#define BACKUP_WIFI_PASS CONFIG_WIFI_BACKUP_PASSWORD
+#define BACKUP_WIFI_SSID_LEN 32
+#define BACKUP_WIFI_PASS_LEN 64
+
+typedef struct
+{
+    uint32_t connects;              /* Got an IP, the first time included */
+    uint32_t retries;               /* Connect attempts after a failure */
+    uint32_t cached_ap_misses;      /* Attempts on the cached BSSID/channel that failed */
+    uint32_t last_ms;               /* Disconnect (or enable) to got IP, last one */
+    uint32_t max_ms;
+} wifi_backup_stats_t;
 
 void wifi_init_ap_sta_mode(void);
 void wifi_connect_backup(void);
 void wifi_disconnect_backup(void);
 bool wifi_is_backup_connected(void);
 
+/**
+ * @brief Change the backup network, save it in NVS and reconnect if enabled
+ *
+ *  The cached AP of the old network is dropped.
+ *
+ * @param pass NULL to keep the saved password
+ */
+esp_err_t wifi_set_backup_network(const char *ssid, const char *pass);
+
+/**
+ * @brief Copy the SSID of the backup network in use
+ * @param ssid Buffer of BACKUP_WIFI_SSID_LEN + 1 bytes
+ */
+void wifi_backup_ssid(char *ssid);
+
+/**
+ * @brief Reconnect counters and disconnect -> got IP times
+ */
+void wifi_backup_stats(wifi_backup_stats_t *stats);
+
 #endif
\ No newline at end of file
@@ -1,28 +1,86 @@
 #include "h/http_server.h"
 #include "h/task_sensors.h"
+#include "h/task_comms.h"
+#include "h/deadband.h"
+#include "h/metrics.h"
+#include "h/task_stats.h"
+#include "h/live_stream.h"
+#include "h/portal_tls.h"
+#include "h/multipart.h"
+#include "h/boot_profile.h"
+#include "h/mqtt_tls.h"
+#include "h/link_manager.h"
+#include "h/wifi.h"
+#include "h/settings.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
-#include "esp_ota_ops.h"
 #include "esp_system.h"
 #include "esp_task_wdt.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 #include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#if !CONFIG_IDF_TARGET_LINUX
+#include "h/ota_stream.h"
+#include "esp_ota_ops.h"
+#else
+#include "esp_app_desc.h"
+#include "esp_partition.h"
+#endif
+
+#define OTA_BUFSIZE 4096
+
+/* Multipart framing around the image: delimiters and part headers */
+#define OTA_MULTIPART_OVERHEAD 1024
 
-#define OTA_BUFSIZE 1024
+/* Receive timeouts (recv_wait_timeout each) in a row before a stalled upload is given up */
+#define OTA_RECV_TIMEOUTS_MAX 10
+
+#if CONFIG_PORTAL_HTTPS
+#define PORTAL_URL "https://192.168.11.111/"
+#else
+#define PORTAL_URL "http://192.168.11.111/"
+#endif
 
 static const char *TAG = "__HTTP__";
 
 
 char ID[ID_LEN + 1] = "ESP-1";
 char URL[URL_LEN + 1] = CONFIG_BROKER_URL;
-bool mqtt_config_updated = false;
+
+/* Held while ID or URL is written, and while another task copies them */
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+void http_config_get(char *id, char *url)
+{
+    portENTER_CRITICAL(&config_lock);
+    if (id) {
+        memcpy(id, ID, sizeof(ID));
+    }
+    if (url) {
+        memcpy(url, URL, sizeof(URL));
+    }
+    portEXIT_CRITICAL(&config_lock);
+}
 
 
 void print_http_info(void)
 {
     ESP_LOGI(TAG, "");
+#if CONFIG_IDF_TARGET_LINUX
+    ESP_LOGI(TAG, "Configuration Portal: http://localhost:%d", CONFIG_SIM_HTTP_PORT);
+#elif CONFIG_PORTAL_HTTPS
+    ESP_LOGI(TAG, "╔════════════════════════════════════════════════════╗");
+    ESP_LOGI(TAG, "║ HTTPS Configuration Portal: https://192.168.11.111 ║");
+    ESP_LOGI(TAG, "╚════════════════════════════════════════════════════╝");
+#else
     ESP_LOGI(TAG, "╔══════════════════════════════════════════════════╗");
     ESP_LOGI(TAG, "║ HTTP Configuration Portal: http://192.168.11.111 ║");
     ESP_LOGI(TAG, "╚══════════════════════════════════════════════════╝");
+#endif
     ESP_LOGI(TAG, "");
 }
 
@@ -82,56 +140,106 @@ static void send_response_page(httpd_req_t *req, const char *http_status, const
     httpd_resp_send(req, html_buffer, HTTPD_RESP_USE_STRLEN);
 }
 
-/* Configuration handler for root URL */
-static esp_err_t config_handler(httpd_req_t *req)
+/*
+ *  Static config page, gzipped at build time (see CMakeLists.txt) and sent
+ *  as is. The live values are fetched by the page from /data.
+ */
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[] asm("_binary_index_html_gz_end");
+extern const uint8_t style_css_gz_start[] asm("_binary_style_css_gz_start");
+extern const uint8_t style_css_gz_end[] asm("_binary_style_css_gz_end");
+
+typedef struct {
+    const char *type;
+    const uint8_t *start;
+    const uint8_t *end;
+    char etag[11];          /* CRC32 of the compressed asset, quoted */
+} www_asset_t;
+
+static www_asset_t asset_index = { .type = "text/html", .start = index_html_gz_start, .end = index_html_gz_end };
+static www_asset_t asset_style = { .type = "text/css", .start = style_css_gz_start, .end = style_css_gz_end };
+
+static void asset_init(www_asset_t *asset)
 {
-    ESP_LOGI(TAG, "Config page request");
-    
-    char html_buffer[2048];
+    uint32_t crc = esp_rom_crc32_le(0, asset->start, asset->end - asset->start);
+    snprintf(asset->etag, sizeof(asset->etag), "\"%08lx\"", (unsigned long)crc);
+}
 
-    /* MAIN HTML page */
-    snprintf(html_buffer, sizeof(html_buffer),
-        "<!DOCTYPE html><html><head><title>ESP32 Control</title>"
-        "<style>"
-        "body{font-family:system-ui,sans-serif;background:#f0f2f5;margin:0;padding:1rem}"
-        "div{background:#fff;padding:1.5rem;border-radius:8px;box-shadow:0 4px 10px rgba(0,0,0,.1);max-width:500px;margin:0 auto 1rem auto}"
-        "h1{color:#0056b3;margin:0 0 1rem 0;padding-bottom:.5rem;border-bottom:1px solid #eee}"
-        "b{display:block;margin-bottom:.3rem;color:#555;font-weight:600}"
-        "p b{display:inline;font-weight:600;margin-right:.5rem}" /* Style for sensor labels */
-        "input[type=text]{width:100%%;padding:.5rem;border:1px solid #ccc;border-radius:4px;box-sizing:border-box;margin-bottom:1rem}"
-        "input[type=submit]{background:#007bff;color:#fff;border:0;padding:.7rem 1.2rem;border-radius:5px;cursor:pointer;font-size:1em;transition:background .2s;width:100%%;margin-top:.5rem}"
-        "input[type=submit]:hover{background:#0056b3}"
-        "input[type=file]{width:100%%;color:#555}"
-        "input[type=file]::file-selector-button{background:#5c677d;color:#fff;border:0;padding:.6rem 1rem;border-radius:5px;cursor:pointer;transition:background .2s;margin-right:1rem}"
-        "input[type=file]::file-selector-button:hover{background:#4a5467}"
-        "</style></head>"
-        "<body>"
-        "<div><h1>Sensor</h1>"
-        "<p><b>Temperature:</b>%.1f &deg;C</p>"
-        "<p><b>Humidity:</b>%.1f %%</p>"
-        "<p><b>Pressure:</b>%.1f hPa</p>"
-        "</div>"
-        "<div><h1>MQTT Config</h1>"
-        "<form method=\"post\" action=\"/update\">"
-        "<b>ID:</b><input type=\"text\" size=\"6\" maxlength=\"6\" name=\"ID\" value=\"%s\">"
-        "<b>URL:</b><input type=\"text\" size=\"64\" maxlength=\"64\" name=\"URL\" value=\"%s\">"
-        "<input type=\"submit\" value=\"Update Parameters\">"
-        "</form></div>"
-        "<div><h1>OTA Update</h1>"
-        "<form method=\"post\" action=\"/ota\" enctype=\"multipart/form-data\">"
-        "<input type=\"file\" name=\"firmware\">"
-        "<input type=\"submit\" value=\"Update Firmware\">"
-        "</form></div>"
-        "</body></html>",
-        http_temp, http_hum, http_pres, ID, URL);
-
-    /* Send the response */
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_set_hdr(req, "Cache-Control", "no-cache, no-store, must-revalidate");
-    httpd_resp_set_hdr(req, "Pragma", "no-cache");
-    httpd_resp_set_hdr(req, "Expires", "0");
-    httpd_resp_send(req, html_buffer, HTTPD_RESP_USE_STRLEN);
+static esp_err_t asset_handler(httpd_req_t *req)
+{
+    const www_asset_t *asset = req->user_ctx;
+    char if_none_match[sizeof(asset->etag)];
+
+    /* The browser revalidates every time (no-cache), unchanged assets cost one header */
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, asset->etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    ESP_LOGD(TAG, "Sending %s (%d bytes gzip)", req->uri, (int)(asset->end - asset->start));
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char *)asset->start, asset->end - asset->start);
+}
 
+/* Copy a string into a JSON string body, escaping quotes, backslashes and control chars */
+static int json_escape(char *out, size_t size, const char *in)
+{
+    size_t n = 0;
+
+    for (; *in && n + 7 < size; in++) {
+        if (*in == '"' || *in == '\\') {
+            out[n++] = '\\';
+            out[n++] = *in;
+        } else if ((unsigned char)*in < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", (unsigned char)*in);
+        } else {
+            out[n++] = *in;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* Live values for the config page */
+static esp_err_t data_handler(httpd_req_t *req)
+{
+    char json[768];
+    char id[ID_LEN * 6 + 1];
+    char url[URL_LEN * 6 + 1];
+    char ssid[BACKUP_WIFI_SSID_LEN * 6 + 1];
+    char backup_ssid[BACKUP_WIFI_SSID_LEN + 1];
+    int len;
+
+    wifi_backup_ssid(backup_ssid);
+    json_escape(id, sizeof(id), ID);
+    json_escape(url, sizeof(url), URL);
+    json_escape(ssid, sizeof(ssid), backup_ssid);
+
+    len = snprintf(json, sizeof(json),
+                   "{\"temp\":%.2f,\"hum\":%.2f,\"pres\":%.2f,\"sent\":%lu,\"suppressed\":%lu,"
+                   "\"id\":\"%s\",\"url\":\"%s\",\"ssid\":\"%s\",\"profile\":%d,\"profiles\":[",
+                   http_temp, http_hum, http_pres,
+                   (unsigned long)deadband_sent(), (unsigned long)deadband_suppressed(),
+                   id, url, ssid, sensor_profile_active());
+    for (int i = 0; i < sensor_profile_count() && len < sizeof(json); i++) {
+        len += snprintf(json + len, sizeof(json) - len, "%s\"%s\"", i ? "," : "", sensor_profile_get(i)->name);
+    }
+    if (len < sizeof(json)) {
+        len += snprintf(json + len, sizeof(json) - len, "]}");
+    }
+    if (len >= sizeof(json)) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    httpd_resp_send(req, json, len);
     return ESP_OK;
 }
 
@@ -166,8 +274,12 @@ static esp_err_t update_handler(httpd_req_t *req)
             return ESP_OK;
         } else {
             ESP_LOGI(TAG, "Received ID: '%s'", temp_val);
+            portENTER_CRITICAL(&config_lock);
             strncpy(ID, temp_val, ID_LEN);
             ID[ID_LEN] = '\0';
+            portEXIT_CRITICAL(&config_lock);
+            settings_set_str(SETTINGS_KEY_ID, ID);
+            comms_notify(COMMS_EV_CONFIG);
         }
     } else {
         ESP_LOGE(TAG, "ID not found in POST request");
@@ -182,9 +294,12 @@ static esp_err_t update_handler(httpd_req_t *req)
             return ESP_OK;
         } else {
             ESP_LOGI(TAG, "Received URL: '%s'", temp_val);
+            portENTER_CRITICAL(&config_lock);
             strncpy(URL, temp_val, URL_LEN);
             URL[URL_LEN] = '\0';
-            mqtt_config_updated = true;
+            portEXIT_CRITICAL(&config_lock);
+            settings_set_str(SETTINGS_KEY_URL, URL);
+            comms_notify(COMMS_EV_CONFIG);
         }
     } else {
         ESP_LOGE(TAG, "URL not found in POST request");
@@ -206,163 +321,232 @@ static esp_err_t update_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t profile_handler(httpd_req_t *req)
+{
+    char buf[64];
+    char value[8];
+    int ret;
+
+    if (req->content_len >= sizeof(buf)) {
+        send_response_page(req, "400 Bad Request", "Request Too Large", "POST content too long");
+        return ESP_FAIL;
+    }
+
+    if ((ret = httpd_req_recv(req, buf, req->content_len)) <= 0) {
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            httpd_resp_send_408(req);
+        }
+        return ESP_FAIL;
+    }
+    buf[ret] = '\0';
+
+    if (httpd_query_key_value(buf, "profile", value, sizeof(value)) != ESP_OK) {
+        send_response_page(req, "400 Bad Request", "Profile Update Failed", "Profile not found in request");
+        return ESP_OK;
+    }
+
+    esp_err_t err = sensor_profile_select(atoi(value));
+    if (err == ESP_ERR_INVALID_ARG) {
+        send_response_page(req, "400 Bad Request", "Profile Update Failed", "Unknown profile");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        /* Already in use, it just will not survive a reboot */
+        send_response_page(req, "500 Internal Server Error", "Profile Not Saved", "Profile applied but could not be saved");
+        return ESP_OK;
+    }
+
+    send_response_page(req, "200 OK", "Profile Updated", sensor_profile_get(sensor_profile_active())->name);
+    return ESP_OK;
+}
+
+/* Backup WiFi network. An empty password keeps the saved one, unless the SSID changed */
+static esp_err_t wifi_handler(httpd_req_t *req)
+{
+    char buf[512];
+    char ssid[BACKUP_WIFI_SSID_LEN * 3 + 1];
+    char pass[BACKUP_WIFI_PASS_LEN * 3 + 1];
+    char current_ssid[BACKUP_WIFI_SSID_LEN + 1];
+    bool has_pass;
+    int ret;
+
+    if (req->content_len >= sizeof(buf)) {
+        send_response_page(req, "400 Bad Request", "Request Too Large", "POST content too long");
+        return ESP_FAIL;
+    }
+
+    if ((ret = httpd_req_recv(req, buf, req->content_len)) <= 0) {
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            httpd_resp_send_408(req);
+        }
+        return ESP_FAIL;
+    }
+    buf[ret] = '\0';
+
+    if (httpd_query_key_value(buf, "SSID", ssid, sizeof(ssid)) != ESP_OK) {
+        send_response_page(req, "400 Bad Request", "WiFi Update Failed", "SSID not found in request");
+        return ESP_OK;
+    }
+    URL_DECODE(ssid);
+    if (strlen(ssid) == 0 || strlen(ssid) > BACKUP_WIFI_SSID_LEN) {
+        send_response_page(req, "400 Bad Request", "WiFi Update Failed", "The SSID takes 1 to 32 characters");
+        return ESP_OK;
+    }
+
+    has_pass = (httpd_query_key_value(buf, "PASS", pass, sizeof(pass)) == ESP_OK);
+    if (has_pass) {
+        URL_DECODE(pass);
+        wifi_backup_ssid(current_ssid);
+        if (pass[0] == '\0' && strcmp(ssid, current_ssid) == 0) {
+            has_pass = false;
+        } else if (pass[0] != '\0' && (strlen(pass) < 8 || strlen(pass) > BACKUP_WIFI_PASS_LEN)) {
+            send_response_page(req, "400 Bad Request", "WiFi Update Failed", "The password takes 8 to 64 characters");
+            return ESP_OK;
+        }
+    }
+
+    if (wifi_set_backup_network(ssid, has_pass ? pass : NULL) != ESP_OK) {
+        send_response_page(req, "500 Internal Server Error", "WiFi Update Failed", "The network could not be saved");
+        return ESP_OK;
+    }
+
+    send_response_page(req, "200 OK", "WiFi Backup Updated", "Backup network saved, reconnecting");
+    return ESP_OK;
+}
+
+/* Per-task CPU, state and stack usage over the last window, as JSON */
+static esp_err_t debug_tasks_handler(httpd_req_t *req)
+{
+    static char json[TASK_STATS_JSON_LEN];
+    int len = task_stats_json(json, sizeof(json));
+
+    if (len < 0) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Task stats not available yet");
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_send(req, json, len);
+    return ESP_OK;
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
+static esp_err_t ota_write_cb(const uint8_t *data, size_t len, void *arg)
+{
+    return ota_stream_write(arg, data, len);
+}
+
 static esp_err_t ota_update_handler(httpd_req_t *req)
 {
-    esp_ota_handle_t ota_handle = 0;
-    const esp_partition_t *update_partition = NULL;
-    char ota_write_buf[OTA_BUFSIZE + 1] = { 0 };
-    char *body_start_p = NULL;
+    static multipart_t mp;              /* One upload at a time, the httpd task is single threaded */
+    static ota_stream_t ota;            /* Plain, compressed or delta image */
+    static char recv_buf[OTA_BUFSIZE];
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    ota_update_stats_t stats;
+    char content_type[128];
+    char message[160];
     esp_err_t err;
-    char error[100];
     TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
     bool added_to_wdt = false;
+    int remaining = req->content_len;
+    int timeouts = 0;
+    int64_t start_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Starting OTA update, %d bytes", remaining);
+
+    if (httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) != ESP_OK ||
+        multipart_init(&mp, content_type) != ESP_OK) {
+        send_response_page(req, "400 Bad Request", "Firmware Update Failed", "Expected a multipart/form-data upload");
+        return ESP_FAIL;
+    }
 
-    ESP_LOGI(TAG, "Starting OTA update...");
+    /* The file is a bit smaller than the body, enough to refuse what can not fit */
+    if (partition == NULL || remaining > partition->size + OTA_MULTIPART_OVERHEAD) {
+        send_response_page(req, "400 Bad Request", "Firmware Update Failed", "Could not start the update (ESP_ERR_INVALID_SIZE)");
+        return ESP_FAIL;
+    }
+    ota_stream_begin(&ota, 0);
 
     /*  Try to add current task to watchdog monitoring */
     err = esp_task_wdt_add(current_task);
     if (err == ESP_OK) {
         added_to_wdt = true;
         esp_task_wdt_reset();
-        ESP_LOGD(TAG, "OTA task added to watchdog monitoring");
     } else {
         ESP_LOGW(TAG, "Could not add OTA task to watchdog: %s", esp_err_to_name(err));
     }
 
-    /* Find the OTA partition */
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
-        ESP_LOGE(TAG, "OTA partition not found");
-        if (added_to_wdt) esp_task_wdt_delete(current_task);
-        send_response_page(req, "400 Bad Request", "Firmware Update Failed", "OTA partition not found");
-        return ESP_FAIL;
-    }
-    ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x",
-             update_partition->subtype, update_partition->address);
-
-    /* Begin the OTA update process */
-    err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &ota_handle);
-    if (err != ESP_OK) {
-        snprintf(error, sizeof(error), "esp_ota_begin failed (%s)", esp_err_to_name(err));
-        ESP_LOGE(TAG, "%s", error);
-        if (added_to_wdt) esp_task_wdt_delete(current_task);
-        send_response_page(req, "400 Bad Request", "Firmware Update Failed", error);
-        return ESP_FAIL;
-    }
-
-    int content_received = 0;
-    int binary_file_len = 0;
-    bool header_found = false;
-    int chunk_count = 0;
-
-    /* Read the request body in chunks */
-    while (true) {
-        /* Feed watchdog every 20 chunks to prevent timeout during large uploads */
-        if (added_to_wdt && (++chunk_count % 20 == 0)) {
-            esp_task_wdt_reset();
-            ESP_LOGD(TAG, "OTA watchdog fed (chunk %d)", chunk_count);
-        }
-
-        int recv_len = httpd_req_recv(req, ota_write_buf, OTA_BUFSIZE);
-        if (recv_len < 0) {
-            if (recv_len == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Socket timeout, can retry */
+    /* Receive into one buffer while the writer task flashes the previous one */
+    while (remaining > 0) {
+        int recv_len = httpd_req_recv(req, recv_buf, MIN(remaining, sizeof(recv_buf)));
+        if (recv_len == HTTPD_SOCK_ERR_TIMEOUT) {
+            /* A stalled client must neither trip the watchdog nor hold the httpd task */
+            if (added_to_wdt) {
+                esp_task_wdt_reset();
+            }
+            if (++timeouts < OTA_RECV_TIMEOUTS_MAX) {
                 continue;
             }
-            esp_ota_abort(ota_handle);
-            ESP_LOGE(TAG, "Firmware reception failed");
-            if (added_to_wdt) esp_task_wdt_delete(current_task);
-            send_response_page(req, "400 Bad Request", "Firmware Update failed", "Reception failed");
-            return ESP_FAIL;
+            ESP_LOGE(TAG, "Firmware upload stalled, %d bytes left", remaining);
+            err = ESP_ERR_TIMEOUT;
+            break;
         }
-
-        /* First chunk - remove the header */
-        if (!header_found) {
-            /* Find the boundary between headers and binary data */
-            body_start_p = strstr(ota_write_buf, "\r\n\r\n");
-            
-            if (body_start_p != NULL) {
-                /* Move the pointer past the "\r\n\r\n" */
-                body_start_p += 4; 
-                
-                /* Calculate the length of the binary data in this first chunk */
-                int data_len = recv_len - (body_start_p - ota_write_buf);
-                
-                /* Write the first chunk of binary data */
-                err = esp_ota_write(ota_handle, (const void *)body_start_p, data_len);
-                if (err != ESP_OK) {
-                    snprintf(error, sizeof(error), "esp_ota_write failed (%s)", esp_err_to_name(err));
-                    ESP_LOGE(TAG, "%s", error);
-                    if (added_to_wdt) esp_task_wdt_delete(current_task);
-                    send_response_page(req, "400 Bad Request", "Firmware Write Failed", error);
-                    return ESP_FAIL;
-                }
-                header_found = true;
-                binary_file_len += data_len;
-            }
-        } else {
-            /* This is a subsequent chunk, containing only binary data */
-            err = esp_ota_write(ota_handle, (const void *)ota_write_buf, recv_len);
-            if (err != ESP_OK) {
-                snprintf(error, sizeof(error), "esp_ota_write failed (%s)", esp_err_to_name(err));
-                ESP_LOGE(TAG, "%s", error);
-                if (added_to_wdt) esp_task_wdt_delete(current_task);
-                send_response_page(req, "400 Bad Request", "Firmware Write Failed", error);
-                return ESP_FAIL;
-            }
-            binary_file_len += recv_len;
+        if (recv_len <= 0) {
+            ESP_LOGE(TAG, "Firmware reception failed");
+            err = ESP_FAIL;
+            break;
         }
+        timeouts = 0;
+        remaining -= recv_len;
 
-        content_received += recv_len;
-        ESP_LOGD(TAG, "Received %d bytes, written %d bytes of binary", content_received, binary_file_len);
-
-        /* Check if we have finished receiving */
-        if (recv_len == 0) {
+        err = multipart_feed(&mp, (const uint8_t *)recv_buf, recv_len, ota_write_cb, &ota);
+        if (err != ESP_OK) {
             break;
         }
+        if (added_to_wdt) {
+            esp_task_wdt_reset();
+        }
     }
 
-    ESP_LOGI(TAG, "Total binary data written: %d bytes", binary_file_len);
+    if (err == ESP_OK && (!multipart_done(&mp) || mp.file_parts != 1)) {
+        ESP_LOGE(TAG, "Upload incomplete or without a firmware file");
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    if (err != ESP_OK) {
+        ota_stream_abort(&ota);
+    } else {
+        err = ota_stream_finish(&ota, NULL, &stats);
+    }
 
-    /* Feed watchdog before finalizing OTA */
     if (added_to_wdt) {
-        esp_task_wdt_reset();
+        esp_task_wdt_delete(current_task);
     }
 
-    /* Finish the OTA update */
-    err = esp_ota_end(ota_handle);
-    if (err != ESP_OK) {
-        if (added_to_wdt) esp_task_wdt_delete(current_task);
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted or incomplete");
-            send_response_page(req, "400 Bad Request", "Firmware Update Failed", "Image validation failed, image is corrupted or incomplete");
-        } else {
-            snprintf(error, sizeof(error), "esp_ota_end failed (%s)!", esp_err_to_name(err));
-            ESP_LOGE(TAG, "%s", error);
-            send_response_page(req, "400 Bad Request", "Firmware Write Failed", error);
-        }
+    if (err == ESP_ERR_TIMEOUT) {
+        httpd_resp_send_408(req);
         return ESP_FAIL;
     }
-
-    /* Set the boot partition to the new one */
-    err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
-        snprintf(error, sizeof(error), "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-        ESP_LOGE(TAG, "%s", error);
-        if (added_to_wdt) esp_task_wdt_delete(current_task);
-        send_response_page(req, "400 Bad Request", "Firmware Write Failed", error);
+        snprintf(message, sizeof(message), "%s (%s)",
+                 err == ESP_ERR_OTA_VALIDATE_FAILED ? "Image validation failed, image is corrupted or incomplete" :
+                 err == ESP_ERR_INVALID_STATE ? "Delta does not apply to the running firmware"
+                                              : "Firmware write failed", esp_err_to_name(err));
+        ESP_LOGE(TAG, "%s", message);
+        send_response_page(req, "400 Bad Request", "Firmware Update Failed", message);
         return ESP_FAIL;
     }
 
     /* Send a success response and then restart */
-    ESP_LOGI(TAG, "OTA Update successful! Rebooting...");
-    const char *success_msg = "Firmware update successful. Rebooting now...";
-    httpd_resp_send(req, success_msg, HTTPD_RESP_USE_STRLEN);
-    
-    /* Clean up watchdog before restart */
-    if (added_to_wdt) {
-        esp_task_wdt_delete(current_task);
-    }
+    uint32_t total_ms = (esp_timer_get_time() - start_us) / 1000;
+    snprintf(message, sizeof(message),
+             "%u bytes (%u sent) in %lu ms (%lu KB/s). SHA-256 %02x%02x%02x%02x... Rebooting now...",
+             (unsigned)stats.bytes, (unsigned)stats.in_bytes, (unsigned long)total_ms, (unsigned long)stats.kbytes_per_s,
+             stats.sha256[0], stats.sha256[1], stats.sha256[2], stats.sha256[3]);
+    ESP_LOGI(TAG, "OTA Update successful: %s", message);
+    send_response_page(req, "200 OK", "Firmware Updated", message);
     
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
@@ -370,6 +554,41 @@ static esp_err_t ota_update_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+#else /* CONFIG_IDF_TARGET_LINUX */
+
+static esp_err_t ota_update_handler(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_sendstr(req, "No OTA in the simulation build");
+}
+
+#endif /* !CONFIG_IDF_TARGET_LINUX */
+
+/* Running firmware, for the fleet tools and to check an update went through */
+static esp_err_t version_handler(httpd_req_t *req)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+#if CONFIG_IDF_TARGET_LINUX
+    const esp_partition_t *running = NULL;      /* No OTA slots */
+#else
+    const esp_partition_t *running = esp_ota_get_running_partition();
+#endif
+    char json[256];
+    int len;
+
+    len = snprintf(json, sizeof(json),
+                   "{\"project\":\"%s\",\"version\":\"%s\",\"idf\":\"%s\",\"built\":\"%s %s\","
+                   "\"partition\":\"%s\",\"elf_sha256\":\"%02x%02x%02x%02x%02x%02x%02x%02x\"}",
+                   app->project_name, app->version, app->idf_ver, app->date, app->time,
+                   running ? running->label : "?",
+                   app->app_elf_sha256[0], app->app_elf_sha256[1], app->app_elf_sha256[2], app->app_elf_sha256[3],
+                   app->app_elf_sha256[4], app->app_elf_sha256[5], app->app_elf_sha256[6], app->app_elf_sha256[7]);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    return httpd_resp_send(req, json, len);
+}
+
 /* Favicon handler - prevents 404 errors */
 static esp_err_t favicon_handler(httpd_req_t *req)
 {
@@ -399,11 +618,11 @@ static esp_err_t http_handler(httpd_req_t *req)
                                "<html>"
                                "<head>"
                                "<title>ESP32 Configuration Portal</title>"
-                               "<meta http-equiv=\"refresh\" content=\"0;URL='http://192.168.11.111/'\">"
+                               "<meta http-equiv=\"refresh\" content=\"0;URL='" PORTAL_URL "'\">"
                                "</head>"
                                "<body>"
                                "<p>Redirecting to ESP32 Configuration Portal...</p>"
-                               "<p>If you are not redirected automatically, <a href='http://192.168.11.111/'>click here</a>.</p>"
+                               "<p>If you are not redirected automatically, <a href='" PORTAL_URL "'>click here</a>.</p>"
                                "</body>"
                                "</html>";
 
@@ -419,7 +638,7 @@ static esp_err_t http_handler(httpd_req_t *req)
     } else {
         /* For all other URLs, do a standard redirect */
         httpd_resp_set_status(req, "302 Found");
-        httpd_resp_set_hdr(req, "Location", "http://192.168.11.111/");
+        httpd_resp_set_hdr(req, "Location", PORTAL_URL);
     }
     
     httpd_resp_send(req, html_response, strlen(html_response));
@@ -429,7 +648,21 @@ static esp_err_t http_handler(httpd_req_t *req)
 httpd_uri_t uri_root = {
     .uri = "/",
     .method = HTTP_GET,
-    .handler = config_handler
+    .handler = asset_handler,
+    .user_ctx = &asset_index
+};
+
+httpd_uri_t uri_style = {
+    .uri = "/style.css",
+    .method = HTTP_GET,
+    .handler = asset_handler,
+    .user_ctx = &asset_style
+};
+
+httpd_uri_t uri_data = {
+    .uri = "/data",
+    .method = HTTP_GET,
+    .handler = data_handler
 };
     
 httpd_uri_t uri_update = {
@@ -438,12 +671,66 @@ httpd_uri_t uri_update = {
     .handler = update_handler
 };
 
+httpd_uri_t uri_profile = {
+    .uri = "/profile",
+    .method = HTTP_POST,
+    .handler = profile_handler
+};
+
+httpd_uri_t uri_wifi = {
+    .uri = "/wifi",
+    .method = HTTP_POST,
+    .handler = wifi_handler
+};
+
+httpd_uri_t uri_metrics = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metrics_handler
+};
+
+httpd_uri_t uri_debug_tasks = {
+    .uri = "/debug/tasks",
+    .method = HTTP_GET,
+    .handler = debug_tasks_handler
+};
+
+httpd_uri_t uri_debug_tls = {
+    .uri = "/debug/tls",
+    .method = HTTP_GET,
+    .handler = portal_tls_handler
+};
+
+httpd_uri_t uri_debug_mqtt_tls = {
+    .uri = "/debug/mqtt_tls",
+    .method = HTTP_GET,
+    .handler = mqtt_tls_handler
+};
+
+httpd_uri_t uri_debug_link = {
+    .uri = "/debug/link",
+    .method = HTTP_GET,
+    .handler = link_manager_handler
+};
+
+httpd_uri_t uri_debug_boot = {
+    .uri = "/debug/boot",
+    .method = HTTP_GET,
+    .handler = boot_profile_handler
+};
+
 httpd_uri_t uri_ota = {
     .uri = "/ota",
     .method = HTTP_POST,
     .handler = ota_update_handler
 };
 
+httpd_uri_t uri_version = {
+    .uri = "/version",
+    .method = HTTP_GET,
+    .handler = version_handler
+};
+
 httpd_uri_t uri_favicon = {
     .uri = "/favicon.ico",
     .method = HTTP_GET,
@@ -457,47 +744,123 @@ httpd_uri_t uri_any = {
 };
 
 
-httpd_handle_t start_http_server(void)
+/* Captive portal detection URLs, then the catch-all redirect to the portal */
+static void register_redirects(httpd_handle_t server)
+{
+    for (int i = 0; CAPTIVE_PORTAL_URLS[i]; i++) {
+        httpd_uri_t uri = {
+            .uri = CAPTIVE_PORTAL_URLS[i],
+            .method = HTTP_GET,
+            .handler = http_handler
+        };
+        httpd_register_uri_handler(server, &uri);
+    }
+    
+    /* Register catch-all handler last */
+    httpd_register_uri_handler(server, &uri_any);
+}
+
+
+#if CONFIG_PORTAL_HTTPS
+/*
+ *  The OS connectivity checks only speak plain HTTP, a small server on
+ *  port 80 answers them and sends everything else to the HTTPS portal.
+ */
+static void start_redirect_server(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    httpd_handle_t server = NULL;
+
+    config.max_uri_handlers = 16;
+    config.lru_purge_enable = true;
+    config.recv_wait_timeout = 2;
+    config.send_wait_timeout = 2;
+    config.max_open_sockets = 2;
+    config.backlog_conn = 2;
+    config.task_priority = 5;
+    config.stack_size = 4096;
+    config.ctrl_port += 1;              // The HTTPS server holds the default one
+
+    if (httpd_start(&server, &config) != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting HTTP redirect server!");
+        return;
+    }
+    register_redirects(server);
+}
+#endif
+
+
+httpd_handle_t start_http_server(void)
+{
+#if CONFIG_PORTAL_HTTPS
+    httpd_ssl_config_t ssl_config = HTTPD_SSL_CONFIG_DEFAULT();
+    httpd_config_t *config = &ssl_config.httpd;
+#else
+    httpd_config_t http_config = HTTPD_DEFAULT_CONFIG();
+    httpd_config_t *config = &http_config;
+#endif
     
     /* Optimize server config for better reliability and reduce recv errors */
-    config.max_uri_handlers = 25;
-    config.lru_purge_enable = true;
-    config.recv_wait_timeout = 2;       // Reduced timeout
-    config.send_wait_timeout = 2;       // Reduced timeout
-    config.max_open_sockets = 4;        // Smaller to prevent issues
-    config.backlog_conn = 2;            // Minimal backlog
-    config.task_priority = 5;           // Lower priority
-    config.stack_size =  8192;
-    config.close_fn = NULL;             // Let system handle cleanup
+    config->max_uri_handlers = 32;
+    config->lru_purge_enable = true;
+    config->recv_wait_timeout = 2;       // Reduced timeout
+    config->send_wait_timeout = 2;       // Reduced timeout
+    config->max_open_sockets = 4;        // Smaller to prevent issues
+    config->backlog_conn = 2;            // Minimal backlog
+    config->task_priority = 5;           // Lower priority
+    config->stack_size =  8192;
+    config->close_fn = NULL;             // Let system handle cleanup
     
     httpd_handle_t server = NULL;
+
+    asset_init(&asset_index);
+    asset_init(&asset_style);
     
-    ESP_LOGI(TAG, "Starting HTTP server on port: %d", config.server_port);
-    if (httpd_start(&server, &config) != ESP_OK) {
+#if CONFIG_PORTAL_HTTPS
+    config->stack_size = 10240;          // mbedTLS handshake
+    portal_tls_configure(&ssl_config);
+
+    ESP_LOGI(TAG, "Starting HTTPS server on port: %d", ssl_config.port_secure);
+    if (httpd_ssl_start(&server, &ssl_config) != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting HTTPS server!");
+        return NULL;
+    }
+#else
+#if CONFIG_IDF_TARGET_LINUX
+    config->server_port = CONFIG_SIM_HTTP_PORT;
+    config->ctrl_port = CONFIG_SIM_HTTP_PORT + 1;
+#endif
+    ESP_LOGI(TAG, "Starting HTTP server on port: %d", config->server_port);
+    if (httpd_start(&server, config) != ESP_OK) {
         ESP_LOGE(TAG, "Error starting HTTP server!");
         return NULL;
     }
+#endif
     
     /* Register handlers - favicon first to avoid conflicts */
     httpd_register_uri_handler(server, &uri_favicon);
     httpd_register_uri_handler(server, &uri_root);
+    httpd_register_uri_handler(server, &uri_style);
+    httpd_register_uri_handler(server, &uri_data);
     httpd_register_uri_handler(server, &uri_update);
+    httpd_register_uri_handler(server, &uri_profile);
+    httpd_register_uri_handler(server, &uri_wifi);
+    httpd_register_uri_handler(server, &uri_metrics);
+    httpd_register_uri_handler(server, &uri_debug_tasks);
+    httpd_register_uri_handler(server, &uri_debug_tls);
+    httpd_register_uri_handler(server, &uri_debug_boot);
+    httpd_register_uri_handler(server, &uri_debug_mqtt_tls);
+    httpd_register_uri_handler(server, &uri_debug_link);
     httpd_register_uri_handler(server, &uri_ota);
+    httpd_register_uri_handler(server, &uri_version);
+    live_stream_start(server);
     
-    /* Register captive portal detection URLs (excluding favicon) */
-    for (int i = 0; CAPTIVE_PORTAL_URLS[i]; i++) {
-        httpd_uri_t uri = {
-            .uri = CAPTIVE_PORTAL_URLS[i],
-            .method = HTTP_GET,
-            .handler = http_handler
-        };
-        httpd_register_uri_handler(server, &uri);
-    }
-    
-    /* Register catch-all handler last */
+#if CONFIG_PORTAL_HTTPS
     httpd_register_uri_handler(server, &uri_any);
+    start_redirect_server();
+#else
+    register_redirects(server);
+#endif
     
     print_http_info();
     return server;
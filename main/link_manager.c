@@ -0,0 +1,356 @@
+#include "h/link_manager.h"
+#include "h/wifi.h"
+#include "h/metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_eth.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_event.h"
+#include "ping/ping_sock.h"
+#include "lwip/ip_addr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+const static char *TAG = "__LINK__";
+
+typedef struct
+{
+    esp_netif_t *netif;
+    esp_ping_handle_t ping;         /* NULL while the link has no IP */
+    uint32_t probes_failed;
+} link_probe_t;
+
+/* Inputs come from the event loop and from the probe tasks, all under link_mutex */
+static SemaphoreHandle_t link_mutex = NULL;
+static link_policy_t policy;
+static link_probe_t probes[LINK_COUNT];
+static link_change_cb_t change_cb = NULL;
+
+/* Failover being measured, until MQTT is connected again. 0 if none */
+static int64_t failover_outage_us = 0;
+static int64_t failover_switch_us = 0;
+
+static uint32_t failover_count = 0;
+static uint32_t failover_last_detect_ms = 0;
+static uint32_t failover_last_ms = 0;
+static uint32_t failover_max_ms = 0;
+static uint64_t failover_total_ms = 0;
+
+
+/*
+ * @brief Pick the link after an input, with link_mutex held
+ * @return true if the active link changed
+ */
+static bool link_select(void)
+{
+    link_id_t before = policy.active;
+    link_id_t active = link_policy_select(&policy, esp_timer_get_time());
+
+    /* esp-netif gives the default back to the highest route priority on IP events */
+    if (active != LINK_NONE && probes[active].netif && esp_netif_get_default_netif() != probes[active].netif) {
+        esp_netif_set_default_netif(probes[active].netif);
+    }
+
+    if (active == before) {
+        return false;
+    }
+
+    if (active == LINK_NONE) {
+        ESP_LOGE(TAG, "No usable link, %s lost", link_policy_name(before));
+        return true;
+    }
+
+    if (policy.switch_outage_us) {
+        failover_outage_us = policy.switch_outage_us;
+        failover_switch_us = esp_timer_get_time();
+        ESP_LOGW(TAG, "Failover %s -> %s, %lu ms after the outage", link_policy_name(before), link_policy_name(active),
+                 (unsigned long)((failover_switch_us - failover_outage_us) / 1000));
+    } else {
+        failover_outage_us = 0;
+        ESP_LOGI(TAG, "Active link %s -> %s", link_policy_name(before), link_policy_name(active));
+    }
+
+    if (before != LINK_NONE || policy.switch_outage_us) {
+        metric_inc(active == LINK_WIFI ? METRIC_FAILOVER_TO_WIFI : METRIC_FAILOVER_TO_ETH);
+    }
+    return true;
+}
+
+
+/*
+ * @brief Act on the decision, without link_mutex
+ */
+static void link_done(bool changed, link_id_t active, bool suspect)
+{
+#if !CONFIG_LINK_WIFI_HOT_STANDBY
+    /* Cold standby: associate as soon as Ethernet looks bad, leave once it is back */
+    if (changed && active == LINK_ETH) {
+        wifi_disconnect_backup();
+    } else if (active != LINK_ETH || suspect) {
+        wifi_connect_backup();
+    }
+#endif
+
+    if (changed && change_cb) {
+        change_cb(active);
+    }
+}
+
+
+/* ________________ Probes ________________ */
+
+static void probe_result(esp_ping_handle_t hdl, link_id_t link, bool ok)
+{
+    bool changed;
+    bool was_ok;
+    bool suspect;
+    link_id_t active;
+
+    xSemaphoreTake(link_mutex, portMAX_DELAY);
+    if (hdl != probes[link].ping) {
+        /* Late answer of a session deleted with the IP */
+        xSemaphoreGive(link_mutex);
+        return;
+    }
+
+    was_ok = policy.link[link].probe_ok;
+    if (!ok) {
+        probes[link].probes_failed++;
+        metric_inc(link == LINK_ETH ? METRIC_LINK_PROBE_FAILS_ETH : METRIC_LINK_PROBE_FAILS_WIFI);
+    }
+    link_policy_probe(&policy, link, ok, esp_timer_get_time());
+    if (was_ok != policy.link[link].probe_ok) {
+        ESP_LOGW(TAG, "%s probes %s", link_policy_name(link), was_ok ? "failing, link down" : "passing again");
+    }
+
+    changed = link_select();
+    active = policy.active;
+    suspect = link_policy_suspect(&policy);
+    xSemaphoreGive(link_mutex);
+
+    link_done(changed, active, suspect);
+}
+
+
+static void probe_success_cb(esp_ping_handle_t hdl, void *args)
+{
+    probe_result(hdl, (link_id_t)(intptr_t)args, true);
+}
+
+
+static void probe_timeout_cb(esp_ping_handle_t hdl, void *args)
+{
+    probe_result(hdl, (link_id_t)(intptr_t)args, false);
+}
+
+
+static void probe_stop(link_id_t link)
+{
+    if (probes[link].ping) {
+        esp_ping_stop(probes[link].ping);
+        esp_ping_delete_session(probes[link].ping);
+        probes[link].ping = NULL;
+    }
+}
+
+
+/*
+ * @brief Ping the target over this link only, whatever the default netif
+ */
+static void probe_start(link_id_t link, const esp_ip4_addr_t *gw)
+{
+    esp_ping_config_t cfg = ESP_PING_DEFAULT_CONFIG();
+    esp_ping_callbacks_t cbs = {
+        .cb_args = (void *)(intptr_t)link,
+        .on_ping_success = probe_success_cb,
+        .on_ping_timeout = probe_timeout_cb,
+    };
+
+    if (LINK_PROBE_TARGET[0] == '\0' || !ipaddr_aton(LINK_PROBE_TARGET, &cfg.target_addr)) {
+        ip_addr_set_ip4_u32(&cfg.target_addr, gw->addr);
+    }
+    cfg.count = ESP_PING_COUNT_INFINITE;
+    cfg.interval_ms = CONFIG_LINK_PROBE_INTERVAL_MS;
+    cfg.timeout_ms = CONFIG_LINK_PROBE_TIMEOUT_MS;
+    cfg.interface = esp_netif_get_netif_impl_index(probes[link].netif);
+
+    probe_stop(link);
+    if (esp_ping_new_session(&cfg, &cbs, &probes[link].ping) != ESP_OK) {
+        ESP_LOGE(TAG, "Could not start the %s probes", link_policy_name(link));
+        probes[link].ping = NULL;
+        return;
+    }
+    esp_ping_start(probes[link].ping);
+}
+
+
+/* ________________ Events ________________ */
+
+static void link_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    int64_t now = esp_timer_get_time();
+    ip_event_got_ip_t *got_ip = event_data;
+    bool changed;
+    bool suspect;
+    link_id_t active;
+
+    xSemaphoreTake(link_mutex, portMAX_DELAY);
+    if (event_base == ETH_EVENT) {
+        link_policy_carrier(&policy, LINK_ETH, event_id == ETHERNET_EVENT_CONNECTED, now);
+    } else if (event_base == WIFI_EVENT) {
+        link_policy_carrier(&policy, LINK_WIFI, event_id == WIFI_EVENT_STA_CONNECTED, now);
+    } else {
+        switch (event_id) {
+            case IP_EVENT_ETH_GOT_IP:
+            case IP_EVENT_STA_GOT_IP:
+                active = (event_id == IP_EVENT_ETH_GOT_IP) ? LINK_ETH : LINK_WIFI;
+                probes[active].netif = got_ip->esp_netif;
+                probe_start(active, &got_ip->ip_info.gw);
+                link_policy_ip(&policy, active, true, now);
+                break;
+            case IP_EVENT_ETH_LOST_IP:
+            case IP_EVENT_STA_LOST_IP:
+                active = (event_id == IP_EVENT_ETH_LOST_IP) ? LINK_ETH : LINK_WIFI;
+                probe_stop(active);
+                link_policy_ip(&policy, active, false, now);
+                break;
+            default:
+                break;
+        }
+    }
+
+    changed = link_select();
+    active = policy.active;
+    suspect = link_policy_suspect(&policy);
+    xSemaphoreGive(link_mutex);
+
+    link_done(changed, active, suspect);
+}
+
+
+void link_manager_init(link_change_cb_t cb)
+{
+    const link_policy_cfg_t cfg = {
+        .fail_threshold = CONFIG_LINK_PROBE_FAILS,
+        .ok_threshold = CONFIG_LINK_PROBE_OKS,
+        .hold_ms = CONFIG_LINK_SWITCHBACK_HOLD_S * 1000,
+    };
+    ip_addr_t target;
+
+    link_policy_init(&policy, &cfg);
+    change_cb = cb;
+    link_mutex = xSemaphoreCreateMutex();
+
+    if (LINK_PROBE_TARGET[0] != '\0' && !ipaddr_aton(LINK_PROBE_TARGET, &target)) {
+        ESP_LOGE(TAG, "Probe target %s is not an address, probing the gateways", LINK_PROBE_TARGET);
+    }
+
+    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ETHERNET_EVENT_CONNECTED, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ETHERNET_EVENT_DISCONNECTED, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_LOST_IP, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &link_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_LOST_IP, &link_event_handler, NULL));
+
+#if CONFIG_LINK_WIFI_HOT_STANDBY
+    /* The STA associates as soon as it starts, see wifi_init_ap_sta_mode() */
+    wifi_connect_backup();
+#endif
+
+    ESP_LOGI(TAG, "Probing every %d ms, down after %d failures, back to ethernet after %d s",
+             CONFIG_LINK_PROBE_INTERVAL_MS, CONFIG_LINK_PROBE_FAILS, CONFIG_LINK_SWITCHBACK_HOLD_S);
+}
+
+
+link_id_t link_manager_active(void)
+{
+    return policy.active;
+}
+
+
+bool link_manager_suspect(void)
+{
+    bool suspect;
+
+    xSemaphoreTake(link_mutex, portMAX_DELAY);
+    suspect = link_policy_suspect(&policy);
+    xSemaphoreGive(link_mutex);
+
+    return suspect;
+}
+
+
+void link_manager_mqtt_connected(void)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t ms;
+
+    xSemaphoreTake(link_mutex, portMAX_DELAY);
+    if (failover_outage_us == 0) {
+        xSemaphoreGive(link_mutex);
+        return;
+    }
+
+    ms = (now - failover_outage_us) / 1000;
+    failover_last_detect_ms = (failover_switch_us - failover_outage_us) / 1000;
+    failover_last_ms = ms;
+    failover_total_ms += ms;
+    failover_count++;
+    if (ms > failover_max_ms) {
+        failover_max_ms = ms;
+    }
+    failover_outage_us = 0;
+    xSemaphoreGive(link_mutex);
+
+    ESP_LOGW(TAG, "Failover done: MQTT connected %lu ms after the outage (detected in %lu ms)",
+             (unsigned long)ms, (unsigned long)failover_last_detect_ms);
+}
+
+
+/* ________________ Report ________________ */
+
+esp_err_t link_manager_handler(httpd_req_t *req)
+{
+    char json[640];
+    link_policy_t p;
+    uint32_t probes_failed[LINK_COUNT];
+    wifi_backup_stats_t wifi;
+    int len;
+
+    wifi_backup_stats(&wifi);
+
+    xSemaphoreTake(link_mutex, portMAX_DELAY);
+    p = policy;
+    for (int i = 0; i < LINK_COUNT; i++) {
+        probes_failed[i] = probes[i].probes_failed;
+    }
+    len = snprintf(json, sizeof(json), "{\"active\":\"%s\",\"standby\":\"%s\",\"switches\":%lu,\"links\":[",
+                   link_policy_name(p.active), CONFIG_LINK_WIFI_HOT_STANDBY ? "hot" : "cold", (unsigned long)p.switches);
+    for (int i = 0; i < LINK_COUNT; i++) {
+        const link_state_t *l = &p.link[i];
+
+        len += snprintf(json + len, sizeof(json) - len,
+                        "%s{\"name\":\"%s\",\"carrier\":%s,\"ip\":%s,\"probe_ok\":%s,\"fails\":%u,\"probes_failed\":%lu}",
+                        i ? "," : "", link_policy_name(i), l->carrier ? "true" : "false", l->has_ip ? "true" : "false",
+                        l->probe_ok ? "true" : "false", l->fails, (unsigned long)probes_failed[i]);
+    }
+    len += snprintf(json + len, sizeof(json) - len,
+                    "],\"failover\":{\"count\":%lu,\"last_detect_ms\":%lu,\"last_ms\":%lu,\"avg_ms\":%lu,\"max_ms\":%lu}",
+                    (unsigned long)failover_count, (unsigned long)failover_last_detect_ms, (unsigned long)failover_last_ms,
+                    (unsigned long)(failover_count ? failover_total_ms / failover_count : 0), (unsigned long)failover_max_ms);
+    len += snprintf(json + len, sizeof(json) - len,
+                    ",\"wifi\":{\"connects\":%lu,\"retries\":%lu,\"cached_ap_misses\":%lu,\"last_ms\":%lu,\"max_ms\":%lu}}",
+                    (unsigned long)wifi.connects, (unsigned long)wifi.retries, (unsigned long)wifi.cached_ap_misses,
+                    (unsigned long)wifi.last_ms, (unsigned long)wifi.max_ms);
+    xSemaphoreGive(link_mutex);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, json, len);
+}
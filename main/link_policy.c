@@ -0,0 +1,149 @@
+#include "h/link_policy.h"
+
+#include <string.h>
+
+
+void link_policy_init(link_policy_t *p, const link_policy_cfg_t *cfg)
+{
+    memset(p, 0, sizeof(*p));
+    p->cfg = *cfg;
+    p->active = LINK_NONE;
+    for (int i = 0; i < LINK_COUNT; i++) {
+        p->link[i].probe_ok = true;
+    }
+}
+
+
+bool link_policy_usable(const link_policy_t *p, link_id_t link)
+{
+    const link_state_t *l = &p->link[link];
+
+    return l->carrier && l->has_ip && l->probe_ok;
+}
+
+
+/* Keep the usable time and the start of an outage of the active link up to date */
+static void link_update(link_policy_t *p, link_id_t link, int64_t now_us)
+{
+    link_state_t *l = &p->link[link];
+
+    if (!link_policy_usable(p, link)) {
+        if (link == p->active && p->outage_us == 0) {
+            /* Declared down by the probes: it stopped working at the first failed one */
+            p->outage_us = l->first_fail_us ? l->first_fail_us : now_us;
+        }
+        l->usable_since_us = 0;
+    } else if (l->usable_since_us == 0) {
+        l->usable_since_us = now_us;
+    }
+}
+
+
+/* A fresh carrier or address gets the benefit of the doubt, the hold time still applies */
+static void probe_reset(link_state_t *l)
+{
+    l->probe_ok = true;
+    l->fails = 0;
+    l->oks = 0;
+    l->first_fail_us = 0;
+}
+
+
+void link_policy_carrier(link_policy_t *p, link_id_t link, bool up, int64_t now_us)
+{
+    link_state_t *l = &p->link[link];
+
+    if (up && !l->carrier) {
+        probe_reset(l);
+    }
+    l->carrier = up;
+    link_update(p, link, now_us);
+}
+
+
+void link_policy_ip(link_policy_t *p, link_id_t link, bool has_ip, int64_t now_us)
+{
+    link_state_t *l = &p->link[link];
+
+    if (has_ip && !l->has_ip) {
+        probe_reset(l);
+    }
+    l->has_ip = has_ip;
+    link_update(p, link, now_us);
+}
+
+
+void link_policy_probe(link_policy_t *p, link_id_t link, bool ok, int64_t now_us)
+{
+    link_state_t *l = &p->link[link];
+
+    if (ok) {
+        l->fails = 0;
+        l->first_fail_us = 0;
+        if (!l->probe_ok && ++l->oks >= p->cfg.ok_threshold) {
+            l->probe_ok = true;
+            l->oks = 0;
+        }
+    } else {
+        l->oks = 0;
+        if (l->fails == 0) {
+            l->first_fail_us = now_us;
+        }
+        if (l->fails < UINT8_MAX) {
+            l->fails++;
+        }
+        if (l->fails >= p->cfg.fail_threshold) {
+            l->probe_ok = false;
+        }
+    }
+    link_update(p, link, now_us);
+}
+
+
+bool link_policy_suspect(const link_policy_t *p)
+{
+    return p->active != LINK_NONE && p->link[p->active].fails > 0 && link_policy_usable(p, p->active);
+}
+
+
+link_id_t link_policy_select(link_policy_t *p, int64_t now_us)
+{
+    link_id_t next = p->active;
+
+    if (p->active == LINK_NONE || !link_policy_usable(p, p->active)) {
+        if (link_policy_usable(p, LINK_ETH)) {
+            next = LINK_ETH;
+        } else if (link_policy_usable(p, LINK_WIFI)) {
+            next = LINK_WIFI;
+        } else {
+            next = LINK_NONE;
+        }
+    } else if (p->active != LINK_ETH && link_policy_usable(p, LINK_ETH) &&
+               now_us - p->link[LINK_ETH].usable_since_us >= (int64_t)p->cfg.hold_ms * 1000) {
+        next = LINK_ETH;
+    }
+
+    if (next == p->active) {
+        return next;
+    }
+
+    if (p->active != LINK_NONE && next != LINK_NONE) {
+        p->switches++;
+    }
+    if (next != LINK_NONE) {
+        p->switch_outage_us = p->outage_us;
+        p->outage_us = 0;
+    }
+    p->active = next;
+    return next;
+}
+
+
+const char *link_policy_name(link_id_t link)
+{
+    switch (link) {
+        case LINK_ETH:  return "ethernet";
+        case LINK_WIFI: return "wifi";
+        default:        return "none";
+    }
+}
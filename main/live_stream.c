@@ -0,0 +1,177 @@
+#include "h/live_stream.h"
+#include "h/metrics.h"
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "lwip/sockets.h"
+
+#if CONFIG_HTTPD_WS_SUPPORT
+
+const static char *TAG = "__LIVE__";
+
+static httpd_handle_t live_server = NULL;
+static sensq latest;                                /* Written by the sensor task, under latest_lock */
+static portMUX_TYPE latest_lock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_bool send_queued = false;             /* One broadcast pending at most */
+static atomic_bool have_clients = false;            /* Skip the work queue when nobody listens */
+
+
+/*
+ * @brief Send the latest sample to every WebSocket client (httpd task)
+ *
+ *  The sockets of the clients have a short send timeout (see ws_handler),
+ *  a client that can not take a frame in time is closed.
+ */
+static void broadcast_work(void *arg)
+{
+    static char frame_buf[LIVE_STREAM_FRAME_LEN];   /* Only used from the httpd task */
+    size_t fds_count = CONFIG_LWIP_MAX_SOCKETS;
+    int fds[CONFIG_LWIP_MAX_SOCKETS];
+    int clients = 0;
+    sensq sample;
+    int len;
+
+    atomic_store(&send_queued, false);
+
+    portENTER_CRITICAL(&latest_lock);
+    sample = latest;
+    portEXIT_CRITICAL(&latest_lock);
+
+    len = snprintf(frame_buf, sizeof(frame_buf), "{\"seq\":%lu,\"temp\":%.2f,\"hum\":%.2f,\"pres\":%.2f}",
+                   (unsigned long)sample.seq, sample.value[TEMP], sample.value[HUM], sample.value[PRES]);
+    if (len < 0 || len >= sizeof(frame_buf)) {
+        /* Truncated, len would point past the buffer */
+        return;
+    }
+
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t *)frame_buf,
+        .len = len,
+    };
+
+    if (httpd_get_client_list(live_server, &fds_count, fds) != ESP_OK) {
+        return;
+    }
+
+    for (int i = 0; i < fds_count; i++) {
+        if (httpd_ws_get_fd_info(live_server, fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) {
+            continue;
+        }
+        clients++;
+        if (httpd_ws_send_frame_async(live_server, fds[i], &frame) != ESP_OK) {
+            ESP_LOGW(TAG, "Client %d too slow, closing", fds[i]);
+            metric_inc(METRIC_LIVE_CLIENTS_DROPPED);
+            httpd_sess_trigger_close(live_server, fds[i]);
+        } else {
+            metric_inc(METRIC_LIVE_FRAMES_SENT);
+        }
+    }
+
+    if (clients == 0) {
+        atomic_store(&have_clients, false);
+    }
+}
+
+
+static int count_ws_clients(httpd_handle_t server)
+{
+    size_t fds_count = CONFIG_LWIP_MAX_SOCKETS;
+    int fds[CONFIG_LWIP_MAX_SOCKETS];
+    int clients = 0;
+
+    if (httpd_get_client_list(server, &fds_count, fds) == ESP_OK) {
+        for (int i = 0; i < fds_count; i++) {
+            if (httpd_ws_get_fd_info(server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET) {
+                clients++;
+            }
+        }
+    }
+    return clients;
+}
+
+
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        /* Handshake done, this socket now counts as a WebSocket client */
+        int fd = httpd_req_to_sockfd(req);
+
+        if (count_ws_clients(req->handle) > CONFIG_LIVE_STREAM_MAX_CLIENTS) {
+            ESP_LOGW(TAG, "Too many live clients, refusing %d", fd);
+            return ESP_FAIL;
+        }
+
+        /* Replaces the httpd send timeout: a stalled client must not hold the httpd task */
+        struct timeval timeout = {
+            .tv_sec = CONFIG_LIVE_STREAM_SEND_TIMEOUT_MS / 1000,
+            .tv_usec = (CONFIG_LIVE_STREAM_SEND_TIMEOUT_MS % 1000) * 1000,
+        };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        ESP_LOGI(TAG, "Live client %d connected", fd);
+        atomic_store(&have_clients, true);
+        return ESP_OK;
+    }
+
+    /* The stream is one way, read and drop whatever the client sends */
+    uint8_t buf[32];
+    httpd_ws_frame_t frame = { .payload = buf };
+
+    if (httpd_ws_recv_frame(req, &frame, 0) != ESP_OK || frame.len > sizeof(buf)) {
+        return ESP_FAIL;
+    }
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+
+
+static const httpd_uri_t uri_ws = {
+    .uri = "/ws",
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .is_websocket = true,
+};
+
+
+void live_stream_start(httpd_handle_t server)
+{
+    if (httpd_register_uri_handler(server, &uri_ws) != ESP_OK) {
+        ESP_LOGE(TAG, "Could not register /ws");
+        return;
+    }
+    live_server = server;
+}
+
+
+void live_stream_publish(const sensq *sample)
+{
+    if (live_server == NULL || !atomic_load(&have_clients)) {
+        return;
+    }
+
+    portENTER_CRITICAL(&latest_lock);
+    latest = *sample;
+    portEXIT_CRITICAL(&latest_lock);
+
+    /* A broadcast already queued will pick up this sample */
+    if (!atomic_exchange(&send_queued, true)) {
+        if (httpd_queue_work(live_server, broadcast_work, NULL) != ESP_OK) {
+            atomic_store(&send_queued, false);
+        }
+    }
+}
+
+#else /* !CONFIG_HTTPD_WS_SUPPORT */
+
+void live_stream_start(httpd_handle_t server)
+{
+}
+
+void live_stream_publish(const sensq *sample)
+{
+}
+
+#endif /* CONFIG_HTTPD_WS_SUPPORT */
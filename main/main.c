@@ -1,7 +1,12 @@
 #include "h/task_comms.h"
 #include "h/task_sensors.h"
 #include "h/sensor_queue.h"
+#include "h/spsc_ring.h"
+#include "h/metrics.h"
 #include "h/wifi.h"
+#include "h/http_server.h"
+#include "h/settings.h"
+#include "h/boot_profile.h"
 
 #include <string.h>
 #include "esp_log.h"
@@ -15,6 +20,15 @@ const static char *TAG = "main";
 #define CORE0           0
 #define CORE1           ((CONFIG_FREERTOS_NUMBER_OF_CORES > 1) ? 1 : tskNO_AFFINITY)
 
+/*
+ * The comms task runs the TLS record writes of its publishes (~2 KB deep with
+ * mbedTLS), the broker getaddrinfo(), NVS writes and the JSON formatting.
+ * The large buffers (batch payload, backfill samples) are static. Check
+ * "stack_free" of core1_comms on /debug/tasks after changing what it does.
+ */
+#define SENSORS_STACK   4096
+#define COMMS_STACK     6144
+
 /* Task handles for watchdog monitoring */
 TaskHandle_t sensor_task_handle = NULL;
 TaskHandle_t comms_task_handle = NULL;
@@ -37,11 +51,21 @@ void print_partition_table(void)
 }
 
 
+/* Wake the comms task when the sensor task pushed a sample */
+static void notify_comms(void *arg)
+{
+    comms_notify(COMMS_EV_DATA);
+}
+
+
 void app_main(void)
 {
-    static QueueHandle_t msg_queue;
+    spsc_ring_t *msg_ring;
+
+    boot_profile_init();
 
     /* Initialize NVS */
+    boot_profile_begin(BOOT_PHASE_NVS);
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
       ESP_ERROR_CHECK(nvs_flash_erase());
@@ -49,6 +73,13 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    /* Board ID and broker URL saved from the config page, the defaults otherwise */
+    settings_get_str(SETTINGS_KEY_ID, ID, sizeof(ID));
+    settings_get_str(SETTINGS_KEY_URL, URL, sizeof(URL));
+    boot_profile_end(BOOT_PHASE_NVS);
+
+    boot_profile_begin(BOOT_PHASE_WDT);
+
     /* Deinitialize the watchdog and then reintitialize it with the custom config */
     esp_task_wdt_config_t twdt_config = {
         .timeout_ms = 10000,  // 10 second timeout
@@ -58,19 +89,27 @@ void app_main(void)
     
     ESP_ERROR_CHECK(esp_task_wdt_deinit());
     ESP_ERROR_CHECK(esp_task_wdt_init(&twdt_config));
+    boot_profile_end(BOOT_PHASE_WDT);
     ESP_LOGI(TAG, "TWDT configured with 10s timeout");
 
-    /* Create main queue for passing info from sensor reading to the comms part */
-    msg_queue = xQueueGenericCreate(SENSQ_LEN, sizeof(sensq), queueQUEUE_TYPE_SET);
-    if (msg_queue == NULL) {
-        ESP_LOGE(TAG, "Error creating queue. Stopping!");
+    /* Create the lock-free ring passing samples from the sensor core to the comms core */
+#if CONFIG_SENSQ_FULL_DROP_NEWEST
+    msg_ring = spsc_ring_create(SENSQ_LEN, sizeof(sensq), SPSC_RING_DROP_NEWEST);
+#else
+    msg_ring = spsc_ring_create(SENSQ_LEN, sizeof(sensq), SPSC_RING_OVERWRITE_OLDEST);
+#endif
+    if (msg_ring == NULL) {
+        ESP_LOGE(TAG, "Error creating sensor ring. Stopping!");
         return;
     }
+    spsc_ring_set_notify(msg_ring, notify_comms, NULL);
+    metrics_set_ring(msg_ring);
 
-    print_partition_table();
-
-    xTaskCreatePinnedToCore(task_sensors, "core0_sensors", 4096, (void*)&msg_queue, TASK_PRIO_3, &sensor_task_handle, CORE0);
-    xTaskCreatePinnedToCore(task_comms, "core1_comms", 4096, (void*)&msg_queue, TASK_PRIO_3, &comms_task_handle, CORE1);
+    xTaskCreatePinnedToCore(task_sensors, "core0_sensors", SENSORS_STACK, (void*)msg_ring, TASK_PRIO_3, &sensor_task_handle, CORE0);
+    xTaskCreatePinnedToCore(task_comms, "core1_comms", COMMS_STACK, (void*)msg_ring, TASK_PRIO_3, &comms_task_handle, CORE1);
 
     ESP_LOGI(TAG, "Tasks created - they will self-register with watchdog");
+
+    /* Only a log, printed once the tasks run so the UART does not delay them */
+    print_partition_table();
 }
\ No newline at end of file
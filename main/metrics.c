@@ -0,0 +1,161 @@
+#include "h/metrics.h"
+#include "h/pub_latency.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+const static char *TAG = "__METRICS__";
+
+_Atomic uint32_t metrics[METRIC_COUNT];
+
+typedef struct
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+} metric_desc_t;
+
+#define GENERATE_METRIC_DESC(ID, NAME, LABELS, HELP) { NAME, LABELS, HELP },
+
+static const metric_desc_t metric_desc[METRIC_COUNT] = {
+    FOREACH_METRIC(GENERATE_METRIC_DESC)
+};
+
+static spsc_ring_t *sensor_ring = NULL;
+
+
+void metrics_set_ring(spsc_ring_t *ring)
+{
+    sensor_ring = ring;
+}
+
+
+/*
+ * Output is sent in chunks through a small buffer, flushed when the next
+ * line might not fit. Keeps the handler stack use flat.
+ */
+typedef struct
+{
+    httpd_req_t *req;
+    char buf[512];
+    int len;
+    esp_err_t err;
+} metrics_out_t;
+
+static void out_flush(metrics_out_t *out)
+{
+    if (out->len > 0 && out->err == ESP_OK) {
+        out->err = httpd_resp_send_chunk(out->req, out->buf, out->len);
+    }
+    out->len = 0;
+}
+
+static void out_printf(metrics_out_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_printf(metrics_out_t *out, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    if (sizeof(out->buf) - out->len < 160) {
+        out_flush(out);
+    }
+
+    va_start(args, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, args);
+    va_end(args);
+
+    if (n > 0) {
+        out->len += (n < sizeof(out->buf) - out->len) ? n : (int)(sizeof(out->buf) - out->len - 1);
+    }
+}
+
+static void out_gauge(metrics_out_t *out, const char *name, const char *help, unsigned long value)
+{
+    out_printf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lu\n", name, help, name, name, value);
+}
+
+
+static void write_counters(metrics_out_t *out)
+{
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        const metric_desc_t *m = &metric_desc[i];
+
+        if (i == 0 || strcmp(m->name, metric_desc[i - 1].name) != 0) {
+            out_printf(out, "# HELP %s %s\n# TYPE %s counter\n", m->name, m->help, m->name);
+        }
+        if (m->labels[0]) {
+            out_printf(out, "%s{%s} %lu\n", m->name, m->labels, (unsigned long)metric_get(i));
+        } else {
+            out_printf(out, "%s %lu\n", m->name, (unsigned long)metric_get(i));
+        }
+    }
+}
+
+
+static void write_ring(metrics_out_t *out)
+{
+    if (sensor_ring == NULL) {
+        return;
+    }
+
+    out_gauge(out, "lxft_queue_depth", "Samples waiting in the sensor ring", spsc_ring_count(sensor_ring));
+    out_gauge(out, "lxft_queue_capacity", "Size of the sensor ring", spsc_ring_capacity(sensor_ring));
+    out_gauge(out, "lxft_queue_high_watermark", "Highest sensor ring depth seen", spsc_ring_high_watermark(sensor_ring));
+    out_printf(out, "# HELP lxft_samples_dropped_total Samples lost because the sensor ring was full\n"
+                    "# TYPE lxft_samples_dropped_total counter\n");
+    out_printf(out, "lxft_samples_dropped_total{reason=\"queue_full\"} %lu\n", (unsigned long)spsc_ring_dropped(sensor_ring));
+    out_printf(out, "lxft_samples_dropped_total{reason=\"queue_overwritten\"} %lu\n", (unsigned long)spsc_ring_overwritten(sensor_ring));
+}
+
+
+static void write_latency(metrics_out_t *out)
+{
+    pub_latency_stats_t stats;
+    unsigned long cumulative = 0;
+    const char *name = "lxft_publish_ack_latency_seconds";
+
+    pub_latency_get(&stats);
+
+    out_printf(out, "# HELP %s Time from publish to PUBACK of the QoS1 messages\n# TYPE %s histogram\n", name, name);
+    for (int i = 0; i < PUB_LATENCY_BUCKETS - 1; i++) {
+        cumulative += stats.count[i];
+        out_printf(out, "%s_bucket{le=\"%g\"} %lu\n", name, pub_latency_bounds_ms[i] / 1000.0, cumulative);
+    }
+    cumulative += stats.count[PUB_LATENCY_BUCKETS - 1];
+    out_printf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    out_printf(out, "%s_sum %.3f\n", name, stats.sum_ms / 1000.0);
+    out_printf(out, "%s_count %lu\n", name, cumulative);
+}
+
+
+esp_err_t metrics_handler(httpd_req_t *req)
+{
+    static metrics_out_t out;
+
+    /* out is static, the httpd task serves one request at a time */
+    out.req = req;
+    out.len = 0;
+    out.err = ESP_OK;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    write_counters(&out);
+    write_ring(&out);
+    write_latency(&out);
+    out_gauge(&out, "lxft_heap_free_bytes", "Free heap", esp_get_free_heap_size());
+    out_gauge(&out, "lxft_heap_min_free_bytes", "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+    out_gauge(&out, "lxft_uptime_seconds", "Time since boot", (unsigned long)(esp_timer_get_time() / 1000000));
+
+    out_flush(&out);
+    if (out.err != ESP_OK) {
+        ESP_LOGW(TAG, "Sending metrics failed (%s)", esp_err_to_name(out.err));
+        return out.err;
+    }
+
+    /* Terminate the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
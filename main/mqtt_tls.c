@@ -0,0 +1,342 @@
+#include "h/mqtt_tls.h"
+
+#include <stdio.h>
+#include "esp_log.h"
+
+#if CONFIG_COMMS_MQTT_TLS_RESUME
+
+#include <string.h>
+#include <stdlib.h>
+#include "h/metrics.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+
+const static char *TAG = "__MQTT_TLS__";
+
+#define MQTT_TLS_DEFAULT_PORT 8883
+
+typedef struct
+{
+    esp_tls_cfg_t cfg;
+    esp_tls_t *tls;
+    int sockfd;
+} mqtt_tls_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+} connect_stats_t;
+
+/*
+ *  Shared by the clients built one after the other, only one runs at a
+ *  time. Touched from the MQTT task, read by the httpd task.
+ */
+static esp_tls_client_session_t *session = NULL;
+static uint8_t session_master[48];              /* A resumed session keeps its master secret */
+static connect_stats_t full_stats = { .min_us = UINT32_MAX };
+static connect_stats_t resumed_stats = { .min_us = UINT32_MAX };
+static uint32_t failed_count = 0;
+static uint32_t last_us = 0;
+static bool last_resumed = false;
+
+
+void mqtt_tls_forget_session(void)
+{
+    if (session) {
+        esp_tls_free_client_session(session);
+        session = NULL;
+    }
+}
+
+
+/*
+ * @brief Tell if a failed connect is worth dropping the offered session for
+ *
+ *  Only when the handshake itself failed: the broker sent an alert or
+ *  closed the connection on the ClientHello, maybe because of the session.
+ *  DNS, socket and TCP errors, timeouts included, happen just as well with
+ *  a full handshake, and are common in a failover or a broker restart,
+ *  exactly when resuming pays off.
+ */
+static bool handshake_refused(esp_tls_t *tls)
+{
+    esp_tls_error_handle_t error;
+    int tls_code = 0;
+    int tls_flags = 0;
+
+    if (esp_tls_get_error_handle(tls, &error) != ESP_OK ||
+        esp_tls_get_and_clear_last_error(error, &tls_code, &tls_flags) != ESP_ERR_MBEDTLS_SSL_HANDSHAKE_FAILED) {
+        return false;
+    }
+
+    /* esp-tls keeps the mbedTLS error code negated */
+    tls_code = -tls_code;
+    ESP_LOGW(TAG, "Handshake failed, mbedTLS error -0x%04x", (unsigned)-tls_code);
+    return tls_code != MBEDTLS_ERR_NET_RECV_FAILED && tls_code != MBEDTLS_ERR_NET_SEND_FAILED &&
+           tls_code != MBEDTLS_ERR_NET_CONN_RESET && tls_code != MBEDTLS_ERR_SSL_TIMEOUT;
+}
+
+
+/*
+ * @brief Keep the session of the connection just made, and tell if it was a resumed one
+ *
+ *  A resumed session keeps the master secret of the one offered. That holds
+ *  for TLS 1.2 only, the transport does not negotiate 1.3.
+ */
+static bool session_update(esp_tls_t *tls, bool offered)
+{
+    mbedtls_ssl_context *ssl = esp_tls_get_ssl_context(tls);
+    mbedtls_ssl_session current;
+    bool resumed = false;
+
+    mbedtls_ssl_session_init(&current);
+    if (ssl && mbedtls_ssl_get_session(ssl, &current) == 0) {
+        resumed = offered && memcmp(session_master, current.MBEDTLS_PRIVATE(master), sizeof(session_master)) == 0;
+        memcpy(session_master, current.MBEDTLS_PRIVATE(master), sizeof(session_master));
+    }
+    mbedtls_ssl_session_free(&current);
+
+    /* A full handshake gave a new session, a resumed one may carry a new ticket */
+    mqtt_tls_forget_session();
+    session = esp_tls_get_client_session(tls);
+    return resumed;
+}
+
+
+static void stats_add(connect_stats_t *stats, uint32_t us)
+{
+    stats->count++;
+    stats->total_us += us;
+    if (us < stats->min_us) stats->min_us = us;
+    if (us > stats->max_us) stats->max_us = us;
+}
+
+
+/* ________________ Transport ________________ */
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    bool offered = (session != NULL);
+    int64_t start_us = esp_timer_get_time();
+    uint32_t us;
+
+    ctx->tls = esp_tls_init();
+    if (ctx->tls == NULL) {
+        return ERR_TCP_TRANSPORT_NO_MEM;
+    }
+
+    ctx->cfg.timeout_ms = timeout_ms;
+    ctx->cfg.client_session = session;
+    if (esp_tls_conn_new_sync(host, strlen(host), port ? port : MQTT_TLS_DEFAULT_PORT, &ctx->cfg, ctx->tls) <= 0) {
+        /* Do not offer it again if the broker chokes on it, keep it through network errors */
+        bool refused = offered && handshake_refused(ctx->tls);
+
+        ESP_LOGE(TAG, "Connection to %s:%d failed%s", host, port, refused ? ", dropping the saved session" : "");
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        ctx->sockfd = -1;
+        failed_count++;
+        metric_inc(METRIC_MQTT_TLS_FAILED);
+
+        if (refused) {
+            mqtt_tls_forget_session();
+        }
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    us = esp_timer_get_time() - start_us;
+    esp_tls_get_conn_sockfd(ctx->tls, &ctx->sockfd);
+
+    last_resumed = session_update(ctx->tls, offered);
+    last_us = us;
+    if (last_resumed) {
+        stats_add(&resumed_stats, us);
+        metric_inc(METRIC_MQTT_TLS_RESUMED);
+    } else {
+        stats_add(&full_stats, us);
+        metric_inc(METRIC_MQTT_TLS_FULL);
+    }
+
+    ESP_LOGI(TAG, "Connected to %s in %lu ms, %s handshake%s", host, (unsigned long)(us / 1000),
+             last_resumed ? "resumed" : "full", offered && !last_resumed ? " (session refused)" : "");
+    return 0;
+}
+
+
+static int tls_poll(mqtt_tls_t *ctx, bool write, int timeout_ms)
+{
+    struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    fd_set set;
+    fd_set errset;
+    int ret;
+
+    if (ctx->tls == NULL || ctx->sockfd < 0) {
+        return -1;
+    }
+
+    FD_ZERO(&set);
+    FD_ZERO(&errset);
+    FD_SET(ctx->sockfd, &set);
+    FD_SET(ctx->sockfd, &errset);
+    ret = select(ctx->sockfd + 1, write ? NULL : &set, write ? &set : NULL, &errset, timeout_ms >= 0 ? &timeout : NULL);
+    if (ret > 0 && FD_ISSET(ctx->sockfd, &errset)) {
+        int sock_errno = 0;
+        socklen_t len = sizeof(sock_errno);
+
+        getsockopt(ctx->sockfd, SOL_SOCKET, SO_ERROR, &sock_errno, &len);
+        ESP_LOGE(TAG, "Socket error: %s", strerror(sock_errno));
+        return -1;
+    }
+    return ret;
+}
+
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    int avail;
+
+    /* Records already decrypted do not show on the socket */
+    if (ctx->tls && (avail = esp_tls_get_bytes_avail(ctx->tls)) > 0) {
+        return avail;
+    }
+    return tls_poll(ctx, false, timeout_ms);
+}
+
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return tls_poll(esp_transport_get_context_data(t), true, timeout_ms);
+}
+
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    int poll = tls_poll_read(t, timeout_ms);
+    int ret;
+
+    if (poll <= 0) {
+        return poll;
+    }
+
+    ret = esp_tls_conn_read(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Read error -0x%x", -ret);
+    }
+    return ret;
+}
+
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    int poll = tls_poll_write(t, timeout_ms);
+    int ret;
+
+    if (poll <= 0) {
+        return poll;
+    }
+
+    ret = esp_tls_conn_write(ctx->tls, buffer, len);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Write error -0x%x", -ret);
+    }
+    return ret;
+}
+
+
+static int tls_close(esp_transport_handle_t t)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+
+    if (ctx->tls) {
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+    }
+    ctx->sockfd = -1;
+    return 0;
+}
+
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+    tls_close(t);
+    free(esp_transport_get_context_data(t));
+    return 0;
+}
+
+
+esp_transport_handle_t mqtt_tls_transport_create(const esp_tls_cfg_t *cfg)
+{
+    esp_transport_handle_t t = esp_transport_init();
+    mqtt_tls_t *ctx = calloc(1, sizeof(mqtt_tls_t));
+
+    if (t == NULL || ctx == NULL) {
+        ESP_LOGE(TAG, "No memory for the MQTT transport");
+        free(ctx);
+        if (t) {
+            esp_transport_destroy(t);
+        }
+        return NULL;
+    }
+
+    ctx->cfg = *cfg;
+    /* The resumption check compares TLS 1.2 master secrets, see session_update() */
+    ctx->cfg.tls_version = ESP_TLS_VER_TLS_1_2;
+    ctx->sockfd = -1;
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+    esp_transport_set_default_port(t, MQTT_TLS_DEFAULT_PORT);
+    return t;
+}
+
+
+/* ________________ Report ________________ */
+
+static int stats_json(char *buf, size_t len, const char *name, const connect_stats_t *stats)
+{
+    return snprintf(buf, len, "\"%s\":{\"count\":%lu,\"avg_us\":%lu,\"min_us\":%lu,\"max_us\":%lu}", name,
+                    (unsigned long)stats->count, (unsigned long)(stats->count ? stats->total_us / stats->count : 0),
+                    (unsigned long)(stats->count ? stats->min_us : 0), (unsigned long)stats->max_us);
+}
+
+
+esp_err_t mqtt_tls_handler(httpd_req_t *req)
+{
+    char json[320];
+    int len;
+
+    len = snprintf(json, sizeof(json), "{\"session\":%s,\"last\":{\"us\":%lu,\"resumed\":%s},",
+                   session ? "true" : "false", (unsigned long)last_us, last_resumed ? "true" : "false");
+    len += stats_json(json + len, sizeof(json) - len, "full", &full_stats);
+    json[len++] = ',';
+    len += stats_json(json + len, sizeof(json) - len, "resumed", &resumed_stats);
+    len += snprintf(json + len, sizeof(json) - len, ",\"failed\":%lu}", (unsigned long)failed_count);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, json, len);
+}
+
+#else /* !CONFIG_COMMS_MQTT_TLS_RESUME */
+
+esp_err_t mqtt_tls_handler(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_sendstr(req, "MQTT TLS session resumption disabled");
+}
+
+#endif /* CONFIG_COMMS_MQTT_TLS_RESUME */
@@ -0,0 +1,166 @@
+#include "h/multipart.h"
+
+#include <string.h>
+#include <strings.h>
+
+
+esp_err_t multipart_init(multipart_t *mp, const char *content_type)
+{
+    const char *b;
+    size_t len;
+
+    memset(mp, 0, sizeof(*mp));
+
+    if (content_type == NULL || strncasecmp(content_type, "multipart/form-data", 19) != 0 ||
+        (b = strstr(content_type, "boundary=")) == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    b += 9;
+
+    /* The boundary may be quoted */
+    if (*b == '"') {
+        b++;
+        len = strcspn(b, "\"");
+    } else {
+        len = strcspn(b, "; \t");
+    }
+    if (len == 0 || len > MULTIPART_BOUNDARY_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, b, len);
+    mp->delim_len = len + 4;
+    mp->delim[mp->delim_len] = '\0';
+
+    /* KMP failure function: longest proper prefix of delim[0..i] that is also a suffix */
+    mp->fail[0] = 0;
+    for (size_t i = 1, k = 0; i < mp->delim_len; i++) {
+        while (k > 0 && mp->delim[i] != mp->delim[k]) {
+            k = mp->fail[k - 1];
+        }
+        if (mp->delim[i] == mp->delim[k]) {
+            k++;
+        }
+        mp->fail[i] = k;
+    }
+
+    /* The body starts with "--boundary", as if the "\r\n" was already there */
+    mp->match = 2;
+    mp->state = MULTIPART_PREAMBLE;
+    return ESP_OK;
+}
+
+
+/*
+ * @brief Advance the delimiter match by one char
+ * @param released Set to the number of held back delim chars that turned out to be data
+ * @return true if c was matched (held back), false if it is data as well
+ */
+static bool match_char(multipart_t *mp, char c, size_t *released)
+{
+    size_t k = mp->match;
+
+    while (k > 0 && c != mp->delim[k]) {
+        k = mp->fail[k - 1];
+    }
+    *released = mp->match - k;
+
+    if (c == mp->delim[k]) {
+        mp->match = k + 1;
+        return true;
+    }
+    mp->match = 0;
+    return false;
+}
+
+
+esp_err_t multipart_feed(multipart_t *mp, const uint8_t *data, size_t len, multipart_data_cb_t on_data, void *arg)
+{
+    size_t i = 0;
+    esp_err_t err;
+
+    while (i < len) {
+        switch (mp->state) {
+        case MULTIPART_PREAMBLE:
+        case MULTIPART_DATA: {
+            bool emit = (mp->state == MULTIPART_DATA && mp->file_part);
+            size_t run = i;         /* Data of this feed not passed on yet, never holds matched chars */
+
+            for (; i < len && mp->match < mp->delim_len; i++) {
+                size_t released;
+                bool matched;
+
+                if (mp->match == 0 && data[i] != (uint8_t)mp->delim[0]) {
+                    continue;       /* Plain data, stays in the run */
+                }
+                matched = match_char(mp, (char)data[i], &released);
+
+                /* The run comes first, then the held chars that turned out to be data */
+                if (emit) {
+                    if (i > run && (err = on_data(data + run, i - run, arg)) != ESP_OK) {
+                        return err;
+                    }
+                    if (released > 0 && (err = on_data((const uint8_t *)mp->delim, released, arg)) != ESP_OK) {
+                        return err;
+                    }
+                }
+                run = matched ? i + 1 : i;
+            }
+
+            if (emit && i > run && (err = on_data(data + run, i - run, arg)) != ESP_OK) {
+                return err;
+            }
+
+            if (mp->match == mp->delim_len) {
+                mp->match = 0;
+                mp->after_len = 0;
+                mp->state = MULTIPART_AFTER_DELIM;
+            }
+            break;
+        }
+
+        case MULTIPART_AFTER_DELIM:
+            mp->after[mp->after_len++] = (char)data[i++];
+            if (mp->after_len < 2) {
+                break;
+            }
+            if (mp->after[0] == '-' && mp->after[1] == '-') {
+                mp->state = MULTIPART_DONE;
+            } else if (mp->after[0] == '\r' && mp->after[1] == '\n') {
+                mp->headers_len = 0;
+                mp->state = MULTIPART_HEADERS;
+            } else {
+                return ESP_FAIL;
+            }
+            break;
+
+        case MULTIPART_HEADERS:
+            if (mp->headers_len == sizeof(mp->headers) - 1) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            mp->headers[mp->headers_len++] = (char)data[i++];
+            mp->headers[mp->headers_len] = '\0';
+
+            /* An empty line ends the part headers */
+            if (mp->headers_len >= 4 && memcmp(mp->headers + mp->headers_len - 4, "\r\n\r\n", 4) == 0) {
+                mp->file_part = strstr(mp->headers, "filename=") != NULL;
+                mp->file_parts += mp->file_part;
+                mp->match = 0;
+                mp->state = MULTIPART_DATA;
+            } else if (mp->headers_len == 2 && memcmp(mp->headers, "\r\n", 2) == 0) {
+                /* Part without headers */
+                mp->file_part = false;
+                mp->match = 0;
+                mp->state = MULTIPART_DATA;
+            }
+            break;
+
+        case MULTIPART_DONE:
+            /* Epilogue, ignored */
+            return ESP_OK;
+        }
+    }
+
+    return ESP_OK;
+}
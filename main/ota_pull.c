@@ -0,0 +1,414 @@
+#include "h/ota_pull.h"
+
+#include <stdio.h>
+#include "esp_log.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+#include "h/ota_stream.h"
+#include "h/http_server.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_http_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+const static char *TAG = "__OTA_PULL__";
+
+#define OTA_PULL_URL_LEN    256
+#define OTA_PULL_CMD_LEN    (OTA_PULL_URL_LEN + 160)
+
+typedef struct
+{
+    char url[OTA_PULL_URL_LEN];
+    size_t size;
+    uint8_t sha256[OTA_SHA256_LEN];
+} ota_job_t;
+
+static ota_job_t job;
+static atomic_bool busy = false;
+
+/* Last status, published by the comms task which owns the MQTT client */
+static char status_msg[160];
+static int status_len = 0;
+static atomic_bool status_pending = false;
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+
+extern const uint8_t ca_cert_pem_start[] asm("_binary_ca_crt_start");
+
+
+/* ________________ Command parsing ________________ */
+
+/* Value of "key" in a flat JSON object, NULL if missing */
+static const char *json_value(const char *json, const char *key)
+{
+    char pattern[24];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if ((p = strstr(json, pattern)) == NULL) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    while (*p == ' ' || *p == ':') {
+        p++;
+    }
+    return p;
+}
+
+static bool json_string(const char *json, const char *key, char *out, size_t size)
+{
+    const char *p = json_value(json, key);
+    const char *end;
+
+    if (p == NULL || *p != '"' || (end = strchr(p + 1, '"')) == NULL || end - p - 1 >= size) {
+        return false;
+    }
+    memcpy(out, p + 1, end - p - 1);
+    out[end - p - 1] = '\0';
+    return true;
+}
+
+static bool hex_to_bin(const char *hex, uint8_t *out, size_t len)
+{
+    if (strlen(hex) != len * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+    return true;
+}
+
+static bool parse_command(const char *cmd, ota_job_t *out)
+{
+    char sha_hex[OTA_SHA256_LEN * 2 + 1];
+    const char *size;
+
+    if (!json_string(cmd, "url", out->url, sizeof(out->url)) ||
+        !json_string(cmd, "sha256", sha_hex, sizeof(sha_hex)) ||
+        !hex_to_bin(sha_hex, out->sha256, OTA_SHA256_LEN) ||
+        (size = json_value(cmd, "size")) == NULL) {
+        return false;
+    }
+    out->size = strtoul(size, NULL, 10);
+
+    if (strncmp(out->url, "https://", 8) != 0 &&
+        !(CONFIG_OTA_PULL_ALLOW_HTTP && strncmp(out->url, "http://", 7) == 0)) {
+        return false;
+    }
+    return out->size > 0;
+}
+
+
+/* ________________ Download ________________ */
+
+/*
+ * @brief Newer states replace older ones not sent yet
+ * @param detail "failed": error text, "done": extra JSON members, NULL otherwise
+ */
+static void publish_status(const char *state, size_t offset, const char *detail)
+{
+    char msg[sizeof(status_msg)];
+    bool failed = detail && strcmp(state, "failed") == 0;
+    int len;
+
+    len = snprintf(msg, sizeof(msg), "{\"state\":\"%s\",\"offset\":%u,\"size\":%u%s%s%s}",
+                   state, (unsigned)offset, (unsigned)job.size,
+                   failed ? ",\"error\":\"" : (detail ? "," : ""), detail ? detail : "", failed ? "\"" : "");
+
+    portENTER_CRITICAL(&status_lock);
+    memcpy(status_msg, msg, sizeof(msg));
+    status_len = len;
+    portEXIT_CRITICAL(&status_lock);
+    atomic_store(&status_pending, true);
+}
+
+
+/*
+ * @brief One HTTP request from the current offset to the end of the image
+ * @return ESP_OK once the whole image is received, ESP_ERR_INVALID_RESPONSE if
+ *         the server will not resume, ESP_ERR_NOT_FOUND on a 4xx status,
+ *         other errors are worth a retry
+ */
+static esp_err_t download_from(ota_stream_t *ota, uint8_t *buf)
+{
+    esp_http_client_config_t config = {
+        .url = job.url,
+        .cert_pem = (const char *)ca_cert_pem_start,
+        .timeout_ms = CONFIG_OTA_PULL_TIMEOUT_MS,
+        .keep_alive_enable = true,
+    };
+    esp_http_client_handle_t http;
+    size_t next_report = 0;         /* Progress first reported where this request starts */
+    char range[32];
+    esp_err_t err;
+    int status;
+
+    http = esp_http_client_init(&config);
+    if (http == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (ota->in_bytes > 0) {
+        snprintf(range, sizeof(range), "bytes=%u-", (unsigned)ota->in_bytes);
+        esp_http_client_set_header(http, "Range", range);
+        ESP_LOGI(TAG, "Resuming at %u of %u bytes", (unsigned)ota->in_bytes, (unsigned)job.size);
+    }
+
+    err = esp_http_client_open(http, 0);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Connection failed (%s)", esp_err_to_name(err));
+        esp_http_client_cleanup(http);
+        return err;
+    }
+    esp_http_client_fetch_headers(http);
+    status = esp_http_client_get_status_code(http);
+
+    if (!(status == 200 && ota->in_bytes == 0) && !(status == 206 && ota->in_bytes > 0)) {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d at offset %u", status, (unsigned)ota->in_bytes);
+        esp_http_client_cleanup(http);
+        /* 200 to a Range request: the server can not resume, start over */
+        if (status == 200) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        return (status >= 400 && status < 500) ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+    }
+
+    while (ota->in_bytes < job.size) {
+        int n = esp_http_client_read(http, (char *)buf, CONFIG_OTA_BUFFER_SIZE);
+        if (n <= 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        err = ota_stream_write(ota, buf, n);
+        if (err != ESP_OK) {
+            break;
+        }
+        if (ota->in_bytes >= next_report) {
+            publish_status("downloading", ota->in_bytes, NULL);
+            next_report = ota->in_bytes + job.size / 10;
+        }
+    }
+
+    esp_http_client_cleanup(http);
+    if (ota->in_bytes == job.size) {
+        return ESP_OK;
+    }
+    return err == ESP_OK ? ESP_FAIL : err;
+}
+
+
+static void ota_pull_task(void *arg)
+{
+    static ota_stream_t ota;
+    ota_update_stats_t stats;
+    uint8_t *buf = malloc(CONFIG_OTA_BUFFER_SIZE);
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = (buf == NULL) ? ESP_ERR_NO_MEM : ESP_OK;
+    int retries = 0;
+    size_t last_offset = 0;
+
+    ESP_LOGI(TAG, "Pulling %u bytes from %s", (unsigned)job.size, job.url);
+    ota_stream_begin(&ota, job.size);
+
+    while (err == ESP_OK) {
+        err = download_from(&ota, buf);
+        if (err == ESP_OK) {
+            break;
+        }
+
+        if (err == ESP_ERR_INVALID_RESPONSE && ota.in_bytes > 0 && ota.state != OTA_STREAM_FAILED) {
+            ESP_LOGW(TAG, "Server does not support ranges, restarting the download");
+            ota_stream_abort(&ota);
+            ota_stream_begin(&ota, job.size);
+            continue;
+        }
+        if (err == ESP_ERR_INVALID_SIZE || err == ESP_ERR_NO_MEM || err == ESP_ERR_NOT_FOUND ||
+            err == ESP_ERR_INVALID_STATE || err == ESP_ERR_INVALID_VERSION || err == ESP_ERR_INVALID_RESPONSE) {
+            break;      /* Not a link problem, retrying will not help */
+        }
+
+        /* Link down or failover in progress: count only the attempts that made no progress */
+        retries = (ota.in_bytes > last_offset) ? 0 : retries + 1;
+        last_offset = ota.in_bytes;
+        if (retries > CONFIG_OTA_PULL_RETRIES) {
+            break;
+        }
+        ESP_LOGW(TAG, "Download interrupted at %u bytes, retry %d in %d s",
+                 (unsigned)ota.in_bytes, retries, CONFIG_OTA_PULL_RETRY_DELAY_S);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_OTA_PULL_RETRY_DELAY_S * 1000));
+        err = ESP_OK;
+    }
+
+    if (err == ESP_OK) {
+        publish_status("verifying", ota.in_bytes, NULL);
+        err = ota_stream_finish(&ota, job.sha256, &stats);
+    } else {
+        ota_stream_abort(&ota);
+    }
+    free(buf);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Pull OTA failed (%s)", esp_err_to_name(err));
+        publish_status("failed", 0, err == ESP_ERR_INVALID_CRC ? "sha256 mismatch" :
+                                    err == ESP_ERR_INVALID_STATE ? "delta base mismatch" : esp_err_to_name(err));
+        atomic_store(&busy, false);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    /* End to end: command received to image ready, retries and unpacking included */
+    uint32_t total_ms = (esp_timer_get_time() - start_us) / 1000;
+    char done[48];
+
+    ESP_LOGI(TAG, "Pull OTA done in %lu ms (%u bytes downloaded for a %u bytes image), rebooting",
+             (unsigned long)total_ms, (unsigned)stats.in_bytes, (unsigned)stats.bytes);
+    snprintf(done, sizeof(done), "\"image\":%u,\"ms\":%lu", (unsigned)stats.bytes, (unsigned long)total_ms);
+    publish_status("done", stats.in_bytes, done);
+
+    /* Give the comms task a chance to report it, the new image is booted anyway */
+    for (int i = 0; i < 50 && atomic_load(&status_pending); i++) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    vTaskDelay(pdMS_TO_TICKS(500));
+    esp_restart();
+}
+
+
+/* ________________ MQTT side ________________ */
+
+void ota_pull_subscribe(esp_mqtt_client_handle_t client)
+{
+    char topic[40];
+    char id[ID_LEN + 1];
+
+    http_config_get(id, NULL);
+    snprintf(topic, sizeof(topic), OTA_PULL_TOPIC_FMT, id);
+    if (esp_mqtt_client_subscribe(client, topic, 1) < 0) {
+        ESP_LOGW(TAG, "Could not subscribe to %s", topic);
+    }
+}
+
+
+void ota_pull_resubscribe(esp_mqtt_client_handle_t client, const char *old_id)
+{
+    char topic[40];
+
+    snprintf(topic, sizeof(topic), OTA_PULL_TOPIC_FMT, old_id);
+    if (esp_mqtt_client_unsubscribe(client, topic) < 0) {
+        ESP_LOGW(TAG, "Could not unsubscribe from %s", topic);
+    }
+    ota_pull_subscribe(client);
+}
+
+
+void ota_pull_send_status(esp_mqtt_client_handle_t client)
+{
+    char topic[40];
+    char id[ID_LEN + 1];
+    char msg[sizeof(status_msg)];
+    int len;
+
+    /* Cleared first, so a status set while this one is sent is not lost */
+    if (!atomic_exchange(&status_pending, false)) {
+        return;
+    }
+
+    portENTER_CRITICAL(&status_lock);
+    memcpy(msg, status_msg, sizeof(msg));
+    len = status_len;
+    portEXIT_CRITICAL(&status_lock);
+
+    http_config_get(id, NULL);
+    snprintf(topic, sizeof(topic), OTA_PULL_STATUS_TOPIC_FMT, id);
+    if (esp_mqtt_client_publish(client, topic, msg, len, 1, 0) < 0) {
+        atomic_store(&status_pending, true);
+    }
+}
+
+
+bool ota_pull_handle_data(esp_mqtt_event_handle_t event)
+{
+    char topic[40];
+    char id[ID_LEN + 1];
+    char cmd[OTA_PULL_CMD_LEN];
+    int topic_len;
+
+    http_config_get(id, NULL);
+    topic_len = snprintf(topic, sizeof(topic), OTA_PULL_TOPIC_FMT, id);
+
+    if (event->topic_len != topic_len || memcmp(event->topic, topic, topic_len) != 0) {
+        return false;
+    }
+
+    /* Commands are small, a fragmented one is not valid */
+    if (event->data_len != event->total_data_len || event->data_len >= sizeof(cmd)) {
+        ESP_LOGE(TAG, "OTA command too long");
+        return true;
+    }
+    memcpy(cmd, event->data, event->data_len);
+    cmd[event->data_len] = '\0';
+
+    if (atomic_exchange(&busy, true)) {
+        ESP_LOGW(TAG, "OTA already running, command ignored");
+        return true;
+    }
+
+    if (!parse_command(cmd, &job)) {
+        ESP_LOGE(TAG, "Invalid OTA command: %s", cmd);
+        atomic_store(&busy, false);
+        return true;
+    }
+
+    if (xTaskCreate(ota_pull_task, "ota_pull", 8192, NULL, 4, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Could not start the OTA task");
+        atomic_store(&busy, false);
+    }
+    return true;
+}
+
+
+bool ota_pull_busy(void)
+{
+    return atomic_load(&busy);
+}
+
+#else /* CONFIG_IDF_TARGET_LINUX */
+
+/* Simulation build: no OTA slots, nothing to subscribe to */
+void ota_pull_subscribe(esp_mqtt_client_handle_t client)
+{
+}
+
+
+void ota_pull_resubscribe(esp_mqtt_client_handle_t client, const char *old_id)
+{
+}
+
+
+void ota_pull_send_status(esp_mqtt_client_handle_t client)
+{
+}
+
+
+bool ota_pull_handle_data(esp_mqtt_event_handle_t event)
+{
+    return false;
+}
+
+
+bool ota_pull_busy(void)
+{
+    return false;
+}
+
+#endif /* !CONFIG_IDF_TARGET_LINUX */
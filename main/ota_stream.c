@@ -0,0 +1,386 @@
+#include "h/ota_stream.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_image_format.h"
+
+const static char *TAG = "__OTA_STREAM__";
+
+#define OTA_BASE_HASH_CHUNK 4096
+
+static const char *format_name(const ota_stream_t *s)
+{
+    if (s->state == OTA_STREAM_RAW) {
+        return "raw";
+    }
+    return s->hdr.type == OTA_IMAGE_DELTA ? "delta" : "compressed";
+}
+
+
+/* ________________ Delta ________________ */
+
+/* Check that the running app is the one the delta was made against */
+static esp_err_t delta_check_base(ota_stream_t *s)
+{
+    mbedtls_sha256_context sha;
+    uint8_t digest[OTA_SHA256_LEN];
+    uint8_t *buf;
+    esp_err_t err = ESP_OK;
+
+    s->base = esp_ota_get_running_partition();
+    if (s->base == NULL || s->hdr.base_size == 0 || s->hdr.base_size > s->base->size) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((buf = malloc(OTA_BASE_HASH_CHUNK)) == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    for (size_t off = 0; off < s->hdr.base_size && err == ESP_OK; off += OTA_BASE_HASH_CHUNK) {
+        size_t n = MIN(OTA_BASE_HASH_CHUNK, s->hdr.base_size - off);
+        err = esp_partition_read(s->base, off, buf, n);
+        mbedtls_sha256_update(&sha, buf, n);
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    free(buf);
+
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (memcmp(digest, s->hdr.base_sha256, OTA_SHA256_LEN) != 0) {
+        ESP_LOGE(TAG, "Delta was made for another firmware than the one running on %s", s->base->label);
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+
+/* Copy or add base bytes, in scratch sized steps */
+static esp_err_t delta_from_base(ota_stream_t *s, const uint8_t *diff, size_t len)
+{
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(s->scratch));
+        esp_err_t err = esp_partition_read(s->base, s->src, s->scratch, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (diff) {
+            for (size_t i = 0; i < n; i++) {
+                s->scratch[i] += diff[i];
+            }
+            diff += n;
+        }
+        err = ota_update_write(&s->ota, s->scratch, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        s->src += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+
+/* All varints of the current op are read */
+static esp_err_t delta_op_ready(ota_stream_t *s)
+{
+    esp_err_t err = ESP_OK;
+
+    if (s->op == 'I') {
+        s->remaining = s->args[0];
+    } else {
+        uint32_t len = s->args[1];
+        s->src = s->args[0];
+        if (len > s->hdr.base_size || s->src > s->hdr.base_size - len) {
+            ESP_LOGE(TAG, "Delta reads past the base image");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (s->op == 'C') {
+            err = delta_from_base(s, NULL, len);
+        } else {
+            s->remaining = len;
+        }
+    }
+
+    if (s->remaining == 0) {
+        s->op = 0;
+    }
+    return err;
+}
+
+
+/* Apply the inflated op stream */
+static esp_err_t delta_feed(ota_stream_t *s, const uint8_t *p, size_t len)
+{
+    esp_err_t err;
+
+    while (len > 0) {
+        if (s->delta_done) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        if (s->remaining > 0) {
+            size_t n = MIN(len, s->remaining);
+            err = (s->op == 'A') ? delta_from_base(s, p, n) : ota_update_write(&s->ota, p, n);
+            if (err != ESP_OK) {
+                return err;
+            }
+            p += n;
+            len -= n;
+            s->remaining -= n;
+            if (s->remaining == 0) {
+                s->op = 0;
+            }
+            continue;
+        }
+
+        if (s->op == 0) {
+            s->op = *p++;
+            len--;
+            s->field = 0;
+            s->shift = 0;
+            s->args[0] = s->args[1] = 0;
+            if (s->op == 'E') {
+                s->delta_done = true;
+            } else if (s->op != 'C' && s->op != 'A' && s->op != 'I') {
+                ESP_LOGE(TAG, "Unknown delta op 0x%02x", s->op);
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            continue;
+        }
+
+        /* LEB128 argument */
+        uint8_t b = *p++;
+        len--;
+        if (s->shift > 28) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        s->args[s->field] |= (uint32_t)(b & 0x7f) << s->shift;
+        s->shift += 7;
+        if (b & 0x80) {
+            continue;
+        }
+        s->shift = 0;
+        if (++s->field < (s->op == 'I' ? 1 : 2)) {
+            continue;
+        }
+        err = delta_op_ready(s);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+
+/* ________________ Inflate ________________ */
+
+static esp_err_t inflate_feed(ota_stream_t *s, const uint8_t *p, size_t len)
+{
+    esp_err_t err;
+
+    if (s->inflate_done) {
+        ESP_LOGE(TAG, "Data after the end of the compressed stream");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    while (1) {
+        size_t in_bytes = len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - s->dict_ofs;
+        tinfl_status status;
+
+        status = tinfl_decompress(s->inflator, p, &in_bytes, s->dict, s->dict + s->dict_ofs, &out_bytes,
+                                  TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_PARSE_ZLIB_HEADER);
+        p += in_bytes;
+        len -= in_bytes;
+
+        if (out_bytes > 0) {
+            const uint8_t *out = s->dict + s->dict_ofs;
+            err = (s->hdr.type == OTA_IMAGE_DELTA) ? delta_feed(s, out, out_bytes)
+                                                   : ota_update_write(&s->ota, out, out_bytes);
+            if (err != ESP_OK) {
+                return err;
+            }
+            s->dict_ofs = (s->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            s->inflate_done = true;
+            return (len > 0) ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
+        }
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Corrupt compressed stream (%d)", (int)status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        /* All input used, otherwise the window wrapped and there is more output */
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return ESP_OK;
+        }
+    }
+}
+
+
+/* ________________ Container ________________ */
+
+static esp_err_t header_ready(ota_stream_t *s)
+{
+    const ota_image_header_t *h = &s->hdr;
+    esp_err_t err;
+
+    if (h->version != OTA_IMAGE_VERSION || (h->type != OTA_IMAGE_ZLIB && h->type != OTA_IMAGE_DELTA)) {
+        ESP_LOGE(TAG, "Unsupported image container v%d type %d", h->version, h->type);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (h->type == OTA_IMAGE_DELTA && (err = delta_check_base(s)) != ESP_OK) {
+        return err;
+    }
+
+    s->inflator = malloc(sizeof(tinfl_decompressor));
+    s->dict = malloc(TINFL_LZ_DICT_SIZE);
+    if (s->inflator == NULL || s->dict == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    tinfl_init(s->inflator);
+
+    err = ota_update_begin(&s->ota, h->image_size);
+    if (err == ESP_OK) {
+        s->state = OTA_STREAM_INFLATE;
+        ESP_LOGI(TAG, "%s image, %lu bytes once unpacked", format_name(s), (unsigned long)h->image_size);
+    }
+    return err;
+}
+
+
+static void stream_release(ota_stream_t *s)
+{
+    free(s->inflator);
+    free(s->dict);
+    s->inflator = NULL;
+    s->dict = NULL;
+}
+
+
+void ota_stream_begin(ota_stream_t *s, size_t in_size)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = OTA_STREAM_DETECT;
+    s->in_size = in_size;
+    s->start_us = esp_timer_get_time();
+}
+
+
+esp_err_t ota_stream_write(ota_stream_t *s, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    esp_err_t err = ESP_OK;
+
+    if (s->state == OTA_STREAM_FAILED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s->in_size && s->in_bytes + len > s->in_size) {
+        ESP_LOGE(TAG, "More data than the announced %u bytes", (unsigned)s->in_size);
+        s->state = OTA_STREAM_FAILED;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    s->in_bytes += len;
+
+    /* Container header, or the first bytes of a plain image */
+    while ((s->state == OTA_STREAM_DETECT || s->state == OTA_STREAM_HEADER) && len > 0) {
+        size_t want = (s->state == OTA_STREAM_DETECT) ? sizeof(s->hdr.magic) : sizeof(s->hdr);
+        size_t n = MIN(len, want - s->hdr_fill);
+
+        memcpy((uint8_t *)&s->hdr + s->hdr_fill, p, n);
+        s->hdr_fill += n;
+        p += n;
+        len -= n;
+        if (s->hdr_fill < want) {
+            return ESP_OK;
+        }
+
+        if (s->state == OTA_STREAM_HEADER) {
+            err = header_ready(s);
+        } else if (memcmp(s->hdr.magic, OTA_IMAGE_MAGIC, sizeof(s->hdr.magic)) == 0) {
+            s->state = OTA_STREAM_HEADER;
+        } else {
+            if ((uint8_t)s->hdr.magic[0] != ESP_IMAGE_HEADER_MAGIC) {
+                ESP_LOGW(TAG, "Not an app image or container, the image check will decide");
+            }
+            err = ota_update_begin(&s->ota, s->in_size);
+            if (err == ESP_OK) {
+                s->state = OTA_STREAM_RAW;
+                err = ota_update_write(&s->ota, s->hdr.magic, sizeof(s->hdr.magic));
+            }
+        }
+        if (err != ESP_OK) {
+            s->state = OTA_STREAM_FAILED;
+            return err;
+        }
+    }
+
+    if (len == 0) {
+        return ESP_OK;
+    }
+    err = (s->state == OTA_STREAM_RAW) ? ota_update_write(&s->ota, p, len) : inflate_feed(s, p, len);
+    if (err != ESP_OK) {
+        s->state = OTA_STREAM_FAILED;
+    }
+    return err;
+}
+
+
+esp_err_t ota_stream_finish(ota_stream_t *s, const uint8_t *expected_sha256, ota_update_stats_t *stats)
+{
+    ota_update_stats_t local;
+    const uint8_t *sha = expected_sha256;
+    esp_err_t err;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+
+    if (s->state != OTA_STREAM_RAW && s->state != OTA_STREAM_INFLATE) {
+        err = (s->state == OTA_STREAM_FAILED) ? ESP_ERR_INVALID_STATE : ESP_ERR_INVALID_SIZE;
+        ota_stream_abort(s);
+        return err;
+    }
+    if (s->state == OTA_STREAM_INFLATE) {
+        if (!s->inflate_done || (s->hdr.type == OTA_IMAGE_DELTA && !s->delta_done)) {
+            ESP_LOGE(TAG, "Packed image truncated at %u bytes", (unsigned)s->in_bytes);
+            ota_stream_abort(s);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        /* The trusted hash comes from the caller, the container one still catches corruption */
+        if (sha && memcmp(sha, s->hdr.image_sha256, OTA_SHA256_LEN) != 0) {
+            ESP_LOGE(TAG, "Container is not the announced image");
+            ota_stream_abort(s);
+            return ESP_ERR_INVALID_CRC;
+        }
+        sha = s->hdr.image_sha256;
+        stream_release(s);
+    }
+
+    err = ota_update_finish(&s->ota, sha, stats);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    stats->in_bytes = s->in_bytes;
+    stats->elapsed_ms = (esp_timer_get_time() - s->start_us) / 1000;
+    ESP_LOGI(TAG, "Update done in %lu ms: %u bytes %s input, %u bytes image (%d%%)",
+             (unsigned long)stats->elapsed_ms, (unsigned)s->in_bytes, format_name(s), (unsigned)stats->bytes,
+             stats->bytes ? (int)((uint64_t)s->in_bytes * 100 / stats->bytes) : 0);
+    return ESP_OK;
+}
+
+
+void ota_stream_abort(ota_stream_t *s)
+{
+    ota_update_abort(&s->ota);
+    stream_release(s);
+    s->state = OTA_STREAM_FAILED;
+}
@@ -0,0 +1,240 @@
+#include "h/ota_update.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+const static char *TAG = "__OTA__";
+
+typedef struct
+{
+    int index;
+    size_t len;                     /* 0: stop the writer */
+} ota_chunk_t;
+
+
+static void ota_writer_task(void *arg)
+{
+    ota_update_t *ota = arg;
+    ota_chunk_t chunk;
+
+    while (xQueueReceive(ota->full_q, &chunk, portMAX_DELAY) == pdTRUE && chunk.len > 0) {
+        /* After an error the buffers still go back, so the caller never waits forever */
+        if (ota->writer_err == ESP_OK) {
+            esp_err_t err = esp_ota_write(ota->handle, ota->buf[chunk.index], chunk.len);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+                ota->writer_err = err;
+            } else {
+                mbedtls_sha256_update(&ota->sha, ota->buf[chunk.index], chunk.len);
+            }
+        }
+        xQueueSend(ota->free_q, &chunk.index, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(ota->writer_done);
+    vTaskDelete(NULL);
+}
+
+
+static void ota_release(ota_update_t *ota)
+{
+    free(ota->buf[0]);
+    free(ota->buf[1]);
+    if (ota->full_q) vQueueDelete(ota->full_q);
+    if (ota->free_q) vQueueDelete(ota->free_q);
+    if (ota->writer_done) vSemaphoreDelete(ota->writer_done);
+    mbedtls_sha256_free(&ota->sha);
+    memset(ota, 0, sizeof(*ota));
+}
+
+
+/* Wait for the writer to drain and exit */
+static void ota_stop_writer(ota_update_t *ota)
+{
+    ota_chunk_t stop = { .index = 0, .len = 0 };
+
+    xQueueSend(ota->full_q, &stop, portMAX_DELAY);
+    xSemaphoreTake(ota->writer_done, portMAX_DELAY);
+}
+
+
+esp_err_t ota_update_begin(ota_update_t *ota, size_t image_size)
+{
+    esp_err_t err;
+    int spare = 1;
+
+    memset(ota, 0, sizeof(*ota));
+
+    ota->partition = esp_ota_get_next_update_partition(NULL);
+    if (ota->partition == NULL) {
+        ESP_LOGE(TAG, "OTA partition not found");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (image_size > ota->partition->size) {
+        ESP_LOGE(TAG, "Image of %u bytes does not fit in %s (%u bytes)",
+                 (unsigned)image_size, ota->partition->label, (unsigned)ota->partition->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ota->buf[0] = malloc(CONFIG_OTA_BUFFER_SIZE);
+    ota->buf[1] = malloc(CONFIG_OTA_BUFFER_SIZE);
+    ota->full_q = xQueueCreate(2, sizeof(ota_chunk_t));
+    ota->free_q = xQueueCreate(2, sizeof(int));
+    ota->writer_done = xSemaphoreCreateBinary();
+    mbedtls_sha256_init(&ota->sha);
+    if (!ota->buf[0] || !ota->buf[1] || !ota->full_q || !ota->free_q || !ota->writer_done) {
+        ota_release(ota);
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* Erase one sector at a time as the writes reach it, not the whole slot now */
+    err = esp_ota_begin(ota->partition, OTA_WITH_SEQUENTIAL_WRITES, &ota->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        ota_release(ota);
+        return err;
+    }
+    mbedtls_sha256_starts(&ota->sha, 0);
+
+    if (xTaskCreate(ota_writer_task, "ota_writer", 4096, ota, CONFIG_OTA_WRITER_PRIORITY, NULL) != pdPASS) {
+        esp_ota_abort(ota->handle);
+        ota_release(ota);
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* The caller starts on buffer 0, buffer 1 is free */
+    ota->cur = 0;
+    xQueueSend(ota->free_q, &spare, 0);
+
+    ota->expected_size = image_size;
+    ota->start_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Writing to %s at 0x%lx%s", ota->partition->label, (unsigned long)ota->partition->address,
+             image_size ? "" : ", size unknown");
+    return ESP_OK;
+}
+
+
+/* Hand the current buffer to the writer and take the other one */
+static esp_err_t ota_submit(ota_update_t *ota)
+{
+    ota_chunk_t chunk = { .index = ota->cur, .len = ota->fill };
+    int64_t t0;
+
+    xQueueSend(ota->full_q, &chunk, portMAX_DELAY);
+
+    t0 = esp_timer_get_time();
+    xQueueReceive(ota->free_q, &ota->cur, portMAX_DELAY);
+    ota->wait_us += esp_timer_get_time() - t0;
+
+    ota->fill = 0;
+    return ota->writer_err;
+}
+
+
+esp_err_t ota_update_write(ota_update_t *ota, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    if (ota->expected_size && ota->received + len > ota->expected_size) {
+        ESP_LOGE(TAG, "More data than the announced %u bytes", (unsigned)ota->expected_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (ota->received + len > ota->partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ota->received += len;
+
+    while (len > 0) {
+        size_t n = CONFIG_OTA_BUFFER_SIZE - ota->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ota->buf[ota->cur] + ota->fill, p, n);
+        ota->fill += n;
+        p += n;
+        len -= n;
+
+        if (ota->fill == CONFIG_OTA_BUFFER_SIZE) {
+            esp_err_t err = ota_submit(ota);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+
+    return ota->writer_err;
+}
+
+
+esp_err_t ota_update_finish(ota_update_t *ota, const uint8_t *expected_sha256, ota_update_stats_t *stats)
+{
+    uint8_t sha256[OTA_SHA256_LEN];
+    esp_err_t err = ESP_OK;
+
+    if (ota->fill > 0) {
+        err = ota_submit(ota);
+    }
+    ota_stop_writer(ota);
+    if (err == ESP_OK) {
+        err = ota->writer_err;
+    }
+    if (err == ESP_OK && ota->expected_size && ota->received != ota->expected_size) {
+        ESP_LOGE(TAG, "Image truncated: %u of %u bytes", (unsigned)ota->received, (unsigned)ota->expected_size);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        esp_ota_abort(ota->handle);
+        ota_release(ota);
+        return err;
+    }
+
+    mbedtls_sha256_finish(&ota->sha, sha256);
+    if (expected_sha256 && memcmp(sha256, expected_sha256, OTA_SHA256_LEN) != 0) {
+        ESP_LOGE(TAG, "Image SHA-256 mismatch");
+        esp_ota_abort(ota->handle);
+        ota_release(ota);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    err = esp_ota_end(ota->handle);
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(ota->partition);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Image not accepted (%s)", esp_err_to_name(err));
+        ota_release(ota);
+        return err;
+    }
+
+    uint32_t elapsed_ms = (esp_timer_get_time() - ota->start_us) / 1000;
+    uint32_t kbps = elapsed_ms ? (uint32_t)((uint64_t)ota->received * 1000 / 1024 / elapsed_ms) : 0;
+
+    ESP_LOGI(TAG, "Image of %u bytes written in %lu ms (%lu KB/s, %lu ms waiting on flash)",
+             (unsigned)ota->received, (unsigned long)elapsed_ms, (unsigned long)kbps,
+             (unsigned long)(ota->wait_us / 1000));
+
+    if (stats) {
+        stats->bytes = ota->received;
+        stats->in_bytes = ota->received;
+        stats->elapsed_ms = elapsed_ms;
+        stats->kbytes_per_s = kbps;
+        stats->flash_wait_ms = ota->wait_us / 1000;
+        memcpy(stats->sha256, sha256, OTA_SHA256_LEN);
+    }
+
+    ota_release(ota);
+    return ESP_OK;
+}
+
+
+void ota_update_abort(ota_update_t *ota)
+{
+    if (ota->full_q == NULL) {
+        return;
+    }
+    ota_stop_writer(ota);
+    esp_ota_abort(ota->handle);
+    ota_release(ota);
+}
@@ -0,0 +1,203 @@
+#include "h/portal_tls.h"
+
+#include <stdio.h>
+#include "esp_log.h"
+
+#if CONFIG_PORTAL_HTTPS
+
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_tls.h"
+#include "esp_rom_crc.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
+
+const static char *TAG = "__TLS__";
+
+extern const unsigned char servercert_start[] asm("_binary_servercert_pem_start");
+extern const unsigned char servercert_end[] asm("_binary_servercert_pem_end");
+extern const unsigned char prvtkey_pem_start[] asm("_binary_prvtkey_pem_start");
+extern const unsigned char prvtkey_pem_end[] asm("_binary_prvtkey_pem_end");
+
+/* Sessions remembered to recognize a resumed handshake, see session_resumed() */
+#define PORTAL_TLS_KNOWN_SESSIONS 8
+
+typedef struct
+{
+    uint32_t us;
+    uint32_t heap;
+    uint32_t peak;
+    bool resumed;
+} handshake_cost_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+} handshake_stats_t;
+
+/*
+ *  esp_https_server runs the handshakes one at a time in the httpd task,
+ *  so the one in progress needs no more than these statics.
+ */
+static int64_t hs_start_us = 0;
+static uint32_t hs_heap_before = 0;
+
+/* Per connection, indexed by socket, and totals. Only touched from the httpd task. */
+static handshake_cost_t conn_cost[CONFIG_LWIP_MAX_SOCKETS];
+static handshake_stats_t full_stats = { .min_us = UINT32_MAX };
+static handshake_stats_t resumed_stats = { .min_us = UINT32_MAX };
+static uint32_t known_sessions[PORTAL_TLS_KNOWN_SESSIONS];   /* CRC32 of the master secrets */
+static int known_next = 0;
+
+
+/*
+ * @brief Called by mbedTLS once the ClientHello is parsed, start of the timed part
+ * @return 0: keep the configured certificate
+ */
+static int handshake_start_cb(mbedtls_ssl_context *ssl)
+{
+    hs_start_us = esp_timer_get_time();
+    hs_heap_before = esp_get_free_heap_size();
+
+    heap_caps_monitor_local_minimum_free_size_stop();
+    heap_caps_monitor_local_minimum_free_size_start();
+    return 0;
+}
+
+
+/*
+ * @brief Tell if the handshake just done resumed an earlier session
+ *
+ *  mbedTLS keeps its resume flag in the private handshake state, gone once
+ *  the handshake is over. A session ticket brings back the master secret of
+ *  the session it was issued for, so a session whose master matches one of
+ *  the last full handshakes was resumed. TLS 1.2 only, 1.3 is off in the
+ *  mbedTLS config.
+ */
+static bool session_resumed(mbedtls_ssl_context *ssl)
+{
+    const mbedtls_ssl_session *sess = ssl ? ssl->MBEDTLS_PRIVATE(session) : NULL;
+    uint32_t crc;
+
+    if (sess == NULL) {
+        return false;
+    }
+
+    crc = esp_rom_crc32_le(0, sess->MBEDTLS_PRIVATE(master), sizeof(sess->MBEDTLS_PRIVATE(master)));
+    for (int i = 0; i < PORTAL_TLS_KNOWN_SESSIONS; i++) {
+        if (known_sessions[i] == crc) {
+            return true;
+        }
+    }
+
+    known_sessions[known_next] = crc;
+    known_next = (known_next + 1) % PORTAL_TLS_KNOWN_SESSIONS;
+    return false;
+}
+
+
+static void stats_add(handshake_stats_t *stats, uint32_t us)
+{
+    stats->count++;
+    stats->total_us += us;
+    if (us < stats->min_us) stats->min_us = us;
+    if (us > stats->max_us) stats->max_us = us;
+}
+
+
+static void session_cb(esp_https_server_user_cb_arg_t *arg)
+{
+    mbedtls_ssl_context *ssl;
+    bool resumed;
+    int fd = -1;
+
+    if (arg->user_cb_state != HTTPD_SSL_USER_CB_SESS_CREATE || hs_start_us == 0) {
+        return;
+    }
+
+    uint32_t us = esp_timer_get_time() - hs_start_us;
+    uint32_t heap_after = esp_get_free_heap_size();
+    uint32_t heap_min = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+    hs_start_us = 0;
+
+    ssl = esp_tls_get_ssl_context((esp_tls_t *)arg->tls);
+    resumed = session_resumed(ssl);
+    stats_add(resumed ? &resumed_stats : &full_stats, us);
+
+    esp_tls_get_conn_sockfd((esp_tls_t *)arg->tls, &fd);
+    if (fd >= LWIP_SOCKET_OFFSET && fd < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS) {
+        handshake_cost_t *cost = &conn_cost[fd - LWIP_SOCKET_OFFSET];
+        cost->us = us;
+        cost->heap = hs_heap_before > heap_after ? hs_heap_before - heap_after : 0;
+        cost->peak = hs_heap_before > heap_min ? hs_heap_before - heap_min : 0;
+        cost->resumed = resumed;
+    }
+
+    ESP_LOGD(TAG, "Handshake on %d: %lu us, %s", fd, (unsigned long)us, resumed ? "resumed" : "full");
+#if CONFIG_EXAMPLE_ENABLE_HTTPS_USER_CALLBACK
+    ESP_LOGI(TAG, "Session on %d: %s, %s", fd, mbedtls_ssl_get_version(ssl), mbedtls_ssl_get_ciphersuite(ssl));
+#endif
+}
+
+
+void portal_tls_configure(httpd_ssl_config_t *conf)
+{
+    conf->servercert = servercert_start;
+    conf->servercert_len = servercert_end - servercert_start;
+    conf->prvtkey_pem = prvtkey_pem_start;
+    conf->prvtkey_len = prvtkey_pem_end - prvtkey_pem_start;
+
+    /* A resumed session skips the certificate and the key exchange, the expensive part */
+    conf->session_tickets = true;
+
+    conf->cert_select_cb = handshake_start_cb;
+    conf->user_cb = session_cb;
+}
+
+
+static int stats_json(char *buf, size_t len, const char *name, const handshake_stats_t *stats)
+{
+    return snprintf(buf, len, "\"%s\":{\"count\":%lu,\"avg_us\":%lu,\"min_us\":%lu,\"max_us\":%lu}", name,
+                    (unsigned long)stats->count, (unsigned long)(stats->count ? stats->total_us / stats->count : 0),
+                    (unsigned long)(stats->count ? stats->min_us : 0), (unsigned long)stats->max_us);
+}
+
+
+esp_err_t portal_tls_handler(httpd_req_t *req)
+{
+    char json[320];
+    handshake_cost_t cost = { 0 };
+    int fd = httpd_req_to_sockfd(req);
+    int len;
+
+    if (fd >= LWIP_SOCKET_OFFSET && fd < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS) {
+        cost = conn_cost[fd - LWIP_SOCKET_OFFSET];
+    }
+
+    len = snprintf(json, sizeof(json), "{\"this\":{\"us\":%lu,\"heap\":%lu,\"peak\":%lu,\"resumed\":%s},",
+                   (unsigned long)cost.us, (unsigned long)cost.heap, (unsigned long)cost.peak,
+                   cost.resumed ? "true" : "false");
+    len += stats_json(json + len, sizeof(json) - len, "full", &full_stats);
+    json[len++] = ',';
+    len += stats_json(json + len, sizeof(json) - len, "resumed", &resumed_stats);
+    json[len++] = '}';
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, json, len);
+}
+
+#else /* !CONFIG_PORTAL_HTTPS */
+
+esp_err_t portal_tls_handler(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_sendstr(req, "Portal not on HTTPS");
+}
+
+#endif /* CONFIG_PORTAL_HTTPS */
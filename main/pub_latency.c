@@ -0,0 +1,206 @@
+#include "h/pub_latency.h"
+#include "h/spsc_ring.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+const static char *TAG = "__LATENCY__";
+
+/* Log a summary every this many PUBACKs */
+#define PUB_LATENCY_LOG_EVERY 64
+
+/* Completed traces waiting for the comms task */
+#define PUB_TRACE_RING_LEN 16
+
+typedef struct
+{
+    int msg_id;             /* 0 = free slot */
+    int64_t sent_us;        /* 0 until the comms task recorded it */
+    int64_t acked_us;       /* 0 until the PUBACK arrived */
+    int64_t read_us;
+    int64_t dequeue_us;
+    uint32_t samples;
+} inflight_t;
+
+static inflight_t inflight[CONFIG_COMMS_LATENCY_TRACK_SLOTS];
+static pub_latency_stats_t stats;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static spsc_ring_t *trace_ring = NULL;
+
+
+void pub_latency_init(void)
+{
+#if CONFIG_LATENCY_TRACE
+    if (trace_ring == NULL) {
+        trace_ring = spsc_ring_create(PUB_TRACE_RING_LEN, sizeof(pub_trace_t), SPSC_RING_DROP_NEWEST);
+        if (trace_ring == NULL) {
+            ESP_LOGE(TAG, "No memory for the trace ring, tracing disabled");
+        }
+    }
+#endif
+}
+
+
+/*
+ * @brief Account a matched message. Called with the lock held.
+ *
+ *  The trace is pushed from the MQTT task, or from the comms task when the
+ *  PUBACK came first. The lock keeps those pushes from overlapping, so the
+ *  ring still only ever has one producer at a time.
+ */
+static void record(const inflight_t *slot)
+{
+    int64_t latency_us = slot->acked_us - slot->sent_us;
+    uint32_t ms = (latency_us > 0) ? (uint32_t)(latency_us / 1000) : 0;
+    int bucket = 0;
+
+    if (trace_ring) {
+        pub_trace_t trace = {
+            .msg_id = slot->msg_id,
+            .samples = slot->samples,
+            .read_us = slot->read_us,
+            .dequeue_us = slot->dequeue_us,
+            .publish_us = slot->sent_us,
+            .puback_us = slot->acked_us,
+        };
+        spsc_ring_push(trace_ring, &trace);
+    }
+
+    while (bucket < PUB_LATENCY_BUCKETS - 1 && ms > pub_latency_bounds_ms[bucket]) {
+        bucket++;
+    }
+
+    stats.count[bucket]++;
+    stats.acked++;
+    stats.sum_ms += ms;
+    if (ms > stats.max_ms) {
+        stats.max_ms = ms;
+    }
+}
+
+
+/*
+ * @brief Find the slot of msg_id, or take a free one, or else the oldest one
+ *
+ *  Called with the lock held.
+ */
+static inflight_t *lookup(int msg_id, bool *found)
+{
+    inflight_t *free_slot = NULL;
+    inflight_t *oldest = &inflight[0];
+
+    for (int i = 0; i < CONFIG_COMMS_LATENCY_TRACK_SLOTS; i++) {
+        inflight_t *slot = &inflight[i];
+
+        if (slot->msg_id == msg_id) {
+            *found = true;
+            return slot;
+        }
+        if (slot->msg_id == 0) {
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+        } else if (MAX(slot->sent_us, slot->acked_us) < MAX(oldest->sent_us, oldest->acked_us)) {
+            oldest = slot;
+        }
+    }
+
+    *found = false;
+    if (free_slot) {
+        return free_slot;
+    }
+
+    /* A PUBACK that never came, e.g. the session was lost */
+    stats.untracked++;
+    return oldest;
+}
+
+
+void pub_latency_sent(int msg_id, int64_t sent_us, const sensq *oldest, uint32_t samples)
+{
+    bool found;
+
+    if (msg_id <= 0) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    inflight_t *slot = lookup(msg_id, &found);
+    if (!(found && slot->acked_us)) {
+        slot->acked_us = 0;
+    }
+    slot->msg_id = msg_id;
+    slot->sent_us = sent_us;
+    /* The read time of a sample from an earlier boot is not on this clock */
+    slot->read_us = oldest->prev_boot ? 0 : oldest->timestamp_us;
+    slot->dequeue_us = oldest->dequeue_us;
+    slot->samples = samples;
+
+    if (slot->acked_us) {
+        record(slot);
+        slot->msg_id = 0;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+
+void pub_latency_acked(int msg_id)
+{
+    int64_t now = esp_timer_get_time();
+    bool found, log = false;
+    pub_latency_stats_t snapshot;
+
+    if (msg_id <= 0) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    inflight_t *slot = lookup(msg_id, &found);
+    if (found && slot->sent_us) {
+        slot->acked_us = now;
+        record(slot);
+        slot->msg_id = 0;
+        if (stats.acked % PUB_LATENCY_LOG_EVERY == 0) {
+            snapshot = stats;
+            log = true;
+        }
+    } else {
+        /* PUBACK handled before the comms task got the msg_id back */
+        slot->msg_id = msg_id;
+        slot->sent_us = 0;
+        slot->acked_us = now;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (log) {
+        ESP_LOGI(TAG, "PUBACK latency: %lu acked, avg %lu ms, max %lu ms, %lu untracked",
+                 (unsigned long)snapshot.acked, (unsigned long)(snapshot.sum_ms / snapshot.acked),
+                 (unsigned long)snapshot.max_ms, (unsigned long)snapshot.untracked);
+    }
+}
+
+
+void pub_latency_reset_inflight(void)
+{
+    portENTER_CRITICAL(&lock);
+    memset(inflight, 0, sizeof(inflight));
+    portEXIT_CRITICAL(&lock);
+}
+
+
+void pub_latency_get(pub_latency_stats_t *out)
+{
+    portENTER_CRITICAL(&lock);
+    *out = stats;
+    portEXIT_CRITICAL(&lock);
+}
+
+
+bool pub_latency_pop_trace(pub_trace_t *trace)
+{
+    return trace_ring != NULL && spsc_ring_pop(trace_ring, trace);
+}
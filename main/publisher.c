@@ -0,0 +1,312 @@
+#include "h/publisher.h"
+#include "h/http_server.h"
+#include "h/sensor_codec.h"
+#include "h/pub_latency.h"
+#include "h/metrics.h"
+#include "h/time_sync.h"
+#include "h/boot_profile.h"
+#include "h/store_forward.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+const static char *TAG = "__PUB__";
+
+#define TOPIC_LEN 40
+
+
+#if CONFIG_SENSOR_PUBLISH_MODE_BATCH
+
+/* Worst case JSON size of one sample in the batch payload */
+#define PUB_SAMPLE_JSON_LEN 128
+#define PUB_BATCH_BUF_LEN   (64 + CONFIG_SENSOR_BATCH_MAX_SAMPLES * PUB_SAMPLE_JSON_LEN)
+
+static sensq batch[CONFIG_SENSOR_BATCH_MAX_SAMPLES];
+static int batch_cnt = 0;
+static int64_t batch_start_us = 0;
+static char payload[PUB_BATCH_BUF_LEN];
+
+
+#if !CONFIG_SENSOR_BATCH_BINARY
+/*
+ * @brief Serialize samples into the payload buffer
+ *
+ *  {"id":"ESP-1","samples":[{"seq":7,"t":35012,"ts":1760000000123,"TEMP":21.50,"HUM":40.12,"PRES":101325.00},...]}
+ *  "t" is the read time in ms since boot, "ts" the same as Unix time in ms,
+ *  only present once SNTP synced the clock. Stored samples read before the
+ *  last reset have no "ts", their "t" is of the boot that read them.
+ *
+ * @return Payload length, or -1 if it did not fit
+ */
+static int format_batch(const char *id, const sensq *samples, int count)
+{
+    int len = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"samples\":[", id);
+
+    for (int i = 0; i < count && len < sizeof(payload); i++) {
+        len += snprintf(payload + len, sizeof(payload) - len, "%s{\"seq\":%lu,\"t\":%lld",
+                        i ? "," : "", (unsigned long)samples[i].seq, (long long)(samples[i].timestamp_us / 1000));
+        if (time_sync_is_synced() && !samples[i].prev_boot && len < sizeof(payload)) {
+            len += snprintf(payload + len, sizeof(payload) - len, ",\"ts\":%lld",
+                            (long long)time_sync_epoch_ms(samples[i].timestamp_us));
+        }
+        SENSQ_FOREACH_CHANNEL(type) {
+            if (len >= sizeof(payload)) {
+                break;
+            }
+            len += snprintf(payload + len, sizeof(payload) - len, ",\"%s\":%.2f",
+                            sensq_string[type], samples[i].value[type]);
+        }
+        if (len < sizeof(payload)) {
+            len += snprintf(payload + len, sizeof(payload) - len, "}");
+        }
+    }
+    if (len < sizeof(payload)) {
+        len += snprintf(payload + len, sizeof(payload) - len, "]}");
+    }
+
+    return (len < sizeof(payload)) ? len : -1;
+}
+#endif /* !CONFIG_SENSOR_BATCH_BINARY */
+
+
+bool publisher_send_samples(esp_mqtt_client_handle_t client, const sensq *samples, int count, bool backfill)
+{
+    char topic[TOPIC_LEN];
+    char id[ID_LEN + 1];
+    int len, msg_id;
+    int64_t sent_us;
+
+    if (count > CONFIG_SENSOR_BATCH_MAX_SAMPLES) {
+        count = CONFIG_SENSOR_BATCH_MAX_SAMPLES;
+    }
+    http_config_get(id, NULL);
+
+#if CONFIG_SENSOR_BATCH_BINARY
+    len = sensor_codec_encode(samples, count, (uint8_t *)payload, sizeof(payload));
+#else
+    len = format_batch(id, samples, count);
+#endif
+    if (len < 0) {
+        ESP_LOGE(TAG, "Batch of %d samples does not fit in %d bytes, dropping it", count, PUB_BATCH_BUF_LEN);
+        return true;
+    }
+
+    snprintf(topic, sizeof(topic), PUB_BATCH_TOPIC_FMT "%s", id, backfill ? PUB_BACKFILL_SUFFIX : "");
+    sent_us = esp_timer_get_time();
+    msg_id = esp_mqtt_client_publish(client, topic, payload, len, 1, 0);
+    if (msg_id == -2) {
+        ESP_LOGW(TAG, "MQTT outbox full, batch of %d samples kept", count);
+        metric_inc(METRIC_PUBLISH_OUTBOX_FULL);
+        return false;
+    } else if (msg_id < 0) {
+        ESP_LOGE(TAG, "Error publishing batch! Client not connected.");
+        metric_inc(METRIC_PUBLISH_NOT_CONNECTED);
+        return false;
+    }
+    pub_latency_sent(msg_id, sent_us, &samples[0], count);
+    metric_add(METRIC_SAMPLES_PUBLISHED, count);
+    boot_profile_mark(BOOT_PHASE_FIRST_PUBLISH);
+
+    ESP_LOGI(TAG, "Sent batch of %d samples (%d bytes) to %s, msg_id=%d", count, len, topic, msg_id);
+    return true;
+}
+
+
+bool publisher_flush(esp_mqtt_client_handle_t client)
+{
+    if (batch_cnt == 0) {
+        return true;
+    }
+
+    if (!publisher_send_samples(client, batch, batch_cnt, false)) {
+        return false;
+    }
+
+    batch_cnt = 0;
+    return true;
+}
+
+
+bool publisher_add_sample(esp_mqtt_client_handle_t client, const sensq *sample)
+{
+    /* A failed flush keeps the batch, once full it goes to the store and forward log */
+    if (batch_cnt == CONFIG_SENSOR_BATCH_MAX_SAMPLES) {
+        ESP_LOGW(TAG, "Batch full and not sent, storing samples #%lu..#%lu",
+                 (unsigned long)batch[0].seq, (unsigned long)batch[batch_cnt - 1].seq);
+        for (int i = 0; i < batch_cnt; i++) {
+            store_forward_append(&batch[i]);
+        }
+        batch_cnt = 0;
+    }
+
+    if (batch_cnt == 0) {
+        batch_start_us = esp_timer_get_time();
+    }
+    batch[batch_cnt++] = *sample;
+
+    if (batch_cnt == CONFIG_SENSOR_BATCH_MAX_SAMPLES) {
+        publisher_flush(client);
+    }
+    return true;
+}
+
+
+void publisher_poll(esp_mqtt_client_handle_t client)
+{
+    if (CONFIG_SENSOR_BATCH_WINDOW_MS == 0 || batch_cnt == 0) {
+        return;
+    }
+
+    if (esp_timer_get_time() - batch_start_us >= (int64_t)CONFIG_SENSOR_BATCH_WINDOW_MS * 1000) {
+        publisher_flush(client);
+    }
+}
+
+#else /* CONFIG_SENSOR_PUBLISH_MODE_PER_TYPE */
+
+/* Fixed header, topic length and packet id of a QoS1 PUBLISH, on top of topic and payload in the outbox */
+#define PUB_MQTT_OVERHEAD 9
+
+static const char topic_fmt[] = "/sensor_%s/%s%s";
+
+/*
+ * @brief Check that the outbox takes every value of the samples
+ *
+ *  A sample is published whole or not at all: were the outbox to fill up
+ *  after some of its values, the others would be lost, and those sent
+ *  would be sent twice when the sample is stored and sent again.
+ */
+static bool outbox_has_room(esp_mqtt_client_handle_t client, const char *id, const sensq *samples, int count, bool backfill)
+{
+    char mqttdata[11];
+    char topic[TOPIC_LEN];
+    int need = 0;
+
+    for (int i = 0; i < count; i++) {
+        SENSQ_FOREACH_CHANNEL(type) {
+            need += snprintf(mqttdata, sizeof(mqttdata), "%.2f", samples[i].value[type]);
+            need += snprintf(topic, sizeof(topic), topic_fmt, id, sensq_string[type], backfill ? PUB_BACKFILL_SUFFIX : "");
+            need += PUB_MQTT_OVERHEAD;
+        }
+    }
+
+    return esp_mqtt_client_get_outbox_size(client) + need <= CONFIG_COMMS_OUTBOX_LIMIT;
+}
+
+bool publisher_send_samples(esp_mqtt_client_handle_t client, const sensq *samples, int count, bool backfill)
+{
+    char mqttdata[11];
+    char topic[TOPIC_LEN];
+    char id[ID_LEN + 1];
+    int msg_id;
+    int64_t sent_us;
+
+    http_config_get(id, NULL);
+
+    if (!outbox_has_room(client, id, samples, count, backfill)) {
+        ESP_LOGW(TAG, "MQTT outbox full, %d samples kept", count);
+        metric_inc(METRIC_PUBLISH_OUTBOX_FULL);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        SENSQ_FOREACH_CHANNEL(type) {
+            /* Prepare topic and data to send */
+            snprintf(mqttdata, sizeof(mqttdata), "%.2f", samples[i].value[type]);
+            snprintf(topic, sizeof(topic), topic_fmt, id, sensq_string[type], backfill ? PUB_BACKFILL_SUFFIX : "");
+
+            ESP_LOGD(TAG, "Sending %s = %s", topic, mqttdata);
+            sent_us = esp_timer_get_time();
+            msg_id = esp_mqtt_client_publish(client, topic, mqttdata, 0, 1, 0);
+            if (msg_id == -2) {
+                /* Room was checked above, only a publish from another task can get here */
+                ESP_LOGW(TAG, "MQTT outbox full, %s not sent", topic);
+                metric_inc(METRIC_PUBLISH_OUTBOX_FULL);
+                return false;
+            } else if (msg_id < 0) {
+                /* QoS1 is queued while disconnected, this is out of memory: resent whole, rather twice than lost */
+                ESP_LOGE(TAG, "Error publishing! Client not connected.");
+                metric_inc(METRIC_PUBLISH_NOT_CONNECTED);
+                return false;
+            }
+            pub_latency_sent(msg_id, sent_us, &samples[i], 1);
+            ESP_LOGD(TAG, "Sent publish, msg_id=%d", msg_id);
+        }
+        metric_inc(METRIC_SAMPLES_PUBLISHED);
+        boot_profile_mark(BOOT_PHASE_FIRST_PUBLISH);
+    }
+
+    return true;
+}
+
+bool publisher_add_sample(esp_mqtt_client_handle_t client, const sensq *sample)
+{
+    return publisher_send_samples(client, sample, 1, false);
+}
+
+void publisher_poll(esp_mqtt_client_handle_t client)
+{
+}
+
+bool publisher_flush(esp_mqtt_client_handle_t client)
+{
+    return true;
+}
+
+#endif /* CONFIG_SENSOR_PUBLISH_MODE_BATCH */
+
+
+#if CONFIG_LATENCY_TRACE
+/*
+ *  {"msg_id":12,"n":12,"read":35012,"dequeue":35013,"publish":35020,"puback":35110,"read_ts":1760000000123}
+ *  Stage times in ms since boot. "dequeue" is null for samples sent from the
+ *  store-and-forward log, "read" too for samples stored before the last
+ *  reset. "read_ts" is only present once SNTP synced the clock.
+ */
+void publisher_send_traces(esp_mqtt_client_handle_t client)
+{
+    char topic[TOPIC_LEN];
+    char msg[192];
+    char id[ID_LEN + 1];
+    char read[24];
+    char dequeue[24];
+    pub_trace_t trace;
+    int len;
+
+    http_config_get(id, NULL);
+    snprintf(topic, sizeof(topic), PUB_TRACE_TOPIC_FMT, id);
+
+    while (pub_latency_pop_trace(&trace)) {
+        if (trace.read_us) {
+            snprintf(read, sizeof(read), "%lld", (long long)(trace.read_us / 1000));
+        } else {
+            snprintf(read, sizeof(read), "null");
+        }
+        if (trace.dequeue_us) {
+            snprintf(dequeue, sizeof(dequeue), "%lld", (long long)(trace.dequeue_us / 1000));
+        } else {
+            snprintf(dequeue, sizeof(dequeue), "null");
+        }
+
+        len = snprintf(msg, sizeof(msg),
+                       "{\"msg_id\":%d,\"n\":%lu,\"read\":%s,\"dequeue\":%s,\"publish\":%lld,\"puback\":%lld",
+                       trace.msg_id, (unsigned long)trace.samples, read, dequeue,
+                       (long long)(trace.publish_us / 1000), (long long)(trace.puback_us / 1000));
+        if (time_sync_is_synced() && trace.read_us) {
+            len += snprintf(msg + len, sizeof(msg) - len, ",\"read_ts\":%lld",
+                            (long long)time_sync_epoch_ms(trace.read_us));
+        }
+        len += snprintf(msg + len, sizeof(msg) - len, "}");
+
+        /* QoS0, a trace must not add to the outbox it is measuring */
+        if (esp_mqtt_client_publish(client, topic, msg, len, 0, 0) < 0) {
+            ESP_LOGD(TAG, "Trace for msg_id=%d not sent", trace.msg_id);
+        }
+    }
+}
+#else
+void publisher_send_traces(esp_mqtt_client_handle_t client)
+{
+}
+#endif /* CONFIG_LATENCY_TRACE */
@@ -0,0 +1,181 @@
+#include "h/sensor_codec.h"
+
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+
+
+static inline uint32_t zigzag32(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag32(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint64_t zigzag64(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag64(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+
+/*
+ * @brief Append a LEB128 varint
+ * @return false if it did not fit
+ */
+static bool put_varint(uint8_t *buf, size_t len, size_t *pos, uint64_t v)
+{
+    do {
+        if (*pos >= len) {
+            return false;
+        }
+        buf[(*pos)++] = (uint8_t)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+
+    return true;
+}
+
+
+/*
+ * @brief Read a LEB128 varint of at most 10 bytes
+ * @return false if truncated or too long
+ */
+static bool get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) {
+            return false;
+        }
+        uint8_t b = buf[(*pos)++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static int32_t to_fixed(enum sensq_type type, float value)
+{
+    float scaled = roundf(value * sensor_codec_scale[type]);
+
+    /* NaN from a failed read, or out of range, saturate */
+    if (!(scaled > INT32_MIN)) {
+        return INT32_MIN;
+    }
+    if (scaled >= INT32_MAX) {
+        return INT32_MAX;
+    }
+    return (int32_t)scaled;
+}
+
+
+int sensor_codec_encode(const sensq *samples, int count, uint8_t *buf, size_t len)
+{
+    size_t pos = 0;
+    int32_t prev_value[ENDTYPE] = { 0 };
+    uint32_t prev_seq = 0;
+    int64_t prev_ms = 0;
+
+    if (count < 0 || len < 2) {
+        return -1;
+    }
+
+    buf[pos++] = SENSOR_CODEC_VERSION;
+    buf[pos++] = SENSOR_CODEC_CHANNELS;
+    if (!put_varint(buf, len, &pos, (uint64_t)count)) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const sensq *s = &samples[i];
+        int64_t ms = s->timestamp_us / 1000;
+        bool ok;
+
+        if (i == 0) {
+            ok = put_varint(buf, len, &pos, s->seq) &&
+                 put_varint(buf, len, &pos, zigzag64(ms));
+        } else {
+            ok = put_varint(buf, len, &pos, zigzag32((int32_t)(s->seq - prev_seq))) &&
+                 put_varint(buf, len, &pos, zigzag64(ms - prev_ms));
+        }
+        if (!ok) {
+            return -1;
+        }
+        prev_seq = s->seq;
+        prev_ms = ms;
+
+        SENSQ_FOREACH_CHANNEL(type) {
+            int32_t fixed = to_fixed(type, s->value[type]);
+
+            /* Wrapping difference, undone by the same wrap on decode */
+            if (!put_varint(buf, len, &pos, zigzag32((int32_t)((uint32_t)fixed - (uint32_t)prev_value[type])))) {
+                return -1;
+            }
+            prev_value[type] = fixed;
+        }
+    }
+
+    return (int)pos;
+}
+
+
+int sensor_codec_decode(const uint8_t *buf, size_t len, sensq *samples, int max)
+{
+    size_t pos = 0;
+    uint64_t v, count;
+    int32_t value[ENDTYPE] = { 0 };
+    uint32_t seq = 0;
+    int64_t ms = 0;
+
+    if (len < 2 || buf[0] != SENSOR_CODEC_VERSION || buf[1] != SENSOR_CODEC_CHANNELS) {
+        return -1;
+    }
+    pos = 2;
+
+    if (!get_varint(buf, len, &pos, &count) || count > (uint64_t)max) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        sensq *s = &samples[i];
+
+        if (!get_varint(buf, len, &pos, &v)) {
+            return -1;
+        }
+        seq = (i == 0) ? (uint32_t)v : seq + (uint32_t)unzigzag32((uint32_t)v);
+
+        if (!get_varint(buf, len, &pos, &v)) {
+            return -1;
+        }
+        ms = (i == 0) ? unzigzag64(v) : ms + unzigzag64(v);
+
+        s->seq = seq;
+        s->timestamp_us = ms * 1000;
+        s->dequeue_us = 0;
+        s->prev_boot = false;
+        s->value[INVALID] = 0;
+
+        SENSQ_FOREACH_CHANNEL(type) {
+            if (!get_varint(buf, len, &pos, &v)) {
+                return -1;
+            }
+            value[type] = (int32_t)((uint32_t)value[type] + (uint32_t)unzigzag32((uint32_t)v));
+            s->value[type] = (float)value[type] / sensor_codec_scale[type];
+        }
+    }
+
+    /* Trailing bytes mean a corrupt or mismatched payload */
+    return (pos == len) ? (int)count : -1;
+}
@@ -0,0 +1,138 @@
+#include "h/settings.h"
+
+#include "esp_log.h"
+#include "nvs.h"
+
+const static char *TAG = "__SETTINGS__";
+
+
+esp_err_t settings_get_u8(const char *key, uint8_t *value)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_get_u8(handle, key, value);
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_set_u8(const char *key, uint8_t value)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_u8(handle, key, value);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Saving '%s' failed (%s)", key, esp_err_to_name(err));
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_get_str(const char *key, char *value, size_t len)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_get_str(handle, key, value, &len);
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_set_str(const char *key, const char *value)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_str(handle, key, value);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Saving '%s' failed (%s)", key, esp_err_to_name(err));
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_get_blob(const char *key, void *value, size_t len)
+{
+    nvs_handle_t handle;
+    size_t stored = len;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_get_blob(handle, key, value, &stored);
+    if (err == ESP_OK && stored != len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_set_blob(const char *key, const void *value, size_t len)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(handle, key, value, len);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Saving '%s' failed (%s)", key, esp_err_to_name(err));
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+
+esp_err_t settings_erase(const char *key)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_erase_key(handle, key);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+
+    nvs_close(handle);
+    return err;
+}
@@ -0,0 +1,152 @@
+#include "bmp280.h"
+
+#include <math.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+const static char *TAG = "__SIM_BME280__";
+
+/* Slow swings around indoor values, so the deadband and the batches see real changes */
+#define SIM_TEMP_C              22.0f
+#define SIM_TEMP_SWING_C        3.0f
+#define SIM_HUM_PCT             45.0f
+#define SIM_HUM_SWING_PCT       8.0f
+#define SIM_PRES_PA             101325.0f
+#define SIM_PRES_SWING_PA       150.0f
+#define SIM_CYCLE_S             600.0       /* Temperature, humidity against it */
+#define SIM_PRES_CYCLE_S        3600.0
+
+/* Noise of one conversion without oversampling, it drops with its square root */
+#define SIM_TEMP_NOISE_C        0.01f
+#define SIM_HUM_NOISE_PCT       0.05f
+#define SIM_PRES_NOISE_PA       1.5f
+
+static const uint8_t osrs[] = { 0, 1, 2, 4, 8, 16 };
+
+
+/* xorshift32, the sequence only depends on the seed */
+static float sim_uniform(bmp280_t *dev)
+{
+    uint32_t x = dev->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    dev->rng = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static float sim_noise(bmp280_t *dev, float sigma, BMP280_Oversampling os)
+{
+    /* Box-Muller */
+    float u1 = sim_uniform(dev) + 1e-7f;
+    float u2 = sim_uniform(dev);
+
+    return sigma * sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2) / sqrtf(osrs[os]);
+}
+
+
+/*
+ * @brief One conversion, as the chip does it: oversampled channels, skipped
+ *        ones keep their last value, the IIR filter on temperature and pressure
+ */
+static void sim_convert(bmp280_t *dev)
+{
+    const bmp280_params_t *p = &dev->params;
+    const double t = esp_timer_get_time() / 1e6;
+    const float k = 1 << p->filter;
+    const bool first = dev->pressure == 0;
+    float v;
+
+    if (osrs[p->oversampling_temperature]) {
+        v = SIM_TEMP_C + SIM_TEMP_SWING_C * (float)sin(2 * M_PI * t / SIM_CYCLE_S) +
+            sim_noise(dev, SIM_TEMP_NOISE_C, p->oversampling_temperature);
+        dev->temperature = first ? v : dev->temperature + (v - dev->temperature) / k;
+    }
+    if (osrs[p->oversampling_pressure]) {
+        v = SIM_PRES_PA + SIM_PRES_SWING_PA * (float)sin(2 * M_PI * t / SIM_PRES_CYCLE_S) +
+            sim_noise(dev, SIM_PRES_NOISE_PA, p->oversampling_pressure);
+        dev->pressure = first ? v : dev->pressure + (v - dev->pressure) / k;
+    }
+    if (osrs[p->oversampling_humidity]) {
+        dev->humidity = SIM_HUM_PCT - SIM_HUM_SWING_PCT * (float)sin(2 * M_PI * t / SIM_CYCLE_S) +
+                        sim_noise(dev, SIM_HUM_NOISE_PCT, p->oversampling_humidity);
+    }
+}
+
+
+esp_err_t i2cdev_init(void)
+{
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_init_desc(bmp280_t *dev, uint8_t addr, int port, int sda_gpio, int scl_gpio)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->id = BME280_CHIP_ID;
+    dev->rng = CONFIG_SIM_SENSOR_SEED;
+
+    ESP_LOGI(TAG, "Simulated BME280 at 0x%02x, seed %d, %d/1000 reads failing", addr,
+             CONFIG_SIM_SENSOR_SEED, CONFIG_SIM_SENSOR_ERROR_PERMILLE);
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_init_default_params(bmp280_params_t *params)
+{
+    params->mode = BMP280_MODE_NORMAL;
+    params->filter = BMP280_FILTER_OFF;
+    params->oversampling_pressure = BMP280_STANDARD;
+    params->oversampling_temperature = BMP280_STANDARD;
+    params->oversampling_humidity = BMP280_STANDARD;
+    params->standby = BMP280_STANDBY_250;
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_init(bmp280_t *dev, bmp280_params_t *params)
+{
+    dev->params = *params;
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_force_measurement(bmp280_t *dev)
+{
+    if (dev->params.mode != BMP280_MODE_FORCED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    sim_convert(dev);
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_is_measuring(bmp280_t *dev, bool *busy)
+{
+    *busy = false;
+    return ESP_OK;
+}
+
+
+esp_err_t bmp280_read_float(bmp280_t *dev, float *temperature, float *pressure, float *humidity)
+{
+    /* A lost transfer on the bus */
+    if (sim_uniform(dev) * 1000.0f < CONFIG_SIM_SENSOR_ERROR_PERMILLE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    /* In normal mode the chip converts all the time, a read gets a fresh one */
+    if (dev->params.mode == BMP280_MODE_NORMAL) {
+        sim_convert(dev);
+    }
+
+    *temperature = dev->temperature;
+    *pressure = dev->pressure;
+    if (humidity) {
+        *humidity = dev->humidity;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,102 @@
+#include "h/link_manager.h"
+#include "h/wifi.h"
+#include "h/settings.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+/*
+ * Simulation build (linux target): the host network in place of the
+ * Ethernet and WiFi links. The process uses the sockets of the host, which
+ * is connected already, so there is one link and it is always up. The STA
+ * part of wifi.h keeps the backup network settings, the portal form and
+ * /data behave as on the board.
+ */
+
+const static char *TAG = "__SIM_NETIF__";
+
+static char sta_ssid[BACKUP_WIFI_SSID_LEN + 1] = BACKUP_WIFI_SSID;
+
+
+/* ________________ Link manager ________________ */
+
+void link_manager_init(link_change_cb_t cb)
+{
+    ESP_LOGI(TAG, "Host network, always up");
+    cb(LINK_ETH);
+}
+
+
+link_id_t link_manager_active(void)
+{
+    return LINK_ETH;
+}
+
+
+bool link_manager_suspect(void)
+{
+    return false;
+}
+
+
+void link_manager_mqtt_connected(void)
+{
+    /* No failover to measure */
+}
+
+
+/* Same fields as on the board, the tools reading it work unchanged */
+esp_err_t link_manager_handler(httpd_req_t *req)
+{
+    static const char json[] =
+        "{\"active\":\"host\",\"standby\":\"none\",\"switches\":0,"
+        "\"links\":[{\"name\":\"host\",\"carrier\":true,\"ip\":true,\"probe_ok\":true,\"fails\":0,\"probes_failed\":0}],"
+        "\"failover\":{\"count\":0,\"last_detect_ms\":0,\"last_ms\":0,\"avg_ms\":0,\"max_ms\":0},"
+        "\"wifi\":{\"connects\":0,\"retries\":0,\"cached_ap_misses\":0,\"last_ms\":0,\"max_ms\":0}}";
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, json, sizeof(json) - 1);
+}
+
+
+/* ________________ WiFi ________________ */
+
+void wifi_init_ap_sta_mode(void) {
+    settings_get_str(SETTINGS_KEY_STA_SSID, sta_ssid, sizeof(sta_ssid));
+    ESP_LOGI(TAG, "No hotspot in the simulation build, portal on port %d", CONFIG_SIM_HTTP_PORT);
+}
+
+void wifi_connect_backup(void) {
+}
+
+void wifi_disconnect_backup(void) {
+}
+
+bool wifi_is_backup_connected(void) {
+    return false;
+}
+
+esp_err_t wifi_set_backup_network(const char *ssid, const char *pass) {
+    esp_err_t err = settings_set_str(SETTINGS_KEY_STA_SSID, ssid);
+
+    if (err == ESP_OK && pass) {
+        err = settings_set_str(SETTINGS_KEY_STA_PASS, pass);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    snprintf(sta_ssid, sizeof(sta_ssid), "%s", ssid);
+    ESP_LOGI(TAG, "Backup WiFi network set to %s", sta_ssid);
+    return ESP_OK;
+}
+
+void wifi_backup_ssid(char *ssid) {
+    memcpy(ssid, sta_ssid, sizeof(sta_ssid));
+}
+
+void wifi_backup_stats(wifi_backup_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+}
@@ -0,0 +1,33 @@
+#include "esp_task_wdt.h"
+
+/*
+ * Simulation build (linux target): esp_system gives the linux target the
+ * esp_task_wdt.h declarations but no task watchdog behind them. The
+ * configuration calls succeed and adding a task fails, so the tasks take
+ * their "not watched" path, as they do on the board when the TWDT is off.
+ */
+
+esp_err_t esp_task_wdt_init(const esp_task_wdt_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_deinit(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_add(TaskHandle_t task_handle)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_task_wdt_delete(TaskHandle_t task_handle)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_task_wdt_reset(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
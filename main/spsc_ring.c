@@ -0,0 +1,179 @@
+#include "h/spsc_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  head and tail are free running counters, the slot is (index & mask).
+ *  Only the producer moves head. tail is moved by the consumer, and by the
+ *  producer when it overwrites the oldest item. Both move tail with a CAS,
+ *  so the consumer can tell that the slot it just copied was taken over
+ *  by the producer and retry with the next one.
+ *
+ *  In overwrite mode the producer may write the slot the consumer is
+ *  copying, a seqlock style read: the copy is only kept if tail did not
+ *  move meanwhile. The slots are copied through relaxed atomic words so
+ *  that this read is not a data race, the CAS on tail orders them.
+ */
+
+static void slot_store(spsc_ring_t *ring, uint32_t index, const void *item)
+{
+    _Atomic uint32_t *slot = ring->slots + (size_t)(index & ring->mask) * ring->slot_words;
+    const uint8_t *src = item;
+    uint32_t left = ring->item_size;
+    uint32_t word;
+
+    for (uint32_t i = 0; i < ring->slot_words; i++, src += sizeof(word), left -= sizeof(word)) {
+        word = 0;
+        memcpy(&word, src, left < sizeof(word) ? left : sizeof(word));
+        atomic_store_explicit(&slot[i], word, memory_order_relaxed);
+    }
+}
+
+static void slot_load(spsc_ring_t *ring, uint32_t index, void *item)
+{
+    _Atomic uint32_t *slot = ring->slots + (size_t)(index & ring->mask) * ring->slot_words;
+    uint8_t *dst = item;
+    uint32_t left = ring->item_size;
+    uint32_t word;
+
+    for (uint32_t i = 0; i < ring->slot_words; i++, dst += sizeof(word), left -= sizeof(word)) {
+        word = atomic_load_explicit(&slot[i], memory_order_relaxed);
+        memcpy(dst, &word, left < sizeof(word) ? left : sizeof(word));
+    }
+}
+
+
+spsc_ring_t *spsc_ring_create(uint32_t capacity, uint32_t item_size, spsc_ring_policy_t policy)
+{
+    spsc_ring_t *ring;
+
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0 || item_size == 0) {
+        return NULL;
+    }
+
+    /* sizeof is a multiple of the cache line alignment, as aligned_alloc() wants */
+    ring = aligned_alloc(SPSC_RING_CACHE_LINE, sizeof(spsc_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(spsc_ring_t));
+
+    ring->slot_words = (item_size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    ring->slots = malloc((size_t)capacity * ring->slot_words * sizeof(uint32_t));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask = capacity - 1;
+    ring->item_size = item_size;
+    ring->policy = policy;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->overwritten, 0);
+    atomic_init(&ring->high_watermark, 0);
+
+    return ring;
+}
+
+
+void spsc_ring_delete(spsc_ring_t *ring)
+{
+    if (ring) {
+        free(ring->slots);
+        free(ring);
+    }
+}
+
+
+void spsc_ring_set_notify(spsc_ring_t *ring, spsc_ring_notify_t notify, void *arg)
+{
+    ring->notify_arg = arg;
+    ring->notify = notify;
+}
+
+
+bool spsc_ring_push(spsc_ring_t *ring, const void *item)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t capacity = ring->mask + 1;
+    uint32_t level;
+
+    /* Only look at the consumer's cache line when the cached view says full */
+    if (head - ring->tail_cache >= capacity) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (head - ring->tail_cache >= capacity) {
+            if (ring->policy == SPSC_RING_DROP_NEWEST) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return false;
+            }
+
+            /* Take the oldest slot. If the CAS fails the consumer freed it already. */
+            uint32_t expected = ring->tail_cache;
+            if (atomic_compare_exchange_strong_explicit(&ring->tail, &expected, expected + 1,
+                                                        memory_order_acq_rel, memory_order_acquire)) {
+                atomic_fetch_add_explicit(&ring->overwritten, 1, memory_order_relaxed);
+                ring->tail_cache = expected + 1;
+            } else {
+                ring->tail_cache = expected;
+            }
+        }
+    }
+
+    slot_store(ring, head, item);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* The cached tail overestimates the level, confirm before raising the mark */
+    level = head + 1 - ring->tail_cache;
+    if (level > atomic_load_explicit(&ring->high_watermark, memory_order_relaxed)) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        level = head + 1 - ring->tail_cache;
+        if (level > atomic_load_explicit(&ring->high_watermark, memory_order_relaxed)) {
+            atomic_store_explicit(&ring->high_watermark, level, memory_order_relaxed);
+        }
+    }
+
+    if (ring->notify) {
+        ring->notify(ring->notify_arg);
+    }
+
+    return true;
+}
+
+
+bool spsc_ring_pop(spsc_ring_t *ring, void *item)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while (1) {
+        /* Only look at the producer's cache line when the cached view says empty.
+           An overwrite can move tail past a stale head_cache, hence the signed test. */
+        if ((int32_t)(ring->head_cache - tail) <= 0) {
+            ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (ring->head_cache == tail) {
+                return false;
+            }
+        }
+
+        slot_load(ring, tail, item);
+
+        /* Commit the read. On failure the producer overwrote this slot, the copy is stale.
+           The release half keeps the loads of the copy before it. */
+        if (atomic_compare_exchange_strong_explicit(&ring->tail, &tail, tail + 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+
+uint32_t spsc_ring_count(spsc_ring_t *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return head - tail;
+}
@@ -0,0 +1,325 @@
+#include "h/store_forward.h"
+#include "h/publisher.h"
+
+#include <string.h>
+#include <stddef.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+const static char *TAG = "__SF__";
+
+#if CONFIG_SF_ENABLE
+
+#define SF_PAGE_MAGIC       0x53464C47  /* "SFLG" */
+#define SF_PAGE_PENDING     0xFFFFFFFF  /* Erased flash value */
+#define SF_PAGE_CONSUMED    0x00000000  /* Programmed in place once the page is sent */
+#define SF_PAGES_PER_SECTOR (SF_SECTOR_SIZE / SF_PAGE_SIZE)
+
+/* A backfill publish can not be larger than a batch */
+#if CONFIG_SENSOR_PUBLISH_MODE_BATCH && (CONFIG_SENSOR_BATCH_MAX_SAMPLES < CONFIG_SF_BACKFILL_MAX_SAMPLES)
+#define SF_BACKFILL_MAX CONFIG_SENSOR_BATCH_MAX_SAMPLES
+#else
+#define SF_BACKFILL_MAX CONFIG_SF_BACKFILL_MAX_SAMPLES
+#endif
+
+/*
+ *  Flash layout: the partition is a ring of 256 byte pages. A page is only
+ *  ever written once, after its whole sector was erased, so every page_seq
+ *  maps to a fixed slot: (page_seq % page_count). The state is recovered
+ *  on boot from the page headers alone.
+ */
+typedef struct __attribute__((__packed__))
+{
+    uint32_t seq;
+    int64_t timestamp_us;
+    float value[ENDTYPE - 1];
+} sf_record_t;
+
+typedef struct __attribute__((__packed__))
+{
+    uint32_t magic;
+    uint32_t page_seq;
+    uint32_t consumed;      /* SF_PAGE_PENDING until all records were sent */
+    uint16_t count;
+    uint16_t crc;           /* CRC16 of the used records */
+} sf_page_hdr_t;
+
+#define SF_RECS_PER_PAGE ((SF_PAGE_SIZE - sizeof(sf_page_hdr_t)) / sizeof(sf_record_t))
+
+typedef struct __attribute__((__packed__))
+{
+    sf_page_hdr_t hdr;
+    sf_record_t rec[SF_RECS_PER_PAGE];
+} sf_page_t;
+
+_Static_assert(sizeof(sf_page_t) <= SF_PAGE_SIZE, "store-and-forward page does not fit in a flash page");
+
+
+static const esp_partition_t *sf_part = NULL;
+static uint32_t page_count = 0;     /* Pages in the partition, whole sectors only */
+static uint32_t head_seq = 0;       /* page_seq of the next page to write */
+static uint32_t tail_seq = 0;       /* Oldest page not yet sent */
+static uint16_t tail_rec = 0;       /* Records of the tail page already sent */
+static uint32_t boot_seq = 0;       /* First page_seq written since this boot */
+static sf_page_t ram_page;          /* Page being filled, newest samples */
+static sf_page_t read_page;         /* Scratch page for the backfill */
+static sensq backfill_buf[SF_BACKFILL_MAX]; /* Samples of one backfill publish, off the comms task stack */
+static int64_t last_backfill_us = 0;
+
+
+static inline size_t page_offset(uint32_t seq)
+{
+    return (seq % page_count) * SF_PAGE_SIZE;
+}
+
+
+static uint16_t page_crc(const sf_page_t *page)
+{
+    return esp_rom_crc16_le(0, (const uint8_t *)page->rec, page->hdr.count * sizeof(sf_record_t));
+}
+
+
+/*
+ * @brief Rebuild head and tail from the page headers on flash
+ *
+ *  Writing restarts at the next sector boundary, so a page torn by a reset
+ *  is never programmed twice. Slots that were skipped this way read back as
+ *  invalid and are stepped over by the backfill.
+ */
+static void sf_recover(void)
+{
+    sf_page_hdr_t hdr;
+    bool found = false;
+    uint32_t max_seq = 0;
+    uint32_t min_pending = UINT32_MAX;
+
+    for (uint32_t i = 0; i < page_count; i++) {
+        if (esp_partition_read(sf_part, i * SF_PAGE_SIZE, &hdr, sizeof(hdr)) != ESP_OK) {
+            continue;
+        }
+        if (hdr.magic != SF_PAGE_MAGIC || (hdr.page_seq % page_count) != i) {
+            continue;
+        }
+
+        if (!found || hdr.page_seq > max_seq) {
+            max_seq = hdr.page_seq;
+        }
+        found = true;
+
+        if (hdr.consumed == SF_PAGE_PENDING && hdr.page_seq < min_pending) {
+            min_pending = hdr.page_seq;
+        }
+    }
+
+    head_seq = found ? max_seq + 1 : 0;
+    if (head_seq % SF_PAGES_PER_SECTOR) {
+        head_seq += SF_PAGES_PER_SECTOR - (head_seq % SF_PAGES_PER_SECTOR);
+    }
+    tail_seq = (min_pending != UINT32_MAX) ? min_pending : head_seq;
+    tail_rec = 0;
+}
+
+
+/*
+ * @brief Write the RAM page to the head slot, erasing the sector on entry
+ */
+static void sf_write_page(void)
+{
+    size_t offset = page_offset(head_seq);
+    esp_err_t err;
+
+    if (offset % SF_SECTOR_SIZE == 0) {
+        /* Reusing a sector drops the pages it still holds */
+        if (head_seq + SF_PAGES_PER_SECTOR > page_count) {
+            uint32_t oldest_kept = head_seq + SF_PAGES_PER_SECTOR - page_count;
+            if (tail_seq < oldest_kept) {
+                ESP_LOGW(TAG, "Log full, dropping %lu unsent pages", (unsigned long)(oldest_kept - tail_seq));
+                tail_seq = oldest_kept;
+                tail_rec = 0;
+            }
+        }
+
+        err = esp_partition_erase_range(sf_part, offset, SF_SECTOR_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Erase at 0x%x failed (%s)", (unsigned)offset, esp_err_to_name(err));
+        }
+    }
+
+    ram_page.hdr.magic = SF_PAGE_MAGIC;
+    ram_page.hdr.page_seq = head_seq;
+    ram_page.hdr.consumed = SF_PAGE_PENDING;
+    ram_page.hdr.crc = page_crc(&ram_page);
+
+    err = esp_partition_write(sf_part, offset, &ram_page, sizeof(ram_page));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Page write at 0x%x failed (%s)", (unsigned)offset, esp_err_to_name(err));
+    } else {
+        ESP_LOGD(TAG, "Stored page %lu (%d samples)", (unsigned long)head_seq, ram_page.hdr.count);
+    }
+
+    /* A failed slot reads back as invalid and is skipped later */
+    head_seq++;
+    ram_page.hdr.count = 0;
+}
+
+
+/*
+ * @brief Turn a stored record back into a sample
+ *
+ *  timestamp_us is an esp_timer value, it only means something in the boot
+ *  that wrote it. Pages older than boot_seq were written before the last
+ *  reset, their samples are flagged so no Unix time or latency is derived
+ *  from them.
+ */
+static void record_to_sample(const sf_record_t *rec, uint32_t page_seq, sensq *sample)
+{
+    sample->seq = rec->seq;
+    sample->timestamp_us = rec->timestamp_us;
+    sample->dequeue_us = 0;
+    sample->prev_boot = (page_seq < boot_seq);
+    sample->value[INVALID] = 0;
+    memcpy(&sample->value[INVALID + 1], rec->value, sizeof(rec->value));
+}
+
+
+/*
+ * @brief Load the tail page in read_page, skipping slots that are not valid
+ * @return true if a valid pending page was loaded
+ */
+static bool sf_load_tail(void)
+{
+    while (tail_seq != head_seq) {
+        if (esp_partition_read(sf_part, page_offset(tail_seq), &read_page, sizeof(read_page)) == ESP_OK &&
+            read_page.hdr.magic == SF_PAGE_MAGIC &&
+            read_page.hdr.page_seq == tail_seq &&
+            read_page.hdr.count <= SF_RECS_PER_PAGE &&
+            read_page.hdr.crc == page_crc(&read_page) &&
+            tail_rec < read_page.hdr.count) {
+            return true;
+        }
+
+        ESP_LOGD(TAG, "Skipping page %lu", (unsigned long)tail_seq);
+        tail_seq++;
+        tail_rec = 0;
+    }
+
+    return false;
+}
+
+
+esp_err_t store_forward_init(void)
+{
+    sf_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, SF_PARTITION_LABEL);
+    if (sf_part == NULL) {
+        ESP_LOGW(TAG, "Partition '%s' not found, store-and-forward disabled", SF_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    page_count = (sf_part->size / SF_SECTOR_SIZE) * SF_PAGES_PER_SECTOR;
+    ram_page.hdr.count = 0;
+    sf_recover();
+    boot_seq = head_seq;
+
+    ESP_LOGI(TAG, "Log on '%s': %lu pages of %d samples, %lu pages pending",
+             sf_part->label, (unsigned long)page_count, (int)SF_RECS_PER_PAGE,
+             (unsigned long)(head_seq - tail_seq));
+    return ESP_OK;
+}
+
+
+void store_forward_append(const sensq *sample)
+{
+    sf_record_t *rec;
+
+    if (sf_part == NULL) {
+        return;
+    }
+
+    rec = &ram_page.rec[ram_page.hdr.count++];
+    rec->seq = sample->seq;
+    rec->timestamp_us = sample->timestamp_us;
+    memcpy(rec->value, &sample->value[INVALID + 1], sizeof(rec->value));
+
+    if (ram_page.hdr.count == SF_RECS_PER_PAGE) {
+        sf_write_page();
+    }
+}
+
+
+bool store_forward_pending(void)
+{
+    return sf_part != NULL && (tail_seq != head_seq || ram_page.hdr.count > 0);
+}
+
+
+void store_forward_backfill(esp_mqtt_client_handle_t client)
+{
+    sensq *out = backfill_buf;
+    int64_t now = esp_timer_get_time();
+    int n = 0;
+
+    if (!store_forward_pending() || now - last_backfill_us < (int64_t)CONFIG_SF_BACKFILL_INTERVAL_MS * 1000) {
+        return;
+    }
+    last_backfill_us = now;
+
+    if (sf_load_tail()) {
+        /* Oldest samples are on flash */
+        while (n < SF_BACKFILL_MAX && tail_rec + n < read_page.hdr.count) {
+            record_to_sample(&read_page.rec[tail_rec + n], tail_seq, &out[n]);
+            n++;
+        }
+        if (!publisher_send_samples(client, out, n, true)) {
+            return;
+        }
+
+        tail_rec += n;
+        if (tail_rec == read_page.hdr.count) {
+            /* Clear the marker bits in place, no erase needed */
+            const uint32_t consumed = SF_PAGE_CONSUMED;
+            esp_partition_write(sf_part, page_offset(tail_seq) + offsetof(sf_page_hdr_t, consumed),
+                                &consumed, sizeof(consumed));
+            tail_seq++;
+            tail_rec = 0;
+        }
+    } else if (ram_page.hdr.count > 0) {
+        /* Then the samples that did not fill a page yet */
+        while (n < SF_BACKFILL_MAX && n < ram_page.hdr.count) {
+            record_to_sample(&ram_page.rec[n], head_seq, &out[n]);
+            n++;
+        }
+        if (!publisher_send_samples(client, out, n, true)) {
+            return;
+        }
+
+        ram_page.hdr.count -= n;
+        memmove(&ram_page.rec[0], &ram_page.rec[n], ram_page.hdr.count * sizeof(sf_record_t));
+    }
+
+    ESP_LOGI(TAG, "Backfilled %d samples, %lu pages pending", n, (unsigned long)(head_seq - tail_seq));
+}
+
+#else /* !CONFIG_SF_ENABLE */
+
+esp_err_t store_forward_init(void)
+{
+    ESP_LOGI(TAG, "Store-and-forward disabled");
+    return ESP_OK;
+}
+
+void store_forward_append(const sensq *sample)
+{
+}
+
+bool store_forward_pending(void)
+{
+    return false;
+}
+
+void store_forward_backfill(esp_mqtt_client_handle_t client)
+{
+}
+
+#endif /* CONFIG_SF_ENABLE */
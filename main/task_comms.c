@@ -2,27 +2,62 @@
 #include "h/sensor_queue.h"
 #include "h/wifi.h"
 #include "h/http_server.h"
+#include "h/publisher.h"
+#include "h/store_forward.h"
+#include "h/deadband.h"
+#include "h/pub_latency.h"
+#include "h/metrics.h"
+#include "h/task_stats.h"
+#include "h/time_sync.h"
+#include "h/ota_pull.h"
+#include "h/spsc_ring.h"
+#include "h/boot_profile.h"
+#include "h/settings.h"
+#include "h/mqtt_tls.h"
+#include "h/link_manager.h"
 #include <string.h>
 #include "esp_log.h"
-#include "esp_eth.h"
+#include "esp_timer.h"
 #include "esp_netif.h"
-#include "ethernet_init.h"
 #include "esp_event.h"
 #include "esp_mac.h"
+#include "esp_random.h"
 #include "mqtt_client.h"
 #include "lwip/ip4_addr.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
 #include "esp_task_wdt.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_eth.h"
+#include "ethernet_init.h"
+#endif
 
 const static char *TAG = "__COMMS__";
 
+/* Short lived task bringing up the hotspot and the portal, see task_portal_init() */
+#define PORTAL_INIT_STACK   6144
+#define PORTAL_INIT_PRIO    2
+
+/* The broker certificate is issued to this name, whatever address it is reached at */
+#define BROKER_COMMON_NAME  "localhost"
+
 
+#if !CONFIG_IDF_TARGET_LINUX
 static uint8_t eth_port_cnt = 0;
 static esp_eth_handle_t *eth_handles = NULL;
-static bool ip_acquired = false;
+#endif
+/* State and wake-up events of the comms task, see task_comms.h */
+static EventGroupHandle_t comms_events = NULL;
 
-static bool mqtt_is_connected = false;
 static esp_mqtt_client_handle_t client = NULL;
 
+/* Broker URI with the cached address in place of the host name, see broker_uri_get() */
+static char broker_uri[URL_LEN + 16];
+
+/* Portal config the running client was built with, see mqtt_config_apply(). Comms task only. */
+static char applied_url[URL_LEN + 1];
+static char applied_id[ID_LEN + 1];
+
 /* Certificates for MQTTS */
 extern const uint8_t client_cert_pem_start[] asm("_binary_client_esp1_crt_start");
 extern const uint8_t client_cert_pem_end[] asm("_binary_client_esp1_crt_end");
@@ -34,6 +69,7 @@ extern const uint8_t ca_cert_pem_start[] asm("_binary_ca_crt_start");
 extern const uint8_t ca_cert_pem_end[] asm("_binary_ca_crt_end");
 
 
+#if !CONFIG_IDF_TARGET_LINUX
 /* Event handler for Ethernet events */
 static void eth_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data)
@@ -47,13 +83,11 @@ static void eth_event_handler(void *arg, esp_event_base_t event_base,
         ESP_LOGI(TAG, "Ethernet Link Up");
         ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
                  mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+        boot_profile_end(BOOT_PHASE_LINK);
         break;
     case ETHERNET_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "Ethernet Link Down - activating WiFi backup");
-        ip_acquired = false;
-        mqtt_is_connected = false;
-        /*  Enable WiFi backup when Ethernet disconnects */
-        wifi_connect_backup();
+        /* The link manager moves the traffic to WiFi */
+        ESP_LOGI(TAG, "Ethernet Link Down");
         break;
     case ETHERNET_EVENT_START:
         ESP_LOGI(TAG, "Ethernet Started");
@@ -65,6 +99,7 @@ static void eth_event_handler(void *arg, esp_event_base_t event_base,
         break;
     }
 }
+#endif /* !CONFIG_IDF_TARGET_LINUX */
 
 
 static void log_error_if_nonzero(const char *message, int error_code)
@@ -94,11 +129,18 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             ESP_LOGI(TAG, "MQTT Event: Trying to connect");
             break;
         case MQTT_EVENT_CONNECTED:
-            mqtt_is_connected = true;
+            xEventGroupClearBits(comms_events, COMMS_BROKER_UNVERIFIED);
+            xEventGroupSetBits(comms_events, COMMS_MQTT_UP | COMMS_EV_MQTT);
+            metric_inc(METRIC_MQTT_CONNECTS);
+            boot_profile_end(BOOT_PHASE_MQTT);
+            link_manager_mqtt_connected();
             ESP_LOGI(TAG, "MQTT Event: Connected!");
+            ota_pull_subscribe(event->client);
             break;
         case MQTT_EVENT_DISCONNECTED:
-            mqtt_is_connected = false;
+            xEventGroupClearBits(comms_events, COMMS_MQTT_UP);
+            xEventGroupSetBits(comms_events, COMMS_EV_MQTT);
+            metric_inc(METRIC_MQTT_DISCONNECTS);
             ESP_LOGE(TAG, "MQTT Event: Disconnected!");
             break;
         case MQTT_EVENT_ERROR:
@@ -108,10 +150,28 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
                 log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
                 log_error_if_nonzero("captured as transport's socket errno",  event->error_handle->esp_transport_sock_errno);
                 ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
+
+                /* Never reached the broker at its cached address, it may have moved.
+                   Test and clear in one call, the comms task sets the bit. */
+                if (xEventGroupClearBits(comms_events, COMMS_BROKER_UNVERIFIED) & COMMS_BROKER_UNVERIFIED) {
+                    xEventGroupSetBits(comms_events, COMMS_EV_BROKER_STALE);
+                }
             }
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGD(TAG, "MQTT Event: Published");
+            ESP_LOGD(TAG, "MQTT Event: Published, msg_id=%d", event->msg_id);
+            pub_latency_acked(event->msg_id);
+            boot_profile_mark(BOOT_PHASE_FIRST_ACK);
+            /* The outbox shrank, and the boot report may be due */
+            xEventGroupSetBits(comms_events, COMMS_EV_MQTT);
+            break;
+        case MQTT_EVENT_SUBSCRIBED:
+            ESP_LOGD(TAG, "MQTT Event: Subscribed, msg_id=%d", event->msg_id);
+            break;
+        case MQTT_EVENT_DATA:
+            if (!ota_pull_handle_data(event)) {
+                ESP_LOGW(TAG, "MQTT Event: Data on unexpected topic %.*s", event->topic_len, event->topic);
+            }
             break;
         default:
             ESP_LOGE(TAG, "MQTT Event not handled - id:%d", event->event_id);
@@ -120,60 +180,272 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 }
 
 
-static void config_mqtt_protocol() {
-    printf("Initializing MQTT Protocol\nUpdated config: %d\n", mqtt_config_updated);
-    printf("ID: %s\n", ID);
-    printf("URL: %s\n\n", URL);
+/*
+ * @brief Create and start the MQTT client for the given broker
+ *
+ *  The outbox holds the QoS1 messages until their PUBACK. Its limit is
+ *  explicit so a slow broker can not use up the heap, see mqtt_outbox_congested().
+ */
+static void mqtt_client_create(const char *uri)
+{
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker.address.uri = uri,
+        .broker.verification.certificate = (const char *)ca_cert_pem_start,
+        .broker.verification.certificate_len = ca_cert_pem_end - ca_cert_pem_start,
+        .broker.verification.common_name = BROKER_COMMON_NAME,
+        .credentials = {
+            .authentication = {
+                .certificate = (const char *)client_cert_pem_start,
+                .certificate_len = client_cert_pem_end - client_cert_pem_start,
+                .key = (const char *)client_key_pem_start,
+                .key_len = client_key_pem_end - client_key_pem_start,
+            },
+        },
+        .buffer = {
+            .size = CONFIG_COMMS_MQTT_BUFFER_SIZE,
+            .out_size = CONFIG_COMMS_MQTT_BUFFER_SIZE,
+        },
+        .outbox.limit = CONFIG_COMMS_OUTBOX_LIMIT,
+        /* Spread the reconnects of a fleet after a broker restart */
+        .network.reconnect_timeout_ms = CONFIG_COMMS_MQTT_RECONNECT_MS + esp_random() % (CONFIG_COMMS_MQTT_RECONNECT_JITTER_MS + 1),
+    };
+
+#if CONFIG_COMMS_MQTT_TLS_RESUME
+    /* Same checks as above, through the transport that resumes the last TLS session */
+    const esp_tls_cfg_t tls_cfg = {
+        .cacert_buf = ca_cert_pem_start,
+        .cacert_bytes = ca_cert_pem_end - ca_cert_pem_start,
+        .clientcert_buf = client_cert_pem_start,
+        .clientcert_bytes = client_cert_pem_end - client_cert_pem_start,
+        .clientkey_buf = client_key_pem_start,
+        .clientkey_bytes = client_key_pem_end - client_key_pem_start,
+        .common_name = BROKER_COMMON_NAME,
+    };
+    mqtt_cfg.network.transport = mqtt_tls_transport_create(&tls_cfg);
+#endif
+
+    boot_profile_begin(BOOT_PHASE_MQTT);
+    client = esp_mqtt_client_init(&mqtt_cfg);
+    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    esp_mqtt_client_start(client);
+}
+
+
+/* ________________ Broker address cache ________________ */
+
+/*
+ * @brief Host part of a URI, scheme://host[:port][/path]
+ * @return Its length, *host points to it
+ */
+static int uri_host(const char *uri, const char **host)
+{
+    const char *p = strstr(uri, "://");
+
+    *host = p ? p + 3 : uri;
+    return strcspn(*host, ":/");
+}
+
+
+/*
+ * @brief URI to connect to: applied_url, with the host name replaced by its cached address
+ *
+ *  The broker host name resolved on a previous boot is kept in NVS, so the
+ *  connect does not wait for DNS. The broker certificate is checked against
+ *  a fixed common name, the address in the URI does not change what is verified.
+ */
+static const char *broker_uri_get(void)
+{
+    char host[URL_LEN + 1];
+    char cached[URL_LEN + 1];
+    char ip[16];
+    const char *h;
+    int host_len = uri_host(applied_url, &h);
+    ip4_addr_t addr;
+
+    xEventGroupClearBits(comms_events, COMMS_BROKER_UNVERIFIED | COMMS_BROKER_SAVE);
+
+    snprintf(host, sizeof(host), "%.*s", host_len, h);
+    if (ip4addr_aton(host, &addr)) {
+        return applied_url;             /* Already an address, nothing to resolve */
+    }
+
+    if (settings_get_str(SETTINGS_KEY_BROKER_HOST, cached, sizeof(cached)) != ESP_OK || strcmp(cached, host) != 0 ||
+        settings_get_str(SETTINGS_KEY_BROKER_IP, ip, sizeof(ip)) != ESP_OK || !ip4addr_aton(ip, &addr)) {
+        xEventGroupSetBits(comms_events, COMMS_BROKER_SAVE);
+        return applied_url;
+    }
+
+    snprintf(broker_uri, sizeof(broker_uri), "%.*s%s%s", (int)(h - applied_url), applied_url, ip, h + host_len);
+    xEventGroupSetBits(comms_events, COMMS_BROKER_UNVERIFIED);
+    ESP_LOGI(TAG, "Broker %s at its cached address %s", host, ip);
+    return broker_uri;
+}
+
+
+/*
+ * @brief Save the address the broker host name resolves to, once connected
+ *
+ *  The MQTT client just resolved it, so the lwIP DNS cache answers right away.
+ */
+static void broker_cache_save(void)
+{
+    const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    char host[URL_LEN + 1];
+    char ip[16];
+    const char *h;
+    int host_len = uri_host(applied_url, &h);
+
+    xEventGroupClearBits(comms_events, COMMS_BROKER_SAVE);
+    snprintf(host, sizeof(host), "%.*s", host_len, h);
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+        ESP_LOGW(TAG, "Could not resolve %s, broker address not cached", host);
+        return;
+    }
+    inet_ntoa_r(((struct sockaddr_in *)res->ai_addr)->sin_addr, ip, sizeof(ip));
+    freeaddrinfo(res);
+
+    if (settings_set_str(SETTINGS_KEY_BROKER_HOST, host) == ESP_OK &&
+        settings_set_str(SETTINGS_KEY_BROKER_IP, ip) == ESP_OK) {
+        ESP_LOGI(TAG, "Broker %s cached at %s", host, ip);
+    }
+}
 
-    if (client == NULL) {
-        const esp_mqtt_client_config_t mqtt_cfg = {
-            .broker.address.uri = CONFIG_BROKER_URL,
-            .broker.verification.certificate = (const char *)ca_cert_pem_start,
-            .broker.verification.certificate_len = ca_cert_pem_end - ca_cert_pem_start,
-            .broker.verification.common_name = "localhost",
-            .credentials = {
-                .authentication = {
-                    .certificate = (const char *)client_cert_pem_start,
-                    .certificate_len = client_cert_pem_end - client_cert_pem_start,
-                    .key = (const char *)client_key_pem_start,
-                    .key_len = client_key_pem_end - client_key_pem_start,
-                },
-            }
-        };
-
-        client = esp_mqtt_client_init(&mqtt_cfg);
-        esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-        esp_mqtt_client_start(client);
-
-    } else if (mqtt_config_updated) {
-        esp_mqtt_client_destroy(client);
-
-        const esp_mqtt_client_config_t mqtt_cfg = {
-            .broker.address.uri = URL,
-            .broker.verification.certificate = (const char *)ca_cert_pem_start,
-            .broker.verification.certificate_len = ca_cert_pem_end - ca_cert_pem_start,
-            .broker.verification.common_name = "localhost",
-            .credentials = {
-                .authentication = {
-                    .certificate = (const char *)client_cert_pem_start,
-                    .certificate_len = client_cert_pem_end - client_cert_pem_start,
-                    .key = (const char *)client_key_pem_start,
-                    .key_len = client_key_pem_end - client_key_pem_start,
-                },
-            }
-        };
 
-        client = esp_mqtt_client_init(&mqtt_cfg);
-        esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-        esp_mqtt_client_start(client);
-        mqtt_config_updated = false;
+/*
+ * @brief Replace the client, for a new broker or a stale cached address
+ */
+static void mqtt_client_rebuild(void)
+{
+    esp_mqtt_client_destroy(client);
+    xEventGroupClearBits(comms_events, COMMS_MQTT_UP);
+    pub_latency_reset_inflight();
+#if CONFIG_COMMS_MQTT_TLS_RESUME
+    mqtt_tls_forget_session();
+#endif
 
+    mqtt_client_create(broker_uri_get());
+}
+
+
+/*
+ * @brief Apply a config change from the portal, touching only what changed
+ *
+ *  Only a new broker URL needs a new client, and a new TLS session. A new
+ *  board ID moves the command topic subscription, the topics of the next
+ *  messages follow it. The certificates are embedded, they only change with
+ *  the firmware. The httpd task may be writing the config, it is read here
+ *  once, as a copy.
+ */
+static void mqtt_config_apply(void)
+{
+    char id[ID_LEN + 1];
+    char url[URL_LEN + 1];
+
+    http_config_get(id, url);
+    if (strcmp(applied_url, url) != 0) {
+        ESP_LOGI(TAG, "Broker changed from %s to %s, new client", applied_url, url);
+        memcpy(applied_url, url, sizeof(applied_url));
+        memcpy(applied_id, id, sizeof(applied_id));
+        mqtt_client_rebuild();
+    } else if (strcmp(applied_id, id) != 0) {
+        ESP_LOGI(TAG, "Board ID changed from %s to %s, connection kept", applied_id, id);
+        if (comms_state(COMMS_MQTT_UP)) {
+            ota_pull_resubscribe(client, applied_id);
+        }
+        memcpy(applied_id, id, sizeof(applied_id));
     } else {
-        esp_mqtt_client_reconnect(client);
+        ESP_LOGI(TAG, "MQTT config unchanged, connection kept");
     }
 }
 
 
+static void config_mqtt_protocol(bool config_updated) {
+    printf("Initializing MQTT Protocol\nUpdated config: %d\n", config_updated);
+
+    if (client == NULL) {
+        http_config_get(applied_id, applied_url);
+        printf("ID: %s\n", applied_id);
+        printf("URL: %s\n\n", applied_url);
+        mqtt_client_create(broker_uri_get());
+
+    } else if (config_updated) {
+        mqtt_config_apply();
+    }
+}
+
+
+/*
+ * @brief Called by the link manager when the active link changes
+ */
+static void link_change_cb(link_id_t active)
+{
+    comms_notify(COMMS_EV_LINK);
+}
+
+
+/*
+ * @brief Follow the active link, from the comms task
+ *
+ *  The connection of the old link is bound to its address, it can not move.
+ *  The client is restarted at once on the new link instead of waiting for
+ *  its keepalive to fail, and the TLS session is resumed. The messages of
+ *  its outbox not acked yet are sent again once connected.
+ */
+static void link_switch(void)
+{
+    link_id_t active = link_manager_active();
+
+    if (active == LINK_NONE) {
+        xEventGroupClearBits(comms_events, COMMS_LINK_UP | COMMS_MQTT_UP);
+        return;
+    }
+
+    xEventGroupSetBits(comms_events, COMMS_LINK_UP);
+    time_sync_start();
+    if (client == NULL) {
+        config_mqtt_protocol(false);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Reconnecting MQTT over %s", link_policy_name(active));
+    xEventGroupClearBits(comms_events, COMMS_MQTT_UP);
+    esp_mqtt_client_stop(client);
+    esp_mqtt_client_start(client);
+}
+
+
+/*
+ * @brief Check if the outbox is above its high water mark
+ *
+ *  While it is, the comms task leaves the samples in the sensor ring.
+ *  The ring then fills up and its full policy applies at the producer.
+ */
+static bool mqtt_outbox_congested(void)
+{
+    static bool congested = false;
+    int size;
+
+    if (client == NULL || !comms_state(COMMS_MQTT_UP)) {
+        return false;
+    }
+
+    size = esp_mqtt_client_get_outbox_size(client);
+    if (size >= (int)((uint64_t)CONFIG_COMMS_OUTBOX_LIMIT * CONFIG_COMMS_OUTBOX_HIGH_WATER_PCT / 100)) {
+        if (!congested) {
+            ESP_LOGW(TAG, "MQTT outbox at %d bytes, pausing the sensor ring", size);
+            congested = true;
+        }
+    } else if (congested) {
+        ESP_LOGI(TAG, "MQTT outbox at %d bytes, resuming", size);
+        congested = false;
+    }
+
+    return congested;
+}
+
+
+#if !CONFIG_IDF_TARGET_LINUX
 static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
                                  int32_t event_id, void *event_data)
 {
@@ -187,14 +459,7 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&ip_info->netmask));
             ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&ip_info->gw));
             ESP_LOGI(TAG, "~~~~~~~~~~~\n");
-            /*  Disable WiFi backup when Ethernet is available */
-            ip_acquired = true;
-            if (wifi_is_backup_connected()) {
-                ESP_LOGI(TAG, "Ethernet available - disabling WiFi backup");
-                wifi_disconnect_backup();
-            }
-            /* Update MQTT protocol */
-            config_mqtt_protocol();
+            boot_profile_end(BOOT_PHASE_DHCP);
             break;
         
         case IP_EVENT_STA_GOT_IP:
@@ -203,11 +468,7 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI(TAG, "WIFIMASK:" IPSTR, IP2STR(&ip_info->netmask));
             ESP_LOGI(TAG, "WIFIGW:" IPSTR, IP2STR(&ip_info->gw));
             ESP_LOGI(TAG, "~~~~~~~~~~~\n");
-            /* Use WIFI only if Ethernet is not available */
-            if (!ip_acquired) {
-                ip_acquired = true;
-                config_mqtt_protocol();
-            }
+            boot_profile_end(BOOT_PHASE_DHCP);
             break;
         default:
             ESP_LOGD(TAG, "IP event not handled");
@@ -216,9 +477,17 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
 }
 
 
+#endif /* !CONFIG_IDF_TARGET_LINUX */
+
+
 void init_ethernet_and_netif(void)
 {
+    boot_profile_begin(BOOT_PHASE_ETH);
     ESP_ERROR_CHECK(esp_event_loop_create_default());
+#if CONFIG_IDF_TARGET_LINUX
+    /* Simulation build: the host network is up already, see sim/sim_netif.c */
+    link_manager_init(link_change_cb);
+#else
     ESP_ERROR_CHECK(example_eth_init(&eth_handles, &eth_port_cnt));
     ESP_ERROR_CHECK(esp_netif_init());
 
@@ -247,20 +516,44 @@ void init_ethernet_and_netif(void)
         ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handles[i])));
     }
 
-    /* Initialize WiFi in AP+STA mode */
-    wifi_init_ap_sta_mode();
-
     /* Register event handlers */
     ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip_event_handler, NULL));
+    link_manager_init(link_change_cb);
 
+    /* The link negotiation and the DHCP run from here on, next to the rest of the init */
+    boot_profile_begin(BOOT_PHASE_LINK);
+    boot_profile_begin(BOOT_PHASE_DHCP);
     for (int i = 0; i < eth_port_cnt; i++) {
         ESP_ERROR_CHECK(esp_eth_start(eth_handles[i]));
     }
+#endif
+    boot_profile_end(BOOT_PHASE_ETH);
 }
 
 
+/*
+ * @brief Bring up the hotspot with its DNS, and the config portal
+ *
+ *  None of it is on the way to the first publish, so it runs on the other
+ *  core while the Ethernet link comes up, instead of before it.
+ */
+static void task_portal_init(void *arg)
+{
+    boot_profile_begin(BOOT_PHASE_WIFI);
+    wifi_init_ap_sta_mode();
+    boot_profile_end(BOOT_PHASE_WIFI);
+
+    boot_profile_begin(BOOT_PHASE_HTTP);
+    start_http_server();
+    boot_profile_end(BOOT_PHASE_HTTP);
+
+    vTaskDelete(NULL);
+}
+
+
+#if !CONFIG_IDF_TARGET_LINUX
 /*
  * @brief Create a board id from last part of MAC address
  */
@@ -278,27 +571,120 @@ char *get_mqtt_board_id()
 
     return board_id;
 }
+#endif
 
 
-void task_comms(void* msg_queue)
+/*
+ * @brief Publish the per-task CPU and stack usage of the last window
+ */
+static void publish_task_stats(void)
 {
-    char mqttdata[11];
-    char topic_fmt[] = "/sensor_%s/%s";
+    static char diag[TASK_STATS_JSON_LEN];
     char topic[40];
-    int msg_id;
+    int len = task_stats_json(diag, sizeof(diag));
+
+    if (len < 0) {
+        return;
+    }
+
+    snprintf(topic, sizeof(topic), TASK_STATS_TOPIC_FMT, applied_id);
+    if (esp_mqtt_client_publish(client, topic, diag, len, 0, 0) < 0) {
+        ESP_LOGW(TAG, "Task stats not published");
+    }
+}
+
+
+/* ________________ Comms task ________________ */
+
+void comms_notify(EventBits_t events)
+{
+    if (comms_events) {
+        xEventGroupSetBits(comms_events, events);
+    }
+}
+
+
+bool comms_state(EventBits_t state)
+{
+    return comms_events && (xEventGroupGetBits(comms_events) & state) == state;
+}
+
+
+/*
+ * @brief Move the samples from the sensor ring to the publisher, or to the store
+ *
+ *  Stops while the MQTT outbox is near full, a PUBACK wakes the task again.
+ */
+static void drain_samples(spsc_ring_t *msg_ring)
+{
     sensq data;
-    const TickType_t xTicksToWait = pdMS_TO_TICKS(1000);
+
+    while (!mqtt_outbox_congested() && spsc_ring_pop(msg_ring, &data))
+    {
+        EventBits_t state = xEventGroupGetBits(comms_events);
+
+        data.dequeue_us = esp_timer_get_time();
+
+        /* Report by exception: samples inside the deadband are neither sent nor stored */
+        if (!deadband_check(&data)) {
+            continue;
+        }
+
+        if (!(state & COMMS_LINK_UP))
+        {
+            ESP_LOGW(TAG, "Received sample #%lu, storing (network not ready)", (unsigned long)data.seq);
+            metric_inc(METRIC_OFFLINE_NET);
+            store_forward_append(&data);
+            continue;
+        } else if (!(state & COMMS_MQTT_UP)) {
+            ESP_LOGW(TAG, "Received sample #%lu, storing (mqtt not ready)", (unsigned long)data.seq);
+            metric_inc(METRIC_OFFLINE_MQTT);
+            store_forward_append(&data);
+            continue;
+        } else if (link_manager_suspect()) {
+            /* The link missed a probe, what is sent now may be lost with it */
+            ESP_LOGW(TAG, "Received sample #%lu, storing (link suspect)", (unsigned long)data.seq);
+            metric_inc(METRIC_OFFLINE_LINK);
+            store_forward_append(&data);
+            continue;
+        }
+
+        ESP_LOGD(TAG, "Received sample #%lu", (unsigned long)data.seq);
+        if (!publisher_add_sample(client, &data)) {
+            ESP_LOGW(TAG, "Sample #%lu not published, storing", (unsigned long)data.seq);
+            store_forward_append(&data);
+            continue;
+        }
+
+        /* The first batch after boot goes out right away, not at the end of its window */
+        if (!boot_profile_done(BOOT_PHASE_FIRST_PUBLISH)) {
+            publisher_flush(client);
+        }
+    }
+}
+
+
+void task_comms(void* msg_ring)
+{
+    const TickType_t idle_ticks = pdMS_TO_TICKS(CONFIG_COMMS_IDLE_TIMEOUT_MS);
     TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
     bool added_to_wdt = false;
+    EventBits_t events;
 
+    comms_events = xEventGroupCreate();
+    pub_latency_init();
     init_ethernet_and_netif();
 
-    start_http_server();
-    
-    ESP_LOGI(TAG, "Board ID: %s", ID);
-    /* Wait for main to finish initialization */
-    vTaskDelay(pdMS_TO_TICKS(200));
-    
+    /* Needs the event loop and the netif, from init_ethernet_and_netif() */
+    xTaskCreatePinnedToCore(task_portal_init, "portal_init", PORTAL_INIT_STACK, NULL, PORTAL_INIT_PRIO, NULL, 0);
+
+    boot_profile_begin(BOOT_PHASE_STORE);
+    store_forward_init();
+    boot_profile_end(BOOT_PHASE_STORE);
+
+    http_config_get(applied_id, NULL);
+    ESP_LOGI(TAG, "Board ID: %s", applied_id);
+
     /* Try to add task to watchdog monitoring */
     esp_err_t err = esp_task_wdt_add(current_task);
     if (err == ESP_OK) {
@@ -308,41 +694,51 @@ void task_comms(void* msg_queue)
         ESP_LOGW(TAG, "Could not add comms task to watchdog: %s", esp_err_to_name(err));
     }
 
-    /* Main Loop */
+    /* Main Loop: sleep until an event, or the idle timeout for the timed jobs */
     while(1){
-        /* Feed the watchdog only if is active */
+        events = xEventGroupWaitBits(comms_events, COMMS_EVENTS, pdTRUE, pdFALSE, idle_ticks);
+
+        /* Feed the watchdog only if is active, the idle timeout bounds the time between two feeds */
         if (added_to_wdt) {
             esp_task_wdt_reset();
             ESP_LOGD(TAG, "Comms task watchdog fed");
         }
-        
-        if (mqtt_config_updated) {
-            config_mqtt_protocol();
+
+        if (events & COMMS_EV_BROKER_STALE) {
+            ESP_LOGW(TAG, "Broker not reached at its cached address, resolving %s again", applied_url);
+            settings_set_str(SETTINGS_KEY_BROKER_IP, "");
+            mqtt_client_rebuild();
         }
 
-        if (xQueueReceive(*(QueueHandle_t*)msg_queue, (void *)&data, xTicksToWait) == pdTRUE) 
-        {
-            if(ip_acquired == false)
-            {
-                ESP_LOGW(TAG, "Received data = %.2f(%d), ignoring (network not ready)", data.value, (int)data.type);
-                continue;
-            } else if (mqtt_is_connected == false) {
-                ESP_LOGW(TAG, "Received data = %.2f(%d), ignoring (mqtt not ready)", data.value, (int)data.type);
-                continue;
-            }
+        if (events & COMMS_EV_LINK) {
+            link_switch();
+        }
 
-            /* Prepare topic and data to send */
-            snprintf(mqttdata, sizeof(mqttdata), "%.2f", data.value);
-            snprintf(topic, sizeof(topic), topic_fmt, ID, sensq_string[data.type]);
+        if (events & COMMS_EV_CONFIG) {
+            config_mqtt_protocol(true);
+        }
 
-            ESP_LOGI(TAG, "Received data = %.2f (type=%d), sending to %s", data.value, (int)data.type, topic);
-            msg_id = esp_mqtt_client_publish(client, topic, mqttdata, 0, 1, 0);
-            if (msg_id == -1) {
-                ESP_LOGE(TAG, "Error publishing! Queue might be full or client not connected.");
-            } else {
-                ESP_LOGD(TAG, "Sent publish, msg_id=%d", msg_id);
+        /* Also on a timeout: samples left in the ring while the outbox was congested */
+        drain_samples((spsc_ring_t *)msg_ring);
+
+        /* Publish a partially filled batch once its time window expires,
+           then send a rate limited slice of the stored backlog */
+        if (comms_state(COMMS_LINK_UP | COMMS_MQTT_UP) && !link_manager_suspect() && !mqtt_outbox_congested()) {
+            publisher_poll(client);
+            store_forward_backfill(client);
+            publisher_send_traces(client);
+            ota_pull_send_status(client);
+            boot_profile_send(client);
+
+            if (comms_state(COMMS_BROKER_SAVE)) {
+                broker_cache_save();
             }
-        } 
+        }
+
+        /* Diff the run-time stats once per window, and report them */
+        if (task_stats_poll() && CONFIG_TASK_STATS_PUBLISH && comms_state(COMMS_LINK_UP | COMMS_MQTT_UP)) {
+            publish_task_stats();
+        }
     }
     
     esp_mqtt_client_destroy(client);
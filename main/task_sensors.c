@@ -1,13 +1,19 @@
 #include <string.h>
+#include <sys/param.h>
 
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "bmp280.h"
 #include "freertos/FreeRTOS.h"
 #include "h/sensor_queue.h"
+#include "h/spsc_ring.h"
 #include "h/task_sensors.h"
+#include "h/settings.h"
+#include "h/metrics.h"
+#include "h/live_stream.h"
+#include "h/boot_profile.h"
 #include "esp_task_wdt.h"
-#include "driver/gpio.h"
 
 const static char *TAG = "__SENSORS__";
 
@@ -15,21 +21,176 @@ float http_temp = 0;
 float http_hum = 0;
 float http_pres = 0;
 
+/* Longest sleep between two watchdog feeds */
+#define SENSOR_WDT_FEED_MS 1000
+
+/* BME280 on the UEXT connector, at address 0x77 on our boards */
+#define BME280_I2C_PORT     0
+#define BME280_SDA_GPIO     13
+#define BME280_SCL_GPIO     16
+
+static const sensor_profile_t sensor_profiles[] = {
+    {
+        .name = "low-noise 60 s",
+        .period_ms = 60000,
+        .mode = BMP280_MODE_FORCED,
+        .os_temp = BMP280_ULTRA_HIGH_RES,
+        .os_pres = BMP280_ULTRA_HIGH_RES,
+        .os_hum = BMP280_ULTRA_HIGH_RES,
+        .filter = BMP280_FILTER_16,
+        .standby = BMP280_STANDBY_1000,
+    },
+    {
+        .name = "standard 5 s",
+        .period_ms = 5000,
+        .mode = BMP280_MODE_FORCED,
+        .os_temp = BMP280_STANDARD,
+        .os_pres = BMP280_STANDARD,
+        .os_hum = BMP280_STANDARD,
+        .filter = BMP280_FILTER_OFF,
+        .standby = BMP280_STANDBY_1000,
+    },
+    {
+        .name = "fast 250 ms",
+        .period_ms = 250,
+        .mode = BMP280_MODE_NORMAL,
+        .os_temp = BMP280_ULTRA_LOW_POWER,
+        .os_pres = BMP280_LOW_POWER,
+        .os_hum = BMP280_ULTRA_LOW_POWER,
+        .filter = BMP280_FILTER_4,
+        .standby = BMP280_STANDBY_62,
+    },
+};
+
+#define SENSOR_PROFILE_COUNT    (int)(sizeof(sensor_profiles) / sizeof(sensor_profiles[0]))
+#define SENSOR_PROFILE_DEFAULT  1
+
+static volatile uint8_t active_profile = SENSOR_PROFILE_DEFAULT;
+static TaskHandle_t sensor_task = NULL;
+
+
+int sensor_profile_count(void)
+{
+    return SENSOR_PROFILE_COUNT;
+}
+
+
+const sensor_profile_t *sensor_profile_get(int index)
+{
+    if (index < 0 || index >= SENSOR_PROFILE_COUNT) {
+        return NULL;
+    }
+    return &sensor_profiles[index];
+}
+
+
+int sensor_profile_active(void)
+{
+    return active_profile;
+}
+
+
+esp_err_t sensor_profile_select(int index)
+{
+    if (index < 0 || index >= SENSOR_PROFILE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ESP_LOGI(TAG, "Sampling profile: %s", sensor_profiles[index].name);
+    active_profile = index;
+
+    /* The sensor task owns the I2C bus, it applies the change itself */
+    if (sensor_task) {
+        xTaskNotifyGive(sensor_task);
+    }
+
+    return settings_set_u8(SETTINGS_KEY_PROFILE, index);
+}
+
+
+/*
+ * @brief Worst case conversion time, from the BME280 datasheet (appendix 9.1)
+ */
+static TickType_t conversion_ticks(const sensor_profile_t *profile)
+{
+    static const uint8_t osrs[] = { 0, 1, 2, 4, 8, 16 };
+    uint32_t us = 1250 + 2300 * osrs[profile->os_temp];
+
+    if (osrs[profile->os_pres]) {
+        us += 2300 * osrs[profile->os_pres] + 575;
+    }
+    if (osrs[profile->os_hum]) {
+        us += 2300 * osrs[profile->os_hum] + 575;
+    }
+
+    /* Round up, plus one tick since the wake up can land anywhere in a tick */
+    return pdMS_TO_TICKS((us + 999) / 1000) + 1;
+}
+
+
+static void apply_profile(bmp280_t *dev, const sensor_profile_t *profile)
+{
+    bmp280_params_t params;
+
+    bmp280_init_default_params(&params);
+    params.mode = profile->mode;
+    params.filter = profile->filter;
+    params.oversampling_temperature = profile->os_temp;
+    params.oversampling_pressure = profile->os_pres;
+    params.oversampling_humidity = profile->os_hum;
+    params.standby = profile->standby;
+
+    esp_err_t err = bmp280_init(dev, &params);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Applying profile '%s' failed (%s)", profile->name, esp_err_to_name(err));
+    } else {
+        ESP_LOGI(TAG, "Profile '%s': every %lu ms, %s mode", profile->name,
+                 (unsigned long)profile->period_ms, profile->mode == BMP280_MODE_FORCED ? "forced" : "normal");
+    }
+}
+
+
+/*
+ * @brief Same as xTaskDelayUntil(), but sleeps in slices short enough to
+ *        keep feeding the TWDT, and returns early on a profile change
+ * @return true on time, false if woken by sensor_profile_select()
+ */
+static bool sensor_delay_until(TickType_t *last_wake, TickType_t increment, bool feed_wdt)
+{
+    const TickType_t target = *last_wake + increment;
+
+    while (1) {
+        TickType_t left = target - xTaskGetTickCount();
+
+        /* Deadline reached, or already missed */
+        if (left == 0 || left > increment) {
+            break;
+        }
+
+        if (feed_wdt) {
+            esp_task_wdt_reset();
+        }
+        if (ulTaskNotifyTake(pdTRUE, MIN(left, pdMS_TO_TICKS(SENSOR_WDT_FEED_MS)))) {
+            return false;
+        }
+    }
+
+    *last_wake = target;
+    return true;
+}
+
 /*  NOTE: we have a BME280 sensor on board, but the
  *  driver is for both the BME and BMP. Will use BME280 
  *  all functions here, it is not a mistake.
  */
 bmp280_t *init_bme280()
 {
-    bmp280_params_t params;
-    bmp280_init_default_params(&params);
     bmp280_t *dev = (bmp280_t*)malloc(sizeof(bmp280_t));
     memset(dev, 0, sizeof(bmp280_t));
 
-    /* On our boards, BME280 address is 0x77 */
-    /* For I2C pins check the UEXT connector */
-    ESP_ERROR_CHECK(bmp280_init_desc(dev, BMP280_I2C_ADDRESS_1, 0, GPIO_NUM_13, GPIO_NUM_16));
-    ESP_ERROR_CHECK(bmp280_init(dev, &params));
+    /* Simulated in the linux build, see sim/sim_bme280.c */
+    ESP_ERROR_CHECK(bmp280_init_desc(dev, BMP280_I2C_ADDRESS_1, BME280_I2C_PORT, BME280_SDA_GPIO, BME280_SCL_GPIO));
+    apply_profile(dev, &sensor_profiles[active_profile]);
 
     bool bme280p = dev->id == BME280_CHIP_ID;
     printf("BMP280: found %s\n", bme280p ? "BME280" : "BMP280");
@@ -38,65 +199,74 @@ bmp280_t *init_bme280()
 }
 
 
-void read_send_bme280(bmp280_t *dev, QueueHandle_t* queue)
+void read_send_bme280(bmp280_t *dev, spsc_ring_t *ring)
 {
+    static uint32_t seq = 0;
     float pressure, temperature, humidity;
     sensq to_send;
+    int64_t read_us;
 
-    /* Read all info from sensor */
+    /* Read all info from sensor, the sample age is measured from here */
+    read_us = esp_timer_get_time();
     if (bmp280_read_float(dev, &temperature, &pressure, &humidity) != ESP_OK)
     {
         ESP_LOGE(TAG, "Temperature/pressure reading failed");
+        metric_inc(METRIC_SENSOR_ERRORS);
         return;
     }
 
+    metric_inc(METRIC_SAMPLES_READ);
+
     /* Update data for http server */
     http_temp = temperature;
     http_hum = humidity;
     http_pres = pressure;
 
-    /* Put it in the queue one at a time */
-    to_send.value = temperature;
-    to_send.type = TEMP;
-    if (xQueueGenericSend(*(QueueHandle_t*)queue, (void *)&to_send, portMAX_DELAY, queueSEND_TO_BACK) != pdTRUE) 
+    /* Put the whole sample in the queue as a single item */
+    to_send.seq = seq++;
+    to_send.timestamp_us = read_us;
+    to_send.dequeue_us = 0;
+    to_send.prev_boot = false;
+    to_send.value[INVALID] = 0;
+    to_send.value[TEMP] = temperature;
+    to_send.value[PRES] = pressure;
+    to_send.value[HUM] = humidity;
+    /* Never blocks: a stalled comms task must not stop this task feeding the TWDT */
+    if (!spsc_ring_push(ring, &to_send))
     {
-        ESP_LOGE(TAG, "Queue full");
-    }
-
-    to_send.value = pressure;
-    to_send.type = PRES;
-    if (xQueueGenericSend(*(QueueHandle_t*)queue, (void *)&to_send, portMAX_DELAY, queueSEND_TO_BACK) != pdTRUE) 
-    {
-        ESP_LOGE(TAG, "Queue full");
-    }
-
-    to_send.value = humidity;
-    to_send.type = HUM;
-    if (xQueueGenericSend(*(QueueHandle_t*)queue, (void *)&to_send, portMAX_DELAY, queueSEND_TO_BACK) != pdTRUE) 
-    {
-        ESP_LOGE(TAG, "Queue full");
+        ESP_LOGE(TAG, "Sensor ring full, sample #%lu dropped", (unsigned long)to_send.seq);
+    } else {
+        boot_profile_mark(BOOT_PHASE_FIRST_SAMPLE);
     }
 
+    /* Portal live view, never blocks either */
+    live_stream_publish(&to_send);
 }
 
 
-void task_sensors(void* msg_queue)
+void task_sensors(void* msg_ring)
 { 
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    const TickType_t xTimeIncrement = pdMS_TO_TICKS(5000); // run every 5 seconds
+    TickType_t xLastWakeTime;
     bmp280_t *dev_bme280;
     TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
     bool added_to_wdt = false;
+    uint8_t saved_profile;
+
+    sensor_task = current_task;
+
+    /* Restore the profile selected from the config page */
+    if (settings_get_u8(SETTINGS_KEY_PROFILE, &saved_profile) == ESP_OK && saved_profile < SENSOR_PROFILE_COUNT) {
+        active_profile = saved_profile;
+    }
 
     /* Suppress I2C master pull-up warning since everything works fine */
     esp_log_level_set("i2c.master", ESP_LOG_ERROR);
 
+    boot_profile_begin(BOOT_PHASE_SENSOR);
     ESP_ERROR_CHECK(i2cdev_init());
     dev_bme280 = init_bme280();
-    
-    /* Wait a bit for main to finish initialization */
-    vTaskDelay(pdMS_TO_TICKS(200));
-    
+    boot_profile_end(BOOT_PHASE_SENSOR);
+
     /* Try to add task to watchdog monitoring */
     esp_err_t err = esp_task_wdt_add(current_task);
     if (err == ESP_OK) {
@@ -105,16 +275,45 @@ void task_sensors(void* msg_queue)
     } else {
         ESP_LOGW(TAG, "Could not add sensor task to watchdog: %s", esp_err_to_name(err));
     }
-    
+
+    /* First sample right away rather than one period from now, it is the one
+       the first publish after boot waits for */
+    if (sensor_profiles[active_profile].mode == BMP280_MODE_FORCED &&
+        bmp280_force_measurement(dev_bme280) != ESP_OK) {
+        ESP_LOGE(TAG, "Starting the conversion failed");
+    }
+    vTaskDelay(conversion_ticks(&sensor_profiles[active_profile]));
+    read_send_bme280(dev_bme280, (spsc_ring_t *)msg_ring);
+
+    xLastWakeTime = xTaskGetTickCount();
+
     while(1){
-        /* Feed the watchdog only if is active */
-        if (added_to_wdt) {
-            esp_task_wdt_reset();
-            ESP_LOGD(TAG, "Sensor task watchdog fed");
+        const sensor_profile_t *profile = &sensor_profiles[active_profile];
+        const TickType_t period = pdMS_TO_TICKS(profile->period_ms);
+        bool on_time = true;
+
+        if (profile->mode == BMP280_MODE_FORCED) {
+            /* Start the conversion ahead of the deadline, so the read below never waits for it */
+            TickType_t trigger = xLastWakeTime;
+            TickType_t lead = conversion_ticks(profile);
+
+            on_time = sensor_delay_until(&trigger, period > lead ? period - lead : 0, added_to_wdt);
+            if (on_time && bmp280_force_measurement(dev_bme280) != ESP_OK) {
+                ESP_LOGE(TAG, "Starting the conversion failed");
+            }
+        }
+
+        if (on_time) {
+            on_time = sensor_delay_until(&xLastWakeTime, period, added_to_wdt);
+        }
+
+        if (!on_time) {
+            /* Profile changed, reconfigure and start a new schedule from now */
+            apply_profile(dev_bme280, &sensor_profiles[active_profile]);
+            xLastWakeTime = xTaskGetTickCount();
+            continue;
         }
-        
-        vTaskDelayUntil(&xLastWakeTime, xTimeIncrement);
 
-        read_send_bme280(dev_bme280, msg_queue);
+        read_send_bme280(dev_bme280, (spsc_ring_t *)msg_ring);
     }
 }
\ No newline at end of file
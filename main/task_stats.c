@@ -0,0 +1,198 @@
+#include "h/task_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+const static char *TAG = "__STATS__";
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+#define NUM_CORES CONFIG_FREERTOS_NUMBER_OF_CORES
+
+typedef struct
+{
+    char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+    int core;                   /* -1 if not pinned */
+    unsigned prio;
+    eTaskState state;
+    uint32_t cpu_permille;      /* Of one core, over the window */
+    uint32_t stack_free;
+} task_report_t;
+
+/* Two raw snapshots, swapped every window */
+static TaskStatus_t snap_a[CONFIG_TASK_STATS_MAX_TASKS];
+static TaskStatus_t snap_b[CONFIG_TASK_STATS_MAX_TASKS];
+static TaskStatus_t *prev = snap_a, *curr = snap_b;
+static UBaseType_t prev_count = 0;
+static uint32_t prev_total = 0;
+static int64_t last_poll_us = 0;
+
+/* Last completed window, read by the HTTP server and the comms task */
+static task_report_t report[CONFIG_TASK_STATS_MAX_TASKS];
+static int report_count = -1;
+static uint32_t report_window_ms = 0;
+static uint32_t core_load_permille[NUM_CORES];
+static SemaphoreHandle_t report_lock = NULL;
+
+
+static const char *state_name(eTaskState state)
+{
+    switch (state) {
+        case eRunning:   return "running";
+        case eReady:     return "ready";
+        case eBlocked:   return "blocked";
+        case eSuspended: return "suspended";
+        case eDeleted:   return "deleted";
+        default:         return "invalid";
+    }
+}
+
+
+static const TaskStatus_t *find_prev(UBaseType_t task_number)
+{
+    for (UBaseType_t i = 0; i < prev_count; i++) {
+        if (prev[i].xTaskNumber == task_number) {
+            return &prev[i];
+        }
+    }
+    return NULL;
+}
+
+
+bool task_stats_poll(void)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t total, elapsed;
+    UBaseType_t count;
+    TaskStatus_t *tmp;
+
+    if (report_lock == NULL) {
+        report_lock = xSemaphoreCreateMutex();
+        if (report_lock == NULL) {
+            return false;
+        }
+    }
+
+    if (last_poll_us != 0 && now - last_poll_us < (int64_t)CONFIG_TASK_STATS_WINDOW_S * 1000000) {
+        return false;
+    }
+    last_poll_us = now;
+
+    count = uxTaskGetSystemState(curr, CONFIG_TASK_STATS_MAX_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, raise CONFIG_TASK_STATS_MAX_TASKS", CONFIG_TASK_STATS_MAX_TASKS);
+        return false;
+    }
+
+    /* The first snapshot is only a baseline. Counters may wrap, unsigned diffs handle it. */
+    elapsed = total - prev_total;
+    if (prev_count > 0 && elapsed > 0) {
+        xSemaphoreTake(report_lock, portMAX_DELAY);
+
+        for (int c = 0; c < NUM_CORES; c++) {
+            core_load_permille[c] = 1000;
+        }
+
+        for (UBaseType_t i = 0; i < count; i++) {
+            const TaskStatus_t *t = &curr[i];
+            const TaskStatus_t *p = find_prev(t->xTaskNumber);
+            task_report_t *r = &report[i];
+            /* A task created during the window ran at most since then */
+            uint32_t ran = t->ulRunTimeCounter - (p ? p->ulRunTimeCounter : 0);
+            BaseType_t core = xTaskGetCoreID(t->xHandle);
+
+            strncpy(r->name, t->pcTaskName, sizeof(r->name) - 1);
+            r->name[sizeof(r->name) - 1] = '\0';
+            r->core = (core >= 0 && core < NUM_CORES) ? (int)core : -1;
+            r->prio = t->uxCurrentPriority;
+            r->state = t->eCurrentState;
+            r->stack_free = t->usStackHighWaterMark;
+            r->cpu_permille = (uint32_t)((uint64_t)ran * 1000 / elapsed);
+
+            /* Core load is whatever its idle task did not get */
+            for (int c = 0; c < NUM_CORES; c++) {
+                if (t->xHandle == xTaskGetIdleTaskHandleForCore(c)) {
+                    core_load_permille[c] = (r->cpu_permille < 1000) ? 1000 - r->cpu_permille : 0;
+                }
+            }
+        }
+        report_count = count;
+        report_window_ms = elapsed / 1000;
+
+        xSemaphoreGive(report_lock);
+    }
+
+    tmp = prev;
+    prev = curr;
+    curr = tmp;
+    prev_count = count;
+    prev_total = total;
+
+    return report_count >= 0;
+}
+
+
+int task_stats_json(char *buf, size_t len)
+{
+    int n;
+
+    if (report_lock == NULL) {
+        return -1;
+    }
+
+    xSemaphoreTake(report_lock, portMAX_DELAY);
+
+    if (report_count < 0) {
+        xSemaphoreGive(report_lock);
+        return -1;
+    }
+
+    n = snprintf(buf, len, "{\"window_ms\":%lu,\"cores\":[", (unsigned long)report_window_ms);
+    for (int c = 0; c < NUM_CORES && n < len; c++) {
+        n += snprintf(buf + n, len - n, "%s{\"core\":%d,\"load\":%lu.%lu}", c ? "," : "", c,
+                      (unsigned long)(core_load_permille[c] / 10), (unsigned long)(core_load_permille[c] % 10));
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, "],\"tasks\":[");
+    }
+    for (int i = 0; i < report_count && n < len; i++) {
+        const task_report_t *r = &report[i];
+        n += snprintf(buf + n, len - n,
+                      "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,\"state\":\"%s\",\"cpu\":%lu.%lu,\"stack_free\":%lu}",
+                      i ? "," : "", r->name, r->core, r->prio, state_name(r->state),
+                      (unsigned long)(r->cpu_permille / 10), (unsigned long)(r->cpu_permille % 10),
+                      (unsigned long)r->stack_free);
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, "]}");
+    }
+
+    xSemaphoreGive(report_lock);
+
+    return (n < len) ? n : -1;
+}
+
+#else /* Run-time stats not enabled in menuconfig */
+
+bool task_stats_poll(void)
+{
+    static bool warned = false;
+
+    if (!warned) {
+        ESP_LOGW(TAG, "Enable FREERTOS_USE_TRACE_FACILITY and FREERTOS_GENERATE_RUN_TIME_STATS for task stats");
+        warned = true;
+    }
+    return false;
+}
+
+int task_stats_json(char *buf, size_t len)
+{
+    return -1;
+}
+
+#endif
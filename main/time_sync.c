@@ -0,0 +1,73 @@
+#include "h/time_sync.h"
+
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_netif_sntp.h"
+#endif
+
+const static char *TAG = "__SNTP__";
+
+static bool started = false;
+static volatile bool synced = false;
+
+
+#if !CONFIG_IDF_TARGET_LINUX
+static void time_sync_cb(struct timeval *tv)
+{
+    if (!synced) {
+        ESP_LOGI(TAG, "Clock synced, unix time %lld", (long long)tv->tv_sec);
+    }
+    synced = true;
+}
+#endif
+
+
+void time_sync_start(void)
+{
+    if (started) {
+        return;
+    }
+
+#if CONFIG_IDF_TARGET_LINUX
+    /* Simulation build: the host keeps its own clock synced */
+    started = true;
+    synced = true;
+    ESP_LOGI(TAG, "Host clock, no SNTP");
+#else
+    /* Do not block the event loop, the sync callback reports the result */
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_SNTP_SERVER);
+    config.sync_cb = time_sync_cb;
+
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "SNTP init failed (%s)", esp_err_to_name(err));
+        return;
+    }
+
+    started = true;
+    ESP_LOGI(TAG, "SNTP started, server %s", CONFIG_SNTP_SERVER);
+#endif
+}
+
+
+bool time_sync_is_synced(void)
+{
+    return synced;
+}
+
+
+int64_t time_sync_epoch_ms(int64_t timer_us)
+{
+    struct timeval tv;
+
+    if (!synced) {
+        return 0;
+    }
+
+    /* Both clocks are read now, the difference is the age of timer_us */
+    gettimeofday(&tv, NULL);
+    int64_t now_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    return (now_us - (esp_timer_get_time() - timer_us)) / 1000;
+}
@@ -1,40 +1,231 @@
 #include "h/wifi.h"
 #include "h/dns_server.h"
+#include "h/settings.h"
+#include "h/metrics.h"
 #include <string.h>
+#include <sys/param.h>
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
 
 static const char *TAG = "__WIFI__";
 static esp_netif_t *ap_netif = NULL;
 static esp_netif_t *sta_netif = NULL;
 static bool backup_wifi_connected = false;
 static bool backup_wifi_enabled = false;
+static bool sta_started = false;
+
+/* Backup network, replaced by the one saved in NVS */
+static char sta_ssid[BACKUP_WIFI_SSID_LEN + 1] = BACKUP_WIFI_SSID;
+static char sta_pass[BACKUP_WIFI_PASS_LEN + 1] = BACKUP_WIFI_PASS;
+
+/* Last AP that gave an IP, kept in NVS. Connecting to it skips the scan of all channels */
+typedef struct __attribute__((__packed__))
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+} sta_ap_t;
+
+static sta_ap_t cached_ap;
+static bool cached_ap_valid = false;
+static bool cached_ap_tried = false;    /* The attempt in progress is on the cached AP */
+static sta_ap_t connected_ap;           /* From STA_CONNECTED, cached once it gives an IP */
+
+/* Reconnects run from a timer, never block the default event loop */
+static esp_timer_handle_t retry_timer = NULL;
+static uint32_t retry_base_ms = 0;      /* 0 until the first failure */
+static int64_t outage_start_us = 0;     /* Disconnect (or enable) not followed by an IP yet, 0 if none */
+static wifi_backup_stats_t stats;
+
+/*
+ *  The state above is used from the default event loop, the retry timer,
+ *  the link manager (event loop and probe task) and the portal. It is only
+ *  touched under state_lock; the esp_wifi calls are made after it is
+ *  released, on what was decided under it.
+ */
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/*
+ * @brief Start a connect attempt, straight to the cached AP if there is one
+ *
+ *  Called without state_lock, once the caller decided to connect under it.
+ */
+static void sta_connect(void)
+{
+    wifi_config_t sta_config = {
+        .sta = {
+            .pmf_cfg = {
+                .capable = true,
+                .required = false
+            },
+        },
+    };
+    esp_err_t err;
+
+    portENTER_CRITICAL(&state_lock);
+    memcpy(sta_config.sta.ssid, sta_ssid, strnlen(sta_ssid, sizeof(sta_config.sta.ssid)));
+    memcpy(sta_config.sta.password, sta_pass, strnlen(sta_pass, sizeof(sta_config.sta.password)));
+    sta_config.sta.threshold.authmode = sta_pass[0] ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+
+    cached_ap_tried = cached_ap_valid;
+    if (cached_ap_valid) {
+        sta_config.sta.bssid_set = true;
+        memcpy(sta_config.sta.bssid, cached_ap.bssid, sizeof(cached_ap.bssid));
+        sta_config.sta.channel = cached_ap.channel;
+        sta_config.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        /* The strongest AP of the network, not the first one heard */
+        sta_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        sta_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    esp_wifi_set_config(WIFI_IF_STA, &sta_config);
+    err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Backup WiFi connect failed to start (%s)", esp_err_to_name(err));
+    }
+}
+
+
+static void retry_timer_cb(void *arg)
+{
+    bool connect;
+
+    portENTER_CRITICAL(&state_lock);
+    connect = backup_wifi_enabled && !backup_wifi_connected;
+    portEXIT_CRITICAL(&state_lock);
+
+    if (connect) {
+        sta_connect();
+    }
+}
+
+
+/*
+ * @brief Retry after an exponential backoff, half of it random
+ *
+ *  The random half keeps the boards behind one AP from retrying in step
+ *  after it restarts.
+ */
+static void schedule_retry(void)
+{
+    uint32_t delay_ms;
+
+    portENTER_CRITICAL(&state_lock);
+    retry_base_ms = retry_base_ms ? MIN(retry_base_ms * 2, CONFIG_WIFI_RETRY_MAX_MS) : CONFIG_WIFI_RETRY_MIN_MS;
+    delay_ms = retry_base_ms / 2 + esp_random() % (retry_base_ms / 2 + 1);
+    stats.retries++;
+    portEXIT_CRITICAL(&state_lock);
+
+    metric_inc(METRIC_WIFI_RETRIES);
+    ESP_LOGI(TAG, "Retrying backup WiFi connection in %lu ms", (unsigned long)delay_ms);
+
+    esp_timer_stop(retry_timer);
+    esp_timer_start_once(retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+
+/*
+ * @brief Got an IP: stop the backoff, measure the outage and cache the AP
+ */
+static void sta_got_ip(void)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t outage_ms = 0;
+    bool save = false;
+    sta_ap_t ap;
+
+    portENTER_CRITICAL(&state_lock);
+    backup_wifi_connected = true;
+    retry_base_ms = 0;
+    stats.connects++;
+
+    if (outage_start_us) {
+        outage_ms = (now - outage_start_us) / 1000;
+        stats.last_ms = outage_ms;
+        stats.max_ms = MAX(stats.max_ms, stats.last_ms);
+        outage_start_us = 0;
+    }
+
+    /* Only written when it changed, NVS is on flash */
+    if (!cached_ap_valid || memcmp(&cached_ap, &connected_ap, sizeof(cached_ap)) != 0) {
+        cached_ap = connected_ap;
+        cached_ap_valid = true;
+        ap = cached_ap;
+        save = true;
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    if (outage_ms) {
+        ESP_LOGI(TAG, "Backup WiFi up %lu ms after the disconnect", (unsigned long)outage_ms);
+    }
+    if (save) {
+        settings_set_blob(SETTINGS_KEY_STA_AP, &ap, sizeof(ap));
+    }
+}
+
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    bool connect, retry, cached, missed;
+
     switch(event_id) {
         case WIFI_EVENT_STA_START:
             ESP_LOGI(TAG, "WiFi STA started");
-            if (backup_wifi_enabled) {
-                esp_wifi_connect();
+            /* wifi_connect_backup() connects itself once sta_started is set, not both */
+            portENTER_CRITICAL(&state_lock);
+            sta_started = true;
+            connect = backup_wifi_enabled;
+            portEXIT_CRITICAL(&state_lock);
+            if (connect) {
+                sta_connect();
             }
             break;
 
         case WIFI_EVENT_STA_CONNECTED:
-            ESP_LOGI(TAG, "WiFi STA connected to backup network");
+            wifi_event_sta_connected_t *event_conn = (wifi_event_sta_connected_t *)event_data;
+            portENTER_CRITICAL(&state_lock);
+            memcpy(connected_ap.bssid, event_conn->bssid, sizeof(connected_ap.bssid));
+            connected_ap.channel = event_conn->channel;
+            cached = cached_ap_tried;
+            cached_ap_tried = false;
+            portEXIT_CRITICAL(&state_lock);
+            ESP_LOGI(TAG, "WiFi STA connected to backup network, AP " MACSTR " channel %d%s",
+                     MAC2STR(event_conn->bssid), event_conn->channel, cached ? " (cached, no scan)" : "");
             break;
 
         case WIFI_EVENT_STA_DISCONNECTED:
-            ESP_LOGI(TAG, "WiFi STA disconnected from backup network");
+            wifi_event_sta_disconnected_t *event_disc = (wifi_event_sta_disconnected_t *)event_data;
+            ESP_LOGI(TAG, "WiFi STA disconnected from backup network, reason %d", event_disc->reason);
+            portENTER_CRITICAL(&state_lock);
             backup_wifi_connected = false;
-            if (backup_wifi_enabled) {
-                ESP_LOGI(TAG, "Retrying backup WiFi connection...");
-                vTaskDelay(pdMS_TO_TICKS(3000)); // Wait before retry
-                esp_wifi_connect();
+            retry = backup_wifi_enabled;
+            missed = retry && cached_ap_tried;
+            if (retry && outage_start_us == 0) {
+                outage_start_us = esp_timer_get_time();
+            }
+            if (missed) {
+                /* Gone or moved, scan for the network on the next attempts */
+                cached_ap_tried = false;
+                cached_ap_valid = false;
+                stats.cached_ap_misses++;
+            }
+            portEXIT_CRITICAL(&state_lock);
+
+            if (missed) {
+                ESP_LOGW(TAG, "Cached AP not reached, scanning all channels next");
+            }
+            if (retry) {
+                schedule_retry();
             }
             break;
 
         case IP_EVENT_STA_GOT_IP:
             ip_event_got_ip_t *event_ip = (ip_event_got_ip_t *)event_data;
             ESP_LOGI(TAG, "WiFi STA Got IP: " IPSTR, IP2STR(&event_ip->ip_info.ip));
-            backup_wifi_connected = true;
+            sta_got_ip();
             break;
         
         case WIFI_EVENT_AP_STACONNECTED:
@@ -51,6 +242,17 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
 }
 
 void wifi_init_ap_sta_mode(void) {
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = retry_timer_cb,
+        .name = "wifi_retry",
+    };
+
+    /* Backup network and its last AP saved from a previous boot */
+    settings_get_str(SETTINGS_KEY_STA_SSID, sta_ssid, sizeof(sta_ssid));
+    settings_get_str(SETTINGS_KEY_STA_PASS, sta_pass, sizeof(sta_pass));
+    cached_ap_valid = (settings_get_blob(SETTINGS_KEY_STA_AP, &cached_ap, sizeof(cached_ap)) == ESP_OK);
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &retry_timer));
+
     /* Create network interfaces for both AP and STA */
     ap_netif = esp_netif_create_default_wifi_ap();
     sta_netif = esp_netif_create_default_wifi_sta();
@@ -82,23 +284,11 @@ void wifi_init_ap_sta_mode(void) {
         },
     };
 
-    /* Configure STA (Station) mode for backup network */
-    wifi_config_t sta_config = {
-        .sta = {
-            .ssid = BACKUP_WIFI_SSID,
-            .password = BACKUP_WIFI_PASS,
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-            .pmf_cfg = {
-                .capable = true,
-                .required = false
-            },
-        },
-    };
+    /* The STA config is set on every connect, see sta_connect() */
 
     /* Set WiFi mode to AP+STA */
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &ap_config));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config));
     
     /* Configure custom IP address for AP */
     esp_netif_ip_info_t ip_info;
@@ -121,23 +311,102 @@ void wifi_init_ap_sta_mode(void) {
 }
 
 void wifi_connect_backup(void) {
-    if (!backup_wifi_enabled) {
+    int64_t now = esp_timer_get_time();
+    bool enable, connect;
+
+    /* Check and set in one go, two callers at once start a single connect */
+    portENTER_CRITICAL(&state_lock);
+    enable = !backup_wifi_enabled;
+    if (enable) {
         backup_wifi_enabled = true;
-        ESP_LOGI(TAG, "Enabling backup WiFi connection to %s", BACKUP_WIFI_SSID);
-        esp_wifi_connect();
+        retry_base_ms = 0;
+        outage_start_us = now;
+    }
+    /* Before the STA has started, WIFI_EVENT_STA_START connects */
+    connect = enable && sta_started;
+    portEXIT_CRITICAL(&state_lock);
+
+    if (enable) {
+        ESP_LOGI(TAG, "Enabling backup WiFi connection");
+    }
+    if (connect) {
+        sta_connect();
     }
 }
 
 void wifi_disconnect_backup(void) {
-    if (backup_wifi_enabled) {
+    bool disable;
+
+    portENTER_CRITICAL(&state_lock);
+    disable = backup_wifi_enabled;
+    if (disable) {
         backup_wifi_enabled = false;
         backup_wifi_connected = false;
+        outage_start_us = 0;
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    if (disable) {
         ESP_LOGI(TAG, "Disabling backup WiFi connection");
+        if (retry_timer) {
+            esp_timer_stop(retry_timer);
+        }
         esp_wifi_disconnect();
     }
 }
 
 bool wifi_is_backup_connected(void) {
-    return backup_wifi_connected;
+    bool connected;
+
+    portENTER_CRITICAL(&state_lock);
+    connected = backup_wifi_connected;
+    portEXIT_CRITICAL(&state_lock);
+    return connected;
 }
 
+esp_err_t wifi_set_backup_network(const char *ssid, const char *pass) {
+    esp_err_t err = settings_set_str(SETTINGS_KEY_STA_SSID, ssid);
+    bool reconnect;
+
+    if (err == ESP_OK && pass) {
+        err = settings_set_str(SETTINGS_KEY_STA_PASS, pass);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&state_lock);
+    snprintf(sta_ssid, sizeof(sta_ssid), "%s", ssid);
+    if (pass) {
+        snprintf(sta_pass, sizeof(sta_pass), "%s", pass);
+    }
+    cached_ap_valid = false;
+    reconnect = backup_wifi_enabled && sta_started;
+    if (reconnect) {
+        retry_base_ms = 0;
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    settings_erase(SETTINGS_KEY_STA_AP);
+    ESP_LOGI(TAG, "Backup WiFi network set to %s", ssid);
+
+    /* Leave the old network, the retry timer joins the new one */
+    if (reconnect) {
+        esp_wifi_disconnect();
+        esp_timer_stop(retry_timer);
+        esp_timer_start_once(retry_timer, (uint64_t)CONFIG_WIFI_RETRY_MIN_MS * 1000);
+    }
+    return ESP_OK;
+}
+
+void wifi_backup_ssid(char *ssid) {
+    portENTER_CRITICAL(&state_lock);
+    memcpy(ssid, sta_ssid, sizeof(sta_ssid));
+    portEXIT_CRITICAL(&state_lock);
+}
+
+void wifi_backup_stats(wifi_backup_stats_t *out) {
+    portENTER_CRITICAL(&state_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&state_lock);
+}
@@ -0,0 +1,176 @@
+/*
+ * Host benchmark: payload size and encode cost of the sensor stream.
+ *
+ * Compares, on the same synthetic samples:
+ *  - per-type text: one "%.2f" message per value (CONFIG_SENSOR_PUBLISH_MODE_PER_TYPE)
+ *  - JSON batch: the /sensor_<ID>/batch payload of publisher.c
+ *  - binary batch: sensor_codec.c, /sensor_<ID>/bin
+ *
+ * Sizes are payload bytes only, the MQTT fixed header and topic come on top
+ * (once per message, i.e. 3 times per sample in per-type mode).
+ * The binary payloads are decoded back and checked against the input.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "h/sensor_queue.h"
+#include "h/sensor_codec.h"
+
+#define SAMPLES     120000
+#define BATCH       12
+#define ROUNDS      5
+
+static sensq samples[SAMPLES];
+static char text[64 + BATCH * 112];
+static uint8_t bin[SENSOR_CODEC_MAX_LEN(BATCH)];
+static volatile size_t sink;
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Slow random walk around indoor values, like the BME280 on a desk */
+static void generate(void)
+{
+    float t = 21.5f, h = 40.0f, p = 101325.0f;
+
+    srand(1);
+    for (int i = 0; i < SAMPLES; i++) {
+        t += ((rand() % 21) - 10) * 0.002f;
+        h += ((rand() % 21) - 10) * 0.01f;
+        p += ((rand() % 21) - 10) * 0.3f;
+        samples[i].seq = i;
+        samples[i].timestamp_us = 1000000LL + i * 5000000LL + (rand() % 2000);
+        samples[i].value[INVALID] = 0;
+        samples[i].value[TEMP] = t;
+        samples[i].value[HUM] = h;
+        samples[i].value[PRES] = p;
+    }
+}
+
+
+static size_t encode_per_type(const sensq *s, int count)
+{
+    char mqttdata[11];
+    size_t bytes = 0;
+
+    for (int i = 0; i < count; i++) {
+        SENSQ_FOREACH_CHANNEL(type) {
+            bytes += snprintf(mqttdata, sizeof(mqttdata), "%.2f", s[i].value[type]);
+        }
+    }
+    return bytes;
+}
+
+
+/* Same output as format_batch() in publisher.c */
+static size_t encode_json(const sensq *s, int count)
+{
+    int len = snprintf(text, sizeof(text), "{\"id\":\"%s\",\"samples\":[", "ESP-1");
+
+    for (int i = 0; i < count; i++) {
+        len += snprintf(text + len, sizeof(text) - len, "%s{\"seq\":%lu,\"t\":%lld",
+                        i ? "," : "", (unsigned long)s[i].seq, (long long)(s[i].timestamp_us / 1000));
+        SENSQ_FOREACH_CHANNEL(type) {
+            len += snprintf(text + len, sizeof(text) - len, ",\"%s\":%.2f", sensq_string[type], s[i].value[type]);
+        }
+        len += snprintf(text + len, sizeof(text) - len, "}");
+    }
+    len += snprintf(text + len, sizeof(text) - len, "]}");
+    return len;
+}
+
+
+static size_t encode_binary(const sensq *s, int count)
+{
+    int len = sensor_codec_encode(s, count, bin, sizeof(bin));
+    if (len < 0) {
+        fprintf(stderr, "binary encode failed\n");
+        exit(1);
+    }
+    return len;
+}
+
+
+static void run(const char *name, size_t (*encode)(const sensq *, int), int batch)
+{
+    size_t bytes = 0;
+    double best = 1e9;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        double t0 = now_s();
+        bytes = 0;
+        for (int i = 0; i < SAMPLES; i += batch) {
+            bytes += encode(&samples[i], batch);
+        }
+        double dt = now_s() - t0;
+        if (dt < best) {
+            best = dt;
+        }
+    }
+    sink += bytes;
+
+    printf("%-28s %7.2f bytes/sample %8.1f ns/sample\n", name, (double)bytes / SAMPLES, best * 1e9 / SAMPLES);
+}
+
+
+/* Decode every binary batch and compare with the input at the codec resolution */
+static int check_roundtrip(void)
+{
+    sensq out[BATCH];
+    unsigned long errors = 0;
+    double t0 = now_s();
+
+    for (int i = 0; i < SAMPLES; i += BATCH) {
+        int len = sensor_codec_encode(&samples[i], BATCH, bin, sizeof(bin));
+        if (sensor_codec_decode(bin, len, out, BATCH) != BATCH) {
+            errors++;
+            continue;
+        }
+        for (int j = 0; j < BATCH; j++) {
+            const sensq *in = &samples[i + j];
+            if (out[j].seq != in->seq || out[j].timestamp_us != in->timestamp_us / 1000 * 1000) {
+                errors++;
+            }
+            SENSQ_FOREACH_CHANNEL(type) {
+                if (fabsf(out[j].value[type] - in->value[type]) > 0.51f / sensor_codec_scale[type] + fabsf(in->value[type]) * 1e-6f) {
+                    errors++;
+                }
+            }
+        }
+    }
+    double dt = now_s() - t0;
+
+    /* Truncated payloads must be rejected, not read past the end */
+    int len = sensor_codec_encode(samples, BATCH, bin, sizeof(bin));
+    for (int cut = 0; cut < len; cut++) {
+        if (sensor_codec_decode(bin, cut, out, BATCH) >= 0) {
+            errors++;
+        }
+    }
+
+    printf("%-28s %7s              %8.1f ns/sample  errors=%lu\n", "binary encode+decode", "", dt * 1e9 / SAMPLES, errors);
+    return errors != 0;
+}
+
+
+int main(void)
+{
+    generate();
+    printf("%d samples, batches of %d\n\n", SAMPLES, BATCH);
+
+    run("per-type text (%.2f x3)", encode_per_type, 1);
+    run("JSON batch", encode_json, BATCH);
+    run("binary batch (v1)", encode_binary, BATCH);
+    run("binary, 1 sample/message", encode_binary, 1);
+
+    return check_roundtrip();
+}
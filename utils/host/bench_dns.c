@@ -0,0 +1,402 @@
+/*
+ * Host harness for the captive portal DNS responder (main/dns_proto.c).
+ *
+ *  - replies: every query of the set is answered and checked (A answer with
+ *    the redirect address, NODATA + SOA for the other types, question kept)
+ *  - throughput: queries/s of dns_reply_build and the latency distribution
+ *    of single calls, worst case included
+ *  - fuzz: mutated and random messages, checking that nothing is written
+ *    past the buffer and that every reply is well formed (build with
+ *    `make fuzz` to run it under ASan / UBSan)
+ *  - rate limit: a flooding client next to normal ones, in simulated time
+ *
+ * The query set is built in, or recorded from a capture, one hex query per line:
+ *   tshark -r portal.pcap -Y "dns.flags.response == 0" -T fields -e udp.payload > queries.txt
+ *   ./build/bench_dns queries.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "h/dns_proto.h"
+
+#define MAX_QUERIES     4096
+#define BENCH_ROUNDS    2000000
+#define LATENCY_SAMPLES 200000
+#define FUZZ_ROUNDS     2000000
+#define CANARY          0xA5
+#define CANARY_LEN      64
+
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_HTTPS  65
+
+typedef struct {
+    uint8_t data[DNS_MAX_LEN];
+    size_t len;
+} query_t;
+
+static query_t queries[MAX_QUERIES];
+static int query_count = 0;
+static uint32_t redirect_ip;
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+/* ________________ Query set ________________ */
+
+static void add_query(const char *name, uint16_t qtype, int edns)
+{
+    query_t *q = &queries[query_count++];
+    uint8_t *p = q->data;
+    const char *label = name;
+
+    static const uint8_t header[] = { 0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    memcpy(p, header, sizeof(header));
+    p[0] = query_count >> 8;
+    p[1] = query_count & 0xFF;
+    p += sizeof(header);
+
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t n = dot ? (size_t)(dot - label) : strlen(label);
+        *p++ = n;
+        memcpy(p, label, n);
+        p += n;
+        label += n + (dot ? 1 : 0);
+    }
+    *p++ = 0;
+    *p++ = qtype >> 8;
+    *p++ = qtype & 0xFF;
+    *p++ = 0;
+    *p++ = DNS_CLASS_IN;
+
+    if (edns) {
+        /* OPT RR, 1232 byte UDP size, as sent by most stub resolvers */
+        static const uint8_t opt[] = { 0, 0, 41, 0x04, 0xD0, 0, 0, 0, 0, 0, 0 };
+        memcpy(p, opt, sizeof(opt));
+        p += sizeof(opt);
+        q->data[11] = 1;
+    }
+    q->len = p - q->data;
+}
+
+/* What phones and laptops send when they join the hotspot */
+static void builtin_queries(void)
+{
+    static const char *names[] = {
+        "connectivitycheck.gstatic.com", "www.google.com", "clients3.google.com",
+        "captive.apple.com", "www.apple.com", "www.msftconnecttest.com", "dns.msftncsi.com",
+        "detectportal.firefox.com", "nmcheck.gnome.org", "connectivity-check.ubuntu.com",
+        "esp32.config", "a.very.long.name.with.many.labels.to.walk.through.example.com",
+    };
+    static const uint16_t types[] = { DNS_TYPE_A, DNS_TYPE_AAAA, DNS_TYPE_HTTPS };
+
+    for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+        for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+            add_query(names[n], types[t], 0);
+            add_query(names[n], types[t], 1);
+        }
+    }
+}
+
+static int load_queries(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[4 * DNS_MAX_LEN];
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (query_count < MAX_QUERIES && fgets(line, sizeof(line), f)) {
+        query_t *q = &queries[query_count];
+        int hi = -1;
+        q->len = 0;
+        /* Hex digits only, so "0a:1b" and "0a1b" both work */
+        for (char *c = line; *c && q->len < DNS_MAX_LEN; c++) {
+            if (!isxdigit((unsigned char)*c)) {
+                continue;
+            }
+            int v = isdigit((unsigned char)*c) ? *c - '0' : tolower((unsigned char)*c) - 'a' + 10;
+            if (hi < 0) {
+                hi = v;
+            } else {
+                q->data[q->len++] = hi << 4 | v;
+                hi = -1;
+            }
+        }
+        if (q->len >= DNS_HEADER_LEN) {
+            query_count++;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/* ________________ Reply checks ________________ */
+
+/* Structure of a reply to a valid query, returns NULL if fine */
+static const char *check_reply(const query_t *q, const uint8_t *r, size_t len, const dns_query_info_t *info)
+{
+    size_t qend;
+
+    if (len < DNS_HEADER_LEN || len > DNS_MAX_LEN) return "length";
+    if (memcmp(r, q->data, 2) != 0) return "id";
+    if (!(r[2] & 0x80)) return "QR not set";
+    if (info->kind == DNS_REPLY_ERROR) return rd16(r + 4) == 0 ? NULL : "error with a question";
+
+    /* Question copied unchanged */
+    for (qend = DNS_HEADER_LEN; qend < len && r[qend]; qend += r[qend] + 1) {
+    }
+    qend += 5;
+    if (qend > len || memcmp(r + DNS_HEADER_LEN, q->data + DNS_HEADER_LEN, qend - DNS_HEADER_LEN) != 0) {
+        return "question";
+    }
+    if (rd16(r + 4) != 1 || rd16(r + 10) != 0) return "counts";
+
+    if (info->kind == DNS_REPLY_ANSWER) {
+        if (rd16(r + 6) != 1 || rd16(r + 8) != 0 || len != qend + 16) return "answer counts";
+        if (rd16(r + qend + 2) != DNS_TYPE_A || memcmp(r + len - 4, &redirect_ip, 4) != 0) return "answer record";
+        if (info->qtype != DNS_TYPE_A && info->qtype != DNS_TYPE_ANY) return "A answer to another type";
+    } else if (info->kind == DNS_REPLY_NODATA) {
+        if (rd16(r + 6) != 0 || rd16(r + 8) != 1 || len != qend + 36) return "nodata counts";
+        if (rd16(r + qend + 2) != DNS_TYPE_SOA) return "nodata record";
+        if (info->qtype == DNS_TYPE_A) return "NODATA to an A query";
+    } else {
+        return "dropped";
+    }
+    return NULL;
+}
+
+static int run_replies(void)
+{
+    uint8_t buf[DNS_MAX_LEN];
+    dns_query_info_t info;
+    char name[DNS_NAME_MAX + 1];
+    int counts[4] = { 0 };
+    int errors = 0;
+
+    for (int i = 0; i < query_count; i++) {
+        const query_t *q = &queries[i];
+        memcpy(buf, q->data, q->len);
+        size_t len = dns_reply_build(buf, q->len, sizeof(buf), redirect_ip, &info);
+        const char *err = check_reply(q, buf, len, &info);
+
+        counts[info.kind]++;
+        if (err) {
+            dns_question_name(q->data, q->len, name, sizeof(name));
+            printf("  !! query %d (%s, type %u): %s\n", i, name, info.qtype, err);
+            errors++;
+        }
+    }
+    printf("replies     %d queries: %d A, %d NODATA, %d errors, %d dropped, %d bad replies\n",
+           query_count, counts[DNS_REPLY_ANSWER], counts[DNS_REPLY_NODATA], counts[DNS_REPLY_ERROR],
+           counts[DNS_REPLY_DROP], errors);
+    return errors;
+}
+
+
+/* ________________ Throughput ________________ */
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_throughput(void)
+{
+    static uint64_t lat[LATENCY_SAMPLES];
+    uint8_t buf[DNS_MAX_LEN];
+    size_t total = 0;
+    double t0, t1;
+
+    /* The copy stands in for recvfrom() filling the buffer */
+    t0 = now_s();
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        const query_t *q = &queries[i % query_count];
+        memcpy(buf, q->data, q->len);
+        total += dns_reply_build(buf, q->len, sizeof(buf), redirect_ip, NULL);
+    }
+    t1 = now_s();
+
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        const query_t *q = &queries[i % query_count];
+        memcpy(buf, q->data, q->len);
+        uint64_t s = now_ns();
+        total += dns_reply_build(buf, q->len, sizeof(buf), redirect_ip, NULL);
+        lat[i] = now_ns() - s;
+    }
+    qsort(lat, LATENCY_SAMPLES, sizeof(lat[0]), cmp_u64);
+
+    printf("throughput  %10.0f queries/s  %6.1f ns/query  (%zu reply bytes)\n",
+           BENCH_ROUNDS / (t1 - t0), (t1 - t0) * 1e9 / BENCH_ROUNDS, total);
+    printf("latency     p50 %llu ns  p99 %llu ns  p99.9 %llu ns  max %llu ns (clock overhead included)\n",
+           (unsigned long long)lat[LATENCY_SAMPLES / 2], (unsigned long long)lat[LATENCY_SAMPLES * 99 / 100],
+           (unsigned long long)lat[LATENCY_SAMPLES * 999 / 1000], (unsigned long long)lat[LATENCY_SAMPLES - 1]);
+}
+
+
+/* ________________ Fuzz ________________ */
+
+static void mutate(uint8_t *m, size_t *len)
+{
+    int ops = 1 + rand() % 4;
+
+    while (ops--) {
+        switch (rand() % 6) {
+        case 0:         /* Bit flip */
+            m[rand() % *len] ^= 1 << (rand() % 8);
+            break;
+        case 1:         /* Random byte, often a label length */
+            m[DNS_HEADER_LEN + rand() % (*len > DNS_HEADER_LEN ? *len - DNS_HEADER_LEN : 1)] = rand();
+            break;
+        case 2:         /* Truncate */
+            *len = rand() % (*len + 1);
+            break;
+        case 3:         /* Grow with garbage */
+            while (*len < DNS_MAX_LEN && rand() % 8) {
+                m[(*len)++] = rand();
+            }
+            break;
+        case 4:         /* Compression pointer or oversize label */
+            m[DNS_HEADER_LEN + rand() % 8] = (rand() & 1) ? 0xC0 : 64 + rand() % 64;
+            break;
+        case 5:         /* Header fields: counts, opcode, QR */
+            m[2 + rand() % 10] = rand();
+            break;
+        }
+        if (*len == 0) {
+            return;
+        }
+    }
+}
+
+static int run_fuzz(unsigned seed)
+{
+    static uint8_t buf[DNS_MAX_LEN + CANARY_LEN];
+    dns_query_info_t info;
+    char name[DNS_NAME_MAX + 1];
+    unsigned long kinds[4] = { 0 };
+    int errors = 0;
+
+    srand(seed);
+    for (int i = 0; i < FUZZ_ROUNDS && errors < 10; i++) {
+        size_t len;
+        memset(buf + DNS_MAX_LEN, CANARY, CANARY_LEN);
+
+        if (i % 16 == 0) {
+            len = rand() % (DNS_MAX_LEN + 1);
+            for (size_t k = 0; k < len; k++) {
+                buf[k] = rand();
+            }
+        } else {
+            const query_t *q = &queries[rand() % query_count];
+            memcpy(buf, q->data, q->len);
+            len = q->len;
+            mutate(buf, &len);
+        }
+
+        size_t out = dns_reply_build(buf, len, DNS_MAX_LEN, redirect_ip, &info);
+        kinds[info.kind]++;
+
+        for (int k = 0; k < CANARY_LEN; k++) {
+            if (buf[DNS_MAX_LEN + k] != CANARY) {
+                printf("  !! round %d: write past the buffer\n", i);
+                errors++;
+                break;
+            }
+        }
+        if (out > DNS_MAX_LEN || (out > 0 && (out < DNS_HEADER_LEN || !(buf[2] & 0x80)))) {
+            printf("  !! round %d: bad reply of %zu bytes\n", i, out);
+            errors++;
+        }
+        if ((info.kind == DNS_REPLY_ANSWER || info.kind == DNS_REPLY_NODATA) &&
+            !dns_question_name(buf, out, name, sizeof(name))) {
+            printf("  !! round %d: answered a question with a bad name\n", i);
+            errors++;
+        }
+    }
+    printf("fuzz        %d messages (seed %u): %lu A, %lu NODATA, %lu errors, %lu dropped, %d failures\n",
+           FUZZ_ROUNDS, seed, kinds[DNS_REPLY_ANSWER], kinds[DNS_REPLY_NODATA], kinds[DNS_REPLY_ERROR],
+           kinds[DNS_REPLY_DROP], errors);
+    return errors;
+}
+
+
+/* ________________ Rate limit ________________ */
+
+static void run_rate_limit(void)
+{
+    static dns_rate_t rate;
+    unsigned long flood_ok = 0, flood_sent = 0, normal_ok = 0, normal_sent = 0;
+    const int seconds = 10, normal_clients = 5;
+
+    dns_rate_init(&rate, 20, 40);
+
+    /* 1 ms steps: one client at 1000 queries/s, the others at a phone's 5 queries/s */
+    for (int64_t t = 0; t < seconds * 1000000LL; t += 1000) {
+        flood_sent++;
+        flood_ok += dns_rate_allow(&rate, 0x0A0A0A0A, t);
+        if ((t / 1000) % 200 == 0) {
+            for (int c = 0; c < normal_clients; c++) {
+                normal_sent++;
+                normal_ok += dns_rate_allow(&rate, 0x0A0A0A10 + c, t + c);
+            }
+        }
+    }
+
+    printf("rate limit  20 q/s, burst 40, %d s: flooding client %lu of %lu answered (%.1f q/s), "
+           "%d normal clients %lu of %lu answered\n",
+           seconds, flood_ok, flood_sent, (double)flood_ok / seconds, normal_clients, normal_ok, normal_sent);
+}
+
+
+int main(int argc, char **argv)
+{
+    int errors = 0;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    inet_pton(AF_INET, "192.168.4.1", &redirect_ip);
+
+    if (argc > 1) {
+        if (load_queries(argv[1]) != 0) {
+            return 1;
+        }
+    } else {
+        builtin_queries();
+    }
+    if (query_count == 0) {
+        fprintf(stderr, "no queries\n");
+        return 1;
+    }
+
+    errors += run_replies();
+    run_throughput();
+    errors += run_fuzz(argc > 2 ? (unsigned)atoi(argv[2]) : 1);
+    run_rate_limit();
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Host microbenchmark: sensor -> comms channel.
+ *
+ * Compares the lock-free SPSC ring used by the firmware with a bounded
+ * blocking queue built the way a FreeRTOS queue works (copy in / copy out
+ * inside a critical section, blocked tasks woken through their event lists).
+ * FreeRTOS itself is not available on the host, so the mutex + condition
+ * variable queue below stands in for xQueueSend / xQueueReceive.
+ *
+ * Every run also checks the data: samples must arrive in order, and in
+ * overwrite mode every gap must be accounted for by the overwritten counter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sched.h>
+
+#include "h/sensor_queue.h"
+#include "h/spsc_ring.h"
+
+#define ITEMS       1000000
+#define CAPACITY    32
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* ________________ Blocking queue, FreeRTOS queue semantics ________________ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    sensq items[CAPACITY];
+    unsigned head, count;
+} locked_queue_t;
+
+static void lq_send(locked_queue_t *q, const sensq *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == CAPACITY) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % CAPACITY] = *item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void lq_receive(locked_queue_t *q, sensq *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    *item = q->items[q->head];
+    q->head = (q->head + 1) % CAPACITY;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+/* ________________ Benchmark cases ________________ */
+typedef struct {
+    spsc_ring_t *ring;
+    locked_queue_t *lq;
+    sem_t wake;             /* Stands in for the task notification */
+    int blocking;           /* Consumer sleeps on wake instead of spinning */
+    int slow;               /* Consumer stalls now and then (overwrite test) */
+    unsigned long errors;
+    unsigned long received;
+    unsigned long gaps;
+} bench_t;
+
+static void notify_consumer(void *arg)
+{
+    sem_post(&((bench_t *)arg)->wake);
+}
+
+static void *ring_consumer(void *arg)
+{
+    bench_t *b = arg;
+    sensq s;
+    uint32_t expected = 0;
+
+    while (expected < ITEMS) {
+        if (b->blocking) {
+            sem_wait(&b->wake);
+        }
+        while (spsc_ring_pop(b->ring, &s)) {
+            if (s.seq < expected || s.value[TEMP] != (float)(s.seq & 0xffff)) {
+                b->errors++;
+            }
+            b->gaps += s.seq - expected;
+            expected = s.seq + 1;
+            b->received++;
+            if (b->slow && (s.seq % 1024) == 0) {
+                struct timespec ts = { 0, 200000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        /* In overwrite mode the last items can be lost, stop once the producer is done */
+        if (b->slow && spsc_ring_count(b->ring) == 0 && expected + CAPACITY >= ITEMS) {
+            break;
+        }
+        /* Spinning would starve the producer on a single core host */
+        if (!b->blocking) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *lq_consumer(void *arg)
+{
+    bench_t *b = arg;
+    sensq s;
+
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        lq_receive(b->lq, &s);
+        if (s.seq != i) {
+            b->errors++;
+        }
+        b->received++;
+    }
+    return NULL;
+}
+
+static void fill(sensq *s, uint32_t seq)
+{
+    s->seq = seq;
+    s->timestamp_us = seq;
+    s->value[TEMP] = (float)(seq & 0xffff);
+    s->value[HUM] = 1;
+    s->value[PRES] = 2;
+}
+
+static void run_ring(const char *name, spsc_ring_policy_t policy, int blocking, int slow)
+{
+    bench_t b = { 0 };
+    pthread_t consumer;
+    sensq s = { 0 };
+    double t0, t1;
+
+    b.ring = spsc_ring_create(CAPACITY, sizeof(sensq), policy);
+    b.blocking = blocking;
+    b.slow = slow;
+    sem_init(&b.wake, 0, 0);
+    if (blocking) {
+        spsc_ring_set_notify(b.ring, notify_consumer, &b);
+    }
+
+    t0 = now_s();
+    pthread_create(&consumer, NULL, ring_consumer, &b);
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        fill(&s, i);
+        /* Lossless runs retry on full so both sides move the same data */
+        while (!spsc_ring_push(b.ring, &s) && !slow) {
+            sched_yield();
+        }
+    }
+    if (blocking) {
+        sem_post(&b.wake);
+    }
+    pthread_join(consumer, NULL);
+    t1 = now_s();
+
+    printf("%-34s %8.1f ns/item %10.0f items/s  recv=%lu hwm=%u dropped=%u overwritten=%u gaps=%lu errors=%lu\n",
+           name, (t1 - t0) * 1e9 / ITEMS, ITEMS / (t1 - t0), b.received,
+           spsc_ring_high_watermark(b.ring), spsc_ring_dropped(b.ring), spsc_ring_overwritten(b.ring),
+           b.gaps, b.errors);
+    if (slow && b.gaps > spsc_ring_overwritten(b.ring)) {
+        printf("  !! %lu gaps but only %u overwrites counted\n", b.gaps, spsc_ring_overwritten(b.ring));
+    }
+
+    sem_destroy(&b.wake);
+    spsc_ring_delete(b.ring);
+}
+
+static void run_locked_queue(void)
+{
+    static locked_queue_t q = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER,
+    };
+    bench_t b = { .lq = &q };
+    pthread_t consumer;
+    sensq s = { 0 };
+    double t0, t1;
+
+    t0 = now_s();
+    pthread_create(&consumer, NULL, lq_consumer, &b);
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        fill(&s, i);
+        lq_send(&q, &s);
+    }
+    pthread_join(consumer, NULL);
+    t1 = now_s();
+
+    printf("%-34s %8.1f ns/item %10.0f items/s  recv=%lu errors=%lu\n",
+           "blocking queue (FreeRTOS-like)", (t1 - t0) * 1e9 / ITEMS, ITEMS / (t1 - t0), b.received, b.errors);
+}
+
+
+int main(void)
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("%d items of %zu bytes, capacity %d\n\n", ITEMS, sizeof(sensq), CAPACITY);
+
+    run_locked_queue();
+    run_ring("spsc ring, notify + sleep", SPSC_RING_DROP_NEWEST, 1, 0);
+    run_ring("spsc ring, polling consumer", SPSC_RING_DROP_NEWEST, 0, 0);
+    run_ring("spsc ring, overwrite, slow reader", SPSC_RING_OVERWRITE_OLDEST, 0, 1);
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Republishes the binary sensor batches (/sensor_<ID>/bin) as the JSON batches
+# Home Assistant reads (/sensor_<ID>/batch).
+# Needs the mosquitto clients and the decoder: make build/sensor_decode
+# Usage: ./bin_bridge.sh [broker host] [port]
+
+HOST=${1:-localhost}
+PORT=${2:-8883}
+CERTS=${CERTS:-../certs}
+TLS="--cafile $CERTS/ca.crt --cert $CERTS/client.crt --key $CERTS/client.key --tls-version tlsv1.2"
+
+cd "$(dirname "$0")"
+
+mosquitto_sub $TLS -h "$HOST" -p "$PORT" -t '/sensor_+/bin' -F '%t %x' |
+    build/sensor_decode |
+    while read -r topic json; do
+        mosquitto_pub $TLS -h "$HOST" -p "$PORT" -q 1 -t "$topic" -m "$json"
+    done
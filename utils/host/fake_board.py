@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+Stand-in boards for fleet_ota.py: N local HTTP servers that speak the portal's
+OTA contract (GET /version, multipart POST /ota, 400 on a bad image, reboot
+after a 200).
+
+Each fake board checks the upload like the firmware does: one file part, a
+plain image or an ota_pack.py package, with an app description. It then goes
+down for --reboot-s and comes back reporting the new version. Failures can be
+injected: connections cut mid-upload, boards that roll back after the reboot,
+and a slow link.
+
+Usage:
+  ./fake_board.py [count] [--port 9100] [--inventory fleet.txt] [--fail-rate 0.2]
+                  [--rollback-rate 0.1] [--kbps 200] [--reboot-s 3] [--base image.bin]
+  ./fake_board.py 20 --inventory /tmp/fleet.txt --fail-rate 0.3
+  ./fleet_ota.py /tmp/fleet.txt ../../build/esp32-mqtt-ethernet.bin --parallel 8
+"""
+import argparse
+import http.server
+import json
+import random
+import re
+import threading
+import time
+
+import ota_pack
+from fleet_ota import app_desc
+
+
+class Board:
+    def __init__(self, name, args):
+        self.name = name
+        self.args = args
+        self.version = "v0.0-fake"
+        self.elf = "%064x" % random.getrandbits(256)
+        self.partition = "ota_0"
+        self.down_until = 0
+        self.lock = threading.Lock()
+
+    def down(self):
+        return time.monotonic() < self.down_until
+
+    def reboot(self, desc):
+        with self.lock:
+            self.down_until = time.monotonic() + self.args.reboot_s
+            if random.random() < self.args.rollback_rate:
+                return                  # New image does not boot, the old one stays
+            self.version = desc["version"]
+            self.elf = desc["elf_sha256"]
+            self.partition = "ota_1" if self.partition == "ota_0" else "ota_0"
+
+
+def handler_for(board):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def log_message(self, fmt, *a):
+            pass
+
+        def reply(self, status, body, ctype="text/html"):
+            body = body.encode()
+            self.send_response(status)
+            self.send_header("Content-Type", ctype)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_GET(self):
+            if board.down():
+                self.close_connection = True
+                return                  # Rebooting: connection closed without an answer
+            if self.path != "/version":
+                return self.reply(404, "not found")
+            self.reply(200, json.dumps({"project": "esp32-mqtt-ethernet", "version": board.version,
+                                        "idf": "fake", "built": "", "partition": board.partition,
+                                        "elf_sha256": board.elf[:16]}), "application/json")
+
+        def do_POST(self):
+            if board.down() or self.path != "/ota":
+                self.close_connection = True
+                return
+            length = int(self.headers.get("Content-Length", 0))
+            match = re.search(r"boundary=(\S+)", self.headers.get("Content-Type", ""))
+            if not match:
+                return self.reply(400, "Expected a multipart/form-data upload")
+
+            # Receive at the link speed, and maybe lose the link on the way
+            cut = length * random.uniform(0.1, 0.9) if random.random() < board.args.fail_rate else None
+            body = bytearray()
+            t0 = time.monotonic()
+            while len(body) < length:
+                body += self.rfile.read(min(4096, length - len(body)))
+                if cut and len(body) > cut:
+                    self.close_connection = True
+                    return
+                if board.args.kbps:
+                    ahead = len(body) / 1024 / board.args.kbps - (time.monotonic() - t0)
+                    if ahead > 0:
+                        time.sleep(ahead)
+
+            parts = [p for p in bytes(body).split(b"--" + match.group(1).encode()) if b"filename=" in p[:512]]
+            if len(parts) != 1:
+                return self.reply(400, "Upload incomplete or without a firmware file")
+            data = parts[0].split(b"\r\n\r\n", 1)[1][:-2]
+            try:
+                image = ota_pack.unpack(data, board.args.base_image) if data[:4] == ota_pack.MAGIC else data
+                desc = app_desc(image)
+            except Exception as e:
+                return self.reply(400, "Image validation failed, image is corrupted or incomplete (%s)" % e)
+
+            self.reply(200, "%d bytes. Rebooting now..." % len(data))
+            board.reboot(desc)
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("count", nargs="?", type=int, default=8)
+    parser.add_argument("--port", type=int, default=9100, help="port of the first board")
+    parser.add_argument("--inventory", help="write the inventory for fleet_ota.py here")
+    parser.add_argument("--fail-rate", type=float, default=0.0, help="share of uploads cut mid-way")
+    parser.add_argument("--rollback-rate", type=float, default=0.0, help="share of updates that roll back")
+    parser.add_argument("--kbps", type=float, default=0, help="upload speed limit per board, KB/s")
+    parser.add_argument("--reboot-s", type=float, default=3)
+    parser.add_argument("--base", help="image the boards run, to apply delta packages")
+    args = parser.parse_args()
+
+    args.base_image = None
+    if args.base:
+        with open(args.base, "rb") as f:
+            args.base_image = f.read()
+
+    lines = []
+    for i in range(args.count):
+        board = Board("ESP-%d" % (i + 1), args)
+        server = http.server.ThreadingHTTPServer(("127.0.0.1", args.port + i), handler_for(board))
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        lines.append("%s  http://127.0.0.1:%d" % (board.name, args.port + i))
+
+    if args.inventory:
+        with open(args.inventory, "w") as f:
+            f.write("# fake_board.py\n" + "\n".join(lines) + "\n")
+    print("\n".join(lines), flush=True)
+    print("%d fake boards up, Ctrl-C to stop" % args.count, flush=True)
+    try:
+        while True:
+            time.sleep(3600)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+"""
+Fleet OTA: pushes one firmware to many boards at once through the portal
+upload (POST /ota), replacing update_firmware.sh for boards that are reachable
+on the network.
+
+Per board: GET /version, skip if it already runs the image, upload with
+progress, wait for the reboot and check GET /version again (a board that
+comes back on the old firmware rolled back). Failed attempts are retried with
+exponential backoff and jitter. Ends with a summary, the exit code is the
+number of boards that failed.
+
+Inventory, one board per line ('#' comments):
+  ESP-1  https://192.168.11.111
+  ESP-2  https://192.168.11.112
+  ESP-3  http://10.0.0.7:8080
+
+The image can be a plain build or an ota_pack.py package (a delta only if
+every board runs its base, pass it with --base to read the target version).
+
+Usage:
+  ./fleet_ota.py inventory [image] [--parallel 4] [--retries 3] [--report out.json]
+  ./fleet_ota.py fleet.txt ../../build/esp32-mqtt-ethernet.bin.z --parallel 8
+Test without boards: ./fake_board.py 20 --inventory /tmp/fleet.txt
+"""
+import argparse
+import concurrent.futures
+import http.client
+import json
+import os
+import random
+import ssl
+import struct
+import sys
+import threading
+import time
+import urllib.parse
+
+import ota_pack
+
+APP_DESC_OFFSET = 32        # Image header (24) + first segment header (8)
+APP_DESC_MAGIC = 0xABCD5432
+CHUNK = 8192
+
+print_lock = threading.Lock()
+
+
+def log(board, msg):
+    with print_lock:
+        print("[%-8s] %s" % (board, msg), flush=True)
+
+
+def app_desc(image):
+    """Version and ELF SHA-256 (hex) from the esp_app_desc_t of an app image"""
+    magic, = struct.unpack_from("<I", image, APP_DESC_OFFSET)
+    if magic != APP_DESC_MAGIC:
+        raise ValueError("no app description in the image")
+    field = lambda off, n: image[APP_DESC_OFFSET + off:APP_DESC_OFFSET + off + n].split(b"\0")[0].decode()
+    return {
+        "version": field(16, 32),
+        "project": field(48, 32),
+        "elf_sha256": image[APP_DESC_OFFSET + 144:APP_DESC_OFFSET + 176].hex(),
+    }
+
+
+def load_target(path, base_path):
+    with open(path, "rb") as f:
+        data = f.read()
+    image = data
+    if data[:4] == ota_pack.MAGIC:
+        base = None
+        if base_path:
+            with open(base_path, "rb") as f:
+                base = f.read()
+        image = ota_pack.unpack(data, base)
+    return data, app_desc(image)
+
+
+def load_inventory(path):
+    boards = []
+    with open(path) as f:
+        for line in f:
+            line = line.split("#", 1)[0].split()
+            if len(line) >= 2:
+                boards.append((line[0], urllib.parse.urlsplit(line[1])))
+    return boards
+
+
+# ________________ HTTP ________________
+
+def connection(url, timeout):
+    if url.scheme == "https":
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+        ctx.check_hostname = False
+        ctx.verify_mode = ssl.CERT_NONE        # Self-signed portal certificate
+        return http.client.HTTPSConnection(url.hostname, url.port or 443, timeout=timeout, context=ctx)
+    return http.client.HTTPConnection(url.hostname, url.port or 80, timeout=timeout)
+
+
+def get_version(url, timeout=5):
+    conn = connection(url, timeout)
+    try:
+        conn.request("GET", "/version")
+        resp = conn.getresponse()
+        if resp.status != 200:
+            raise OSError("GET /version: HTTP %d" % resp.status)
+        return json.loads(resp.read())
+    finally:
+        conn.close()
+
+
+class UploadRejected(Exception):
+    """The board refused the image, retrying will not help"""
+
+
+def upload(board, url, data, name, timeout):
+    boundary = "----fleetota%016x" % random.getrandbits(64)
+    head = ("--%s\r\nContent-Disposition: form-data; name=\"firmware\"; filename=\"%s\"\r\n"
+            "Content-Type: application/octet-stream\r\n\r\n" % (boundary, name)).encode()
+    tail = ("\r\n--%s--\r\n" % boundary).encode()
+    total = len(head) + len(data) + len(tail)
+
+    conn = connection(url, timeout)
+    try:
+        conn.putrequest("POST", "/ota")
+        conn.putheader("Content-Type", "multipart/form-data; boundary=" + boundary)
+        conn.putheader("Content-Length", str(total))
+        conn.endheaders()
+
+        t0 = time.monotonic()
+        next_report = 0.1
+        conn.send(head)
+        for off in range(0, len(data), CHUNK):
+            conn.send(data[off:off + CHUNK])
+            done = min(off + CHUNK, len(data)) / len(data)
+            if done >= next_report:
+                log(board, "upload %3d%%  %6d KB" % (done * 100, min(off + CHUNK, len(data)) / 1024))
+                next_report += 0.1
+        conn.send(tail)
+
+        # The board answers once the image is flashed and checked, so this is the real rate
+        resp = conn.getresponse()
+        body = resp.read().decode(errors="replace")
+        if resp.status == 400:
+            raise UploadRejected(" ".join(body.split())[-160:])
+        if resp.status != 200:
+            raise OSError("POST /ota: HTTP %d" % resp.status)
+        return time.monotonic() - t0
+    finally:
+        conn.close()
+
+
+def wait_reboot(url, target, timeout):
+    """Poll /version until the board is back on the target, returns its /version"""
+    t0 = time.monotonic()
+    went_down = False
+    while time.monotonic() - t0 < timeout:
+        time.sleep(2)
+        try:
+            info = get_version(url, timeout=3)
+        except (OSError, ValueError, http.client.HTTPException):
+            went_down = True
+            continue
+        if target["elf_sha256"].startswith(info.get("elf_sha256", "-")):
+            return info, time.monotonic() - t0
+        if went_down:
+            raise UploadRejected("rolled back to %s" % info.get("version"))
+    raise TimeoutError("not back on the new firmware after %d s" % timeout)
+
+
+# ________________ One board ________________
+
+def update_board(board, url, data, name, target, args):
+    result = {"board": board, "url": url.geturl(), "status": "failed", "attempts": 0,
+              "from": None, "to": None, "upload_s": None, "reboot_s": None, "error": None}
+
+    for attempt in range(args.retries + 1):
+        result["attempts"] = attempt + 1
+        try:
+            before = get_version(url)
+            result["from"] = before.get("version")
+            if not args.force and target["elf_sha256"].startswith(before.get("elf_sha256", "-")):
+                log(board, "already on %s" % target["version"])
+                result.update(status="skipped", to=result["from"], error=None)
+                return result
+
+            log(board, "%s -> %s, attempt %d" % (result["from"], target["version"], attempt + 1))
+            result["upload_s"] = upload(board, url, data, name, args.timeout)
+            log(board, "uploaded in %.1f s (%.1f KB/s), waiting for the reboot" % (
+                result["upload_s"], len(data) / 1024 / result["upload_s"]))
+
+            after, result["reboot_s"] = wait_reboot(url, target, args.reboot_timeout)
+            result.update(status="updated", to=after.get("version"), error=None)
+            log(board, "running %s on %s" % (result["to"], after.get("partition")))
+            return result
+
+        except UploadRejected as e:
+            result["error"] = str(e)
+            log(board, "failed: %s" % e)
+            return result
+        except (OSError, ValueError, TimeoutError, http.client.HTTPException) as e:
+            result["error"] = str(e) or type(e).__name__
+
+        if attempt < args.retries:
+            delay = args.backoff * (2 ** attempt)
+            delay += random.uniform(0, delay)           # Jitter, so retries do not line up
+            log(board, "attempt %d failed (%s), retry in %.0f s" % (attempt + 1, result["error"], delay))
+            time.sleep(delay)
+
+    log(board, "giving up: %s" % result["error"])
+    return result
+
+
+def summary(results, elapsed):
+    print("\n%-10s %-8s %3s  %-14s %-14s %8s %8s  %s" % ("board", "status", "try", "from", "to", "upload", "reboot", "error"))
+    for r in results:
+        print("%-10s %-8s %3d  %-14s %-14s %8s %8s  %s" % (
+            r["board"], r["status"], r["attempts"], r["from"] or "-", r["to"] or "-",
+            "%.1f s" % r["upload_s"] if r["upload_s"] else "-",
+            "%.1f s" % r["reboot_s"] if r["reboot_s"] else "-", r["error"] or ""))
+    counts = {s: sum(r["status"] == s for r in results) for s in ("updated", "skipped", "failed")}
+    print("\n%d boards in %.1f s: %d updated, %d already up to date, %d failed" % (
+        len(results), elapsed, counts["updated"], counts["skipped"], counts["failed"]))
+    return counts["failed"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("inventory")
+    parser.add_argument("image", nargs="?", default=os.path.join(os.path.dirname(__file__), "..", "..", "build", "esp32-mqtt-ethernet.bin"))
+    parser.add_argument("--base", help="base image, to read the version from a delta package")
+    parser.add_argument("--parallel", type=int, default=4, help="boards updated at the same time")
+    parser.add_argument("--retries", type=int, default=3)
+    parser.add_argument("--backoff", type=float, default=5, help="first retry delay in s, doubled each time")
+    parser.add_argument("--timeout", type=float, default=60, help="socket timeout of the upload in s")
+    parser.add_argument("--reboot-timeout", type=float, default=120)
+    parser.add_argument("--force", action="store_true", help="update boards already on the image")
+    parser.add_argument("--report", help="write the results as JSON")
+    args = parser.parse_args()
+
+    data, target = load_target(args.image, args.base)
+    boards = load_inventory(args.inventory)
+    name = os.path.basename(args.image)
+    print("%s: %s %s (elf %s), %d bytes to %d boards, %d at a time\n" % (
+        name, target["project"], target["version"], target["elf_sha256"][:16], len(data), len(boards), args.parallel))
+
+    t0 = time.monotonic()
+    with concurrent.futures.ThreadPoolExecutor(max_workers=args.parallel) as pool:
+        results = list(pool.map(lambda b: update_board(b[0], b[1], data, name, target, args), boards))
+
+    failed = summary(results, time.monotonic() - t0)
+    if args.report:
+        with open(args.report, "w") as f:
+            json.dump({"image": name, "target": target, "results": results}, f, indent=2)
+    sys.exit(failed)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Latency percentiles per board and per pipeline stage.
+
+Reads the traces the boards publish on /sensor_<ID>/trace (CONFIG_LATENCY_TRACE)
+and the batches on /sensor_<ID>/batch, and prints p50/p90/p99/max of:
+
+  read->dequeue     sensor ring wait
+  dequeue->publish  batching, outbox backpressure
+  publish->puback   broker round trip
+  read->puback      whole device side pipeline
+  read->host        sensor read to arrival here (needs SNTP on the board
+                    and an NTP synced host, uses the "ts" field of the batches)
+
+Samples sent from the store-and-forward log have no dequeue time, they only
+count in publish->puback.
+
+Usage:
+  ./latency_report.py [broker host] [port]        subscribe with mosquitto_sub
+  mosquitto_sub ... -v -t '/sensor_+/trace' -t '/sensor_+/batch' | ./latency_report.py -
+"""
+import json
+import os
+import subprocess
+import sys
+import time
+from collections import defaultdict, deque
+
+REPORT_EVERY_S = 30
+KEEP = 10000        # Most recent values kept per board and stage
+
+STAGES = ["read->dequeue", "dequeue->publish", "publish->puback", "read->puback", "read->host"]
+
+values = defaultdict(lambda: defaultdict(lambda: deque(maxlen=KEEP)))
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return float("nan")
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+
+def board_of(topic):
+    # /sensor_<ID>/<kind>
+    parts = topic.strip("/").split("/")
+    if len(parts) != 2 or not parts[0].startswith("sensor_"):
+        return None, None
+    return parts[0][len("sensor_"):], parts[1]
+
+
+def handle(topic, payload, received_ms):
+    board, kind = board_of(topic)
+    if board is None:
+        return
+    try:
+        msg = json.loads(payload)
+    except ValueError:
+        return
+
+    stages = values[board]
+    if kind == "trace":
+        if msg.get("dequeue") is not None:
+            stages["read->dequeue"].append(msg["dequeue"] - msg["read"])
+            stages["dequeue->publish"].append(msg["publish"] - msg["dequeue"])
+            stages["read->puback"].append(msg["puback"] - msg["read"])
+        stages["publish->puback"].append(msg["puback"] - msg["publish"])
+    elif kind == "batch":
+        for sample in msg.get("samples", []):
+            if "ts" in sample:
+                stages["read->host"].append(received_ms - sample["ts"])
+
+
+def report():
+    print("\n%-10s %-17s %7s %8s %8s %8s %8s" % ("board", "stage (ms)", "count", "p50", "p90", "p99", "max"))
+    for board in sorted(values):
+        for stage in STAGES:
+            v = sorted(values[board][stage])
+            if not v:
+                continue
+            print("%-10s %-17s %7d %8.0f %8.0f %8.0f %8.0f" % (
+                board, stage, len(v), percentile(v, 50), percentile(v, 90), percentile(v, 99), v[-1]))
+    sys.stdout.flush()
+
+
+def open_input(args):
+    if args and args[0] == "-":
+        return sys.stdin, None
+
+    host = args[0] if len(args) > 0 else "localhost"
+    port = args[1] if len(args) > 1 else "8883"
+    certs = os.environ.get("CERTS", os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "certs"))
+    cmd = ["mosquitto_sub", "-h", host, "-p", port, "-v",
+           "--cafile", os.path.join(certs, "ca.crt"),
+           "--cert", os.path.join(certs, "client.crt"),
+           "--key", os.path.join(certs, "client.key"),
+           "--tls-version", "tlsv1.2",
+           "-t", "/sensor_+/trace", "-t", "/sensor_+/batch"]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True, bufsize=1)
+    return proc.stdout, proc
+
+
+def main():
+    stream, proc = open_input(sys.argv[1:])
+    last_report = time.time()
+
+    try:
+        for line in stream:
+            received_ms = time.time() * 1000
+            topic, _, payload = line.rstrip("\n").partition(" ")
+            handle(topic, payload, received_ms)
+
+            if time.time() - last_report >= REPORT_EVERY_S:
+                report()
+                last_report = time.time()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if proc:
+            proc.terminate()
+
+    report()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,411 @@
+/*
+ * Fault injection for the link manager (main/link_policy.c), on a simulated
+ * netif in virtual time.
+ *
+ * Each scenario describes the world as a function of time: Ethernet PHY
+ * link, Ethernet upstream, WiFi AP, WiFi upstream. The simulation turns it
+ * into what the firmware sees: carrier events, DHCP after a delay, WiFi
+ * association after a delay, and ping probes that answer or time out. The
+ * glue around link_policy is the one of main/link_manager.c: probes on every
+ * link with an IP, cold standby association, and the MQTT reconnect on the
+ * new link (TLS resumption time). A sample every 100 ms is accounted as sent
+ * live, stored (network, MQTT or suspect link) or sent into a dead link (in
+ * the outbox, sent again after the reconnect).
+ *
+ * Checked per scenario: failover time, number of switches (no thrashing),
+ * no switch back to Ethernet before the hold time.
+ *
+ *   ./build/link_sim            all scenarios, exit code = failed checks
+ *   ./build/link_sim -v         with the switch log
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h/link_policy.h"
+
+/* Defaults of the Link Manager menu */
+#define PROBE_INTERVAL_MS   1000
+#define PROBE_TIMEOUT_MS    500
+#define PROBE_FAILS         3
+#define PROBE_OKS           3
+#define HOLD_S              30
+
+/* Simulated network */
+#define STEP_MS             5
+#define ETH_DHCP_MS         300
+#define WIFI_ASSOC_MS       1800
+#define WIFI_DHCP_MS        700
+#define ETH_RTT_MS          1
+#define WIFI_RTT_MS         15
+#define MQTT_RESUME_MS      150     /* TCP + resumed TLS + CONNECT */
+#define MQTT_RETRY_MS       10000
+#define SAMPLE_MS           100
+
+#define MS(x)               ((int64_t)(x) * 1000)
+
+typedef struct
+{
+    bool eth_phy;
+    bool eth_upstream;
+    bool wifi_ap;
+    bool wifi_upstream;
+} world_t;
+
+typedef struct
+{
+    const char *name;
+    void (*world)(int64_t t_ms, world_t *w);
+    bool hot;
+    int duration_s;
+    /* Checks, -1 to skip */
+    int max_switches;
+    int max_failover_ms;
+    int min_failovers;
+} scenario_t;
+
+typedef struct
+{
+    bool carrier;
+    bool has_ip;
+    int64_t ip_at_us;               /* DHCP done, 0 if not running */
+    int64_t assoc_at_us;            /* Association done, 0 if not running */
+    int64_t next_probe_us;
+    int64_t probe_at_us;            /* Answer or timeout of the probe in flight, 0 if none */
+    bool probe_ok;
+    uint32_t probes_failed;
+} sim_link_t;
+
+typedef struct
+{
+    link_policy_t policy;
+    sim_link_t link[LINK_COUNT];
+    bool hot;
+    bool wifi_wanted;
+
+    bool mqtt_connected;
+    int64_t mqtt_at_us;             /* Connect attempt ends, 0 if none */
+    int64_t outage_us;              /* Failover being measured, 0 if none */
+    int64_t switch_us;
+
+    /* Results */
+    uint32_t failovers;
+    int64_t failover_max_us;
+    int64_t detect_max_us;
+    int64_t last_eth_break_us;      /* Last time Ethernet was not usable */
+    int64_t early_switch_back_us;   /* Shortest Ethernet usable time at a switch back, -1 if none */
+    uint32_t sent, stored_offline, stored_suspect, outbox;
+} sim_t;
+
+static bool verbose = false;
+static int failed_checks = 0;
+
+
+/* ________________ Scenarios ________________ */
+
+static void world_unplug(int64_t t, world_t *w)
+{
+    *w = (world_t){ .eth_phy = t < 20000 || t >= 60000, .eth_upstream = true, .wifi_ap = true, .wifi_upstream = true };
+}
+
+/* Cable flapping: 700 ms down, 1300 ms up, for 40 s */
+static void world_flap(int64_t t, world_t *w)
+{
+    bool flapping = t >= 20000 && t < 60000;
+
+    *w = (world_t){ .eth_phy = !flapping || (t % 2000) >= 700, .eth_upstream = true, .wifi_ap = true, .wifi_upstream = true };
+}
+
+/* The switch or the router behind it dies, the PHY link stays up */
+static void world_upstream(int64_t t, world_t *w)
+{
+    *w = (world_t){ .eth_phy = true, .eth_upstream = t < 20000 || t >= 50000, .wifi_ap = true, .wifi_upstream = true };
+}
+
+/* One probe out of 7 lost, never 3 in a row */
+static void world_lossy(int64_t t, world_t *w)
+{
+    *w = (world_t){ .eth_phy = true, .eth_upstream = (t / 1000) % 7 != 3, .wifi_ap = true, .wifi_upstream = true };
+}
+
+static void world_wifi_down(int64_t t, world_t *w)
+{
+    *w = (world_t){ .eth_phy = true, .eth_upstream = true, .wifi_ap = t < 20000 || t >= 40000, .wifi_upstream = true };
+}
+
+/* Both links down for 10 s, Ethernet comes back first */
+static void world_both_down(int64_t t, world_t *w)
+{
+    bool down = t >= 20000 && t < 30000;
+
+    *w = (world_t){ .eth_phy = !down, .eth_upstream = true, .wifi_ap = !down || t >= 29000, .wifi_upstream = true };
+}
+
+static const scenario_t scenarios[] = {
+    /* name                 world            hot    s    switches failover_ms failovers */
+    { "unplug",             world_unplug,    true,  120, 2,       500,        1 },
+    { "unplug, cold",       world_unplug,    false, 120, 2,       4000,       1 },
+    { "flapping cable",     world_flap,      true,  120, 2,       500,        1 },
+    { "upstream dead",      world_upstream,  true,  120, 2,       PROBE_FAILS * PROBE_INTERVAL_MS + PROBE_TIMEOUT_MS + 500, 1 },
+    { "upstream dead, cold",world_upstream,  false, 120, 2,       -1,         1 },
+    { "lossy upstream",     world_lossy,     true,  120, 0,       -1,         0 },
+    { "wifi down",          world_wifi_down, true,  120, 0,       -1,         0 },
+    { "both down",          world_both_down, true,  120, 2,       -1,         1 },
+};
+
+
+/* ________________ Simulation ________________ */
+
+static bool link_works(const world_t *w, link_id_t link)
+{
+    return link == LINK_ETH ? w->eth_phy && w->eth_upstream : w->wifi_ap && w->wifi_upstream;
+}
+
+
+/* Same as link_select() + link_done() in main/link_manager.c */
+static void sim_select(sim_t *s, int64_t now)
+{
+    link_id_t before = s->policy.active;
+    link_id_t active = link_policy_select(&s->policy, now);
+    bool suspect = link_policy_suspect(&s->policy);
+
+    if (!link_policy_usable(&s->policy, LINK_ETH)) {
+        s->last_eth_break_us = now;
+    }
+
+    if (!s->hot) {
+        if (active != before && active == LINK_ETH) {
+            s->wifi_wanted = false;
+        } else if (active != LINK_ETH || suspect) {
+            s->wifi_wanted = true;
+        }
+    }
+
+    if (active == before) {
+        return;
+    }
+
+    if (verbose) {
+        printf("    %7.3f s  %s -> %s\n", now / 1e6, link_policy_name(before), link_policy_name(active));
+    }
+
+    if (before == LINK_WIFI && active == LINK_ETH) {
+        int64_t usable_us = now - s->policy.link[LINK_ETH].usable_since_us;
+
+        if (s->early_switch_back_us < 0 || usable_us < s->early_switch_back_us) {
+            s->early_switch_back_us = usable_us;
+        }
+    }
+
+    if (active == LINK_NONE) {
+        s->mqtt_connected = false;
+        s->mqtt_at_us = 0;
+        return;
+    }
+
+    if (s->policy.switch_outage_us) {
+        s->outage_us = s->policy.switch_outage_us;
+        s->switch_us = now;
+    }
+
+    /* Restart the client on the new link */
+    s->mqtt_connected = false;
+    s->mqtt_at_us = now + MS(MQTT_RESUME_MS);
+}
+
+
+static void sim_carrier(sim_t *s, link_id_t link, bool up, int64_t now)
+{
+    sim_link_t *l = &s->link[link];
+
+    l->carrier = up;
+    link_policy_carrier(&s->policy, link, up, now);
+    if (up && !l->has_ip) {
+        l->ip_at_us = now + MS(link == LINK_ETH ? ETH_DHCP_MS : WIFI_DHCP_MS);
+    }
+    if (!up && link == LINK_WIFI) {
+        /* The STA starts over: association, then DHCP */
+        l->has_ip = false;
+        l->ip_at_us = 0;
+        l->probe_at_us = 0;
+        link_policy_ip(&s->policy, link, false, now);
+    }
+    sim_select(s, now);
+}
+
+
+static void sim_netif(sim_t *s, const world_t *w, int64_t now)
+{
+    sim_link_t *eth = &s->link[LINK_ETH];
+    sim_link_t *wifi = &s->link[LINK_WIFI];
+    bool wifi_on = s->hot || s->wifi_wanted;
+
+    /* Ethernet keeps its lease across a carrier loss, like esp-netif until its lost IP timer */
+    if (w->eth_phy != eth->carrier) {
+        sim_carrier(s, LINK_ETH, w->eth_phy, now);
+    }
+
+    if (wifi_on && w->wifi_ap && !wifi->carrier && wifi->assoc_at_us == 0) {
+        wifi->assoc_at_us = now + MS(WIFI_ASSOC_MS);
+    }
+    if (wifi->assoc_at_us && now >= wifi->assoc_at_us) {
+        wifi->assoc_at_us = 0;
+        if (wifi_on && w->wifi_ap) {
+            sim_carrier(s, LINK_WIFI, true, now);
+        }
+    }
+    if (wifi->carrier && (!w->wifi_ap || !wifi_on)) {
+        sim_carrier(s, LINK_WIFI, false, now);
+    }
+
+    for (int i = 0; i < LINK_COUNT; i++) {
+        sim_link_t *l = &s->link[i];
+
+        if (l->ip_at_us && now >= l->ip_at_us) {
+            l->ip_at_us = 0;
+            if (l->carrier) {
+                l->has_ip = true;
+                l->next_probe_us = now + MS(PROBE_INTERVAL_MS);
+                link_policy_ip(&s->policy, i, true, now);
+                sim_select(s, now);
+            }
+        }
+
+        /* One ping in flight per link, the timeout is shorter than the interval */
+        if (l->has_ip && l->probe_at_us == 0 && now >= l->next_probe_us) {
+            l->probe_ok = link_works(w, i);
+            l->probe_at_us = now + MS(l->probe_ok ? (i == LINK_ETH ? ETH_RTT_MS : WIFI_RTT_MS) : PROBE_TIMEOUT_MS);
+            l->next_probe_us += MS(PROBE_INTERVAL_MS);
+        }
+        if (l->probe_at_us && now >= l->probe_at_us) {
+            l->probe_at_us = 0;
+            if (!l->probe_ok) {
+                l->probes_failed++;
+            }
+            link_policy_probe(&s->policy, i, l->probe_ok, now);
+            sim_select(s, now);
+        }
+    }
+}
+
+
+static void sim_mqtt(sim_t *s, const world_t *w, int64_t now)
+{
+    link_id_t active = s->policy.active;
+
+    if (s->mqtt_at_us == 0 || now < s->mqtt_at_us) {
+        return;
+    }
+
+    s->mqtt_at_us = 0;
+    if (active == LINK_NONE || !link_works(w, active)) {
+        s->mqtt_at_us = now + MS(MQTT_RETRY_MS);
+        return;
+    }
+
+    s->mqtt_connected = true;
+    if (s->outage_us) {
+        int64_t total = now - s->outage_us;
+        int64_t detect = s->switch_us - s->outage_us;
+
+        s->failovers++;
+        if (total > s->failover_max_us) s->failover_max_us = total;
+        if (detect > s->detect_max_us) s->detect_max_us = detect;
+        if (verbose) {
+            printf("    %7.3f s  MQTT connected, failover %lld ms (detected in %lld ms)\n", now / 1e6,
+                   (long long)(total / 1000), (long long)(detect / 1000));
+        }
+        s->outage_us = 0;
+    }
+}
+
+
+/* Same decisions as the drain loop of task_comms() */
+static void sim_sample(sim_t *s, const world_t *w)
+{
+    link_id_t active = s->policy.active;
+
+    if (active == LINK_NONE || !s->mqtt_connected) {
+        s->stored_offline++;
+    } else if (link_policy_suspect(&s->policy)) {
+        s->stored_suspect++;
+    } else if (link_works(w, active)) {
+        s->sent++;
+    } else {
+        s->outbox++;
+    }
+}
+
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("    FAILED: %s\n", what);
+        failed_checks++;
+    }
+}
+
+
+static void run(const scenario_t *sc)
+{
+    const link_policy_cfg_t cfg = { .fail_threshold = PROBE_FAILS, .ok_threshold = PROBE_OKS, .hold_ms = HOLD_S * 1000 };
+    sim_t s;
+    world_t w;
+    char what[96];
+
+    memset(&s, 0, sizeof(s));
+    link_policy_init(&s.policy, &cfg);
+    s.hot = sc->hot;
+    s.early_switch_back_us = -1;
+
+    printf("%s (%s standby)\n", sc->name, sc->hot ? "hot" : "cold");
+    for (int64_t t_ms = 0; t_ms < (int64_t)sc->duration_s * 1000; t_ms += STEP_MS) {
+        int64_t now = MS(t_ms) + 1;
+
+        sc->world(t_ms, &w);
+        sim_netif(&s, &w, now);
+        sim_mqtt(&s, &w, now);
+        if (t_ms % SAMPLE_MS == 0 && t_ms >= 5000) {
+            sim_sample(&s, &w);
+        }
+    }
+
+    printf("    switches %lu, failovers %lu, failover max %lld ms (detect %lld ms), probes failed eth %lu wifi %lu\n",
+           (unsigned long)s.policy.switches, (unsigned long)s.failovers, (long long)(s.failover_max_us / 1000),
+           (long long)(s.detect_max_us / 1000), (unsigned long)s.link[LINK_ETH].probes_failed,
+           (unsigned long)s.link[LINK_WIFI].probes_failed);
+    printf("    samples: %lu sent, %lu stored offline, %lu stored on a suspect link, %lu into a dead link (outbox)\n",
+           (unsigned long)s.sent, (unsigned long)s.stored_offline, (unsigned long)s.stored_suspect, (unsigned long)s.outbox);
+
+    if (sc->max_switches >= 0) {
+        snprintf(what, sizeof(what), "%lu switches, %d max", (unsigned long)s.policy.switches, sc->max_switches);
+        check(s.policy.switches <= (uint32_t)sc->max_switches, what);
+    }
+    if (sc->max_failover_ms >= 0) {
+        snprintf(what, sizeof(what), "failover %lld ms, %d max", (long long)(s.failover_max_us / 1000), sc->max_failover_ms);
+        check(s.failover_max_us <= MS(sc->max_failover_ms), what);
+    }
+    snprintf(what, sizeof(what), "%lu failovers, %d min", (unsigned long)s.failovers, sc->min_failovers);
+    check(s.failovers >= (uint32_t)sc->min_failovers, what);
+    if (s.early_switch_back_us >= 0) {
+        snprintf(what, sizeof(what), "switched back after %lld ms on ethernet, hold %d s",
+                 (long long)(s.early_switch_back_us / 1000), HOLD_S);
+        check(s.early_switch_back_us >= MS(HOLD_S * 1000), what);
+    }
+    check(s.policy.active == LINK_ETH, "not back on ethernet at the end");
+}
+
+
+int main(int argc, char **argv)
+{
+    verbose = (argc > 1 && strcmp(argv[1], "-v") == 0);
+
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run(&scenarios[i]);
+    }
+
+    printf("%s: %d failed checks\n", failed_checks ? "FAIL" : "OK", failed_checks);
+    return failed_checks;
+}
@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+"""
+Packs a firmware image for the OTA paths (main/ota_stream.c): zlib compressed,
+or as a delta against the image the board is running now.
+
+A delta is a list of ops applied to the running app, then zlib compressed:
+  'C' src len          copy from the running app
+  'A' src len bytes    running app bytes + bytes (mod 256), for code that only moved
+  'I' len bytes        new bytes
+  'E'                  end
+The package is decoded back and compared with the image before it is written.
+
+The SHA-256 printed is the one of the unpacked image, that is what the pull
+OTA command carries (ota_serve.py reads it from the package).
+
+Usage:
+  ./ota_pack.py [image] [-o out]                    compressed image
+  ./ota_pack.py [image] --base running.bin [-o out] delta against running.bin
+  ./ota_pack.py ../../build/esp32-mqtt-ethernet.bin --base v1.2.bin
+"""
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b"LXOT"
+VERSION = 1
+TYPE_ZLIB = 1
+TYPE_DELTA = 2
+HEADER = struct.Struct("<4sBBHII32s32s")
+
+BLOCK = 16          # Shortest exact match looked up
+STRIDE = 4          # Base positions indexed
+MAX_BAD = 24        # Mismatches more than matches before an 'A' run stops
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def read_varint(data, pos):
+    n = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        n |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return n, pos
+
+
+# ________________ Delta ________________
+
+def exact_len(old, o, new, n):
+    length = 0
+    limit = min(len(old) - o, len(new) - n)
+    # Whole slices first, byte by byte only at the end
+    step = 256
+    while length + step <= limit and old[o + length:o + length + step] == new[n + length:n + length + step]:
+        length += step
+    while length < limit and old[o + length] == new[n + length]:
+        length += 1
+    return length
+
+
+def approx_len(old, o, new, n):
+    """Length of the following run worth an 'A' op: most bytes equal, the rest small diffs"""
+    best = best_len = score = k = 0
+    limit = min(len(old) - o, len(new) - n)
+    while k < limit:
+        score += 1 if old[o + k] == new[n + k] else -1
+        k += 1
+        if score > best:
+            best, best_len = score, k
+        elif score < best - MAX_BAD:
+            break
+    return best_len
+
+
+def make_delta(old, new):
+    index = {}
+    for off in range(0, len(old) - BLOCK + 1, STRIDE):
+        index.setdefault(old[off:off + BLOCK], off)
+
+    ops = bytearray()
+    lit = 0                 # Start of the bytes not covered yet
+    i = 0
+    while i + BLOCK <= len(new):
+        src = index.get(new[i:i + BLOCK])
+        if src is None:
+            i += 1
+            continue
+
+        # Grow the match back over the pending literal bytes
+        while i > lit and src > 0 and new[i - 1] == old[src - 1]:
+            i -= 1
+            src -= 1
+        if i > lit:
+            ops += b"I" + varint(i - lit) + new[lit:i]
+
+        length = exact_len(old, src, new, i)
+        ops += b"C" + varint(src) + varint(length)
+        i += length
+        src += length
+
+        length = approx_len(old, src, new, i)
+        if length:
+            diff = bytes((new[i + k] - old[src + k]) & 0xFF for k in range(length))
+            ops += b"A" + varint(src) + varint(length) + diff
+            i += length
+        lit = i
+
+    if lit < len(new):
+        ops += b"I" + varint(len(new) - lit) + new[lit:]
+    return bytes(ops + b"E")
+
+
+def apply_delta(old, ops):
+    out = bytearray()
+    pos = 0
+    while True:
+        op = ops[pos:pos + 1]
+        pos += 1
+        if op == b"E":
+            return bytes(out)
+        if op == b"I":
+            length, pos = read_varint(ops, pos)
+            out += ops[pos:pos + length]
+            pos += length
+            continue
+        src, pos = read_varint(ops, pos)
+        length, pos = read_varint(ops, pos)
+        if op == b"C":
+            out += old[src:src + length]
+        elif op == b"A":
+            out += bytes((a + b) & 0xFF for a, b in zip(old[src:src + length], ops[pos:pos + length]))
+            pos += length
+        else:
+            raise ValueError("bad op %r at %d" % (op, pos - 1))
+
+
+# ________________ Container ________________
+
+def pack(image, base=None):
+    if base is None:
+        payload = image
+        header = HEADER.pack(MAGIC, VERSION, TYPE_ZLIB, 0, len(image), 0,
+                             hashlib.sha256(image).digest(), bytes(32))
+    else:
+        payload = make_delta(base, image)
+        header = HEADER.pack(MAGIC, VERSION, TYPE_DELTA, 0, len(image), len(base),
+                             hashlib.sha256(image).digest(), hashlib.sha256(base).digest())
+    return header + zlib.compress(payload, 9)
+
+
+def unpack(package, base=None):
+    magic, version, kind, _, size, base_size, image_sha, base_sha = HEADER.unpack_from(package)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not an OTA package")
+    payload = zlib.decompress(package[HEADER.size:])
+    if kind == TYPE_DELTA:
+        if base is None or len(base) != base_size or hashlib.sha256(base).digest() != base_sha:
+            raise ValueError("delta needs the base image it was made from")
+        payload = apply_delta(base, payload)
+    if len(payload) != size or hashlib.sha256(payload).digest() != image_sha:
+        raise ValueError("unpacked image does not match the header")
+    return payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", nargs="?", default=os.path.join(os.path.dirname(__file__), "..", "..", "build", "esp32-mqtt-ethernet.bin"))
+    parser.add_argument("--base", help="image running on the board, makes a delta")
+    parser.add_argument("-o", "--output", help="default: <image>.z or <image>.delta")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    base = None
+    if args.base:
+        with open(args.base, "rb") as f:
+            base = f.read()
+    output = args.output or args.image + (".delta" if base is not None else ".z")
+
+    t0 = time.monotonic()
+    package = pack(image, base)
+    elapsed = time.monotonic() - t0
+    if unpack(package, base) != image:
+        sys.exit("package does not decode back to the image")
+
+    with open(output, "wb") as f:
+        f.write(package)
+
+    def line(name, size):
+        print("  %-28s %9d bytes  %5.1f%% of the image" % (name, size, 100.0 * size / len(image)))
+
+    print("%s: %d bytes, sha256 %s" % (args.image, len(image), hashlib.sha256(image).hexdigest()))
+    if base is not None:
+        line("compressed", len(zlib.compress(image, 9)) + HEADER.size)
+        line("delta vs %s" % os.path.basename(args.base), len(package))
+    else:
+        line("compressed", len(package))
+    print("Wrote %s in %.1f s, %d bytes less to send (-%.1f%%)" % (
+        output, elapsed, len(image) - len(package), 100.0 * (len(image) - len(package)) / len(image)))
+
+
+if __name__ == "__main__":
+    main()
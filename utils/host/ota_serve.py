@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Local HTTP server for the pull OTA (main/ota_pull.c), with Range support.
+
+Serves one firmware image, or an ota_pack.py package, and prints the MQTT
+command that makes a board fetch it. --drop-after cuts the first download after that many bytes, to
+check that the board resumes from where it stopped.
+
+Usage:
+  ./ota_serve.py [image] [--port 8070] [--drop-after BYTES] [--board ESP-1] [--host IP]
+  ./ota_serve.py ../../build/esp32-mqtt-ethernet.bin --drop-after 300000
+"""
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import socket
+
+
+def local_ip():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    try:
+        s.connect(("10.255.255.255", 1))
+        return s.getsockname()[0]
+    except OSError:
+        return "127.0.0.1"
+    finally:
+        s.close()
+
+
+class ImageHandler(http.server.BaseHTTPRequestHandler):
+    image = b""
+    drop_after = 0
+    dropped = False
+
+    def do_GET(self):
+        start, end = 0, len(self.image) - 1
+        match = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        if match:
+            start = int(match.group(1))
+            if match.group(2):
+                end = min(end, int(match.group(2)))
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(self.image))
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, len(self.image)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+
+        body = self.image[start:end + 1]
+        cls = type(self)
+        if cls.drop_after and not cls.dropped and start < cls.drop_after:
+            cls.dropped = True
+            self.wfile.write(body[:cls.drop_after - start])
+            self.log_message("dropping the connection after byte %d", cls.drop_after)
+            self.close_connection = True
+            self.connection.shutdown(socket.SHUT_RDWR)
+            return
+        self.wfile.write(body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", nargs="?", default=os.path.join(os.path.dirname(__file__), "..", "..", "build", "esp32-mqtt-ethernet.bin"))
+    parser.add_argument("--port", type=int, default=8070)
+    parser.add_argument("--drop-after", type=int, default=0, help="cut the first transfer after this many bytes")
+    parser.add_argument("--board", default="ESP-1", help="board ID, for the printed command")
+    parser.add_argument("--host", default=local_ip(), help="address the board should use")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        ImageHandler.image = f.read()
+    ImageHandler.drop_after = args.drop_after
+
+    # The board checks the unpacked image, a package carries its hash in the header
+    image = ImageHandler.image
+    if image[:4] == b"LXOT":
+        sha256 = image[16:48].hex()
+    else:
+        sha256 = hashlib.sha256(image).hexdigest()
+
+    name = os.path.basename(args.image)
+    command = '{"url":"http://%s:%d/%s","size":%d,"sha256":"%s"}' % (
+        args.host, args.port, name, len(image), sha256)
+
+    print("Serving %s (%d bytes) on port %d" % (args.image, len(ImageHandler.image), args.port))
+    print("Trigger the update with:")
+    print("  mosquitto_pub -h <broker> -p 8883 --cafile ../certs/ca.crt --cert ../certs/client.crt --key ../certs/client.key \\")
+    print("    -q 1 -t '/sensor_%s/ota' -m '%s'" % (args.board, command))
+    print("Progress: mosquitto_sub ... -t '/sensor_%s/ota/status'" % args.board)
+
+    http.server.ThreadingHTTPServer(("", args.port), ImageHandler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+/*
+ * Decoder for the binary sensor payload (main/sensor_codec.c).
+ *
+ * Reads "<topic> <payload hex>" lines, as printed by
+ *     mosquitto_sub -t '/sensor_+/bin' -F '%t %x'
+ * and writes "<topic> <json>" lines, where the topic is /sensor_<ID>/batch
+ * and the JSON is the same as the firmware's JSON batch payload.
+ * Used by bin_bridge.sh to feed Home Assistant.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h/sensor_queue.h"
+#include "h/sensor_codec.h"
+
+#define MAX_SAMPLES 256
+#define LINE_LEN    (2 * SENSOR_CODEC_MAX_LEN(MAX_SAMPLES) + 256)
+
+static char line[LINE_LEN];
+static uint8_t payload[SENSOR_CODEC_MAX_LEN(MAX_SAMPLES)];
+static sensq samples[MAX_SAMPLES];
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/* Returns the number of bytes, or -1 on a bad hex string */
+static int parse_hex(const char *hex, uint8_t *out, size_t max)
+{
+    size_t n = 0;
+
+    while (hex[0] && hex[0] != '\n' && hex[0] != '\r') {
+        int hi = hex_value(hex[0]);
+        int lo = hex[1] ? hex_value(hex[1]) : -1;
+        if (hi < 0 || lo < 0 || n == max) {
+            return -1;
+        }
+        out[n++] = (uint8_t)(hi << 4 | lo);
+        hex += 2;
+    }
+    return (int)n;
+}
+
+
+int main(void)
+{
+    char id[32];
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char *hex = strchr(line, ' ');
+        int len, count;
+
+        if (hex == NULL) {
+            continue;
+        }
+        *hex++ = '\0';
+
+        /* The device ID only travels in the topic */
+        if (sscanf(line, "/sensor_%31[^/]/bin", id) != 1) {
+            fprintf(stderr, "skipping topic %s\n", line);
+            continue;
+        }
+
+        len = parse_hex(hex, payload, sizeof(payload));
+        count = (len < 0) ? -1 : sensor_codec_decode(payload, len, samples, MAX_SAMPLES);
+        if (count < 0) {
+            fprintf(stderr, "%s: invalid payload\n", line);
+            continue;
+        }
+
+        printf("/sensor_%s/batch {\"id\":\"%s\",\"samples\":[", id, id);
+        for (int i = 0; i < count; i++) {
+            printf("%s{\"seq\":%lu,\"t\":%lld", i ? "," : "",
+                   (unsigned long)samples[i].seq, (long long)(samples[i].timestamp_us / 1000));
+            SENSQ_FOREACH_CHANNEL(type) {
+                printf(",\"%s\":%.2f", sensq_string[type], samples[i].value[type]);
+            }
+            printf("}");
+        }
+        printf("]}\n");
+    }
+
+    return 0;
+}
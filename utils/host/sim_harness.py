@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+"""
+Regression and performance run of the simulation build of the firmware (linux
+target): the real sensor ring, comms task, publisher, MQTT client and portal
+handlers, with a simulated BME280 and the host network (main/sim/).
+
+Starts a local mosquitto and the firmware, checks the portal handlers with
+curl, points the board at the broker (POST /update) and selects a sampling
+profile (POST /profile), then for --duration seconds measures:
+
+  read rate         samples/s read by the sensor task, against the profile
+  read->host        sensor read to arrival here, p50/p99/max (one clock)
+  delivery          every sample the device published reached the broker
+  http              latency of GET /data and GET /metrics, p50/p99/max
+
+Build the firmware first, apart from the board build:
+  idf.py -B build_sim -D SDKCONFIG=build_sim/sdkconfig --preview set-target linux build
+
+Usage:
+  ./sim_harness.py [--elf ../../build_sim/esp32-mqtt-ethernet.elf] [--duration 30]
+                   [--profile 2] [--mqtt-port 1883] [--http-port 8080]
+                   [--id SIM-1] [--report run.json]
+
+Needs mosquitto, mosquitto_sub and curl. Exit code = number of failed checks.
+"""
+import argparse
+import json
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SETTLE_S = 2            # After the run, for the last PUBACKed messages to arrive
+HTTP_LOAD = 50          # Requests per endpoint for the latency figures
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return float("nan")
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+
+def wait_port(port, timeout_s):
+    end = time.monotonic() + timeout_s
+    while time.monotonic() < end:
+        try:
+            socket.create_connection(("localhost", port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+class Broker:
+    """Local mosquitto, plain MQTT, and a subscriber on every board topic"""
+
+    def __init__(self, port, workdir):
+        conf = os.path.join(workdir, "mosquitto.conf")
+        with open(conf, "w") as f:
+            f.write("listener %d 127.0.0.1\nallow_anonymous true\n" % port)
+        self.proc = subprocess.Popen(["mosquitto", "-c", conf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        if not wait_port(port, 5):
+            raise RuntimeError("mosquitto did not start on port %d" % port)
+
+        self.messages = []          # (received_s, topic, payload)
+        self.lock = threading.Lock()
+        self.sub = subprocess.Popen(["mosquitto_sub", "-h", "localhost", "-p", str(port), "-q", "1",
+                                     "-F", "%t %p", "-t", "/sensor_+/#"],
+                                    stdout=subprocess.PIPE, text=True, bufsize=1)
+        threading.Thread(target=self.read, daemon=True).start()
+
+    def read(self):
+        for line in self.sub.stdout:
+            topic, _, payload = line.rstrip("\n").partition(" ")
+            with self.lock:
+                self.messages.append((time.time(), topic, payload))
+
+    def snapshot(self):
+        with self.lock:
+            return list(self.messages)
+
+    def stop(self):
+        self.sub.terminate()
+        self.proc.terminate()
+
+
+def curl(base, method, path, data=None):
+    """One request: (status, body, seconds)"""
+    cmd = ["curl", "-s", "--compressed", "-m", "5", "-X", method, "-w", "\n%{http_code} %{time_total}", base + path]
+    if data is not None:
+        cmd += ["--data", data]
+    out = subprocess.run(cmd, capture_output=True, text=True).stdout
+    body, _, tail = out.rpartition("\n")
+    code, _, seconds = tail.partition(" ")
+    return int(code or 0), body, float(seconds or 0)
+
+
+def metrics(base):
+    """Prometheus text from GET /metrics, summed over the labels"""
+    values = {}
+    _, body, _ = curl(base, "GET", "/metrics")
+    for line in body.splitlines():
+        m = re.match(r"^([a-z_]+)(\{[^}]*\})?\s+([0-9.eE+-]+)$", line)
+        if m:
+            values[m.group(1)] = values.get(m.group(1), 0) + float(m.group(3))
+    return values
+
+
+class Run:
+    def __init__(self):
+        self.failed = 0
+        self.report = {"checks": {}}
+
+    def check(self, name, ok, detail=""):
+        print("%-4s %-34s %s" % ("ok" if ok else "FAIL", name, detail))
+        self.report["checks"][name] = {"ok": bool(ok), "detail": detail}
+        if not ok:
+            self.failed += 1
+
+
+def json_or_none(body):
+    try:
+        return json.loads(body)
+    except ValueError:
+        return None
+
+
+def check_portal(run, base, args):
+    code, body, _ = curl(base, "GET", "/")
+    run.check("GET /", code == 200 and "<html" in body.lower(), str(code))
+
+    code, body, _ = curl(base, "GET", "/data")
+    data = json_or_none(body)
+    run.check("GET /data", code == 200 and data is not None and "temp" in data and data.get("profiles"), str(code))
+    profiles = data.get("profiles", []) if data else []
+
+    code, body, _ = curl(base, "GET", "/metrics")
+    run.check("GET /metrics", code == 200 and "lxft_samples_read_total" in body, str(code))
+
+    code, body, _ = curl(base, "GET", "/debug/link")
+    link = json_or_none(body)
+    run.check("GET /debug/link", code == 200 and link is not None and link.get("active") == "host", str(code))
+
+    for path in ("/debug/boot", "/version"):
+        code, body, _ = curl(base, "GET", path)
+        run.check("GET " + path, code == 200 and json_or_none(body) is not None, str(code))
+
+    code, body, _ = curl(base, "GET", "/debug/tasks")
+    run.check("GET /debug/tasks", code in (200, 503), str(code))
+
+    code, _, _ = curl(base, "POST", "/ota", "x")
+    run.check("POST /ota (not in the sim)", code == 503, str(code))
+
+    # '+' is a space in a form body
+    code, _, _ = curl(base, "POST", "/wifi", "SSID=Sim+Net&PASS=password1")
+    _, body, _ = curl(base, "GET", "/data")
+    run.check("POST /wifi", code == 200 and (json_or_none(body) or {}).get("ssid") == "Sim Net", str(code))
+
+    url = "mqtt://localhost:%d" % args.mqtt_port
+    code, _, _ = curl(base, "POST", "/update", "ID=%s&URL=%s" % (args.id, url))
+    _, body, _ = curl(base, "GET", "/data")
+    data = json_or_none(body) or {}
+    run.check("POST /update", code == 200 and data.get("id") == args.id and data.get("url") == url, str(code))
+
+    code, _, _ = curl(base, "POST", "/profile", "profile=%d" % args.profile)
+    _, body, _ = curl(base, "GET", "/data")
+    run.check("POST /profile", code == 200 and (json_or_none(body) or {}).get("profile") == args.profile, str(code))
+
+    return profiles
+
+
+def profile_period_s(name):
+    m = re.search(r"(\d+)\s*(ms|s)\b", name or "")
+    if not m:
+        return None
+    return int(m.group(1)) / (1000.0 if m.group(2) == "ms" else 1.0)
+
+
+def samples_of(messages):
+    """Samples received: {(id, seq)}, and read->host latencies in ms"""
+    seen = set()
+    latency = []
+    per_type = 0
+    for received_s, topic, payload in messages:
+        parts = topic.strip("/").split("/")
+        if parts[-1] == "backfill":
+            parts.pop()                 # Store-and-forward backlog, same payload
+        if len(parts) != 2:
+            continue
+        kind = parts[1]
+        if kind == "batch":
+            msg = json_or_none(payload)
+            if not msg:
+                continue
+            for s in msg.get("samples", []):
+                key = (msg.get("id"), s.get("seq"))
+                if key in seen:
+                    continue            # QoS 1 may deliver twice
+                seen.add(key)
+                if "ts" in s:
+                    latency.append(received_s * 1000 - s["ts"])
+        elif kind == "TEMP":
+            per_type += 1
+    return len(seen) + per_type, sorted(latency)
+
+
+def http_load(run, base):
+    for path in ("/data", "/metrics"):
+        times = sorted(curl(base, "GET", path)[2] * 1000 for _ in range(HTTP_LOAD))
+        detail = "p50 %.1f ms, p99 %.1f ms, max %.1f ms" % (percentile(times, 50), percentile(times, 99), times[-1])
+        run.report["http " + path] = {"p50_ms": percentile(times, 50), "p99_ms": percentile(times, 99), "max_ms": times[-1]}
+        run.check("latency GET " + path, times[-1] < 1000, detail)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulation build regression and performance run")
+    parser.add_argument("--elf", default=os.path.join(HERE, "..", "..", "build_sim", "esp32-mqtt-ethernet.elf"))
+    parser.add_argument("--duration", type=float, default=30)
+    parser.add_argument("--profile", type=int, default=2, help="sampling profile index, 2 = fast 250 ms")
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--http-port", type=int, default=8080, help="CONFIG_SIM_HTTP_PORT of the build")
+    parser.add_argument("--id", default="SIM-1", help="board ID set with POST /update")
+    parser.add_argument("--report", help="write the results as JSON")
+    args = parser.parse_args()
+
+    for tool in ("mosquitto", "mosquitto_sub", "curl"):
+        if not shutil.which(tool):
+            sys.exit("%s not found (apt install mosquitto mosquitto-clients curl)" % tool)
+    if not os.access(args.elf, os.X_OK):
+        sys.exit("%s not found, see the build command in --help" % args.elf)
+
+    workdir = tempfile.mkdtemp(prefix="sim_harness_")
+    log_path = os.path.join(workdir, "firmware.log")
+    base = "http://localhost:%d" % args.http_port
+    run = Run()
+    broker = Broker(args.mqtt_port, workdir)
+    log = open(log_path, "w")
+    start_s = time.time()
+    board = subprocess.Popen([os.path.abspath(args.elf)], stdout=log, stderr=subprocess.STDOUT, cwd=workdir)
+
+    try:
+        run.check("portal up", wait_port(args.http_port, 20), base)
+        profiles = check_portal(run, base, args)
+
+        # Measure from here, on the profile just selected
+        before = metrics(base)
+        window_start_s = time.time()
+        time.sleep(args.duration)
+        after = metrics(base)
+        window_s = time.time() - window_start_s
+        time.sleep(SETTLE_S)
+        messages = broker.snapshot()
+
+        first = next((m[0] for m in messages if m[1].endswith("/batch") or m[1].endswith("/TEMP")), None)
+        run.check("first publish", first is not None,
+                  "%.0f ms after the start" % ((first - start_s) * 1000) if first else "nothing received")
+        run.report["first_publish_ms"] = (first - start_s) * 1000 if first else None
+
+        period_s = profile_period_s(profiles[args.profile] if args.profile < len(profiles) else None)
+        read = after.get("lxft_samples_read_total", 0) - before.get("lxft_samples_read_total", 0)
+        rate = read / window_s
+        if period_s:
+            expected = 1 / period_s
+            run.check("read rate", abs(rate - expected) <= 0.1 * expected,
+                      "%.2f/s, profile %.2f/s" % (rate, expected))
+        run.report["read_per_s"] = rate
+
+        received, latency = samples_of(messages)
+        published = after.get("lxft_samples_published_total", 0)
+        if any(m[1].endswith("/bin") for m in messages):
+            print("     binary batches, delivery not checked (CONFIG_SENSOR_BATCH_BINARY)")
+        else:
+            run.check("delivery", received >= published,
+                      "%d received, %d published" % (received, published))
+        lost = after.get("lxft_mqtt_publish_failures_total", 0)
+        run.check("publish failures", lost == 0, "%d" % lost)
+        run.report.update({"received": received, "published": published})
+
+        if latency:
+            run.report["read_to_host_ms"] = {"p50": percentile(latency, 50), "p99": percentile(latency, 99),
+                                             "max": latency[-1], "count": len(latency)}
+            print("     read->host %d samples: p50 %.0f ms, p99 %.0f ms, max %.0f ms" % (
+                len(latency), percentile(latency, 50), percentile(latency, 99), latency[-1]))
+
+        http_load(run, base)
+        run.check("firmware running", board.poll() is None, log_path)
+    finally:
+        board.terminate()
+        broker.stop()
+        log.close()
+
+    if args.report:
+        with open(args.report, "w") as f:
+            json.dump(run.report, f, indent=2)
+    print("\n%d check(s) failed, firmware log: %s" % (run.failed, log_path))
+    sys.exit(run.failed)
+
+
+if __name__ == "__main__":
+    main()
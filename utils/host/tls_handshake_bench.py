@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+Portal TLS handshake cost, full vs. resumed (session ticket).
+
+Opens N connections with a full handshake, then N resuming the session of the
+first one, and asks GET /debug/tls on each for the device side numbers of its
+own handshake (time from the ClientHello, heap held by the session, heap peak).
+
+Usage:
+  ./tls_handshake_bench.py [host] [port] [connections]
+  ./tls_handshake_bench.py 192.168.11.111 443 10
+"""
+import json
+import socket
+import ssl
+import statistics
+import sys
+import time
+
+
+def connect(host, port, ctx, session=None):
+    sock = socket.create_connection((host, port), timeout=10)
+    tls = ctx.wrap_socket(sock, server_hostname=host, session=session, do_handshake_on_connect=False)
+    t0 = time.perf_counter()
+    tls.do_handshake()
+    client_ms = (time.perf_counter() - t0) * 1000
+
+    tls.sendall(("GET /debug/tls HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n" % host).encode())
+    data = b""
+    while True:
+        chunk = tls.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+
+    # The session ticket arrives with the handshake, read it before closing
+    result = (tls.session, tls.session_reused, client_ms, json.loads(data.split(b"\r\n\r\n", 1)[1]))
+    tls.close()
+    return result
+
+
+def new_context():
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.check_hostname = False
+    ctx.verify_mode = ssl.CERT_NONE        # Self-signed portal certificate
+    ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    return ctx
+
+
+def report(name, runs):
+    if not runs:
+        print("%-8s no runs" % name)
+        return
+    client = [r[0] for r in runs]
+    dev = [r[1]["this"] for r in runs]
+    print("%-8s %3d  client %7.1f ms (max %7.1f)  device %7.1f ms  heap held %6d B  peak %6d B" % (
+        name, len(runs), statistics.median(client), max(client),
+        statistics.median(d["us"] for d in dev) / 1000,
+        statistics.median(d["heap"] for d in dev), statistics.median(d["peak"] for d in dev)))
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "192.168.11.111"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 443
+    n = int(sys.argv[3]) if len(sys.argv) > 3 else 10
+
+    full, resumed = [], []
+
+    for _ in range(n):
+        session, reused, client_ms, info = connect(host, port, new_context())
+        full.append((client_ms, info))
+
+    ctx = new_context()
+    session = connect(host, port, ctx)[0]
+    for _ in range(n):
+        session, reused, client_ms, info = connect(host, port, ctx, session)
+        if reused:
+            resumed.append((client_ms, info))
+        else:
+            print("session not resumed, is CONFIG_PORTAL_HTTPS on with session tickets?")
+            full.append((client_ms, info))
+
+    report("full", full)
+    report("resumed", resumed)
+
+    # Totals kept by the device since boot, it tells full and resumed apart itself
+    for kind in ("full", "resumed"):
+        s = info[kind]
+        print("device %-8s %4d handshakes  avg %7.1f ms  max %7.1f ms" % (
+            kind, s["count"], s["avg_us"] / 1000, s["max_us"] / 1000))
+
+
+if __name__ == "__main__":
+    main()